@@ -0,0 +1,338 @@
+// Compiler throughput benchmark.
+//
+// Generates a program of the requested shape and times each phase of the
+// compiler on it on its own, then the whole way from source to machine code:
+//
+//   tokenise     source to a token vector
+//   parse        source to AST, the lexer runs in lockstep as in the compiler
+//   codegen      AST to IR
+//   optimise     the IR passes
+//   isel         instruction selection, register allocation and peephole
+//   encode       x86 to machine code
+//   end_to_end   all of the above, nothing is written to disk
+//   loops        the loop pass alone, on a separate function of many loops
+//
+//   compiler_bench [--functions N] [--depth N] [--loop-statements N]
+//                  [--globals N] [--loops N] [--runs N] [--write-program FILE]
+//
+// Results go to stdout as one JSON object, so they can be kept per commit and
+// compared; a readable summary goes to stderr.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "core/codegen.hpp"
+#include "core/encoder.hpp"
+#include "core/ir.hpp"
+#include "core/isel.hpp"
+#include "core/parse.hpp"
+#include "core/passes.hpp"
+#include "core/peephole.hpp"
+#include "core/tokenise.hpp"
+#include "core/x86.hpp"
+#include "utils/error.hpp"
+#include "utils/string_interner.hpp"
+
+namespace {
+
+struct program_shape_t
+{
+    size_t functions = 2000;
+    size_t depth = 24;            // Nesting of the expression at the top of each function
+    size_t loop_statements = 12;  // Statements in the while loop of each function
+    size_t globals = 500;
+    size_t loops = 1000;          // In the function for the loop pass, half of them nested
+};
+
+// Identifiers are letters only, so number the generated names in base 26.
+// Every name starts with q, which no keyword does.
+std::string name_for(char kind, size_t index) {
+    std::string name = {'q', kind};
+    do {
+        name.push_back(static_cast<char>('a' + index % 26));
+        index /= 26;
+    } while (index > 0);
+    return name;
+}
+
+// Parenthesised all the way down, mixing the parameters, constants and
+// globals so nothing folds away before codegen
+std::string nested_expression(size_t depth, size_t seed, size_t globals) {
+    static constexpr const char* operators[] = {" + ", " - ", " * "};
+    std::string expression = "qa";
+    for (size_t level = 0; level < depth; ++level) {
+        const size_t n = seed + level;
+        std::string operand;
+        if (globals != 0 && n % 5 == 0) {
+            operand = name_for('g', n % globals);
+        } else if (n % 3 == 0) {
+            operand = "qb";
+        } else {
+            operand = std::to_string(n % 97 + 1);
+        }
+        expression = "(" + expression + operators[n % 3] + operand + ")";
+    }
+    return expression;
+}
+
+std::string generate_program(const program_shape_t& shape) {
+    std::string program;
+    for (size_t i = 0; i < shape.globals; ++i) {
+        program += std::format("let {} = {};\n", name_for('g', i), i % 100);
+    }
+
+    for (size_t i = 0; i < shape.functions; ++i) {
+        program += std::format("fn {}(qa, qb) {{\n", name_for('f', i));
+        program += "    let qr = " + nested_expression(shape.depth, i, shape.globals) + ";\n";
+        program += "    let qi = 0;\n"
+                   "    while (qi < qb) {\n";
+        for (size_t s = 0; s < shape.loop_statements; ++s) {
+            switch ((i + s) % 4) {
+            case 0: program += std::format("        qr = qr + qi * {};\n", s + 2); break;
+            case 1: program += std::format("        qr = qr - qa / {};\n", s + 2); break;
+            case 2:
+                program += std::format("        if (qr > {}) {{\n"
+                                       "            qr = qr - {};\n"
+                                       "        }}\n", 1000 + s, 999 + s);
+                break;
+            default:
+                if (shape.globals != 0) {
+                    program += std::format("        qr = qr + {};\n", name_for('g', (i + s) % shape.globals));
+                } else {
+                    program += "        qr = qr + qa;\n";
+                }
+                break;
+            }
+        }
+        program += "        qi = qi + 1;\n"
+                   "    }\n";
+        // Calls between the functions give the inliner and the call lowering
+        // something to do
+        if (i > 0) {
+            program += std::format("    return qr + {}(qi, 2);\n", name_for('f', i - 1));
+        } else {
+            program += "    return qr;\n";
+        }
+        program += "}\n";
+    }
+
+    // Top level statements can't assign, so the calls add up through a chain
+    // of lets
+    size_t total = 0;
+    program += std::format("let {} = 0;\n", name_for('t', total));
+    for (size_t i = 0; i < shape.functions; i += 16, ++total) {
+        program += std::format("let {} = {} + {}({}, 3);\n", name_for('t', total + 1), name_for('t', total),
+                               name_for('f', i), i % 50);
+    }
+    program += std::format("exit({});\n", name_for('t', total));
+    return program;
+}
+
+// One function of loops one after the other, every other one with a loop
+// inside, so the loop pass has many loops in the same function to go through
+std::string generate_loops(size_t loops) {
+    std::string program = "fn qloops(qa, qb) {\n"
+                          "    let qr = qa;\n";
+    for (size_t i = 0; i < loops; i += 2) {
+        program += std::format("    let {0} = 0;\n"
+                               "    while ({0} < qb) {{\n"
+                               "        qr = qr + {0} * 3 + qa * 2;\n", name_for('i', i));
+        if (i + 1 < loops) {
+            program += std::format("        let {0} = 0;\n"
+                                   "        while ({0} < qb) {{\n"
+                                   "            qr = qr + {0} * 5 + qa;\n"
+                                   "            {0} = {0} + 1;\n"
+                                   "        }}\n", name_for('i', i + 1));
+        }
+        program += std::format("        {0} = {0} + 1;\n"
+                               "    }}\n", name_for('i', i));
+    }
+    program += "    return qr;\n"
+               "}\n"
+               "exit(qloops(1, 2));\n";
+    return program;
+}
+
+struct phase_result_t
+{
+    const char* name;
+    std::vector<double> seconds; // One per run, sorted
+    const char* item_unit;       // What the phase got through
+    size_t items;
+    size_t source_bytes = 0;     // Of the program it ran on, when not the main one
+};
+
+// Runs setup untimed before every timed run of body
+template <typename Setup, typename Body>
+std::vector<double> time_runs(int runs, Setup setup, Body body) {
+    std::vector<double> seconds;
+    for (int run = 0; run < runs; ++run) {
+        setup();
+        auto start = std::chrono::steady_clock::now();
+        body();
+        auto end = std::chrono::steady_clock::now();
+        seconds.push_back(std::chrono::duration<double>(end - start).count());
+    }
+    std::sort(seconds.begin(), seconds.end());
+    return seconds;
+}
+
+double median(const std::vector<double>& sorted) {
+    const size_t middle = sorted.size() / 2;
+    return sorted.size() % 2 != 0 ? sorted[middle] : (sorted[middle - 1] + sorted[middle]) / 2;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    program_shape_t shape;
+    int runs = 5;
+    const char* program_path = nullptr;
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--functions") == 0 && i + 1 < argc) {
+            shape.functions = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+            shape.depth = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--loop-statements") == 0 && i + 1 < argc) {
+            shape.loop_statements = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--globals") == 0 && i + 1 < argc) {
+            shape.globals = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--loops") == 0 && i + 1 < argc) {
+            shape.loops = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--write-program") == 0 && i + 1 < argc) {
+            program_path = argv[++i];
+        }
+    }
+
+    const std::string input = generate_program(shape);
+    if (program_path) {
+        std::ofstream(program_path) << input;
+    }
+
+    // Only problems with the generated program should show up
+    set_log_level(log_level_e::WARNING);
+    const optimise_options_t optimise;
+
+    // One pass through the pipeline first, which also gives the size of the
+    // input each phase sees
+    string_interner_t symbols;
+    lexer_t lexer(input, symbols);
+    ast_t ast = parse_statement(lexer);
+    ir_module_t lowered;
+    gen_ir_for_ast(ast, lowered);
+    ir_module_t optimised = lowered;
+    optimise_ir(optimised, optimise);
+    x86_program_t program;
+    select_instructions(optimised, program);
+    optimise_peephole(program);
+    machine_code_t code;
+    encode_program(program, code);
+
+    const std::string loops_input = generate_loops(shape.loops);
+    string_interner_t loops_symbols;
+    lexer_t loops_lexer(loops_input, loops_symbols);
+    ast_t loops_ast = parse_statement(loops_lexer);
+    ir_module_t loops_lowered;
+    gen_ir_for_ast(loops_ast, loops_lowered);
+
+    flush_diagnostics();
+    if (get_error_count() != 0) {
+        error_msg("Generated program failed to compile");
+        return 1;
+    }
+
+    const size_t line_count = static_cast<size_t>(std::count(input.begin(), input.end(), '\n'));
+    const size_t token_count = lexer.tokens_lexed();
+    const size_t lowered_count = count_instructions(lowered);
+    const size_t optimised_count = count_instructions(optimised);
+    std::vector<phase_result_t> phases;
+
+    phases.push_back({"tokenise", time_runs(runs, [] {}, [&] {
+        string_interner_t names;
+        std::vector<token_t> tokens = tokenise(input, names);
+    }), "tokens", token_count});
+
+    phases.push_back({"parse", time_runs(runs, [] {}, [&] {
+        string_interner_t names;
+        lexer_t source(input, names);
+        ast_t tree = parse_statement(source);
+    }), "AST nodes", ast.nodes.size()});
+
+    ir_module_t module;
+    phases.push_back({"codegen", time_runs(runs, [&] { module = {}; }, [&] {
+        gen_ir_for_ast(ast, module);
+    }), "IR instructions", lowered_count});
+
+    phases.push_back({"optimise", time_runs(runs, [&] { module = lowered; }, [&] {
+        optimise_ir(module, optimise);
+    }), "IR instructions", lowered_count});
+
+    x86_program_t selected;
+    phases.push_back({"isel", time_runs(runs, [&] { selected = {}; }, [&] {
+        select_instructions(optimised, selected);
+        optimise_peephole(selected);
+    }), "IR instructions", optimised_count});
+
+    machine_code_t encoded;
+    phases.push_back({"encode", time_runs(runs, [&] { encoded = {}; }, [&] {
+        encode_program(program, encoded);
+    }), "x86 instructions", program.text.size()});
+
+    phases.push_back({"end_to_end", time_runs(runs, [] {}, [&] {
+        string_interner_t names;
+        lexer_t source(input, names);
+        ast_t tree = parse_statement(source);
+        ir_module_t ir;
+        gen_ir_for_ast(tree, ir);
+        optimise_ir(ir, optimise);
+        x86_program_t x86;
+        select_instructions(ir, x86);
+        optimise_peephole(x86);
+        machine_code_t machine_code;
+        encode_program(x86, machine_code);
+    }), "source lines", line_count});
+
+    // Times one pass, so the loop pass is not hidden behind the others
+    phases.push_back({"loops", time_runs(runs, [&] { module = loops_lowered; }, [&] {
+        optimise_loops(module);
+    }), "loops", shape.loops, loops_input.size()});
+
+    const double megabytes = input.size() / (1024.0 * 1024.0);
+    std::string json = std::format(
+        "{{\"benchmark\":\"compiler_bench\",\"runs\":{},"
+        "\"shape\":{{\"functions\":{},\"depth\":{},\"loop_statements\":{},\"globals\":{},\"loops\":{}}},"
+        "\"input\":{{\"bytes\":{},\"lines\":{},\"tokens\":{},\"ast_nodes\":{},\"ir_instructions\":{},"
+        "\"optimised_ir_instructions\":{},\"x86_instructions\":{},\"code_bytes\":{}}},\"phases\":[",
+        runs, shape.functions, shape.depth, shape.loop_statements, shape.globals, shape.loops, input.size(), line_count,
+        token_count, ast.nodes.size(), lowered_count, optimised_count, program.text.size(), code.text.size());
+    std::string summary = std::format("input: {} lines, {:.2f} MiB, {} tokens, best of {} runs\n", line_count,
+                                      megabytes, token_count, runs);
+    for (size_t i = 0; i < phases.size(); ++i) {
+        const phase_result_t& phase = phases[i];
+        const double best = phase.seconds.front();
+        const double source_megabytes = phase.source_bytes != 0 ? phase.source_bytes / (1024.0 * 1024.0) : megabytes;
+        std::format_to(std::back_inserter(json),
+                       "{}{{\"name\":\"{}\",\"best_ms\":{:.3f},\"median_ms\":{:.3f},\"unit\":\"{}\",\"items\":{},"
+                       "\"items_per_second\":{:.0f},\"source_mb_per_second\":{:.2f}}}",
+                       i == 0 ? "" : ",", phase.name, best * 1e3, median(phase.seconds) * 1e3, phase.item_unit,
+                       phase.items, phase.items / best, source_megabytes / best);
+        std::format_to(std::back_inserter(summary), "{:<12} {:>10.3f} ms {:>14.0f} {}/s {:>10.2f} MB/s\n", phase.name,
+                       best * 1e3, phase.items / best, phase.item_unit, source_megabytes / best);
+    }
+    json += "]}\n";
+
+    std::cerr << summary;
+    std::cout << json;
+    return 0;
+}
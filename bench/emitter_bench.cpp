@@ -0,0 +1,159 @@
+// Assembly emitter benchmark.
+//
+// Compiles a generated program once, then writes its listing out two ways
+// and reports lines/sec for both: line by line through an std::ofstream with
+// std::endl (what codegen used to do) and through asm_emitter_t, which
+// formats into memory and writes the file with a single syscall.
+//
+//   emitter_bench [--functions N] [--runs N]
+//
+// The end to end listing rate (AST to finished file) is reported as well.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "core/codegen.hpp"
+#include "core/emitter.hpp"
+#include "core/parse.hpp"
+#include "core/tokenise.hpp"
+#include "core/x86.hpp"
+#include "utils/error.hpp"
+#include "utils/string_interner.hpp"
+
+namespace {
+
+// Identifiers are letters only, so number the generated names in base 26
+std::string letters_for(size_t index) {
+    std::string name;
+    do {
+        name.push_back(static_cast<char>('a' + index % 26));
+        index /= 26;
+    } while (index > 0);
+    return name;
+}
+
+std::string generate_input(size_t function_count) {
+    std::string input;
+    for (size_t i = 0; i < function_count; ++i) {
+        const std::string suffix = letters_for(i);
+        input += "fn step" + suffix + "(value, limit) {\n"
+                 "    let result = value * 3 + limit;\n"
+                 "    let counter = 0;\n"
+                 "    while (counter < limit) {\n"
+                 "        if (result >= 10000) {\n"
+                 "            result = result - 12345;\n"
+                 "        } else {\n"
+                 "            result = result + counter / 2;\n"
+                 "        }\n"
+                 "        counter = counter + 1;\n"
+                 "    }\n"
+                 "    return result;\n"
+                 "}\n"
+                 "let value" + suffix + " = step" + suffix + "(5, 8);\n";
+    }
+    input += "exit(0);\n";
+    return input;
+}
+
+template <typename Body>
+double best_seconds(int runs, Body body) {
+    double best = 1e30;
+    for (int run = 0; run < runs; ++run) {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+    }
+    return best;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    size_t function_count = 20000;
+    int runs = 5;
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--functions") == 0 && i + 1 < argc) {
+            function_count = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = std::max(1, std::atoi(argv[++i]));
+        }
+    }
+
+    const std::string input = generate_input(function_count);
+    const std::string output_path = (std::filesystem::temp_directory_path() / "emitter_bench.asm").string();
+
+    // Codegen logs every node it visits, keep that out of the numbers
+    std::streambuf *log_buffer = std::cerr.rdbuf(nullptr);
+
+    string_interner_t symbols;
+    lexer_t lexer(input, symbols);
+    ast_t ast = parse_statement(lexer);
+
+    x86_program_t program;
+    gen_code_for_ast(ast, program);
+
+    asm_emitter_t listing;
+    print_fasm(program, listing);
+
+    // Split the finished listing back into lines, so both sinks write exactly
+    // the same text
+    std::vector<std::string_view> lines;
+    lines.reserve(listing.line_count());
+    std::string_view text = listing.contents();
+    while (!text.empty()) {
+        size_t end = text.find('\n');
+        lines.push_back(text.substr(0, end));
+        text.remove_prefix(end + 1);
+    }
+
+    double ofstream_time = best_seconds(runs, [&] {
+        std::ofstream output(output_path);
+        for (std::string_view line : lines) {
+            output << line << std::endl;
+        }
+    });
+
+    double emitter_time = best_seconds(runs, [&] {
+        asm_emitter_t output;
+        for (std::string_view line : lines) {
+            output.line(line);
+        }
+        output.write_to_file(output_path);
+    });
+
+    double codegen_time = best_seconds(runs, [&] {
+        x86_program_t instructions;
+        gen_code_for_ast(ast, instructions);
+        asm_emitter_t output;
+        print_fasm(instructions, output);
+        output.write_to_file(output_path);
+    });
+
+    std::cerr.rdbuf(log_buffer);
+    std::filesystem::remove(output_path);
+
+    if (get_error_count() != 0) {
+        error_msg("Generated program failed to compile");
+        return 1;
+    }
+
+    const double line_count = static_cast<double>(lines.size());
+    std::cout << "listing: " << lines.size() << " lines, " << listing.contents().size() / 1024 << " KiB, best of "
+              << runs << " runs\n";
+    std::cout << "ofstream + std::endl: " << line_count / ofstream_time << " lines/s\n";
+    std::cout << "asm_emitter_t:        " << line_count / emitter_time << " lines/s\n";
+    std::cout << "speedup: " << ofstream_time / emitter_time << "x\n";
+    std::cout << "codegen end to end:   " << line_count / codegen_time << " lines/s\n";
+
+    return 0;
+}
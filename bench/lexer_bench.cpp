@@ -0,0 +1,286 @@
+// Lexer throughput benchmark.
+//
+// Times tokenise() against the previous if/else chain lexer (kept verbatim
+// below as the baseline) on a multi-megabyte input and reports MB/s for both.
+//
+//   lexer_bench [file.eps] [--size-mb N] [--runs N]
+//
+// Without a file the input is built by repeating a snippet shaped like
+// examples/main.eps until it reaches the requested size.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "core/tokenise.hpp"
+#include "utils/error.hpp"
+#include "utils/source_file.hpp"
+
+namespace {
+
+namespace baseline {
+
+char peek_ahead(std::string_view contents, size_t token_index, size_t amount_ahead) {
+    if (token_index + amount_ahead >= contents.size()) {
+        return '\0';
+    }
+    return contents[token_index + amount_ahead];
+}
+
+std::vector<token_t> legacy_tokenise(std::string_view contents) {
+    std::vector<token_t> tokens;
+    // Rough guess at token density so the vector doesn't keep regrowing on big inputs
+    tokens.reserve(contents.size() / 4 + 1);
+    size_t token_index = 0;
+
+    while (peek(contents, token_index) != '\0') {
+        // Skip any whitespace characters
+        if (isspace(peek(contents, token_index))) {
+            while (isspace(peek(contents, token_index))) {
+                consume(contents, token_index);
+            }
+            continue;  // Do not create a token for whitespace.
+        }
+
+        token_t curr_token;
+        size_t token_start = token_index;
+
+        if (isdigit(peek(contents, token_index))) {
+            curr_token.type = token_type_e::type_int_lit;
+            while (isdigit(peek(contents, token_index))) {
+                consume(contents, token_index);
+            }
+        }
+        else if (isalpha(peek(contents, token_index))) {
+            while (isalpha(peek(contents, token_index))) {
+                consume(contents, token_index);
+            }
+            std::string_view word = contents.substr(token_start, token_index - token_start);
+            if (word == "exit")
+                curr_token.type = token_type_e::type_exit;
+            else if (word == "let")
+                curr_token.type = token_type_e::type_let;
+            else if (word ==  "if") {
+                curr_token.type = token_type_e::type_if;
+            } else if (word == "while") {
+                curr_token.type = token_type_e::type_while;
+            }
+            else if (word == "else") {
+                curr_token.type = token_type_e::type_else;
+            } else if (word == "return") {
+                curr_token.type = token_type_e::type_return;
+            } else if (word == "fn") {
+                curr_token.type = token_type_e::type_fn;
+            } 
+            else
+                curr_token.type = token_type_e::type_identifier;
+        }
+        else if (peek(contents, token_index) == '*') {
+            curr_token.type = token_type_e::type_mul;
+            consume(contents, token_index);
+        }
+        else if (peek(contents, token_index) == '/') {
+            curr_token.type = token_type_e::type_div;
+            consume(contents, token_index);
+        }
+        else if (peek(contents, token_index) == '+') {
+            curr_token.type = token_type_e::type_add;
+            consume(contents, token_index);
+        }
+        else if (peek(contents, token_index) == '-') {
+            curr_token.type = token_type_e::type_sub;
+            consume(contents, token_index);
+        }
+        else if (peek(contents, token_index) == ';') {
+            curr_token.type = token_type_e::type_semi;
+            consume(contents, token_index);
+        }
+        else if (peek(contents, token_index) == '(') {
+            curr_token.type = token_type_e::type_open_paren;
+            consume(contents, token_index);
+        }
+        else if (peek(contents, token_index) == ')') {
+            curr_token.type = token_type_e::type_close_paren;
+            consume(contents, token_index);
+        }
+        else if (peek(contents, token_index) == '=') {
+            // Check for ==
+            if (peek_ahead(contents, token_index, 1) == '=') {
+                curr_token.type = token_type_e::type_eq;
+                consume(contents, token_index); // Consume first '='
+                consume(contents, token_index); // Consume second '='
+            } else {
+                curr_token.type = token_type_e::type_assignment;
+                consume(contents, token_index);
+            }
+        }
+        else if (peek(contents, token_index) == '!') {
+            // Check for !=
+            if (peek_ahead(contents, token_index, 1) == '=') {
+                curr_token.type = token_type_e::type_nq;
+                consume(contents, token_index); // Consume '!'
+                consume(contents, token_index); // Consume '='
+            } else {
+                error_msg("Invalid token: expected '=' after '!'");
+                consume(contents, token_index); // Consume '!'
+                continue;
+            }
+        }
+         else if (peek(contents, token_index) == '>') {
+            // Check for >=
+            if (peek_ahead(contents, token_index, 1) == '=') {
+                curr_token.type = token_type_e::type_ge;
+                consume(contents, token_index); // Consume '>'
+                consume(contents, token_index); // Consume '='
+            } else {
+                curr_token.type = token_type_e::type_gt; // greater than
+                consume(contents, token_index);
+            }
+        }
+         else if (peek(contents, token_index) == '<') {
+            // Check for <=
+            if (peek_ahead(contents, token_index, 1) == '=') {
+                curr_token.type = token_type_e::type_le;
+                consume(contents, token_index); // Consume '<'
+                consume(contents, token_index); // Consume '='
+            } else {
+                curr_token.type = token_type_e::type_lt; // less than
+                consume(contents, token_index);
+            }
+
+        }else if (peek(contents, token_index) == '{') {
+            curr_token.type = token_type_e::type_open_squigly;
+            consume(contents, token_index);
+        }else if (peek(contents, token_index) == '}') {
+            curr_token.type = token_type_e::type_close_squigly;
+            consume(contents, token_index);
+        } else if (peek(contents, token_index) == ',') {
+            curr_token.type = token_type_e::type_comma;
+            consume(contents, token_index);
+        }
+        else {
+            error_msg("Invalid token");
+            consume(contents, token_index); // Consume unknown character
+            continue;
+        }
+
+        curr_token.value = contents.substr(token_start, token_index - token_start);
+        curr_token.offset = static_cast<uint32_t>(token_start);
+        tokens.push_back(curr_token);
+    }
+
+    // Append the EOF token.
+    token_t eof_token;
+    eof_token.type = token_type_e::type_EOF;
+    eof_token.offset = static_cast<uint32_t>(contents.size());
+    tokens.push_back(eof_token);
+
+    return tokens;
+}
+} // namespace baseline
+
+std::string generate_input(size_t target_bytes) {
+    static const char *snippet =
+        "fn multiply(alpha, beta) {\n"
+        "    return alpha * beta;\n"
+        "}\n"
+        "\n"
+        "fn process(value) {\n"
+        "    let result = value;\n"
+        "    let counter = 0;\n"
+        "    while (counter < 1000) {\n"
+        "        if (result >= 10000) {\n"
+        "            result = result - 12345;\n"
+        "        } else {\n"
+        "            result = result + multiply(counter, 2);\n"
+        "        }\n"
+        "        counter = counter + 1;\n"
+        "    }\n"
+        "    return result;\n"
+        "}\n"
+        "\n"
+        "let x = 5;\n"
+        "let y = 8;\n"
+        "let product = multiply(x, y) / (x - y);\n"
+        "if (product != 40) {\n"
+        "    exit(1);\n"
+        "}\n";
+
+    std::string input;
+    input.reserve(target_bytes + std::strlen(snippet));
+    while (input.size() < target_bytes) {
+        input += snippet;
+    }
+    return input;
+}
+
+template <typename Lexer>
+double best_seconds(Lexer lexer, std::string_view input, int runs, size_t &token_count) {
+    double best = 1e30;
+    for (int run = 0; run < runs; ++run) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<token_t> tokens = lexer(input);
+        auto end = std::chrono::steady_clock::now();
+        token_count = tokens.size();
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+    }
+    return best;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    size_t size_mb = 16;
+    int runs = 5;
+    const char *path = nullptr;
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--size-mb") == 0 && i + 1 < argc) {
+            size_mb = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = std::max(1, std::atoi(argv[++i]));
+        } else {
+            path = argv[i];
+        }
+    }
+
+    source_file_t source;
+    std::string generated;
+    std::string_view input;
+    if (path) {
+        if (!source.open(path)) {
+            error_msg("Could not open file: {}", path);
+            return 1;
+        }
+        input = source.contents();
+    } else {
+        generated = generate_input(size_mb * 1024 * 1024);
+        input = generated;
+    }
+
+    const double megabytes = static_cast<double>(input.size()) / (1024.0 * 1024.0);
+    size_t baseline_tokens = 0;
+    size_t current_tokens = 0;
+    double baseline_time = best_seconds(baseline::legacy_tokenise, input, runs, baseline_tokens);
+    string_interner_t symbols;
+    auto current_lexer = [&](std::string_view contents) {
+        return tokenise(contents, symbols);
+    };
+    double current_time = best_seconds(current_lexer, input, runs, current_tokens);
+
+    if (baseline_tokens != current_tokens) {
+        error_msg("Token count mismatch: baseline {} vs tokenise {}", baseline_tokens, current_tokens);
+        return 1;
+    }
+
+    std::cout << "input: " << megabytes << " MiB, " << current_tokens << " tokens, best of " << runs << " runs\n";
+    std::cout << "baseline (if/else chain): " << megabytes / baseline_time << " MB/s\n";
+    std::cout << "tokenise (table + SIMD):  " << megabytes / current_time << " MB/s\n";
+    std::cout << "speedup: " << baseline_time / current_time << "x\n";
+    return 0;
+}
@@ -0,0 +1,303 @@
+// Runtime benchmark for the compiled programs.
+//
+// Compiles every program in bench/programs with the given optimisation
+// options, runs each one a few times and reports, for the fastest run, what
+// perf stat would: instructions retired, cycles and task clock read through
+// perf_event_open, plus wall time. The exit code is checked against the
+// known result, so a miscompile shows up here before it skews the numbers.
+//
+//   runtime_bench [--programs DIR] [--runs N] [-O0] [--inline-threshold=N]
+//                 [--no-tail-calls] [--no-loops] [--no-constant-propagation]
+//                 [--no-peephole]
+//
+// Hardware counters need perf_event_paranoid <= 2 and a PMU, inside most VMs
+// only the task clock is there. Counters that can't be opened are reported as
+// null. Results go to stdout as one JSON object, a summary to stderr.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "core/codegen.hpp"
+#include "core/elf_writer.hpp"
+#include "core/encoder.hpp"
+#include "core/ir.hpp"
+#include "core/isel.hpp"
+#include "core/parse.hpp"
+#include "core/passes.hpp"
+#include "core/peephole.hpp"
+#include "core/tokenise.hpp"
+#include "core/x86.hpp"
+#include "utils/error.hpp"
+#include "utils/source_file.hpp"
+#include "utils/string_interner.hpp"
+
+#ifndef EPSILANG_BENCH_PROGRAMS
+#define EPSILANG_BENCH_PROGRAMS "bench/programs"
+#endif
+
+namespace {
+
+// Exit codes of the programs shipped in bench/programs, worked out by hand
+struct expected_exit_t
+{
+    std::string_view program;
+    int exit_code;
+};
+
+constexpr expected_exit_t expected_exits[] = {
+    {"calls", 169},
+    {"collatz", 99},
+    {"fib", 5},
+    {"loops", 11},
+};
+
+struct counter_spec_t
+{
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+};
+
+constexpr counter_spec_t counter_specs[] = {
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"task_clock_ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+};
+
+constexpr size_t counter_count = std::size(counter_specs);
+
+struct run_result_t
+{
+    int exit_code = -1;
+    double wall_seconds = 0;
+    std::optional<uint64_t> counters[counter_count];
+};
+
+// Counts the child from its exec on, user space only so it works at the
+// default perf_event_paranoid of 2. -1 when the counter isn't available.
+int open_counter(const counter_spec_t& spec, pid_t pid) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = spec.type;
+    attr.config = spec.config;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC));
+}
+
+// The child waits on a pipe until the counters are attached, so they see the
+// whole program from exec to exit and none of the fork
+bool run_program(const std::string& path, run_result_t& result) {
+    int start_pipe[2];
+    if (pipe(start_pipe) != 0) {
+        return false;
+    }
+    const pid_t pid = fork();
+    if (pid < 0) {
+        close(start_pipe[0]);
+        close(start_pipe[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(start_pipe[1]);
+        char go;
+        if (read(start_pipe[0], &go, 1) == 1) {
+            execl(path.c_str(), path.c_str(), static_cast<char*>(nullptr));
+        }
+        _exit(127);
+    }
+    close(start_pipe[0]);
+
+    int counter_fds[counter_count];
+    for (size_t i = 0; i < counter_count; ++i) {
+        counter_fds[i] = open_counter(counter_specs[i], pid);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const char go = 1;
+    const bool started = write(start_pipe[1], &go, 1) == 1;
+    close(start_pipe[1]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    const auto end = std::chrono::steady_clock::now();
+
+    result.wall_seconds = std::chrono::duration<double>(end - start).count();
+    result.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    for (size_t i = 0; i < counter_count; ++i) {
+        uint64_t value = 0;
+        if (counter_fds[i] >= 0 && read(counter_fds[i], &value, sizeof(value)) == sizeof(value)) {
+            result.counters[i] = value;
+        }
+        if (counter_fds[i] >= 0) {
+            close(counter_fds[i]);
+        }
+    }
+    return started;
+}
+
+// Same pipeline as a single file build of the compiler, straight to an
+// executable
+bool compile_program(const std::string& input_path, const std::string& output_path, const optimise_options_t& optimise) {
+    const size_t errors = get_error_count();
+    source_file_t source;
+    if (!source.open(input_path)) {
+        error_msg("Could not open file: {}", input_path);
+        return false;
+    }
+    const uint32_t file = add_source_file(input_path);
+    set_source_contents(file, source.contents());
+
+    string_interner_t symbols;
+    lexer_t lexer(source.contents(), symbols, file);
+    ast_t ast = parse_statement(lexer);
+    ir_module_t module;
+    if (get_error_count() == errors) {
+        gen_ir_for_ast(ast, module);
+    }
+    bool ok = get_error_count() == errors && verify_ir(module);
+    if (ok) {
+        optimise_ir(module, optimise);
+        x86_program_t program;
+        select_instructions(module, program);
+        if (optimise.enabled && optimise.peephole) {
+            optimise_peephole(program);
+        }
+        machine_code_t code;
+        ok = encode_program(program, code) && write_elf_executable(output_path, code);
+    }
+    // Before the source is closed, the diagnostics point into it
+    flush_diagnostics();
+    return ok && get_error_count() == errors;
+}
+
+std::string json_counter(const std::optional<uint64_t>& value) {
+    return value ? std::to_string(*value) : "null";
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    std::string programs_directory = EPSILANG_BENCH_PROGRAMS;
+    int runs = 5;
+    optimise_options_t optimise;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view argument = argv[i];
+        if (argument == "--programs" && i + 1 < argc) {
+            programs_directory = argv[++i];
+        } else if (argument == "--runs" && i + 1 < argc) {
+            runs = std::max(1, std::atoi(argv[++i]));
+        } else if (argument == "-O0") {
+            optimise.enabled = false;
+        } else if (argument.starts_with("--inline-threshold=")) {
+            optimise.inline_threshold = static_cast<uint32_t>(std::strtoul(argv[i] + argument.find('=') + 1, nullptr, 10));
+        } else if (argument == "--no-tail-calls") {
+            optimise.tail_calls = false;
+        } else if (argument == "--no-loops") {
+            optimise.loops = false;
+        } else if (argument == "--no-constant-propagation") {
+            optimise.constant_propagation = false;
+        } else if (argument == "--no-peephole") {
+            optimise.peephole = false;
+        }
+    }
+
+    std::vector<std::filesystem::path> programs;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(programs_directory, error)) {
+        if (entry.path().extension() == ".eps") {
+            programs.push_back(entry.path());
+        }
+    }
+    if (error || programs.empty()) {
+        error_msg("No .eps programs in '{}'", programs_directory);
+        flush_diagnostics();
+        return 1;
+    }
+    std::sort(programs.begin(), programs.end());
+
+    set_log_level(log_level_e::WARNING);
+    const std::string output_path = (std::filesystem::temp_directory_path() / "runtime_bench_program").string();
+
+    std::string json = std::format(
+        "{{\"benchmark\":\"runtime_bench\",\"runs\":{},\"options\":{{\"optimise\":{},\"inline_threshold\":{},"
+        "\"tail_calls\":{},\"loops\":{},\"constant_propagation\":{},\"peephole\":{}}},\"programs\":[",
+        runs, optimise.enabled, optimise.inline_threshold, optimise.tail_calls, optimise.loops,
+        optimise.constant_propagation, optimise.peephole);
+    std::string summary = std::format("{:<12} {:>5} {:>10} {:>16} {:>16} {:>14}\n", "Program", "Exit", "Wall ms",
+                                      "Instructions", "Cycles", "Task clock ms");
+    bool ok = true;
+    bool first = true;
+    for (const std::filesystem::path& path : programs) {
+        const std::string name = path.stem().string();
+        if (!compile_program(path.string(), output_path, optimise)) {
+            error_msg("Could not compile '{}'", path.string());
+            flush_diagnostics();
+            ok = false;
+            continue;
+        }
+
+        // The fastest run is the one least disturbed by everything else
+        run_result_t best;
+        best.wall_seconds = 1e30;
+        bool ran = true;
+        for (int run = 0; run < runs && ran; ++run) {
+            run_result_t result;
+            ran = run_program(output_path, result);
+            if (ran && result.wall_seconds < best.wall_seconds) {
+                best = result;
+            }
+        }
+        // A run that never happened has no numbers worth reporting
+        if (!ran) {
+            error_msg("Could not run '{}'", name);
+            ok = false;
+            continue;
+        }
+
+        auto expected = std::find_if(std::begin(expected_exits), std::end(expected_exits),
+                                     [&](const expected_exit_t& known) { return known.program == name; });
+        const bool correct = expected == std::end(expected_exits) || expected->exit_code == best.exit_code;
+        if (!correct) {
+            error_msg("'{}' exited with {}, expected {}", name, best.exit_code, expected->exit_code);
+            ok = false;
+        }
+
+        std::format_to(std::back_inserter(json), "{}{{\"name\":\"{}\",\"exit_code\":{},\"correct\":{},\"wall_ms\":{:.3f}",
+                       first ? "" : ",", name, best.exit_code, correct, best.wall_seconds * 1e3);
+        for (size_t i = 0; i < counter_count; ++i) {
+            std::format_to(std::back_inserter(json), ",\"{}\":{}", counter_specs[i].name, json_counter(best.counters[i]));
+        }
+        json += '}';
+        first = false;
+        std::format_to(std::back_inserter(summary), "{:<12} {:>5} {:>10.3f} {:>16} {:>16} {:>14}\n", name,
+                       best.exit_code, best.wall_seconds * 1e3,
+                       best.counters[0] ? std::to_string(*best.counters[0]) : "n/a",
+                       best.counters[1] ? std::to_string(*best.counters[1]) : "n/a",
+                       best.counters[2] ? std::format("{:.3f}", *best.counters[2] / 1e6) : "n/a");
+    }
+    json += "]}\n";
+    std::filesystem::remove(output_path, error);
+
+    flush_diagnostics();
+    std::cerr << summary;
+    std::cout << json;
+    return ok ? 0 : 1;
+}
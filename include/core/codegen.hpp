@@ -1,43 +1,95 @@
 #pragma once
 
-#include <fstream>
-#include <map>
+#include <cstdint>
 #include <string>
 #include <vector>
 
+#include "core/ir.hpp"
 #include "core/parse.hpp"
+#include "core/x86.hpp"
+
+struct function_info_t {
+  const ast_node_t* node = nullptr;
+  // Symbol stored in each frame slot, parameters first and then locals
+  std::vector<symbol_t> frame;
+
+  uint32_t parameter_count() const { return node->fn.params.count; }
+};
+
+// A function as the other files of a program see it
+struct function_signature_t {
+  std::string name;
+  uint32_t param_count = 0;
+};
+
+// How one file of a program is lowered, the defaults are for a program that
+// is a single file
+struct unit_options_t {
+  bool has_entry = true;  // Top level statements become the entry, the first file only
+  bool exports = false;   // Other files may call its functions, none are dropped
+  std::vector<function_signature_t> externals;  // Defined in other files, callable here
+};
+
+// Memoised per expression node, see expression_info
+struct expression_info_t {
+  uint16_t need = 0;      // Registers needed to evaluate it (Sethi-Ullman)
+  bool has_call = false;  // Whether a call happens somewhere inside
+  bool computed = false;
+};
 
 struct code_gen_ctx_t {
-  std::ofstream& asm_file;
-  std::map<std::string, std::string>& symbol_table;
-  std::map<std::string, ast_node_t*>& function_table;
-  int variable_count = 0;
+  ast_t& ast;
+  ir_module_t& module;
+  const unit_options_t& unit;
+
+  std::vector<symbol_t> globals;           // Global slot -> symbol
+  std::vector<uint32_t> global_index;      // Global slot -> index into module.globals
+  std::vector<function_info_t> functions;  // Sorted by name for stable output
+  std::vector<const function_signature_t*> externals;  // The ones called here, after functions
 
-  ast_node_t* current_function =
+  // Lookup tables indexed by symbol, so resolving a name never touches its
+  // text. frame_lookup only holds the function currently being resolved.
+  std::vector<uint32_t> function_lookup;   // Symbol -> index into functions
+  std::vector<var_slot_t> global_lookup;   // Symbol -> global slot
+  std::vector<var_slot_t> frame_lookup;    // Symbol -> frame slot
+
+  function_info_t* current_function =
       nullptr;  // Currently processed function (nullptr for global scope)
 
-  code_gen_ctx_t(std::ofstream& asmFile,
-                 std::map<std::string, std::string>& symbolTable,
-                 std::map<std::string, ast_node_t*>& functionTable);
+  // IR function being lowered, frame slot s is its value s
+  ir_function_t* function = nullptr;
+  ir_block_id_t current_block = no_block;
+
+  std::vector<expression_info_t> expressions;  // Indexed by node id
 
-  std::string generate_label(const std::string& base_name);
-  void access_variable(const std::string& var_name);
+  code_gen_ctx_t(ast_t& ast, ir_module_t& module, const unit_options_t& unit);
+
+  var_slot_t lookup_variable(symbol_t symbol) const;
+
+  ir_block_id_t new_block(const char* name);
+  void switch_to(ir_block_id_t block);
+  // Appends to the current block, after a terminator that is a new
+  // unreachable block
+  void emit(const ir_insn_t& insn);
 };
 
-void gen_binary_op(const ast_node_t& node, code_gen_ctx_t& ctx);
-void gen_code_for_ast(const std::vector<ast_node_t>& ast,
-                      std::ofstream& asm_file,
-                      std::map<std::string, std::string>& symbol_table);
+// AST to IR, then IR to x86
+void gen_ir_for_ast(ast_t& ast, ir_module_t& module, const unit_options_t& unit = {});
+void gen_code_for_ast(ast_t& ast, x86_program_t& program);
+
+const expression_info_t& expression_info(node_id_t id, code_gen_ctx_t& ctx);
+ir_operand_t gen_expression(node_id_t id, code_gen_ctx_t& ctx);
+ir_operand_t gen_binary_op(const ast_node_t& node, code_gen_ctx_t& ctx);
 void gen_node_code(const ast_node_t& node, code_gen_ctx_t& ctx);
 
 void gen_if_code(const ast_node_t& node, code_gen_ctx_t& ctx);
 void gen_block_code(const ast_node_t& node, code_gen_ctx_t& ctx);
 void gen_comparison(const ast_node_t& node,
                     code_gen_ctx_t& ctx,
-                    const std::string& label_true,
-                    const std::string& label_end);
-void process_node_declarations(ast_node_t& node, code_gen_ctx_t& ctx);
+                    ir_block_id_t block_true,
+                    ir_block_id_t block_false);
+void process_node_declarations(const ast_node_t& node, code_gen_ctx_t& ctx);
+void resolve_node_symbols(node_id_t node, code_gen_ctx_t& ctx);
 
-void process_variable_declarations(std::vector<ast_node_t>& ast,
-                                   code_gen_ctx_t& ctx);
-void process_function_declarations(std::vector<ast_node_t>& ast, code_gen_ctx_t& ctx);
\ No newline at end of file
+void process_variable_declarations(ast_t& ast, code_gen_ctx_t& ctx);
+void process_function_declarations(const ast_t& ast, code_gen_ctx_t& ctx);
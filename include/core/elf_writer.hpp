@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+
+#include "core/encoder.hpp"
+
+// Writes a static ELF64 executable for x86-64 Linux: one read/execute segment
+// holding the headers and text, one read/write segment holding the data. No
+// linker is involved, the data fixups are patched here.
+bool write_elf_executable(const std::string& path, const machine_code_t& code);
+
+// Writes a relocatable ELF64 object for ld, one per file of a program. Data
+// fixups become relocations against .data and calls to functions of other
+// files relocations against their undefined symbols.
+bool write_elf_object(const std::string& path, const machine_code_t& code);
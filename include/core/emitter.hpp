@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <format>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// Collects the generated assembly in memory. Codegen used to stream every
+// line into an std::ofstream with std::endl, which flushed (one write
+// syscall) per instruction. Now lines are formatted straight into one
+// growing buffer, and the whole listing goes out in a single write at the end.
+class asm_emitter_t
+{
+public:
+    asm_emitter_t() { buffer.reserve(initial_capacity); }
+
+    // Unformatted line, for the common case of a fixed instruction
+    void line(std::string_view text) {
+        buffer.append(text);
+        buffer.push_back('\n');
+        ++lines;
+    }
+
+    template <typename... Args>
+    void format_line(std::format_string<Args...> fmt, Args&&... args) {
+        std::format_to(std::back_inserter(buffer), fmt, std::forward<Args>(args)...);
+        buffer.push_back('\n');
+        ++lines;
+    }
+
+    void blank_line() { line({}); }
+
+    std::string_view contents() const { return buffer; }
+    size_t line_count() const { return lines; }
+    void clear();
+
+    // Writes everything emitted so far to path, replacing the file
+    bool write_to_file(const std::string& path) const;
+
+private:
+    static constexpr size_t initial_capacity = 64 * 1024;
+
+    std::string buffer;
+    size_t lines = 0;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "core/x86.hpp"
+
+// A rip relative reference from the text section into the data section. The
+// distance between the two is only known once the output file is laid out,
+// so the encoder leaves the field zeroed and records it here.
+struct data_fixup_t
+{
+    uint32_t field;       // Offset of the rel32 field in text
+    uint32_t insn_end;    // Offset of the next instruction, rip points here
+    uint32_t data_offset; // Offset of the referenced qword in data
+};
+
+// A function label, for the symbol table of an object file
+struct code_symbol_t
+{
+    std::string name;
+    uint32_t offset = 0;    // In text, when defined
+    bool is_defined = false; // Otherwise another object file defines it
+    bool is_public = false;
+};
+
+// A call or jump to a function of another object file, the rel32 field is
+// left zeroed for the linker
+struct symbol_fixup_t
+{
+    uint32_t field;    // Offset of the rel32 field in text
+    uint32_t insn_end; // Offset of the next instruction
+    uint32_t symbol;   // Index into machine_code_t::symbols
+};
+
+constexpr uint32_t no_entry = UINT32_MAX;
+
+struct machine_code_t
+{
+    std::vector<uint8_t> text;
+    uint32_t data_size = 0;
+    uint32_t entry = no_entry; // Offset of the entry point in text
+    std::vector<data_fixup_t> data_fixups;
+    std::vector<code_symbol_t> symbols;
+    std::vector<symbol_fixup_t> symbol_fixups;
+};
+
+// Encodes every instruction to bytes and resolves all text labels. Jumps
+// start out short and are widened to rel32 until every target fits, jumps to
+// functions that aren't placed are always rel32 and get a symbol fixup.
+// Returns false after reporting an error.
+bool encode_program(const x86_program_t& program, machine_code_t& code);
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "core/emitter.hpp"
+
+// Three address intermediate representation, sitting between the AST and the
+// x86 backend. Each function is a list of basic blocks and every block ends
+// in exactly one terminator (jump, branch, ret, exit or tail_call), which also gives the
+// control flow graph. Values are virtual registers numbered per function:
+// the named variables come first (parameters, then locals) and can be
+// assigned more than once. Lowering assigns the temporaries after them only
+// once, passes may not keep that up (an inlined callee's variables become
+// plain values of the caller).
+// Globals live in memory and are only touched through load and store.
+using ir_value_t = uint32_t;
+using ir_block_id_t = uint32_t;
+
+constexpr ir_value_t no_value = std::numeric_limits<ir_value_t>::max();
+constexpr ir_block_id_t no_block = std::numeric_limits<ir_block_id_t>::max();
+constexpr uint32_t no_function = std::numeric_limits<uint32_t>::max();
+// Arguments are only passed in the six System V registers so far, codegen
+// rejects functions and calls that need more
+constexpr uint32_t max_call_arguments = 6;
+
+enum class ir_operand_kind_e : uint8_t
+{
+    none,
+    value,      // value is an ir_value_t
+    imm,        // value
+};
+
+struct ir_operand_t
+{
+    ir_operand_kind_e kind = ir_operand_kind_e::none;
+    int64_t value = 0;
+
+    bool is_value() const { return kind == ir_operand_kind_e::value; }
+    bool is_imm() const { return kind == ir_operand_kind_e::imm; }
+};
+
+inline ir_operand_t ir_value(ir_value_t value) { return {ir_operand_kind_e::value, value}; }
+inline ir_operand_t ir_imm(int64_t value) { return {ir_operand_kind_e::imm, value}; }
+
+inline bool operator==(const ir_operand_t& lhs, const ir_operand_t& rhs) {
+    return lhs.kind == rhs.kind && lhs.value == rhs.value;
+}
+
+enum class ir_cond_e : uint8_t
+{
+    eq, ne, lt, ge, le, gt,
+};
+
+enum class ir_op_e : uint8_t
+{
+    copy,       // dst = a
+    add,        // dst = a + b
+    sub,
+    mul,
+    div,        // Signed, rounds towards zero
+    cmp,        // dst = (a cond b) ? 1 : 0
+    load,       // dst = globals[index]
+    store,      // globals[index] = a
+    call,       // dst = functions[index](arguments[first, first + count))
+
+    // Terminators, the last instruction of every block and nowhere else
+    jump,       // goto target[0]
+    branch,     // if (a cond b) goto target[0] else goto target[1]
+    ret,        // return a, a may be none
+    exit,       // exit(a)
+    tail_call,  // return functions[index](arguments[first, first + count)), in this frame
+};
+
+struct ir_insn_t
+{
+    ir_op_e op;
+    ir_cond_e cond = ir_cond_e::eq;
+    ir_value_t dst = no_value;
+    ir_operand_t a;
+    ir_operand_t b;
+    uint32_t index = 0;          // Global for load/store, callee for calls
+    uint32_t first = 0;          // Call arguments in ir_function_t::arguments
+    uint32_t count = 0;
+    ir_block_id_t target[2] = {no_block, no_block};
+
+    explicit ir_insn_t(ir_op_e op) : op(op) {}
+};
+
+struct ir_block_t
+{
+    const char* name = "block"; // What the block came from, for labels and listings
+    std::vector<ir_insn_t> insns;
+
+    const ir_insn_t& terminator() const { return insns.back(); }
+};
+
+// Who can call a function besides its own module
+enum class ir_linkage_e : uint8_t
+{
+    internal,   // Nobody, it goes once nothing here calls it
+    exported,   // The other files of the program
+    external,   // Defined in another file, only declared here and has no blocks
+};
+
+struct ir_function_t
+{
+    std::string name;
+    ir_linkage_e linkage = ir_linkage_e::internal;
+    uint32_t param_count = 0;       // Values [0, param_count) hold the arguments on entry
+    uint32_t value_count = 0;
+    std::vector<std::string> variables; // Names of the named values, parameters first
+    std::vector<ir_block_t> blocks;     // blocks[0] is the entry block
+    std::vector<ir_operand_t> arguments;
+
+    bool is_external() const { return linkage == ir_linkage_e::external; }
+    ir_value_t new_value() { return value_count++; }
+    std::span<const ir_operand_t> call_arguments(const ir_insn_t& call) const {
+        return {arguments.data() + call.first, call.count};
+    }
+};
+
+// The top level statements are one more function, entry, which takes no
+// parameters and never returns. Of a program built from several files only
+// the first has one, the others only define functions.
+struct ir_module_t
+{
+    std::vector<std::string> globals;       // In data section layout order
+    std::vector<ir_function_t> functions;   // Sorted by name, entry last
+    uint32_t entry = 0;                     // no_function when there are no top level statements
+};
+
+// The condition that holds exactly when cond doesn't
+ir_cond_e invert_cond(ir_cond_e cond);
+
+bool is_terminator(ir_op_e op);
+bool is_call(ir_op_e op);
+// Whether the instruction writes dst
+bool has_dst(ir_op_e op);
+
+// Target blocks of a terminator
+std::span<const ir_block_id_t> successors(const ir_insn_t& terminator);
+std::vector<std::vector<ir_block_id_t>> predecessors(const ir_function_t& function);
+
+// Drops blocks no path from the entry reaches and renumbers the rest
+void remove_unreachable_blocks(ir_function_t& function);
+
+// Appends every block that is only entered by a jump from one other block
+// to that block, then drops what became unreachable
+void merge_blocks(ir_function_t& function);
+
+size_t count_instructions(const ir_function_t& function);
+size_t count_instructions(const ir_module_t& module);
+
+std::string_view ir_op_name(ir_op_e op);
+std::string_view ir_cond_name(ir_cond_e cond);
+
+void print_ir(const ir_module_t& module, asm_emitter_t& out);
+
+// Checks the structural invariants every pass relies on. Each violation is
+// reported as an error, returns whether there were none.
+bool verify_ir(const ir_module_t& module);
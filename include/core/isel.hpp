@@ -0,0 +1,16 @@
+#pragma once
+
+#include "core/ir.hpp"
+#include "core/x86.hpp"
+#include "utils/thread_pool.hpp"
+
+// Instruction selection: turns every IR function into x86 instructions on
+// virtual registers (IR value n becomes vreg n) and hands each one to the
+// register allocator. Data labels for the globals are laid out in
+// module.globals order.
+//
+// Functions are selected and allocated independently, each into its own
+// code, on pool's threads when there is a pool. The code is appended in
+// function order and labels are named before any function is selected, so
+// the program comes out the same either way.
+void select_instructions(const ir_module_t& module, x86_program_t& program, thread_pool_t* pool = nullptr);
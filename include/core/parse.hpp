@@ -1,45 +1,117 @@
 #pragma once
 
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <string>
+#include <string_view>
 #include <vector>
-#include <memory>
-#include <map>
 
 #include "core/tokenise.hpp"
+#include "utils/string_interner.hpp"
 
+// The AST is flat: nodes live in one contiguous array owned by ast_t and refer
+// to each other through 32-bit indices. Variable length children (block
+// statements, call arguments, function parameters) are stored as ranges in a
+// shared side table. Nothing is freed per node, the whole tree goes away with
+// its ast_t at the end of compilation.
+using node_id_t = uint32_t;
+
+constexpr node_id_t null_node = std::numeric_limits<node_id_t>::max();
+
+// Where a variable reference lives, filled in by codegen's resolve pass so
+// later passes never look names up. Frame slots number the parameters first
+// and then the locals, globals are an index into the global list with
+// global_slot_flag set.
+using var_slot_t = uint32_t;
+
+constexpr var_slot_t unresolved_slot = std::numeric_limits<var_slot_t>::max();
+constexpr var_slot_t global_slot_flag = 1u << 31;
+
+// Range [begin, begin + count) of ast_t::lists
+struct node_list_t
+{
+    uint32_t begin;
+    uint32_t count;
+};
+
+// Which member of the union is live depends on type:
+//   type_int_lit                      int_lit
+//   type_identifier                   identifier
+//   type_add/sub/mul/div, comparisons binary
+//   type_let, type_assignment         assign
+//   type_exit, type_return            unary
+//   type_if                           if_stmt (else_branch is a block, an if or null_node)
+//   type_while                        while_stmt
+//   type_block                        block (list of node ids)
+//   type_fn                           fn (params is a list of symbols)
+//   type_call                         call (arguments is a list of node ids)
 struct ast_node_t
 {
     token_type_e type;
-    int int_value = 0;
-    std::string string_value;
-    std::unique_ptr<ast_node_t> child_node_1;
-    std::unique_ptr<ast_node_t> child_node_2;
-    std::unique_ptr<ast_node_t> child_node_3;
-
-    std::vector<ast_node_t> statements;
-    std::vector<std::string> parameters;
-    std::vector<ast_node_t> arguments;
-    std::vector<ast_node_t> body;
-    std::map<std::string, std::string> local_symbols;
+    union {
+        struct { int64_t value; } int_lit;
+        struct { symbol_t name; var_slot_t slot; } identifier;
+        struct { node_id_t lhs; node_id_t rhs; } binary;
+        struct { symbol_t name; node_id_t value; var_slot_t slot; } assign;
+        struct { node_id_t value; } unary;
+        struct { node_id_t condition; node_id_t then_block; node_id_t else_branch; } if_stmt;
+        struct { node_id_t condition; node_id_t body; } while_stmt;
+        struct { node_list_t statements; } block;
+        struct { symbol_t name; node_list_t params; node_id_t body; } fn;
+        struct { symbol_t name; node_list_t arguments; } call;
+    };
+};
+
+static_assert(sizeof(ast_node_t) <= 24, "keep AST nodes small, they are stored by value");
+
+struct ast_t
+{
+    std::vector<ast_node_t> nodes;
+    // Byte offset of the token each node starts at, kept next to nodes rather
+    // than in them so the nodes stay small for the passes that never report
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> lists;
+    node_list_t program{}; // Top level statements
+    const string_interner_t* symbols = nullptr;
+    uint32_t file = no_source_file;
+
+    // Children of a list under construction are collected here first, so
+    // nested lists can be built while an outer one is still open
+    std::vector<uint32_t> scratch;
+
+    node_id_t add_node(const ast_node_t& node, uint32_t offset);
+    node_list_t add_list(size_t scratch_mark);
+
+    const ast_node_t& node(node_id_t id) const { return nodes[id]; }
+    std::span<const uint32_t> list(node_list_t range) const { return {lists.data() + range.begin, range.count}; }
+    std::string_view name(symbol_t symbol) const { return symbols->name(symbol); }
+
+    source_location_t location(node_id_t id) const { return {file, offsets[id]}; }
+    source_location_t location(const ast_node_t& node) const { return location(static_cast<node_id_t>(&node - nodes.data())); }
 };
 
 std::string token_type_to_string(token_type_e type);
 
-const token_t* peek_token(const std::vector<token_t>& tokens, const size_t &index);
-const token_t* consume_token(const std::vector<token_t>& tokens, size_t &index);
+const token_t* peek_token(lexer_t& lexer);
+const token_t* peek_token_ahead(lexer_t& lexer, size_t ahead);
+const token_t* consume_token(lexer_t& lexer);
 
-void parse_factor(std::vector<token_t>& tokens, size_t& token_index, ast_node_t& root_node);
-void parse_term(std::vector<token_t>& tokens, size_t& index, ast_node_t& root_node);
-void parse_expression(std::vector<token_t>& tokens, size_t& token_index, ast_node_t& root_node);
-void parse_comparison(std::vector<token_t>& tokens, size_t& token_index, ast_node_t& root_node);
+// Every parse function returns the id of the node it built, or null_node
+// after reporting an error
+node_id_t parse_factor(lexer_t& lexer, ast_t& ast);
+node_id_t parse_term(lexer_t& lexer, ast_t& ast);
+node_id_t parse_expression(lexer_t& lexer, ast_t& ast);
+node_id_t parse_comparison(lexer_t& lexer, ast_t& ast);
 
-void parse_exit_statement(std::vector<token_t>& tokens, size_t& token_index, ast_node_t& root_node);
-void parse_let_statement(std::vector<token_t>& token_stream, size_t &token_index, ast_node_t& root_node);
-void parse_if_statement(std::vector<token_t>& token_stream, size_t &token_index, ast_node_t& root_node);
-void parse_return_statement(std::vector<token_t>& tokens, size_t& token_index, ast_node_t& root_node);
-void parse_function_statement(std::vector<token_t>& tokens, size_t& token_index, ast_node_t& root_node);
+node_id_t parse_exit_statement(lexer_t& lexer, ast_t& ast);
+node_id_t parse_let_statement(lexer_t& lexer, ast_t& ast);
+node_id_t parse_if_statement(lexer_t& lexer, ast_t& ast);
+node_id_t parse_return_statement(lexer_t& lexer, ast_t& ast);
+node_id_t parse_function_statement(lexer_t& lexer, ast_t& ast);
 
-void parse_assignment_statement(std::vector<token_t>& tokens, size_t& token_index, ast_node_t& root_node);
-void parse_while_statement(std::vector<token_t>& tokens, size_t& token_index, ast_node_t& root_node);
-void parse_block(std::vector<token_t>& tokens, size_t& token_index, ast_node_t& root_node);
+node_id_t parse_assignment_statement(lexer_t& lexer, ast_t& ast);
+node_id_t parse_while_statement(lexer_t& lexer, ast_t& ast);
+node_id_t parse_block(lexer_t& lexer, ast_t& ast);
 
-std::vector<ast_node_t> parse_statement(std::vector<token_t>& token_stream);
+ast_t parse_statement(lexer_t& lexer);
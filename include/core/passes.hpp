@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+
+#include "core/ir.hpp"
+
+// IR optimisation passes, run between lowering and instruction selection.
+// optimise_ir runs the enabled ones in order, verifies the IR after each and
+// logs how many instructions every pass removed.
+struct optimise_options_t
+{
+    bool enabled = true;            // -O0 turns every pass off
+    uint32_t inline_threshold = 16; // Largest callee inlined, in IR instructions, 0 for none
+    bool constant_propagation = true;
+    bool loops = true;              // Rotation, invariant code motion and strength reduction
+    bool tail_calls = true;         // Self recursion to loops, other calls in tail position to jumps
+    bool peephole = true;           // On the x86 code after selection, see peephole.hpp
+};
+
+void optimise_ir(ir_module_t& module, const optimise_options_t& options);
+
+struct inline_stats_t
+{
+    uint32_t inlined = 0;           // Calls replaced by the callee's body
+    uint32_t removed_functions = 0; // Functions nothing calls any more
+};
+
+// Copies the body of small leaf functions (no calls, at most threshold
+// instructions) into their callers in place of the call. Callers are done
+// after their callees, so one that only called leaves can be inlined
+// further up in turn. Each inlined call is logged. Functions that neither
+// the entry nor an exported function reaches through calls afterwards are
+// removed.
+inline_stats_t inline_functions(ir_module_t& module, uint32_t threshold);
+
+struct loop_stats_t
+{
+    uint32_t rotated = 0;   // Loops now testing their condition at the bottom
+    uint32_t hoisted = 0;   // Loop invariant instructions moved in front of their loop
+    uint32_t reduced = 0;   // Multiplications of an induction variable replaced by additions
+};
+
+// Optimises the natural loops of every function (found through the
+// dominator tree, so while loops and loops left by tail recursion alike).
+// A loop whose header is only a short condition is rotated: the condition
+// is copied to the end of each latch, so an iteration takes one branch at
+// the bottom and the header stays in front as the guard. Then, inner loops
+// first, pure instructions whose operands don't change inside the loop are
+// hoisted into a preheader, and i * c for an induction variable i stepping
+// by a constant becomes a value added to once per step.
+loop_stats_t optimise_loops(ir_module_t& module);
+
+struct constant_stats_t
+{
+    uint32_t folded = 0;    // Instructions and operands replaced by constants
+    uint32_t branches = 0;  // Branches with a known outcome, now jumps
+    uint32_t removed = 0;   // Instructions in dead code, merged jumps included
+};
+
+// Sparse conditional constant propagation (Wegman and Zadeck). Temporaries
+// are assigned once, so they get one lattice value each, the way SSA values
+// would. Variables assigned more than once and globals are tracked per
+// block instead. Only blocks reachable under the constants found so far are
+// evaluated, so code behind a branch that always goes one way never makes
+// anything overdefined. Afterwards constant results and operands are
+// substituted, decided branches become jumps, and blocks and instructions
+// nothing depends on any more are deleted. Blocks left in a straight line
+// are merged.
+constant_stats_t propagate_constants(ir_module_t& module);
+
+// A call to the function itself right before returning its result becomes
+// copies into the parameters and a jump back to the top of the body, so
+// the recursion runs in constant stack space. Runs before inlining, the
+// function may be small enough to inline afterwards. Returns how many calls
+// were replaced.
+uint32_t eliminate_tail_recursion(ir_module_t& module);
+
+// Every other call whose result is returned as is becomes a tail_call, which
+// selects to a jump that reuses the caller's frame. Not done in the entry
+// function, it has no frame to give away. Returns how many calls changed.
+uint32_t mark_tail_calls(ir_module_t& module);
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "core/x86.hpp"
+
+// Peephole optimisation over the allocated instruction list, between
+// instruction selection and the encoder or fasm listing. Each rule in the
+// table looks at a few instructions from one position on and may replace
+// them. The whole text is swept until a sweep changes nothing, so one rule
+// can set up another (a threaded jump becoming a jump to the next line).
+struct peephole_rule_stats_t
+{
+    std::string_view name;
+    uint32_t hits = 0;
+};
+
+struct peephole_stats_t
+{
+    std::vector<peephole_rule_stats_t> rules; // In rule table order
+    size_t before = 0;                        // Instructions, labels and comments included
+    size_t after = 0;
+};
+
+peephole_stats_t optimise_peephole(x86_program_t& program);
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "core/x86.hpp"
+
+// Linear scan register allocation (Poletto and Sarkar) for one function.
+//
+// Everything in code.text from begin on must be one function body written
+// with virtual registers, starting right after its label. labels is only
+// read, for telling jumps to functions (tail calls) from local ones. Liveness
+// is computed over the body's control flow graph and every virtual register
+// gets one interval,
+// from its first to its last live position. Intervals are handed registers
+// in order of their start, and when none is free the one reaching furthest
+// is spilled to a stack slot.
+//
+// Afterwards every virtual register is replaced by its register or slot,
+// parallel copies are turned into moves and the prologue is inserted at
+// begin. The epilogue goes in front of each ret and each jmp to a function
+// label (a tail call). With save_callee_saved
+// the callee saved registers the function touched are restored there too.
+//
+// Calling convention the allocator relies on: callees preserve rbx and
+// r12-r15 and may overwrite every other register. The allocator knows which
+// values are still needed after each call and pushes only the registers
+// holding those around it, before the parallel copy of the arguments right
+// in front of the call. Values live across a call prefer the callee saved
+// registers, so most calls save nothing. rax and rdx are never allocated
+// (division, return values), neither is r11, which is kept free as a
+// scratch register for fixing up spilled operands.
+struct regalloc_stats_t
+{
+    uint32_t intervals = 0;
+    uint32_t spilled = 0;
+    uint32_t call_saves = 0; // Registers pushed and popped around calls
+};
+
+regalloc_stats_t allocate_registers(x86_code_t& code, const std::vector<x86_label_t>& labels, size_t begin,
+                                    uint32_t vreg_count, bool save_callee_saved);
@@ -1,8 +1,13 @@
 #pragma once
 
-#include <string>
+#include <array>
+#include <cstdint>
+#include <string_view>
 #include <vector>
 
+#include "utils/source_location.hpp"
+#include "utils/string_interner.hpp"
+
 enum class token_type_e
 {
     type_exit,
@@ -37,14 +42,63 @@ enum class token_type_e
     type_EOF,
 };
 
+// Tokens don't own their text, value is a view into the source buffer
+// handed to the lexer, so that buffer has to outlive the token stream.
 struct token_t
 {
+    std::string_view value;
+    uint32_t offset = 0; // Byte offset of value in the source buffer
+    uint32_t file = no_source_file;
+    symbol_t symbol = null_symbol; // Interned name, identifiers only
     token_type_e type;
-    std::string value;
-    std::string identifier;
+
+    source_location_t location() const { return {file, offset}; }
+};
+
+static_assert(sizeof(token_t) <= 32, "tokens are copied through the lexer's ring buffer");
+
+// Pull based token stream. Tokens are lexed on demand into a small ring
+// buffer, so the parser only ever holds max_lookahead tokens in memory no
+// matter how big the source is.
+class lexer_t
+{
+public:
+    static constexpr size_t max_lookahead = 2;
+
+    // file is the id from add_source_file, stamped on every token
+    lexer_t(std::string_view contents, string_interner_t& symbols, uint32_t file = no_source_file);
+
+    string_interner_t& symbols;
+
+    // Token `ahead` positions past the current one, nullptr once the stream is
+    // exhausted (the EOF token has been consumed). Pointers stay valid until
+    // two more tokens have been consumed.
+    const token_t* peek(size_t ahead = 0);
+    const token_t* consume();
+
+    size_t tokens_lexed() const { return lexed_count; }
+    uint32_t file_id() const { return file; }
+    // Where errors about a missing token point
+    source_location_t end_location() const { return {file, static_cast<uint32_t>(contents.size())}; }
+
+private:
+    token_t lex_next();
+    bool fill(size_t wanted);
+
+    std::string_view contents;
+    uint32_t file;
+    size_t pos = 0;
+    bool eof_lexed = false;
+    size_t lexed_count = 0;
+
+    // Room for the lookahead window plus the tokens handed out most recently
+    std::array<token_t, max_lookahead + 2> ring{};
+    size_t head = 0;
+    size_t buffered = 0;
 };
 
-char consume(const std::string &contents, size_t &token_index);
-char peek(const std::string &contents, size_t token_index);
+char consume(std::string_view contents, size_t &token_index);
+char peek(std::string_view contents, size_t token_index);
 
-std::vector<token_t> tokenise(const std::string &contents);
+// Lex the whole input up front, for tools that want the full token list
+std::vector<token_t> tokenise(std::string_view contents, string_interner_t& symbols);
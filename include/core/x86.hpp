@@ -0,0 +1,192 @@
+#pragma once
+
+#include <cstdint>
+#include <format>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "core/emitter.hpp"
+
+// Codegen produces a list of x86-64 instructions instead of assembly text.
+// The list is either encoded straight to machine code (encoder.hpp) or
+// printed as fasm source for debugging.
+
+// Numbered the way the hardware encodes them
+enum class x86_reg_e : uint8_t
+{
+    rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi,
+    r8, r9, r10, r11, r12, r13, r14, r15,
+    none,
+};
+
+enum class x86_op_e : uint8_t
+{
+    // Pseudo instructions, they don't produce any bytes
+    label,      // dst is the label placed here
+    comment,    // Only shows up in the fasm listing
+    parallel_copy, // dst.value/src.value: first and count in x86_program_t::copies
+
+    mov,
+    push,
+    pop,
+    add,
+    sub,
+    imul,
+    imul_wide,  // rdx:rax = rax * dst, signed
+    cqo,        // rdx = sign of rax
+    idiv,       // rax = rdx:rax / dst, rdx = remainder, signed
+    neg,
+    shl,        // dst <<= src, src is an immediate
+    sar,        // Arithmetic shift right
+    shr,        // Logical shift right
+    lea,        // dst = address of src, a memory operand
+    xor_,
+    cmp,
+    sete,       // Low byte of dst = flags say so ? 1 : 0
+    setne,
+    setl,
+    setge,
+    setle,
+    setg,
+    movzx,      // dst = low byte of src, zero extended
+    jmp,
+    je,
+    jne,
+    jl,
+    jge,
+    jle,
+    jg,
+    call,
+    ret,
+    syscall,
+};
+
+enum class x86_operand_kind_e : uint8_t
+{
+    none,
+    reg,        // reg
+    vreg,       // value is the virtual register number, until allocation
+    imm,        // value
+    mem,        // qword [reg + index * scale + value], or [label] when reg is none
+    label,      // label, target of a jump or call
+};
+
+using x86_label_id_t = uint32_t;
+
+constexpr x86_label_id_t no_label = std::numeric_limits<x86_label_id_t>::max();
+constexpr uint32_t no_comment = std::numeric_limits<uint32_t>::max();
+
+struct x86_operand_t
+{
+    x86_operand_kind_e kind = x86_operand_kind_e::none;
+    x86_reg_e reg = x86_reg_e::none;
+    x86_label_id_t label = no_label;
+    int64_t value = 0;
+    x86_reg_e index = x86_reg_e::none; // Memory only
+    uint8_t scale = 1;
+};
+
+inline x86_operand_t x86_reg(x86_reg_e reg) { return {x86_operand_kind_e::reg, reg, no_label, 0}; }
+inline x86_operand_t x86_vreg(uint32_t vreg) { return {x86_operand_kind_e::vreg, x86_reg_e::none, no_label, vreg}; }
+inline x86_operand_t x86_imm(int64_t value) { return {x86_operand_kind_e::imm, x86_reg_e::none, no_label, value}; }
+inline x86_operand_t x86_mem(x86_reg_e base, int32_t displacement) { return {x86_operand_kind_e::mem, base, no_label, displacement}; }
+inline x86_operand_t x86_mem(x86_label_id_t label) { return {x86_operand_kind_e::mem, x86_reg_e::none, label, 0}; }
+inline x86_operand_t x86_label(x86_label_id_t label) { return {x86_operand_kind_e::label, x86_reg_e::none, label, 0}; }
+// [base + index * scale], physical registers only, for lea after allocation
+inline x86_operand_t x86_mem(x86_reg_e base, x86_reg_e index, uint8_t scale) {
+    return {x86_operand_kind_e::mem, base, no_label, 0, index, scale};
+}
+
+inline bool operator==(const x86_operand_t& lhs, const x86_operand_t& rhs) {
+    return lhs.kind == rhs.kind && lhs.reg == rhs.reg && lhs.label == rhs.label && lhs.value == rhs.value
+        && lhs.index == rhs.index && lhs.scale == rhs.scale;
+}
+
+struct x86_insn_t
+{
+    x86_op_e op;
+    x86_operand_t dst;
+    x86_operand_t src;
+    uint32_t comment = no_comment; // Index into x86_program_t::comments
+};
+
+// One move of a parallel copy, all sources are read before any destination
+// is written
+struct x86_copy_t
+{
+    x86_operand_t dst;
+    x86_operand_t src;
+};
+
+enum class x86_section_e : uint8_t
+{
+    text,
+    data,
+};
+
+struct x86_label_t
+{
+    std::string name;
+    x86_section_e section = x86_section_e::text;
+    bool is_function = false;
+    bool is_placed = false;
+    bool is_public = false; // Visible to other object files
+};
+
+// A run of instructions with the comments and parallel copies they refer
+// to. Labels are only referred to by id, so functions can be selected into
+// one each on separate threads and appended to the program afterwards.
+struct x86_code_t
+{
+    std::vector<x86_insn_t> text;
+    std::vector<std::string> comments;
+    std::vector<x86_copy_t> copies;
+
+    void emit(x86_op_e op, x86_operand_t dst = {}, x86_operand_t src = {}) { text.push_back({op, dst, src}); }
+    void emit_parallel_copy(const std::vector<x86_copy_t>& moves);
+
+    // Attach a comment to the last instruction
+    template <typename... Args>
+    void annotate(std::format_string<Args...> fmt, Args&&... args) {
+        text.back().comment = static_cast<uint32_t>(comments.size());
+        comments.push_back(std::format(fmt, std::forward<Args>(args)...));
+    }
+
+    // A comment on a line of its own
+    template <typename... Args>
+    void comment(std::format_string<Args...> fmt, Args&&... args) {
+        emit(x86_op_e::comment);
+        annotate(fmt, std::forward<Args>(args)...);
+    }
+};
+
+// A whole program: the text section as instructions plus the data section,
+// which only holds zero initialised qwords for now
+struct x86_program_t : x86_code_t
+{
+    std::vector<x86_label_t> labels;
+    std::vector<x86_label_id_t> data; // One qword each, in layout order
+    x86_label_id_t entry = no_label;
+
+    std::unordered_map<std::string, x86_label_id_t> label_lookup;
+
+    // Finds or creates the label with this name
+    x86_label_id_t label(std::string_view name);
+    x86_label_id_t add_data(std::string_view name);
+
+    void place(x86_label_id_t label);
+    // Moves code to the end of the text, the labels it places count as placed
+    void append(x86_code_t&& code);
+};
+
+std::string_view x86_reg_name(x86_reg_e reg);
+// Name of the low byte, al, sil, r8b and so on
+std::string_view x86_byte_reg_name(x86_reg_e reg);
+std::string_view x86_op_name(x86_op_e op);
+
+// fasm source for the program, only used as debug output
+void print_fasm(const x86_program_t& program, asm_emitter_t& out);
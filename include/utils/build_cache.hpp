@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// 64 bit FNV-1a over everything that goes into an output, used as its cache
+// key. Strings are added with their length so neighbouring fields can't run
+// into each other.
+class content_hash_t
+{
+public:
+    content_hash_t& add_bytes(const void* data, size_t size);
+    content_hash_t& add(std::string_view text);
+    content_hash_t& add(uint64_t value);
+
+    uint64_t value() const { return state; }
+
+private:
+    uint64_t state = 0xcbf29ce484222325;
+};
+
+// Outputs of earlier runs on disk, each one stored under the hash of its
+// inputs. Entries are never written in place: a store goes to a temporary
+// file that is renamed over the entry, so another run never sees half of one.
+class build_cache_t
+{
+public:
+    // Creates the directory if needed, false when it can't be used
+    bool open(const std::string& directory);
+
+    // Copies the entry to path, false when there is none
+    bool restore(uint64_t key, std::string_view extension, const std::string& path, bool executable = false) const;
+    // Copies path into the entry
+    bool store(uint64_t key, std::string_view extension, const std::string& path);
+
+    bool load_text(uint64_t key, std::string_view extension, std::string& text) const;
+    bool store_text(uint64_t key, std::string_view extension, std::string_view text);
+
+    // Identity of the running compiler's binary, so a rebuilt one never
+    // reuses old outputs
+    static bool hash_compiler(content_hash_t& hash);
+
+private:
+    std::string entry_path(uint64_t key, std::string_view extension) const;
+
+    std::string directory;
+    std::atomic<uint32_t> temporaries{0}; // Keeps stores from several threads apart
+};
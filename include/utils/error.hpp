@@ -1,77 +1,149 @@
-#pragma once
-
-#include <string>
-#include <iostream>
-#include <format>
-#include <chrono>
-
-static size_t g_error_count = 0;
-
-enum class log_level_e
-{
-    DEBUG,
-    INFO,
-    WARNING,
-    ERROR,
-};
-
-inline std::string log_level_to_string(const log_level_e& level)
-{
-    switch (level)
-    {
-        case log_level_e::DEBUG: return "DEBUG";
-        case log_level_e::INFO: return "INFO";
-        case log_level_e::WARNING: return "WARNING";
-        case log_level_e::ERROR: return "ERROR";
-        default: return "UNKNOWN";
-    }
-}
-
-inline std::string get_timestamp() {
-    auto now = std::chrono::system_clock::now();
-    auto time = std::chrono::system_clock::to_time_t(now);
-
-    char buffer[32];  // Create a char buffer with sufficient size, because c func
-    std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", std::localtime(&time));
-    return std::string(buffer);
-}
-
-template <typename... Args>
-void log_message(log_level_e level, std::string_view fmt, Args&&... args) {
-    try {
-        if (level == log_level_e::ERROR) {
-            ++g_error_count;
-        }
-
-        std::string formatted_msg = std::vformat(fmt, std::make_format_args(args...));
-        std::cerr << std::format("[{}][{}]: {}\n",
-                               get_timestamp(),
-                               log_level_to_string(level),
-                               formatted_msg);
-    } catch (const std::exception& e) {
-        std::cerr << "Formatting error: " << e.what() << std::endl;
-    }
-}
-
-template <typename... Args>
-void debug_msg(std::string_view fmt, Args&&... args) {
-    log_message(log_level_e::DEBUG, fmt, std::forward<Args>(args)...);
-}
-
-template <typename... Args>
-void info_msg(std::string_view fmt, Args&&... args) {
-    log_message(log_level_e::INFO, fmt, std::forward<Args>(args)...);
-}
-
-template <typename... Args>
-void warning_msg(std::string_view fmt, Args&&... args) {
-    log_message(log_level_e::WARNING, fmt, std::forward<Args>(args)...);
-}
-
-template <typename... Args>
-void error_msg(std::string_view fmt, Args&&... args) {
-    log_message(log_level_e::ERROR, fmt, std::forward<Args>(args)...);
-}
-
-inline size_t get_error_count() { return g_error_count; }
-inline void reset_error_count() { g_error_count = 0; }
\ No newline at end of file
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <format>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "utils/source_location.hpp"
+
+enum class log_level_e
+{
+    DEBUG,
+    INFO,
+    WARNING,
+    ERROR,
+};
+
+inline std::string_view log_level_to_string(log_level_e level)
+{
+    switch (level)
+    {
+        case log_level_e::DEBUG: return "DEBUG";
+        case log_level_e::INFO: return "INFO";
+        case log_level_e::WARNING: return "WARNING";
+        case log_level_e::ERROR: return "ERROR";
+        default: return "UNKNOWN";
+    }
+}
+
+// Levels below this are compiled out: DEBUG and INFO in release builds,
+// nothing otherwise. Override with -DEPSILANG_MIN_LOG_LEVEL=0..3.
+#ifndef EPSILANG_MIN_LOG_LEVEL
+#ifdef NDEBUG
+#define EPSILANG_MIN_LOG_LEVEL 2
+#else
+#define EPSILANG_MIN_LOG_LEVEL 0
+#endif
+#endif
+
+constexpr log_level_e compiled_log_level = static_cast<log_level_e>(EPSILANG_MIN_LOG_LEVEL);
+
+// Messages below the level are dropped before anything is formatted.
+// Defaults to INFO, set it before any threads start logging.
+void set_log_level(log_level_e level);
+log_level_e get_log_level();
+
+inline bool is_logged(log_level_e level) {
+    return level >= compiled_log_level && level >= get_log_level();
+}
+
+// Adds the timestamp and level and appends the line to a buffer, which is
+// written out when it fills up, on errors and on flush_log
+void write_log_line(log_level_e level, std::string_view message);
+// Call before anything else writes to stderr or stdout
+void flush_log();
+
+// Warnings and errors are diagnostics: they're counted with atomics and kept
+// in a buffer of the reporting thread, no lock taken, until flush_diagnostics
+// prints everything reported so far sorted by file, offset and text. That
+// keeps the output the same however the work was split between threads.
+void report_diagnostic(log_level_e level, source_location_t location, std::string message);
+// Call only while no other thread is reporting, between phases and at exit
+void flush_diagnostics();
+
+size_t get_error_count();
+size_t get_warning_count();
+void reset_error_count();
+
+// Counts the errors reported while it is alive, on its own thread and in the
+// thread pool jobs started from there. Scopes nest, an error counts towards
+// every enclosing one. A file of a parallel build is judged by its own
+// errors this way, not by whatever the others report at the same time.
+class error_scope_t
+{
+public:
+    error_scope_t();
+    ~error_scope_t();
+
+    error_scope_t(const error_scope_t&) = delete;
+    error_scope_t& operator=(const error_scope_t&) = delete;
+
+    size_t error_count() const { return errors.load(std::memory_order_relaxed); }
+
+    // The innermost scope of this thread, nullptr outside of any
+    static error_scope_t* current();
+    // For jobs run on another thread, returns the one to restore afterwards
+    static error_scope_t* make_current(error_scope_t* scope);
+
+private:
+    friend void report_diagnostic(log_level_e level, source_location_t location, std::string message);
+
+    error_scope_t* parent;
+    std::atomic<size_t> errors{0};
+};
+
+// The format strings are checked at compile time, so a stray '{' in a
+// message is a build error rather than a garbled diagnostic
+template <typename... Args>
+void report_message(log_level_e level, source_location_t location, std::format_string<Args...> fmt, Args&&... args) {
+    report_diagnostic(level, location, std::format(fmt, std::forward<Args>(args)...));
+}
+
+template <typename... Args>
+void log_message(log_level_e level, std::format_string<Args...> fmt, Args&&... args) {
+    if (!is_logged(level)) {
+        return;
+    }
+    write_log_line(level, std::format(fmt, std::forward<Args>(args)...));
+}
+
+template <typename... Args>
+void debug_msg(std::format_string<Args...> fmt, Args&&... args) {
+    if constexpr (log_level_e::DEBUG >= compiled_log_level) {
+        log_message(log_level_e::DEBUG, fmt, std::forward<Args>(args)...);
+    }
+}
+
+template <typename... Args>
+void info_msg(std::format_string<Args...> fmt, Args&&... args) {
+    if constexpr (log_level_e::INFO >= compiled_log_level) {
+        log_message(log_level_e::INFO, fmt, std::forward<Args>(args)...);
+    }
+}
+
+template <typename... Args>
+void warning_at(source_location_t location, std::format_string<Args...> fmt, Args&&... args) {
+    if constexpr (log_level_e::WARNING >= compiled_log_level) {
+        if (is_logged(log_level_e::WARNING)) {
+            report_message(log_level_e::WARNING, location, fmt, std::forward<Args>(args)...);
+        }
+    }
+}
+
+template <typename... Args>
+void warning_msg(std::format_string<Args...> fmt, Args&&... args) {
+    warning_at(source_location_t{}, fmt, std::forward<Args>(args)...);
+}
+
+template <typename... Args>
+void error_at(source_location_t location, std::format_string<Args...> fmt, Args&&... args) {
+    report_message(log_level_e::ERROR, location, fmt, std::forward<Args>(args)...);
+}
+
+template <typename... Args>
+void error_msg(std::format_string<Args...> fmt, Args&&... args) {
+    error_at(source_location_t{}, fmt, std::forward<Args>(args)...);
+}
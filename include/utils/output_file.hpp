@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Replaces path with size bytes from data in as few write() calls as the
+// kernel allows. Executables are created with the x bits set.
+bool write_output_file(const std::string& path, const void* data, size_t size, bool executable = false);
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Where compile time goes. Phases are timed with profile_scope_t, which does
+// nothing until profiling is turned on (--time-report, --stats, --trace), so
+// the scopes stay in the code for good.
+
+// Heap allocations counted by the replacement global operator new in
+// profiler.cpp. Only counted once profiling is on, until then operator new
+// goes straight to malloc.
+struct allocation_counts_t
+{
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+};
+
+// By every thread
+allocation_counts_t allocation_counts();
+// By the calling thread
+allocation_counts_t thread_allocation_counts();
+
+struct profile_counter_t
+{
+    const char* name;
+    uint64_t value;
+};
+
+// CPU time and allocations are those of the thread the scope ran on, so
+// scopes running side by side on the pool don't count each other's work. A
+// phase that hands work to the pool only shows its own share, the workers'
+// show up in their scopes. "total" has the whole process's, and RSS is
+// always the process's.
+struct profile_event_t
+{
+    const char* name = nullptr;
+    std::string detail;     // The function or file it was about, only shown in the trace
+    uint32_t thread = 0;    // Small id, threads are numbered as they first record
+    uint32_t depth = 0;     // Scopes of the same thread it is nested in
+    int64_t start_us = 0;   // Since profiling was turned on
+    int64_t wall_us = 0;
+    int64_t cpu_us = 0;
+    uint64_t allocations = 0;
+    uint64_t allocated_bytes = 0;
+    uint64_t peak_rss_kb = 0; // When the phase ended
+    std::vector<profile_counter_t> counters;
+};
+
+class profiler_t
+{
+public:
+    void enable();
+    bool is_enabled() const { return enabled; }
+
+    int64_t now_us() const;
+    void record(profile_event_t&& event);
+    // Records the whole run so far as "total", call once before reporting
+    void finish();
+
+    // Phases with the same name are added up, in the order they first started
+    // and indented by nesting
+    void print_time_report() const;
+    // The counters of each phase, per second of its wall time
+    void print_stats() const;
+    // Trace event format, for chrome://tracing or Perfetto
+    bool write_chrome_trace(const std::string& path) const;
+
+private:
+    bool enabled = false;
+    std::chrono::steady_clock::time_point origin;
+    int64_t origin_cpu_us = 0;
+    allocation_counts_t origin_allocations;
+
+    mutable std::mutex mutex;
+    std::vector<profile_event_t> events;
+};
+
+extern profiler_t g_profiler;
+
+class profile_scope_t
+{
+public:
+    explicit profile_scope_t(const char* name, std::string_view detail = {});
+    ~profile_scope_t();
+
+    profile_scope_t(const profile_scope_t&) = delete;
+    profile_scope_t& operator=(const profile_scope_t&) = delete;
+
+    // Something the phase got through, reported with its rate
+    void count(const char* counter, uint64_t value);
+
+private:
+    bool active;
+    profile_event_t event;
+    allocation_counts_t start_allocations;
+};
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// Read-only view of an input file. Regular files are memory-mapped once and
+// handed out as a string_view, so tokens can point straight into the mapping
+// instead of copying characters around. Anything that can't be mapped (pipes,
+// empty files) falls back to reading into an owned buffer.
+class source_file_t
+{
+public:
+    source_file_t() = default;
+    ~source_file_t();
+
+    source_file_t(const source_file_t&) = delete;
+    source_file_t& operator=(const source_file_t&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+
+    std::string_view contents() const { return {data, size}; }
+    bool is_mapped() const { return mapped; }
+
+private:
+    const char* data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    std::string fallback_buffer;
+};
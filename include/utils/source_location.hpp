@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+
+constexpr uint32_t no_source_file = std::numeric_limits<uint32_t>::max();
+
+// A place in an input file, small enough for every token and AST node to carry
+// one. Lines and columns are only worked out when a diagnostic is printed.
+struct source_location_t
+{
+    uint32_t file = no_source_file; // Id from add_source_file
+    uint32_t offset = 0;            // Byte offset into its contents
+};
+
+struct line_column_t
+{
+    uint32_t line = 0;   // 1 based
+    uint32_t column = 0; // 1 based, in bytes
+};
+
+// Ids are handed out in call order and diagnostics are sorted by them, so
+// register files in the order they were given on the command line. Safe to
+// call from several threads.
+uint32_t add_source_file(std::string_view path);
+// The contents have to stay alive until the last flush_diagnostics. A file is
+// only ever set by the thread that loads it.
+void set_source_contents(uint32_t file, std::string_view contents);
+
+std::string_view source_file_path(uint32_t file);
+
+// Scans the file for line starts the first time it's asked about, binary
+// search after that. Only called while diagnostics are flushed.
+line_column_t resolve_location(source_location_t location);
+
+// "path:line:column", or just the path when the contents aren't known
+std::string format_location(source_location_t location);
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Dense id for an interned string. Ids start at 0 and are handed out in the
+// order strings are first seen, so they can index plain arrays directly.
+using symbol_t = uint32_t;
+
+constexpr symbol_t null_symbol = std::numeric_limits<symbol_t>::max();
+
+// Maps identifier text to symbol ids. The lexer interns every identifier it
+// produces, after that the parser and codegen only ever compare integers.
+// Interned text is copied into chunks owned by the interner, views returned
+// by name() stay valid for the interner's whole lifetime.
+class string_interner_t
+{
+public:
+    string_interner_t();
+
+    symbol_t intern(std::string_view text);
+    // null_symbol if text was never interned
+    symbol_t find(std::string_view text) const;
+
+    std::string_view name(symbol_t symbol) const { return strings[symbol]; }
+    size_t size() const { return strings.size(); }
+
+private:
+    struct slot_t
+    {
+        uint32_t hash;
+        symbol_t symbol;
+    };
+
+    static uint32_t hash_of(std::string_view text);
+    size_t probe(std::string_view text, uint32_t hash) const;
+    void grow();
+    std::string_view store(std::string_view text);
+
+    // Open addressing with linear probing, capacity is a power of two
+    std::vector<slot_t> slots;
+    std::vector<std::string_view> strings;
+
+    static constexpr size_t chunk_size = 64 * 1024;
+    std::vector<std::unique_ptr<char[]>> chunks;
+    size_t chunk_used = chunk_size;
+};
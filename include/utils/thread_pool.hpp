@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "utils/error.hpp"
+
+// Fixed set of worker threads for running independent jobs side by side.
+// for_each hands out job indices one at a time, so a few large jobs don't
+// hold up the small ones, and the calling thread works along until the
+// whole batch is done. A job may call for_each itself: the nested batch is
+// queued like any other and its caller can always finish it alone. Errors
+// reported by a job count towards the error_scope_t for_each was called in.
+class thread_pool_t
+{
+public:
+    // 0 workers runs every job on the calling thread
+    explicit thread_pool_t(uint32_t worker_count);
+    ~thread_pool_t();
+
+    thread_pool_t(const thread_pool_t&) = delete;
+    thread_pool_t& operator=(const thread_pool_t&) = delete;
+
+    // Calls job(0) .. job(count - 1) in any order and on any thread, returns
+    // once all of them have returned
+    void for_each(size_t count, const std::function<void(size_t)>& job);
+
+    uint32_t worker_count() const { return static_cast<uint32_t>(workers.size()); }
+
+    // Threads worth running on this machine, at least 1
+    static uint32_t hardware_threads();
+
+private:
+    struct batch_t
+    {
+        const std::function<void(size_t)>* job;
+        size_t count;
+        error_scope_t* error_scope;
+        std::atomic<size_t> next{0}; // Next index to hand out
+        uint32_t workers = 0;        // Workers still running its jobs, under mutex
+    };
+
+    // Runs one job of batch, false when all of them were handed out already
+    static bool run_one(batch_t& batch);
+    void work();
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;     // New batch queued, or stopping
+    std::condition_variable finished; // A worker left its batch
+    std::deque<batch_t*> batches;     // With indices left to hand out
+    bool stopping = false;
+};
@@ -1,639 +1,696 @@
-#include <fstream>
-#include <map>
+#include <algorithm>
+#include <cstdint>
+#include <utility>
 
 #include "core/codegen.hpp"
+#include "core/isel.hpp"
 #include "core/parse.hpp"
+#include "core/passes.hpp"
+#include "core/peephole.hpp"
 #include "core/tokenise.hpp"
 #include "utils/error.hpp"
+#include "utils/profiler.hpp"
 
-code_gen_ctx_t::code_gen_ctx_t(std::ofstream& asmFile, std::map<std::string, std::string>& symbolTable,
-                               std::map<std::string, ast_node_t*>& functionTable)
-    : asm_file(asmFile), symbol_table(symbolTable), function_table(functionTable) {}
-  
-std::string code_gen_ctx_t::generate_label(const std::string& base_name) {
-    static int label_count = 0;
-    return base_name + "_" + std::to_string(label_count++);
-}
-
-void code_gen_ctx_t::access_variable(const std::string& var_name) {
-    if (current_function) {
-        // Check if it's a parameter
-        for (size_t i = 0; i < current_function->parameters.size(); ++i) {
-            if (current_function->parameters[i] == var_name) {
-                int offset = -((i + 1) * 8);
-                asm_file << "    mov rdi, [rbp" << offset << "]" << std::endl;
-                asm_file << "    ; Accessing parameter '" << var_name << "'" << std::endl;
-                return;
-            }
-        }
+namespace {
 
-        // Check if it's a local variable
-        auto it = current_function->local_symbols.find(var_name);
-        if (it != current_function->local_symbols.end()) {
-            int offset = -(current_function->parameters.size() + std::stoi(it->second) + 1) * 8;
-            asm_file << "    mov rdi, [rbp" << offset << "]" << std::endl;
-            asm_file << "    ; Accessing local variable '" << var_name << "'" << std::endl;
-            return;
-        }
+bool is_comparison(token_type_e type) {
+    switch (type) {
+        case token_type_e::type_eq:
+        case token_type_e::type_nq:
+        case token_type_e::type_ge:
+        case token_type_e::type_le:
+        case token_type_e::type_lt:
+        case token_type_e::type_gt:
+            return true;
+        default:
+            return false;
     }
-    
-    // If not local or parameter, check global
-    if (symbol_table.count(var_name) > 0) {
-        asm_file << "    mov rdi, [" << symbol_table[var_name] << "]" << std::endl;
-        asm_file << "    ; Accessing global variable '" << var_name << "'" << std::endl;
-    } else {
-        error_msg("Undefined variable: {}", var_name);
+}
+
+ir_cond_e comparison_cond(token_type_e type) {
+    switch (type) {
+        case token_type_e::type_nq: return ir_cond_e::ne;   // Not equal
+        case token_type_e::type_ge: return ir_cond_e::ge;   // Greater or equal
+        case token_type_e::type_le: return ir_cond_e::le;   // Less or equal
+        case token_type_e::type_lt: return ir_cond_e::lt;   // Less than
+        case token_type_e::type_gt: return ir_cond_e::gt;   // Greater than
+        default: return ir_cond_e::eq;                      // Equal
     }
 }
 
-int get_stack_offset(const ast_node_t& func_node, const std::string& var_name) {
-    // Find parameter position
-    for (size_t i = 0; i < func_node.parameters.size(); i++) {
-        if (func_node.parameters[i] == var_name) {
-            // Parameters are at [rbp-8], [rbp-16], etc.
-            return -((i + 1) * 8);
-        }
+} // namespace
+
+code_gen_ctx_t::code_gen_ctx_t(ast_t& ast, ir_module_t& module, const unit_options_t& unit)
+    : ast(ast), module(module), unit(unit),
+      function_lookup(ast.symbols->size(), UINT32_MAX),
+      global_lookup(ast.symbols->size(), unresolved_slot),
+      frame_lookup(ast.symbols->size(), unresolved_slot),
+      expressions(ast.nodes.size()) {}
+
+// Parameters and locals shadow globals
+var_slot_t code_gen_ctx_t::lookup_variable(symbol_t symbol) const {
+    if (frame_lookup[symbol] != unresolved_slot) {
+        return frame_lookup[symbol];
     }
-    
-    // Check local variables
-    auto it = func_node.local_symbols.find(var_name);
-    if (it != func_node.local_symbols.end()) {
-        // Local variables start after parameters
-        int offset = -(func_node.parameters.size() + std::stoi(it->second) + 1) * 8;
-        return offset;
+    return global_lookup[symbol];
+}
+
+ir_block_id_t code_gen_ctx_t::new_block(const char* name) {
+    function->blocks.emplace_back().name = name;
+    return static_cast<ir_block_id_t>(function->blocks.size() - 1);
+}
+
+void code_gen_ctx_t::switch_to(ir_block_id_t block) {
+    current_block = block;
+}
+
+void code_gen_ctx_t::emit(const ir_insn_t& insn) {
+    std::vector<ir_insn_t>* insns = &function->blocks[current_block].insns;
+    if (!insns->empty() && is_terminator(insns->back().op)) {
+        // Code after return or exit, nothing jumps here and it gets dropped
+        switch_to(new_block("unreachable"));
+        insns = &function->blocks[current_block].insns;
     }
-    
-    return 0; // Not found (will be a global variable)
+    insns->push_back(insn);
+}
+
+static bool is_global_slot(var_slot_t slot) {
+    return (slot & global_slot_flag) != 0;
+}
+
+static bool is_terminated(const code_gen_ctx_t& ctx) {
+    const std::vector<ir_insn_t>& insns = ctx.function->blocks[ctx.current_block].insns;
+    return !insns.empty() && is_terminator(insns.back().op);
+}
+
+static void emit_jump(code_gen_ctx_t& ctx, ir_block_id_t target) {
+    ir_insn_t jump{ir_op_e::jump};
+    jump.target[0] = target;
+    ctx.emit(jump);
 }
 
-void gen_binary_op(const ast_node_t& node, code_gen_ctx_t& ctx) {
-    gen_node_code(*node.child_node_1, ctx);
-    ctx.asm_file << "    push rdi" << std::endl;  // Save left operand on the stack
+// Sethi-Ullman number of an expression: how many registers evaluating it
+// takes. Literals and locals are free, they are immediates or already sit in
+// a register.
+const expression_info_t& expression_info(node_id_t id, code_gen_ctx_t& ctx) {
+    static const expression_info_t missing{0, false, true};
+    if (id == null_node) {
+        return missing;
+    }
 
-    gen_node_code(*node.child_node_2, ctx);
-    ctx.asm_file << "    pop rax" << std::endl;  // Restore left operand from stack
+    expression_info_t& info = ctx.expressions[id];
+    if (info.computed) {
+        return info;
+    }
 
+    const ast_node_t& node = ctx.ast.node(id);
     switch (node.type) {
-        case token_type_e::type_add:
-            ctx.asm_file << "    add rdi, rax" << std::endl;
-            break;
-        case token_type_e::type_sub:
-            ctx.asm_file << "    sub rax, rdi" << std::endl;
-            ctx.asm_file << "    mov rdi, rax" << std::endl;
-            break;
-        case token_type_e::type_mul:
-            ctx.asm_file << "    imul rdi, rax" << std::endl;
+        case token_type_e::type_identifier:
+            info.need = is_global_slot(node.identifier.slot) ? 1 : 0;
             break;
-        case token_type_e::type_div:
-            ctx.asm_file << "    mov rax, rdi" << std::endl;
-            ctx.asm_file << "    xor rdx, rdx" << std::endl;
-            ctx.asm_file << "    div rsi" << std::endl;
-            ctx.asm_file << "    mov rdi, rax" << std::endl;
+        case token_type_e::type_call:
+            info.need = 1;
+            info.has_call = true;
+            for (node_id_t argument : ctx.ast.list(node.call.arguments)) {
+                const expression_info_t& argument_info = expression_info(argument, ctx);
+                info.need = std::max<uint16_t>(info.need, argument_info.need);
+            }
             break;
         default:
-            ctx.asm_file << "    ; unknown binary operator" << std::endl;
+            if (node.type == token_type_e::type_add || node.type == token_type_e::type_sub
+                || node.type == token_type_e::type_mul || node.type == token_type_e::type_div
+                || is_comparison(node.type)) {
+                const expression_info_t lhs = expression_info(node.binary.lhs, ctx);
+                const expression_info_t rhs = expression_info(node.binary.rhs, ctx);
+                info.need = lhs.need == rhs.need ? lhs.need + 1 : std::max(lhs.need, rhs.need);
+                info.has_call = lhs.has_call || rhs.has_call;
+            }
+            break;
     }
+    info.computed = true;
+    return info;
 }
 
-// Process all nodes in the AST to find variable declarations
-void process_variable_declarations(std::vector<ast_node_t>& ast, code_gen_ctx_t& ctx) {
-    for (auto& node : ast) {
-        process_node_declarations(node, ctx);
+// Evaluates both operands of a binary node, the one needing more registers
+// first so fewer values are held at once. Calls may write globals, so
+// anything containing one keeps source order.
+static std::pair<ir_operand_t, ir_operand_t> gen_operands(const ast_node_t& node, code_gen_ctx_t& ctx) {
+    const expression_info_t& lhs = expression_info(node.binary.lhs, ctx);
+    const expression_info_t& rhs = expression_info(node.binary.rhs, ctx);
+    if (rhs.need > lhs.need && !lhs.has_call && !rhs.has_call) {
+        ir_operand_t right = gen_expression(node.binary.rhs, ctx);
+        ir_operand_t left = gen_expression(node.binary.lhs, ctx);
+        return {left, right};
     }
+    ir_operand_t left = gen_expression(node.binary.lhs, ctx);
+    ir_operand_t right = gen_expression(node.binary.rhs, ctx);
+    return {left, right};
 }
 
-void process_function_declarations(std::vector<ast_node_t> &ast, code_gen_ctx_t& ctx) {
-    for (auto& node : ast) {
-        if (node.type == token_type_e::type_fn) {
-            ctx.function_table[node.string_value] = &node;
-        }
+ir_operand_t gen_binary_op(const ast_node_t& node, code_gen_ctx_t& ctx) {
+    auto [lhs, rhs] = gen_operands(node, ctx);
+
+    ir_insn_t insn{ir_op_e::add};
+    switch (node.type) {
+        case token_type_e::type_add: insn.op = ir_op_e::add; break;
+        case token_type_e::type_sub: insn.op = ir_op_e::sub; break;
+        case token_type_e::type_mul: insn.op = ir_op_e::mul; break;
+        case token_type_e::type_div: insn.op = ir_op_e::div; break;
+        default:
+            if (!is_comparison(node.type)) {
+                error_at(ctx.ast.location(node), "Unknown binary operator in codegen: {}", token_type_to_string(node.type));
+                return ir_imm(0);
+            }
+            // A comparison used as a value is 0 or 1
+            insn.op = ir_op_e::cmp;
+            insn.cond = comparison_cond(node.type);
+            break;
     }
+    insn.dst = ctx.function->new_value();
+    insn.a = lhs;
+    insn.b = rhs;
+    ctx.emit(insn);
+    return ir_value(insn.dst);
 }
 
-void gen_while_code(const ast_node_t& node, code_gen_ctx_t& ctx) {
-    std::string label_start = ctx.generate_label("while_start");
-    std::string label_body = ctx.generate_label("while_body");
-    std::string label_end = ctx.generate_label("while_end");
-   
-    // Start of the loop
-    ctx.asm_file << label_start << ":" << std::endl;
-   
-    // Generate condition code
-    gen_comparison(*node.child_node_1, ctx, label_body, label_end);
-   
-    // Loop body - DON'T emit the label again, it was already emitted by gen_comparison
-    // ctx.asm_file << label_body << ":" << std::endl;  // REMOVE THIS LINE
-    
-    if (node.child_node_2 && node.child_node_2->type == token_type_e::type_block) {
-        for (const auto& stmt : node.child_node_2->statements) {
-            gen_node_code(stmt, ctx);
+// Declare every variable and resolve every reference to its slot
+void process_variable_declarations(ast_t& ast, code_gen_ctx_t& ctx) {
+    // Globals first, function bodies may use globals declared after them
+    for (node_id_t node : ast.list(ast.program)) {
+        if (ast.node(node).type != token_type_e::type_fn) {
+            process_node_declarations(ast.node(node), ctx);
         }
     }
-   
-    // Jump back to condition
-    ctx.asm_file << "    jmp " << label_start << std::endl;
-   
-    // Exit point of the loop
-    ctx.asm_file << label_end << ":" << std::endl;
-}
 
-void gen_function_code(const ast_node_t& node, code_gen_ctx_t& ctx) {
-    // Save the previous current_function
-    ast_node_t* previous_function = ctx.current_function;
-    
-    // Set this as the current function
-    ctx.current_function = const_cast<ast_node_t*>(&node);
-    
-    // Generate function label
-    std::string function_name = "func_" + node.string_value;
-    ctx.asm_file << function_name << ":" << std::endl;
-    
-    // Prologue
-    ctx.asm_file << "    push rbp" << std::endl;
-    ctx.asm_file << "    mov rbp, rsp" << std::endl;
-    
-    // Allocate space for local variables if needed
-    int local_vars_count = node.local_symbols.size();
-    if (local_vars_count > 0) {
-        ctx.asm_file << "    sub rsp, " << (local_vars_count * 8) << std::endl;
-    }
-    
-    // Store parameters in the stack
-    for (size_t i = 0; i < node.parameters.size(); i++) {
-        // Parameters are passed in registers: rdi, rsi, rdx, rcx, r8, r9
-        std::string reg;
-        switch(i) {
-            case 0: reg = "rdi"; break;
-            case 1: reg = "rsi"; break;
-            case 2: reg = "rdx"; break;
-            case 3: reg = "rcx"; break;
-            case 4: reg = "r8"; break;
-            case 5: reg = "r9"; break;
-            default:
-                error_msg("More than 6 parameters are not supported yet");
-                return;
+    for (function_info_t& function : ctx.functions) {
+        ctx.current_function = &function;
+
+        std::span<const uint32_t> parameters = ast.list(function.node->fn.params);
+        for (size_t i = 0; i < parameters.size(); ++i) {
+            if (ctx.frame_lookup[parameters[i]] == unresolved_slot) {
+                ctx.frame_lookup[parameters[i]] = static_cast<var_slot_t>(i);
+            }
+            function.frame.push_back(parameters[i]);
         }
-        
-        // Store parameter in its stack position
-        int offset = -(i + 1) * 8;
-        ctx.asm_file << "    mov [rbp" << offset << "], " << reg << std::endl;
+
+        // Process the function body for local variables, then resolve it
+        process_node_declarations(ast.node(function.node->fn.body), ctx);
+        resolve_node_symbols(function.node->fn.body, ctx);
+
+        for (symbol_t symbol : function.frame) {
+            ctx.frame_lookup[symbol] = unresolved_slot;
+        }
+        ctx.current_function = nullptr;
     }
-    
-    // Generate code for function body
-    for (const auto& stmt : node.body) {
-        gen_node_code(stmt, ctx);
-    }
-    
-    // Epilogue
-    ctx.asm_file << "    mov rsp, rbp" << std::endl;
-    ctx.asm_file << "    pop rbp" << std::endl;
-    ctx.asm_file << "    ret" << std::endl;
-    
-    // Restore the previous current_function
-    ctx.current_function = previous_function;
-}
 
-void gen_function_call(const ast_node_t& node, code_gen_ctx_t& ctx) {
-    // Save caller-saved registers
-    ctx.asm_file << "    push rdi" << std::endl;
-    ctx.asm_file << "    push rsi" << std::endl;
-    ctx.asm_file << "    push rdx" << std::endl;
-    ctx.asm_file << "    push rcx" << std::endl;
-    ctx.asm_file << "    push r8" << std::endl;
-    ctx.asm_file << "    push r9" << std::endl;
-    
-    // Calculate and push arguments in reverse order so we can pop them into the right registers
-    for (int i = node.arguments.size() - 1; i >= 0; i--) {
-        gen_node_code(node.arguments[i], ctx);
-        ctx.asm_file << "    push rdi" << std::endl;  // Push each argument result onto the stack
-    }
-    
-    // Pop arguments into appropriate registers in the correct order
-    for (size_t i = 0; i < node.arguments.size(); i++) {
-        std::string reg;
-        switch(i) {
-            case 0: reg = "rdi"; break;
-            case 1: reg = "rsi"; break;
-            case 2: reg = "rdx"; break;
-            case 3: reg = "rcx"; break;
-            case 4: reg = "r8"; break;
-            case 5: reg = "r9"; break;
-            default:
-                error_msg("More than 6 arguments are not supported yet");
-                return;
+    for (node_id_t node : ast.list(ast.program)) {
+        if (ast.node(node).type != token_type_e::type_fn) {
+            resolve_node_symbols(node, ctx);
         }
-        
-        ctx.asm_file << "    pop " << reg << std::endl;
-    }
-    
-    // Call the function
-    std::string function_name = "func_" + node.string_value;
-    ctx.asm_file << "    call " << function_name << std::endl;
-    
-    // Restore caller-saved registers (in reverse order)
-    ctx.asm_file << "    pop r9" << std::endl;
-    ctx.asm_file << "    pop r8" << std::endl;
-    ctx.asm_file << "    pop rcx" << std::endl;
-    ctx.asm_file << "    pop rdx" << std::endl;
-    ctx.asm_file << "    pop rsi" << std::endl;
-    ctx.asm_file << "    pop rdi" << std::endl;
-    
-    // Function result is in rax, move it to rdi
-    ctx.asm_file << "    mov rdi, rax" << std::endl;
+    }
 }
 
-// Process a single node recursively for variable declarations
-void process_node_declarations(ast_node_t& node, code_gen_ctx_t& ctx) {
-    if (node.type == token_type_e::type_fn) {
-        // Process function declaration
-        // Note: We don't add function parameters to the global symbol table
-        
-        // Process the function body for local variables
-        if (node.body.size() > 0) {
-            // Save current function context
-            ast_node_t* previous_function = ctx.current_function;
-            ctx.current_function = &node;
-            
-            int local_var_index = 0;
-            
-            // Process each statement in the function body
-            for (auto& stmt : node.body) {
-                // Check for local variable declarations specifically
-                if (stmt.type == token_type_e::type_let && 
-                    stmt.child_node_1 && 
-                    stmt.child_node_1->type == token_type_e::type_identifier) {
-                    
-                    std::string var_name = stmt.child_node_1->string_value;
-                    
-                    // Add to the function's local symbol table with an index
-                    node.local_symbols[var_name] = std::to_string(local_var_index++);
-                    info_msg("Added local variable '{}' at index {} to function '{}'", 
-                             var_name, local_var_index-1, node.string_value);
-                }
-                
-                // Continue processing other nodes in the statement
-                process_node_declarations(stmt, ctx);
-            }
-            
-            // Restore previous function context
-            ctx.current_function = previous_function;
+void process_function_declarations(const ast_t& ast, code_gen_ctx_t& ctx) {
+    for (node_id_t node : ast.list(ast.program)) {
+        const ast_node_t& function = ast.node(node);
+        if (function.type != token_type_e::type_fn) {
+            continue;
+        }
+        if (function.fn.params.count > max_call_arguments) {
+            error_at(ast.location(node), "Function '{}' has {} parameters, more than {} are not supported yet",
+                     ast.name(function.fn.name), function.fn.params.count, max_call_arguments);
+        }
+        // A later definition with the same name replaces the earlier one
+        uint32_t& index = ctx.function_lookup[function.fn.name];
+        if (index == UINT32_MAX) {
+            index = static_cast<uint32_t>(ctx.functions.size());
+            ctx.functions.emplace_back();
+        }
+        ctx.functions[index].node = &function;
+    }
+
+    std::sort(ctx.functions.begin(), ctx.functions.end(), [&](const function_info_t& lhs, const function_info_t& rhs) {
+        return ast.name(lhs.node->fn.name) < ast.name(rhs.node->fn.name);
+    });
+    for (size_t i = 0; i < ctx.functions.size(); ++i) {
+        ctx.function_lookup[ctx.functions[i].node->fn.name] = static_cast<uint32_t>(i);
+    }
+
+    // Functions of other files, only the ones this file mentions and doesn't
+    // define itself
+    for (const function_signature_t& external : ctx.unit.externals) {
+        const symbol_t symbol = ast.symbols->find(external.name);
+        if (symbol == null_symbol || ctx.function_lookup[symbol] != UINT32_MAX) {
+            continue;
         }
+        ctx.function_lookup[symbol] = static_cast<uint32_t>(ctx.functions.size() + ctx.externals.size());
+        ctx.externals.push_back(&external);
     }
-    else if (node.type == token_type_e::type_let && 
-             node.child_node_1 && 
-             node.child_node_1->type == token_type_e::type_identifier) {
-        
-        std::string identifier = node.child_node_1->string_value;
-        
+}
+
+// Process a single statement recursively for variable declarations
+void process_node_declarations(const ast_node_t& node, code_gen_ctx_t& ctx) {
+    const ast_t& ast = ctx.ast;
+
+    switch (node.type) {
+    case token_type_e::type_let: {
+        symbol_t identifier = node.assign.name;
+
         // Check if we're inside a function
         if (ctx.current_function) {
             // Skip if it's already a parameter or local variable
-            bool is_parameter = false;
-            for (const auto& param : ctx.current_function->parameters) {
-                if (param == identifier) {
-                    is_parameter = true;
-                    break;
-                }
-            }
-            
-            if (!is_parameter && ctx.current_function->local_symbols.find(identifier) == ctx.current_function->local_symbols.end()) {
-                // Add to the function's local symbol table with an index
-                int local_var_index = ctx.current_function->local_symbols.size();
-                ctx.current_function->local_symbols[identifier] = std::to_string(local_var_index);
-                info_msg("Added local variable '{}' at index {} to function '{}'", 
-                         identifier, local_var_index, ctx.current_function->string_value);
+            if (ctx.frame_lookup[identifier] == unresolved_slot) {
+                // Add to the function's frame after the parameters
+                var_slot_t slot = static_cast<var_slot_t>(ctx.current_function->frame.size());
+                ctx.current_function->frame.push_back(identifier);
+                ctx.frame_lookup[identifier] = slot;
+                debug_msg("Added local variable '{}' at index {} to function '{}'",
+                         ast.name(identifier), slot - ctx.current_function->parameter_count(),
+                         ast.name(ctx.current_function->node->fn.name));
             }
-        } 
-        else {
+        }
+        else if (ctx.global_lookup[identifier] == unresolved_slot) {
             // Global variable
-            std::string var_name = "var_" + identifier;
-            ctx.symbol_table[identifier] = var_name;
-            info_msg("Added global variable '{}'", identifier);
+            ctx.global_lookup[identifier] = static_cast<var_slot_t>(ctx.globals.size()) | global_slot_flag;
+            ctx.globals.push_back(identifier);
+            debug_msg("Added global variable '{}'", ast.name(identifier));
         }
-    } 
-    else if (node.type == token_type_e::type_if) {
-        // Process the condition
-        if (node.child_node_1) {
-            process_node_declarations(*node.child_node_1, ctx);
+        break;
+    }
+    case token_type_e::type_if:
+        // Process the 'then' block and the 'else' block or 'else-if'
+        process_node_declarations(ast.node(node.if_stmt.then_block), ctx);
+        if (node.if_stmt.else_branch != null_node) {
+            process_node_declarations(ast.node(node.if_stmt.else_branch), ctx);
         }
-        
-        // Process the 'then' block
-        if (node.child_node_2 && node.child_node_2->type == token_type_e::type_block) {
-            for (auto& stmt : node.child_node_2->statements) {
-                process_node_declarations(stmt, ctx);
-            }
+        break;
+    case token_type_e::type_while:
+        process_node_declarations(ast.node(node.while_stmt.body), ctx);
+        break;
+    case token_type_e::type_block:
+        // Process all statements in a block
+        for (node_id_t statement : ast.list(node.block.statements)) {
+            process_node_declarations(ast.node(statement), ctx);
         }
+        break;
+    default:
+        // Expressions can't declare anything
+        break;
+    }
+}
 
-        // Process the 'else' block or 'else-if'
-        if (node.child_node_3) {
-            if (node.child_node_3->type == token_type_e::type_block) {
-                for (auto& stmt : node.child_node_3->statements) {
-                    process_node_declarations(stmt, ctx);
-                }
-            } else if (node.child_node_3->type == token_type_e::type_if) {
-                process_node_declarations(*node.child_node_3, ctx);
-            }
+// Fill in the slot of every variable reference below node
+void resolve_node_symbols(node_id_t id, code_gen_ctx_t& ctx) {
+    if (id == null_node) {
+        return;
+    }
+    ast_t& ast = ctx.ast;
+    ast_node_t& node = ast.nodes[id];
+
+    switch (node.type) {
+    case token_type_e::type_identifier:
+        node.identifier.slot = ctx.lookup_variable(node.identifier.name);
+        if (node.identifier.slot == unresolved_slot) {
+            error_at(ast.location(id), "Undefined variable: {}", ast.name(node.identifier.name));
         }
-    } 
-    else if (node.type == token_type_e::type_block) {
-        // Process all statements in a block
-        for (auto& stmt : node.statements) {
-            process_node_declarations(stmt, ctx);
+        break;
+    case token_type_e::type_let:
+    case token_type_e::type_assignment:
+        node.assign.slot = ctx.lookup_variable(node.assign.name);
+        if (node.assign.slot == unresolved_slot) {
+            error_at(ast.location(id), "Undefined variable: {}", ast.name(node.assign.name));
+        }
+        resolve_node_symbols(node.assign.value, ctx);
+        break;
+    case token_type_e::type_add:
+    case token_type_e::type_sub:
+    case token_type_e::type_mul:
+    case token_type_e::type_div:
+    case token_type_e::type_eq:
+    case token_type_e::type_nq:
+    case token_type_e::type_ge:
+    case token_type_e::type_le:
+    case token_type_e::type_lt:
+    case token_type_e::type_gt:
+        resolve_node_symbols(node.binary.lhs, ctx);
+        resolve_node_symbols(node.binary.rhs, ctx);
+        break;
+    case token_type_e::type_exit:
+    case token_type_e::type_return:
+        resolve_node_symbols(node.unary.value, ctx);
+        break;
+    case token_type_e::type_if:
+        resolve_node_symbols(node.if_stmt.condition, ctx);
+        resolve_node_symbols(node.if_stmt.then_block, ctx);
+        resolve_node_symbols(node.if_stmt.else_branch, ctx);
+        break;
+    case token_type_e::type_while:
+        resolve_node_symbols(node.while_stmt.condition, ctx);
+        resolve_node_symbols(node.while_stmt.body, ctx);
+        break;
+    case token_type_e::type_block:
+        for (node_id_t statement : ast.list(node.block.statements)) {
+            resolve_node_symbols(statement, ctx);
         }
+        break;
+    case token_type_e::type_call:
+        for (node_id_t argument : ast.list(node.call.arguments)) {
+            resolve_node_symbols(argument, ctx);
+        }
+        break;
+    default:
+        break;
     }
-    
-    // Recursively process child nodes if they exist
-    if (node.child_node_1) {
-        process_node_declarations(*node.child_node_1, ctx);
+}
+
+void gen_while_code(const ast_node_t& node, code_gen_ctx_t& ctx) {
+    ir_block_id_t block_start = ctx.new_block("while_start");
+    ir_block_id_t block_body = ctx.new_block("while_body");
+    ir_block_id_t block_end = ctx.new_block("while_end");
+
+    // Start of the loop
+    emit_jump(ctx, block_start);
+    ctx.switch_to(block_start);
+
+    gen_comparison(ctx.ast.node(node.while_stmt.condition), ctx, block_body, block_end);
+
+    ctx.switch_to(block_body);
+    gen_block_code(ctx.ast.node(node.while_stmt.body), ctx);
+
+    // Jump back to condition
+    emit_jump(ctx, block_start);
+
+    // Exit point of the loop
+    ctx.switch_to(block_end);
+}
+
+static ir_function_t& begin_function(code_gen_ctx_t& ctx, std::string name) {
+    ctx.module.functions.emplace_back();
+    ctx.function = &ctx.module.functions.back();
+    ctx.function->name = std::move(name);
+    ctx.switch_to(ctx.new_block("entry"));
+    return *ctx.function;
+}
+
+static void end_function(code_gen_ctx_t& ctx) {
+    remove_unreachable_blocks(*ctx.function);
+    ctx.function = nullptr;
+    ctx.current_block = no_block;
+}
+
+void gen_function_code(function_info_t& function, code_gen_ctx_t& ctx) {
+    const ast_node_t& node = *function.node;
+
+    // Save the previous current_function
+    function_info_t* previous_function = ctx.current_function;
+
+    // Set this as the current function
+    ctx.current_function = &function;
+
+    ir_function_t& ir = begin_function(ctx, std::string(ctx.ast.name(node.fn.name)));
+    ir.linkage = ctx.unit.exports ? ir_linkage_e::exported : ir_linkage_e::internal;
+    ir.param_count = function.parameter_count();
+    for (symbol_t symbol : function.frame) {
+        ir.variables.emplace_back(ctx.ast.name(symbol));
     }
-    if (node.child_node_2) {
-        process_node_declarations(*node.child_node_2, ctx);
+    ir.value_count = static_cast<uint32_t>(function.frame.size());
+
+    // Generate code for function body
+    gen_block_code(ctx.ast.node(node.fn.body), ctx);
+
+    // Falling off the end returns without a value
+    if (!is_terminated(ctx)) {
+        ctx.emit(ir_insn_t(ir_op_e::ret));
+    }
+    end_function(ctx);
+
+    // Restore the previous current_function
+    ctx.current_function = previous_function;
+}
+
+ir_operand_t gen_function_call(const ast_node_t& node, code_gen_ctx_t& ctx) {
+    uint32_t callee = ctx.function_lookup[node.call.name];
+    if (callee == UINT32_MAX) {
+        error_at(ctx.ast.location(node), "Undefined function: {}", ctx.ast.name(node.call.name));
+        return ir_imm(0);
     }
-    if (node.child_node_3) {
-        process_node_declarations(*node.child_node_3, ctx);
+    if (node.call.arguments.count > max_call_arguments) {
+        error_at(ctx.ast.location(node), "Call to '{}' passes {} arguments, more than {} are not supported yet",
+                 ctx.ast.name(node.call.name), node.call.arguments.count, max_call_arguments);
+        return ir_imm(0);
     }
+    // The count is part of what other files export, so external calls are
+    // held to it just the same
+    const uint32_t param_count = callee < ctx.functions.size()
+        ? ctx.functions[callee].parameter_count()
+        : ctx.externals[callee - ctx.functions.size()]->param_count;
+    if (node.call.arguments.count != param_count) {
+        error_at(ctx.ast.location(node), "'{}' takes {} arguments, {} given",
+                 ctx.ast.name(node.call.name), param_count, node.call.arguments.count);
+        return ir_imm(0);
+    }
+
+    // Nested calls append their own arguments, so collect these first
+    std::vector<ir_operand_t> arguments;
+    for (node_id_t argument : ctx.ast.list(node.call.arguments)) {
+        arguments.push_back(gen_expression(argument, ctx));
+    }
+
+    ir_insn_t call{ir_op_e::call};
+    call.dst = ctx.function->new_value();
+    call.index = callee;
+    call.first = static_cast<uint32_t>(ctx.function->arguments.size());
+    call.count = static_cast<uint32_t>(arguments.size());
+    ctx.function->arguments.insert(ctx.function->arguments.end(), arguments.begin(), arguments.end());
+    ctx.emit(call);
+    return ir_value(call.dst);
 }
 
-void gen_code_for_ast(const std::vector<ast_node_t>& ast,
-                      std::ofstream& asm_file,
-                      std::map<std::string, std::string>& symbol_table) {
-    std::map<std::string, ast_node_t*> function_table;
-    code_gen_ctx_t ctx(asm_file, symbol_table, function_table);
-    
-    ctx.asm_file << "format ELF64" << std::endl;
-  
-    process_variable_declarations(const_cast<std::vector<ast_node_t>&>(ast), ctx);
-    process_function_declarations(const_cast<std::vector<ast_node_t>&>(ast), ctx);
-
-    ctx.asm_file << "section '.data' writeable" << std::endl;
-    for (const auto& pair : ctx.symbol_table) {
-        ctx.asm_file << "    " << pair.second << " dq 0" << std::endl;
-        ctx.asm_file << "    " << pair.second << "_len = $ - " << pair.second
-                << std::endl;
-    }
-
-    ctx.asm_file << "section '.text' executable" << std::endl << std::endl;
-  
-    // Generate code for functions
-    for (const auto& pair : ctx.function_table) {
-        gen_function_code(*pair.second, ctx);
-        ctx.asm_file << std::endl;
-    }
-  
-    // Generate main code
-    ctx.asm_file << "public _start" << std::endl;
-    ctx.asm_file << "_start:" << std::endl;
-    for (const auto& node : ast) {
+void gen_ir_for_ast(ast_t& ast, ir_module_t& module, const unit_options_t& unit) {
+    code_gen_ctx_t ctx(ast, module, unit);
+
+    {
+        profile_scope_t scope("declarations");
+        process_function_declarations(ast, ctx);
+        process_variable_declarations(ast, ctx);
+    }
+
+    // Lay globals out sorted by name so the output doesn't depend on declaration order
+    std::vector<var_slot_t> global_order(ctx.globals.size());
+    for (size_t i = 0; i < global_order.size(); ++i) {
+        global_order[i] = static_cast<var_slot_t>(i);
+    }
+    std::sort(global_order.begin(), global_order.end(), [&](var_slot_t lhs, var_slot_t rhs) {
+        return ast.name(ctx.globals[lhs]) < ast.name(ctx.globals[rhs]);
+    });
+
+    ctx.global_index.resize(ctx.globals.size());
+    for (var_slot_t slot : global_order) {
+        ctx.global_index[slot] = static_cast<uint32_t>(module.globals.size());
+        module.globals.emplace_back(ast.name(ctx.globals[slot]));
+    }
+
+    // Generate code for functions, module.functions lines up with ctx.functions
+    // and then ctx.externals
+    module.functions.reserve(ctx.functions.size() + ctx.externals.size() + 1);
+    for (function_info_t& function : ctx.functions) {
+        gen_function_code(function, ctx);
+    }
+    for (const function_signature_t* external : ctx.externals) {
+        ir_function_t& declaration = module.functions.emplace_back();
+        declaration.name = external->name;
+        declaration.linkage = ir_linkage_e::external;
+        declaration.param_count = external->param_count;
+    }
+
+    if (!unit.has_entry) {
+        // Nothing would ever run them
+        for (node_id_t statement : ast.list(ast.program)) {
+            if (ast.node(statement).type != token_type_e::type_fn) {
+                error_at(ast.location(statement), "Only the first file may have statements outside of functions");
+                break;
+            }
+        }
+        module.entry = no_function;
+        return;
+    }
+
+    // Generate main code, top level variables are all globals
+    module.entry = static_cast<uint32_t>(module.functions.size());
+    begin_function(ctx, "_start");
+    for (node_id_t statement : ast.list(ast.program)) {
         // Skip function definitions in the main code path
+        const ast_node_t& node = ast.node(statement);
         if (node.type != token_type_e::type_fn) {
             gen_node_code(node, ctx);
         }
     }
 
-    ctx.asm_file << "    syscall" << std::endl;
+    // Falling off the end exits with status 0
+    if (!is_terminated(ctx)) {
+        ir_insn_t exit{ir_op_e::exit};
+        exit.a = ir_imm(0);
+        ctx.emit(exit);
+    }
+    end_function(ctx);
 }
 
-void gen_comparison(const ast_node_t& node, code_gen_ctx_t& ctx, const std::string& label_true, const std::string& label_end) {
-    // Generate code for left operand
-    gen_node_code(*node.child_node_1, ctx);
-    ctx.asm_file << "    push rdi" << std::endl;  // Save left operand
-   
-    // Generate code for right operand
-    gen_node_code(*node.child_node_2, ctx);
-    ctx.asm_file << "    pop rax" << std::endl;   // Restore left operand
-   
-    // Compare the values
-    ctx.asm_file << "    cmp rax, rdi" << std::endl;
-   
-    // Perform the appropriate jump based on the comparison type
-    switch (node.type) {
-        case token_type_e::type_eq:  // Equal
-            ctx.asm_file << "    je " << label_true << std::endl;
-            break;
-        case token_type_e::type_nq:  // Not equal
-            ctx.asm_file << "    jne " << label_true << std::endl;
-            break;
-        case token_type_e::type_ge:  // Greater or equal
-            ctx.asm_file << "    jge " << label_true << std::endl;
-            break;
-        case token_type_e::type_le:  // Less or equal
-            ctx.asm_file << "    jle " << label_true << std::endl;
-            break;
-        case token_type_e::type_lt:  // Less than
-            ctx.asm_file << "    jl " << label_true << std::endl;
-            break;
-        case token_type_e::type_gt:  // Greater than
-            ctx.asm_file << "    jg " << label_true << std::endl;
-            break;
-        default:
-            ctx.asm_file << "    ; unknown comparison operator" << std::endl;
-            break;
+void gen_code_for_ast(ast_t& ast, x86_program_t& program) {
+    ir_module_t module;
+    gen_ir_for_ast(ast, module);
+    if (verify_ir(module)) {
+        optimise_ir(module, {});
+        select_instructions(module, program);
+        optimise_peephole(program);
     }
-   
-    // Jump to end if condition is false
-    ctx.asm_file << "    jmp " << label_end << std::endl;
-   
-    // Label for true condition
-    ctx.asm_file << label_true << ":" << std::endl;
+}
+
+void gen_comparison(const ast_node_t& node, code_gen_ctx_t& ctx, ir_block_id_t block_true, ir_block_id_t block_false) {
+    if (!is_comparison(node.type)) {
+        error_at(ctx.ast.location(node), "Expected a comparison but found: {}", token_type_to_string(node.type));
+        emit_jump(ctx, block_false);
+        return;
+    }
+
+    auto [lhs, rhs] = gen_operands(node, ctx);
+
+    ir_insn_t branch{ir_op_e::branch};
+    branch.cond = comparison_cond(node.type);
+    branch.a = lhs;
+    branch.b = rhs;
+    branch.target[0] = block_true;
+    branch.target[1] = block_false;
+    ctx.emit(branch);
 }
 
 void gen_if_code(const ast_node_t& node, code_gen_ctx_t& ctx) {
-    std::string label_true = ctx.generate_label("if_true");
-    std::string label_false = ctx.generate_label("if_false");
-    std::string label_end = ctx.generate_label("if_end");
-    
+    ir_block_id_t block_true = ctx.new_block("if_true");
+    ir_block_id_t block_false = ctx.new_block("if_false");
+    ir_block_id_t block_end = ctx.new_block("if_end");
+
     // Generate comparison code
-    gen_comparison(*node.child_node_1, ctx, label_true, label_false);
-    
+    gen_comparison(ctx.ast.node(node.if_stmt.condition), ctx, block_true, block_false);
+
     // Generate code for 'then' branch
-    if (node.child_node_2 && node.child_node_2->type == token_type_e::type_block) {
-        for (const auto& stmt : node.child_node_2->statements) {
-            gen_node_code(stmt, ctx);
-        }
-    }
-    
-    ctx.asm_file << "    jmp " << label_end << std::endl;
-    
-    // Label for 'else' branch
-    ctx.asm_file << label_false << ":" << std::endl;
-    
-    // Generate code for 'else' branch if it exists
-    if (node.child_node_3) {
-        if (node.child_node_3->type == token_type_e::type_block) {
-            for (const auto& stmt : node.child_node_3->statements) {
-                gen_node_code(stmt, ctx);
-            }
-        } else if (node.child_node_3->type == token_type_e::type_if) {
-            // Handle 'else if'
-            gen_if_code(*node.child_node_3, ctx);
-        }
+    ctx.switch_to(block_true);
+    gen_block_code(ctx.ast.node(node.if_stmt.then_block), ctx);
+    emit_jump(ctx, block_end);
+
+    // Generate code for 'else' branch or 'else if' if it exists
+    ctx.switch_to(block_false);
+    if (node.if_stmt.else_branch != null_node) {
+        gen_block_code(ctx.ast.node(node.if_stmt.else_branch), ctx);
     }
-    
+    emit_jump(ctx, block_end);
+
     // End of if statement
-    ctx.asm_file << label_end << ":" << std::endl;
+    ctx.switch_to(block_end);
 }
 
-void push_var_on_stack(const ast_node_t& node, code_gen_ctx_t& ctx) {
-    switch (node.type) {
-        case token_type_e::type_let: {
-            // Check if we have a valid identifier node
-            if (node.child_node_1 &&
-                node.child_node_1->type == token_type_e::type_identifier) {
-                std::string identifier = node.child_node_1->string_value;
-
-                // Generate code for the expression (will put result in rdi)
-                if (node.child_node_2) {
-                    gen_node_code(*node.child_node_2, ctx);
-                    
-                    // Check if we're inside a function context
-                    if (ctx.current_function) {
-                        // Check if it's a parameter
-                        bool is_parameter = false;
-                        for (size_t i = 0; i < ctx.current_function->parameters.size(); ++i) {
-                            if (ctx.current_function->parameters[i] == identifier) {
-                                int offset = -((i + 1) * 8);
-                                ctx.asm_file << "    mov [rbp" << offset << "], rdi" << std::endl;
-                                ctx.asm_file << "    ; Parameter '" << identifier 
-                                           << "' assigned value in rdi" << std::endl;
-                                is_parameter = true;
-                                break;
-                            }
-                        }
-                        
-                        if (!is_parameter) {
-                            // Check if it's a local variable
-                            auto it = ctx.current_function->local_symbols.find(identifier);
-                            if (it != ctx.current_function->local_symbols.end()) {
-                                int offset = -(ctx.current_function->parameters.size() + 
-                                             std::stoi(it->second) + 1) * 8;
-                                ctx.asm_file << "    mov [rbp" << offset << "], rdi" << std::endl;
-                                ctx.asm_file << "    ; Local variable '" << identifier 
-                                           << "' assigned value in rdi" << std::endl;
-                            } else {
-                                error_msg("Variable not found in local scope: {}", identifier);
-                            }
-                        }
-                    } else {
-                        // Handle global variables
-                        if (ctx.symbol_table.count(identifier) > 0) {
-                            std::string var_name = ctx.symbol_table[identifier];
-                            ctx.asm_file << "    mov [" << var_name << "], rdi" << std::endl;
-                            ctx.asm_file << "    ; Global variable '" << identifier
-                                       << "' assigned value in rdi" << std::endl;
-                        } else {
-                            error_msg("Global variable not declared: {}", identifier);
-                        }
-                    }
-                }
-            } else {
-                error_msg("Invalid variable declaration: missing identifier");
-            }
-            break;
-        }
+// let and plain assignment both just store into the variable's home
+void gen_assignment(const ast_node_t& node, code_gen_ctx_t& ctx) {
+    if (node.assign.value == null_node || node.assign.slot == unresolved_slot) {
+        return;
+    }
 
-        default:
-            info_msg("In codegen found other token than let: {}", token_type_to_string(node.type));
+    ir_operand_t value = gen_expression(node.assign.value, ctx);
+    if (is_global_slot(node.assign.slot)) {
+        ir_insn_t store{ir_op_e::store};
+        store.index = ctx.global_index[node.assign.slot & ~global_slot_flag];
+        store.a = value;
+        ctx.emit(store);
+        return;
+    }
+
+    // x = x + 1 computes straight into x. A copy out of a fresh temporary
+    // would stay a mov, the allocator can't give both the same register.
+    std::vector<ir_insn_t>& insns = ctx.function->blocks[ctx.current_block].insns;
+    if (value.is_value() && static_cast<size_t>(value.value) >= ctx.function->variables.size() && !insns.empty()
+        && has_dst(insns.back().op) && insns.back().dst == value.value) {
+        insns.back().dst = node.assign.slot;
+        if (value.value + 1 == ctx.function->value_count) {
+            --ctx.function->value_count;
+        }
+        return;
     }
+
+    ir_insn_t copy{ir_op_e::copy};
+    copy.dst = node.assign.slot;
+    copy.a = value;
+    ctx.emit(copy);
 }
 
 void gen_block_code(const ast_node_t& node, code_gen_ctx_t& ctx) {
     if (node.type == token_type_e::type_block) {
-        for (const auto& statement : node.statements) {
-            gen_node_code(statement, ctx);
+        for (node_id_t statement : ctx.ast.list(node.block.statements)) {
+            gen_node_code(ctx.ast.node(statement), ctx);
         }
     } else if (node.type == token_type_e::type_if) {
         gen_if_code(node, ctx);
     }
 }
-void gen_node_code(const ast_node_t& node, code_gen_ctx_t& ctx) {
+
+ir_operand_t gen_expression(node_id_t id, code_gen_ctx_t& ctx) {
+    if (id == null_node) {
+        // Already reported by the parser
+        error_msg("Missing operand in codegen");
+        return ir_imm(0);
+    }
+
+    const ast_node_t& node = ctx.ast.node(id);
     switch (node.type) {
-        case token_type_e::type_exit:
-            info_msg("Encountered exit token, writing to output asm file");
-            if (node.child_node_1) {
-                gen_node_code(*node.child_node_1, ctx);
-            }
-            ctx.asm_file << "    mov rax, 60; exit syscall" << std::endl;
-            break;
         case token_type_e::type_int_lit:
-            // Only emit if not part of an expression
-            if (!node.child_node_1 && !node.child_node_2) {
-                info_msg("Encountered int_lit token, writing to output asm file");
-                ctx.asm_file << "    mov rdi, " << node.int_value << std::endl;
-            }
-            break;
-        case token_type_e::type_let:
-            push_var_on_stack(node, ctx);
-            break;
+            debug_msg("Encountered int_lit token, writing to output asm file");
+            return ir_imm(node.int_lit.value);
         case token_type_e::type_identifier:
-            // Use the context's access_variable method
-            ctx.access_variable(node.string_value);
-            break;
-        case token_type_e::type_assignment:
-            // Assignment is handled by the let statement
-            break;
+            if (node.identifier.slot == unresolved_slot) {
+                // Already reported when resolving
+                return ir_imm(0);
+            }
+            if (is_global_slot(node.identifier.slot)) {
+                // Load it now, a call later in the expression may change it
+                ir_insn_t load{ir_op_e::load};
+                load.dst = ctx.function->new_value();
+                load.index = ctx.global_index[node.identifier.slot & ~global_slot_flag];
+                ctx.emit(load);
+                return ir_value(load.dst);
+            }
+            return ir_value(node.identifier.slot);
         case token_type_e::type_add:
         case token_type_e::type_sub:
         case token_type_e::type_mul:
         case token_type_e::type_div:
-            if (!node.child_node_1 || !node.child_node_2) {
-                error_msg("Binary operator missing operands");
-                return;
-            }
-            gen_binary_op(node, ctx);
-            break;
         case token_type_e::type_eq:
         case token_type_e::type_nq:
         case token_type_e::type_ge:
         case token_type_e::type_le:
         case token_type_e::type_lt:
         case token_type_e::type_gt:
-            // Handle comparison operators
-            {
-                std::string label_true = ctx.generate_label("comp_true");
-                std::string label_end = ctx.generate_label("comp_end");
-               
-                gen_comparison(node, ctx, label_true, label_end);
-               
-                // If we reach here, comparison was false
-                ctx.asm_file << "    mov rdi, 0" << std::endl;
-                ctx.asm_file << "    jmp " << label_end << std::endl;
-               
-                // If comparison was true
-                ctx.asm_file << label_true << ":" << std::endl;
-                ctx.asm_file << "    mov rdi, 1" << std::endl;
-               
-                ctx.asm_file << label_end << ":" << std::endl;
-            }
-            break;
-        case token_type_e::type_open_paren:
-            info_msg("Encountered open_paren token in codegen");
-            // Usually handled by expression parsing, but add handling here for standalone
-            if (node.child_node_1) {
-                gen_node_code(*node.child_node_1, ctx);
-            }
-            break;
-        case token_type_e::type_close_paren:
-            info_msg("Encountered close_paren token in codegen");
-            // Usually handled by expression parsing, but add handling here for standalone
-            break;
-        case token_type_e::type_open_squigly:
-            info_msg("Encountered open_squigly token in codegen");
-            // Usually marks the beginning of a block, handled elsewhere
+            return gen_binary_op(node, ctx);
+        case token_type_e::type_call:
+            return gen_function_call(node, ctx);
+        default:
+            error_at(ctx.ast.location(node), "Expected an expression but found: {}", token_type_to_string(node.type));
+            return ir_imm(0);
+    }
+}
+
+void gen_node_code(const ast_node_t& node, code_gen_ctx_t& ctx) {
+    switch (node.type) {
+        case token_type_e::type_exit: {
+            debug_msg("Encountered exit token, writing to output asm file");
+            ir_insn_t exit{ir_op_e::exit};
+            exit.a = node.unary.value != null_node ? gen_expression(node.unary.value, ctx) : ir_imm(0);
+            ctx.emit(exit);
             break;
-        case token_type_e::type_close_squigly:
-            info_msg("Encountered close_squigly token in codegen");
-            // Usually marks the end of a block, handled elsewhere
+        }
+        case token_type_e::type_let:
+        case token_type_e::type_assignment:
+            gen_assignment(node, ctx);
             break;
         case token_type_e::type_if:
             gen_if_code(node, ctx);
             break;
-        case token_type_e::type_else:
-            info_msg("Encountered else token in codegen");
-            // Normally handled as part of if-else construction in gen_if_code
-            if (node.child_node_1) {
-                gen_node_code(*node.child_node_1, ctx);
-            }
-            break;
         case token_type_e::type_while:
             gen_while_code(node, ctx);
             break;
@@ -642,43 +699,37 @@ void gen_node_code(const ast_node_t& node, code_gen_ctx_t& ctx) {
             break;
         case token_type_e::type_fn:
             // Function definitions are handled separately
-            info_msg("Function definition encountered in gen_node_code");
+            debug_msg("Function definition encountered in gen_node_code");
             break;
-        case token_type_e::type_call:
-            gen_function_call(node, ctx);
-            break;
-        case token_type_e::type_comma:
-            info_msg("Encountered comma token in codegen");
-            // Usually handled in function calls or parameter lists
-            if (node.child_node_1) {
-                gen_node_code(*node.child_node_1, ctx);
+        case token_type_e::type_return: {
+            if (!ctx.current_function) {
+                error_at(ctx.ast.location(node), "Return outside of a function");
+                break;
             }
-            if (node.child_node_2) {
-                gen_node_code(*node.child_node_2, ctx);
-            }
-            break;
-        case token_type_e::type_return:
-            if (node.child_node_1) {
-                gen_node_code(*node.child_node_1, ctx);
-                // Move the result from rdi to rax for return value
-                ctx.asm_file << "    mov rax, rdi" << std::endl;
+            ir_insn_t ret{ir_op_e::ret};
+            if (node.unary.value != null_node) {
+                ret.a = gen_expression(node.unary.value, ctx);
             }
-            // Generate function epilogue
-            ctx.asm_file << "    mov rsp, rbp" << std::endl;
-            ctx.asm_file << "    pop rbp" << std::endl;
-            ctx.asm_file << "    ret" << std::endl;
+            ctx.emit(ret);
             break;
-        case token_type_e::type_semi:
-            info_msg("Encountered semi token, writing to output asm file");
-            ctx.asm_file << "    ; Semicolon encountered" << std::endl;
-            break;
-        case token_type_e::type_space:
-            info_msg("Encountered space token, no code generation needed");
-            break;
-        case token_type_e::type_EOF:
-            info_msg("Encountered EOF token, finishing code generation");
+        }
+        case token_type_e::type_int_lit:
+        case token_type_e::type_identifier:
+        case token_type_e::type_add:
+        case token_type_e::type_sub:
+        case token_type_e::type_mul:
+        case token_type_e::type_div:
+        case token_type_e::type_eq:
+        case token_type_e::type_nq:
+        case token_type_e::type_ge:
+        case token_type_e::type_le:
+        case token_type_e::type_lt:
+        case token_type_e::type_gt:
+        case token_type_e::type_call:
+            // Expression statement, only evaluated for its side effects
+            gen_expression(static_cast<node_id_t>(&node - ctx.ast.nodes.data()), ctx);
             break;
         default:
-            error_msg("Encountered unknown token type in codegen");
+            error_at(ctx.ast.location(node), "Encountered unknown token type in codegen: {}", token_type_to_string(node.type));
     }
-}
\ No newline at end of file
+}
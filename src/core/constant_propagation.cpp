@@ -0,0 +1,484 @@
+#include <cstdint>
+#include <vector>
+
+#include "core/passes.hpp"
+#include "utils/error.hpp"
+
+namespace {
+
+constexpr uint32_t no_slot = UINT32_MAX;
+
+// Past this many lattice cells (slots times blocks) globals aren't tracked,
+// past it again the function is left alone
+constexpr size_t max_cells = size_t{1} << 22;
+
+enum class lattice_e : uint8_t
+{
+    undefined,   // No definition reached yet
+    constant,
+    overdefined, // Known to take more than one value, or unknown
+};
+
+struct lattice_t
+{
+    lattice_e kind = lattice_e::undefined;
+    int64_t value = 0;
+
+    bool is_constant() const { return kind == lattice_e::constant; }
+};
+
+lattice_t constant(int64_t value) { return {lattice_e::constant, value}; }
+constexpr lattice_t overdefined{lattice_e::overdefined, 0};
+
+lattice_t meet(const lattice_t& lhs, const lattice_t& rhs) {
+    if (lhs.kind == lattice_e::undefined) {
+        return rhs;
+    }
+    if (rhs.kind == lattice_e::undefined) {
+        return lhs;
+    }
+    if (lhs.kind == lattice_e::overdefined || rhs.kind == lattice_e::overdefined || lhs.value != rhs.value) {
+        return overdefined;
+    }
+    return lhs;
+}
+
+bool operator!=(const lattice_t& lhs, const lattice_t& rhs) {
+    return lhs.kind != rhs.kind || (lhs.kind == lattice_e::constant && lhs.value != rhs.value);
+}
+
+bool compare(ir_cond_e cond, int64_t lhs, int64_t rhs) {
+    switch (cond) {
+        case ir_cond_e::eq: return lhs == rhs;
+        case ir_cond_e::ne: return lhs != rhs;
+        case ir_cond_e::lt: return lhs < rhs;
+        case ir_cond_e::ge: return lhs >= rhs;
+        case ir_cond_e::le: return lhs <= rhs;
+        case ir_cond_e::gt: return lhs > rhs;
+    }
+    return false;
+}
+
+// Same results as the x86 code: arithmetic wraps, division is signed and
+// rounds towards zero. Division by zero and INT64_MIN / -1 are left for the
+// program to trap on.
+lattice_t evaluate(ir_op_e op, ir_cond_e cond, const lattice_t& lhs, const lattice_t& rhs) {
+    if (lhs.kind == lattice_e::overdefined || rhs.kind == lattice_e::overdefined) {
+        return overdefined;
+    }
+    if (lhs.kind == lattice_e::undefined || rhs.kind == lattice_e::undefined) {
+        return {};
+    }
+
+    const uint64_t a = static_cast<uint64_t>(lhs.value);
+    const uint64_t b = static_cast<uint64_t>(rhs.value);
+    switch (op) {
+        case ir_op_e::add: return constant(static_cast<int64_t>(a + b));
+        case ir_op_e::sub: return constant(static_cast<int64_t>(a - b));
+        case ir_op_e::mul: return constant(static_cast<int64_t>(a * b));
+        case ir_op_e::div:
+            if (b == 0 || (lhs.value == INT64_MIN && rhs.value == -1)) {
+                return overdefined;
+            }
+            return constant(lhs.value / rhs.value);
+        case ir_op_e::cmp: return constant(compare(cond, lhs.value, rhs.value) ? 1 : 0);
+        default: return overdefined;
+    }
+}
+
+// Whether removing the instruction when its result is unused changes nothing
+bool is_pure(const ir_insn_t& insn) {
+    switch (insn.op) {
+        case ir_op_e::copy:
+        case ir_op_e::add:
+        case ir_op_e::sub:
+        case ir_op_e::mul:
+        case ir_op_e::cmp:
+        case ir_op_e::load:
+            return true;
+        case ir_op_e::div:
+            // Dividing by zero or INT64_MIN by -1 traps, that has to stay
+            return insn.b.is_imm() && insn.b.value != 0 && insn.b.value != -1;
+        default:
+            return false;
+    }
+}
+
+template <typename Visit>
+void for_each_use(ir_function_t& function, ir_insn_t& insn, Visit&& visit) {
+    visit(insn.a);
+    visit(insn.b);
+    if (is_call(insn.op)) {
+        for (uint32_t i = 0; i < insn.count; ++i) {
+            visit(function.arguments[insn.first + i]);
+        }
+    }
+}
+
+struct propagator_t
+{
+    ir_function_t& function;
+    bool is_entry;
+    size_t global_count;
+    const std::vector<bool>& writes_globals; // Per callee
+
+    // Values defined once live in values, like SSA values would. Values
+    // defined more than once and globals get a slot in the per block state.
+    std::vector<uint32_t> slot_of;
+    uint32_t global_base = 0;
+    uint32_t slot_count = 0;
+    bool track_globals = true;
+
+    std::vector<lattice_t> values;
+    std::vector<std::vector<ir_block_id_t>> users; // Blocks reading each value
+    std::vector<std::vector<lattice_t>> block_in;
+    std::vector<bool> executable;
+    std::vector<bool> queued;
+    std::vector<ir_block_id_t> worklist;
+
+    constant_stats_t stats;
+
+    propagator_t(ir_function_t& function, bool is_entry, size_t global_count, const std::vector<bool>& writes_globals)
+        : function(function), is_entry(is_entry), global_count(global_count), writes_globals(writes_globals) {}
+
+    bool setup();
+    void run();
+    void rewrite();
+    void remove_dead_code();
+
+    lattice_t get(const std::vector<lattice_t>& state, const ir_operand_t& operand) const {
+        switch (operand.kind) {
+            case ir_operand_kind_e::imm:
+                return constant(operand.value);
+            case ir_operand_kind_e::value: {
+                const uint32_t slot = slot_of[operand.value];
+                return slot == no_slot ? values[operand.value] : state[slot];
+            }
+            default:
+                return overdefined;
+        }
+    }
+
+    void queue(ir_block_id_t block) {
+        if (!queued[block]) {
+            queued[block] = true;
+            worklist.push_back(block);
+        }
+    }
+
+    // Result of insn given the state before it, updates state
+    lattice_t step(std::vector<lattice_t>& state, const ir_insn_t& insn);
+    void visit_block(ir_block_id_t block);
+    void flow_to(ir_block_id_t target, const std::vector<lattice_t>& state);
+};
+
+bool propagator_t::setup() {
+    std::vector<uint32_t> def_count(function.value_count, 0);
+    std::vector<bool> global_loaded(global_count, false);
+    for (const ir_block_t& block : function.blocks) {
+        for (const ir_insn_t& insn : block.insns) {
+            if (has_dst(insn.op)) {
+                ++def_count[insn.dst];
+            }
+            if (insn.op == ir_op_e::load) {
+                global_loaded[insn.index] = true;
+            }
+        }
+    }
+
+    slot_of.assign(function.value_count, no_slot);
+    for (ir_value_t value = 0; value < function.value_count; ++value) {
+        // Parameters are defined on entry as well
+        if (def_count[value] > 1 || (value < function.param_count && def_count[value] > 0)) {
+            slot_of[value] = slot_count++;
+        }
+    }
+
+    global_base = slot_count;
+    size_t loaded = 0;
+    for (bool is_loaded : global_loaded) {
+        loaded += is_loaded;
+    }
+    if (loaded > 0 && (slot_count + global_count) * function.blocks.size() <= max_cells) {
+        slot_count += static_cast<uint32_t>(global_count);
+    } else {
+        track_globals = false;
+    }
+    if (size_t{slot_count} * function.blocks.size() > max_cells) {
+        return false;
+    }
+
+    values.assign(function.value_count, lattice_t{});
+    for (ir_value_t value = 0; value < function.param_count; ++value) {
+        values[value] = overdefined;
+    }
+
+    users.assign(function.value_count, {});
+    for (ir_block_id_t id = 0; id < function.blocks.size(); ++id) {
+        for (ir_insn_t& insn : function.blocks[id].insns) {
+            for_each_use(function, insn, [&](const ir_operand_t& operand) {
+                if (operand.is_value() && slot_of[operand.value] == no_slot) {
+                    std::vector<ir_block_id_t>& blocks = users[operand.value];
+                    if (blocks.empty() || blocks.back() != id) {
+                        blocks.push_back(id);
+                    }
+                }
+            });
+        }
+    }
+
+    block_in.assign(function.blocks.size(), std::vector<lattice_t>(slot_count));
+    executable.assign(function.blocks.size(), false);
+    queued.assign(function.blocks.size(), false);
+
+    // On entry the parameters hold whatever the caller passed and locals
+    // hold garbage. Globals are zero when the program starts, anywhere else
+    // they are unknown.
+    std::vector<lattice_t>& entry = block_in[0];
+    for (uint32_t slot = 0; slot < global_base; ++slot) {
+        entry[slot] = overdefined;
+    }
+    for (uint32_t slot = global_base; slot < slot_count; ++slot) {
+        entry[slot] = is_entry ? constant(0) : overdefined;
+    }
+    executable[0] = true;
+    queue(0);
+    return true;
+}
+
+lattice_t propagator_t::step(std::vector<lattice_t>& state, const ir_insn_t& insn) {
+    lattice_t result = overdefined;
+    switch (insn.op) {
+        case ir_op_e::copy:
+            result = get(state, insn.a);
+            break;
+        case ir_op_e::add:
+        case ir_op_e::sub:
+        case ir_op_e::mul:
+        case ir_op_e::div:
+        case ir_op_e::cmp:
+            result = evaluate(insn.op, insn.cond, get(state, insn.a), get(state, insn.b));
+            break;
+        case ir_op_e::load:
+            result = track_globals ? state[global_base + insn.index] : overdefined;
+            break;
+        case ir_op_e::store:
+            if (track_globals) {
+                state[global_base + insn.index] = get(state, insn.a);
+            }
+            break;
+        case ir_op_e::call:
+            if (track_globals && writes_globals[insn.index]) {
+                for (uint32_t slot = global_base; slot < slot_count; ++slot) {
+                    state[slot] = overdefined;
+                }
+            }
+            break;
+        default:
+            break;
+    }
+
+    if (has_dst(insn.op) && slot_of[insn.dst] != no_slot) {
+        state[slot_of[insn.dst]] = result;
+    }
+    return result;
+}
+
+void propagator_t::flow_to(ir_block_id_t target, const std::vector<lattice_t>& state) {
+    bool changed = !executable[target];
+    executable[target] = true;
+
+    std::vector<lattice_t>& in = block_in[target];
+    for (uint32_t slot = 0; slot < slot_count; ++slot) {
+        lattice_t merged = meet(in[slot], state[slot]);
+        if (merged != in[slot]) {
+            in[slot] = merged;
+            changed = true;
+        }
+    }
+    if (changed) {
+        queue(target);
+    }
+}
+
+void propagator_t::visit_block(ir_block_id_t block) {
+    std::vector<lattice_t> state = block_in[block];
+    for (const ir_insn_t& insn : function.blocks[block].insns) {
+        lattice_t result = step(state, insn);
+
+        if (has_dst(insn.op) && slot_of[insn.dst] == no_slot) {
+            lattice_t merged = meet(values[insn.dst], result);
+            if (merged != values[insn.dst]) {
+                values[insn.dst] = merged;
+                for (ir_block_id_t user : users[insn.dst]) {
+                    if (executable[user]) {
+                        queue(user);
+                    }
+                }
+            }
+        }
+
+        if (insn.op == ir_op_e::jump) {
+            flow_to(insn.target[0], state);
+        } else if (insn.op == ir_op_e::branch) {
+            lattice_t condition = evaluate(ir_op_e::cmp, insn.cond, get(state, insn.a), get(state, insn.b));
+            // Only reading a variable nobody assigned leaves it undefined,
+            // don't assume anything about garbage
+            if (condition.is_constant()) {
+                flow_to(insn.target[condition.value ? 0 : 1], state);
+            } else {
+                flow_to(insn.target[0], state);
+                flow_to(insn.target[1], state);
+            }
+        }
+    }
+}
+
+void propagator_t::run() {
+    while (!worklist.empty()) {
+        ir_block_id_t block = worklist.back();
+        worklist.pop_back();
+        queued[block] = false;
+        visit_block(block);
+    }
+}
+
+void propagator_t::rewrite() {
+    for (ir_block_id_t id = 0; id < function.blocks.size(); ++id) {
+        if (!executable[id]) {
+            continue;
+        }
+
+        std::vector<lattice_t> state = block_in[id];
+        for (ir_insn_t& insn : function.blocks[id].insns) {
+            // Operands first, against the state before the instruction
+            for_each_use(function, insn, [&](ir_operand_t& operand) {
+                if (operand.is_value()) {
+                    lattice_t known = get(state, operand);
+                    // Selection divides by an immediate -1 with neg, which
+                    // wraps where idiv would trap
+                    const bool keeps_trap = insn.op == ir_op_e::div && &operand == &insn.b && known.value == -1;
+                    if (known.is_constant() && !keeps_trap) {
+                        operand = ir_imm(known.value);
+                        ++stats.folded;
+                    }
+                }
+            });
+
+            lattice_t result = step(state, insn);
+            if (has_dst(insn.op) && insn.op != ir_op_e::call && result.is_constant()
+                && !(insn.op == ir_op_e::copy && insn.a.is_imm())) {
+                ir_insn_t copy(ir_op_e::copy);
+                copy.dst = insn.dst;
+                copy.a = ir_imm(result.value);
+                insn = copy;
+                ++stats.folded;
+            }
+
+            if (insn.op == ir_op_e::branch && insn.a.is_imm() && insn.b.is_imm()) {
+                ir_insn_t jump(ir_op_e::jump);
+                jump.target[0] = insn.target[compare(insn.cond, insn.a.value, insn.b.value) ? 0 : 1];
+                insn = jump;
+                ++stats.branches;
+            }
+        }
+    }
+
+    // Every edge into a block that never executes came from a branch that
+    // was just decided or from another such block
+    const size_t insn_count = count_instructions(function);
+    remove_unreachable_blocks(function);
+    merge_blocks(function);
+    stats.removed += static_cast<uint32_t>(insn_count - count_instructions(function));
+}
+
+void propagator_t::remove_dead_code() {
+    std::vector<uint32_t> use_count(function.value_count, 0);
+    for (ir_block_t& block : function.blocks) {
+        for (ir_insn_t& insn : block.insns) {
+            for_each_use(function, insn, [&](const ir_operand_t& operand) {
+                if (operand.is_value()) {
+                    ++use_count[operand.value];
+                }
+            });
+        }
+    }
+
+    // Removing an instruction can make the ones feeding it dead too
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (ir_block_t& block : function.blocks) {
+            std::erase_if(block.insns, [&](ir_insn_t& insn) {
+                if (!has_dst(insn.op) || use_count[insn.dst] != 0 || !is_pure(insn)) {
+                    return false;
+                }
+                for_each_use(function, insn, [&](const ir_operand_t& operand) {
+                    if (operand.is_value()) {
+                        --use_count[operand.value];
+                    }
+                });
+                ++stats.removed;
+                changed = true;
+                return true;
+            });
+        }
+    }
+}
+
+// Whether calling each function can change a global, directly or through
+// the functions it calls
+std::vector<bool> find_global_writers(const ir_module_t& module) {
+    std::vector<bool> writes(module.functions.size(), false);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t index = 0; index < module.functions.size(); ++index) {
+            if (writes[index]) {
+                continue;
+            }
+            // Whatever it does may call back into a function here
+            if (module.functions[index].is_external()) {
+                writes[index] = true;
+                changed = true;
+                continue;
+            }
+            for (const ir_block_t& block : module.functions[index].blocks) {
+                for (const ir_insn_t& insn : block.insns) {
+                    if (insn.op == ir_op_e::store || (is_call(insn.op) && writes[insn.index])) {
+                        writes[index] = true;
+                    }
+                }
+            }
+            changed |= writes[index];
+        }
+    }
+    return writes;
+}
+
+} // namespace
+
+constant_stats_t propagate_constants(ir_module_t& module) {
+    const std::vector<bool> writes_globals = find_global_writers(module);
+
+    constant_stats_t total;
+    for (uint32_t index = 0; index < module.functions.size(); ++index) {
+        ir_function_t& function = module.functions[index];
+        if (function.is_external()) {
+            continue;
+        }
+        propagator_t propagator{function, index == module.entry, module.globals.size(), writes_globals};
+        if (!propagator.setup()) {
+            info_msg("Skipping constant propagation in '{}', too large", function.name);
+            continue;
+        }
+        propagator.run();
+        propagator.rewrite();
+        propagator.remove_dead_code();
+
+        total.folded += propagator.stats.folded;
+        total.branches += propagator.stats.branches;
+        total.removed += propagator.stats.removed;
+    }
+    return total;
+}
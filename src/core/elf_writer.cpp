@@ -0,0 +1,307 @@
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <elf.h>
+
+#include "core/elf_writer.hpp"
+#include "utils/error.hpp"
+#include "utils/output_file.hpp"
+
+namespace {
+
+constexpr uint64_t base_address = 0x400000;
+constexpr uint64_t page_size = 0x1000;
+
+uint64_t align_up(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// Section names, offsets into .shstrtab
+constexpr char section_names[] = "\0.text\0.data\0.shstrtab";
+constexpr uint32_t text_name = 1;
+constexpr uint32_t data_name = 7;
+constexpr uint32_t shstrtab_name = 13;
+
+// Same for an object file, sections in this order
+constexpr char object_section_names[] = "\0.text\0.data\0.symtab\0.strtab\0.rela.text\0.shstrtab";
+constexpr uint32_t object_name_offsets[] = {0, 1, 7, 13, 21, 29, 40};
+constexpr uint16_t text_index = 1;
+constexpr uint16_t data_index = 2;
+constexpr uint16_t symtab_index = 3;
+constexpr uint16_t strtab_index = 4;
+constexpr uint16_t rela_index = 5;
+constexpr uint16_t shstrtab_index = 6;
+constexpr uint16_t object_section_count = 7;
+
+template <typename T>
+void put(std::vector<uint8_t>& image, size_t offset, const T& value) {
+    std::memcpy(image.data() + offset, &value, sizeof(T));
+}
+
+template <typename T>
+void append(std::vector<uint8_t>& image, const T& value) {
+    const size_t offset = image.size();
+    image.resize(offset + sizeof(T));
+    put(image, offset, value);
+}
+
+void pad_to(std::vector<uint8_t>& image, uint64_t alignment) {
+    image.resize(align_up(image.size(), alignment), 0);
+}
+
+void init_header(Elf64_Ehdr& header, uint16_t type) {
+    std::memcpy(header.e_ident, ELFMAG, SELFMAG);
+    header.e_ident[EI_CLASS] = ELFCLASS64;
+    header.e_ident[EI_DATA] = ELFDATA2LSB;
+    header.e_ident[EI_VERSION] = EV_CURRENT;
+    header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    header.e_type = type;
+    header.e_machine = EM_X86_64;
+    header.e_version = EV_CURRENT;
+    header.e_ehsize = sizeof(Elf64_Ehdr);
+    header.e_shentsize = sizeof(Elf64_Shdr);
+}
+
+} // namespace
+
+bool write_elf_executable(const std::string& path, const machine_code_t& code) {
+    for (const code_symbol_t& symbol : code.symbols) {
+        if (!symbol.is_defined) {
+            error_msg("Undefined function '{}'", symbol.name);
+            return false;
+        }
+    }
+    if (code.entry == no_entry) {
+        error_msg("Program has no entry point");
+        return false;
+    }
+
+    const bool has_data = code.data_size > 0;
+    const uint16_t segment_count = has_data ? 2 : 1;
+
+    // File layout: headers, text, data, section names, section headers
+    const uint64_t text_offset = sizeof(Elf64_Ehdr) + segment_count * sizeof(Elf64_Phdr);
+    const uint64_t text_end = text_offset + code.text.size();
+    const uint64_t data_offset = align_up(text_end, 16);
+    const uint64_t data_end = data_offset + code.data_size;
+    const uint64_t names_offset = data_end;
+    const uint64_t section_headers_offset = align_up(names_offset + sizeof(section_names), 8);
+    const uint16_t section_count = 4;
+
+    // The data segment starts on a fresh page but keeps its offset within the
+    // page, which the loader requires
+    const uint64_t text_address = base_address + text_offset;
+    const uint64_t data_address = align_up(base_address + text_end, page_size) + data_offset % page_size;
+
+    std::vector<uint8_t> image(section_headers_offset + section_count * sizeof(Elf64_Shdr), 0);
+
+    Elf64_Ehdr header{};
+    init_header(header, ET_EXEC);
+    header.e_entry = text_address + code.entry;
+    header.e_phoff = sizeof(Elf64_Ehdr);
+    header.e_shoff = section_headers_offset;
+    header.e_phentsize = sizeof(Elf64_Phdr);
+    header.e_phnum = segment_count;
+    header.e_shnum = section_count;
+    header.e_shstrndx = 3;
+    put(image, 0, header);
+
+    // The text segment maps the headers as well, like ld does
+    Elf64_Phdr text_segment{};
+    text_segment.p_type = PT_LOAD;
+    text_segment.p_flags = PF_R | PF_X;
+    text_segment.p_offset = 0;
+    text_segment.p_vaddr = base_address;
+    text_segment.p_paddr = base_address;
+    text_segment.p_filesz = text_end;
+    text_segment.p_memsz = text_end;
+    text_segment.p_align = page_size;
+    put(image, sizeof(Elf64_Ehdr), text_segment);
+
+    if (has_data) {
+        Elf64_Phdr data_segment{};
+        data_segment.p_type = PT_LOAD;
+        data_segment.p_flags = PF_R | PF_W;
+        data_segment.p_offset = data_offset;
+        data_segment.p_vaddr = data_address;
+        data_segment.p_paddr = data_address;
+        data_segment.p_filesz = code.data_size;
+        data_segment.p_memsz = code.data_size;
+        data_segment.p_align = page_size;
+        put(image, sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr), data_segment);
+    }
+
+    std::memcpy(image.data() + text_offset, code.text.data(), code.text.size());
+
+    for (const data_fixup_t& fixup : code.data_fixups) {
+        const int64_t displacement = static_cast<int64_t>(data_address + fixup.data_offset)
+                                   - static_cast<int64_t>(text_address + fixup.insn_end);
+        if (displacement < INT32_MIN || displacement > INT32_MAX) {
+            error_msg("Data section out of rip relative range");
+            return false;
+        }
+        put(image, text_offset + fixup.field, static_cast<int32_t>(displacement));
+    }
+
+    // Section headers aren't needed to run, but objdump and gdb want them
+    std::memcpy(image.data() + names_offset, section_names, sizeof(section_names));
+
+    Elf64_Shdr sections[section_count]{};
+    sections[1].sh_name = text_name;
+    sections[1].sh_type = SHT_PROGBITS;
+    sections[1].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+    sections[1].sh_addr = text_address;
+    sections[1].sh_offset = text_offset;
+    sections[1].sh_size = code.text.size();
+    sections[1].sh_addralign = 16;
+
+    sections[2].sh_name = data_name;
+    sections[2].sh_type = SHT_PROGBITS;
+    sections[2].sh_flags = SHF_ALLOC | SHF_WRITE;
+    sections[2].sh_addr = has_data ? data_address : 0;
+    sections[2].sh_offset = data_offset;
+    sections[2].sh_size = code.data_size;
+    sections[2].sh_addralign = 8;
+
+    sections[3].sh_name = shstrtab_name;
+    sections[3].sh_type = SHT_STRTAB;
+    sections[3].sh_offset = names_offset;
+    sections[3].sh_size = sizeof(section_names);
+    sections[3].sh_addralign = 1;
+
+    for (uint16_t i = 0; i < section_count; ++i) {
+        put(image, section_headers_offset + i * sizeof(Elf64_Shdr), sections[i]);
+    }
+
+    return write_output_file(path, image.data(), image.size(), true);
+}
+
+bool write_elf_object(const std::string& path, const machine_code_t& code) {
+    // Symbols: the null one, .data for the data fixups, then the functions
+    // with the local ones first as ELF requires
+    std::vector<Elf64_Sym> symbols(2);
+    symbols[1].st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+    symbols[1].st_shndx = data_index;
+    constexpr uint32_t data_symbol = 1;
+
+    std::string names(1, '\0');
+    std::vector<uint32_t> symbol_index(code.symbols.size());
+    uint32_t first_global = 0;
+    for (bool global : {false, true}) {
+        if (global) {
+            first_global = static_cast<uint32_t>(symbols.size());
+        }
+        for (size_t i = 0; i < code.symbols.size(); ++i) {
+            const code_symbol_t& symbol = code.symbols[i];
+            if ((symbol.is_public || !symbol.is_defined) != global) {
+                continue;
+            }
+            Elf64_Sym& entry = symbols.emplace_back();
+            entry.st_name = static_cast<uint32_t>(names.size());
+            names += symbol.name;
+            names += '\0';
+            if (symbol.is_defined) {
+                entry.st_info = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL, STT_FUNC);
+                entry.st_shndx = text_index;
+                entry.st_value = symbol.offset;
+            } else {
+                entry.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+                entry.st_shndx = SHN_UNDEF;
+            }
+            symbol_index[i] = static_cast<uint32_t>(symbols.size() - 1);
+        }
+    }
+
+    // rip points past the field, which the addends make up for
+    std::vector<Elf64_Rela> relocations;
+    for (const data_fixup_t& fixup : code.data_fixups) {
+        Elf64_Rela& relocation = relocations.emplace_back();
+        relocation.r_offset = fixup.field;
+        relocation.r_info = ELF64_R_INFO(data_symbol, R_X86_64_PC32);
+        relocation.r_addend = static_cast<int64_t>(fixup.data_offset) - (fixup.insn_end - fixup.field);
+    }
+    for (const symbol_fixup_t& fixup : code.symbol_fixups) {
+        Elf64_Rela& relocation = relocations.emplace_back();
+        relocation.r_offset = fixup.field;
+        relocation.r_info = ELF64_R_INFO(symbol_index[fixup.symbol], R_X86_64_PLT32);
+        relocation.r_addend = -static_cast<int64_t>(fixup.insn_end - fixup.field);
+    }
+    std::sort(relocations.begin(), relocations.end(), [](const Elf64_Rela& lhs, const Elf64_Rela& rhs) {
+        return lhs.r_offset < rhs.r_offset;
+    });
+
+    // File layout: header, then each section in order, then section headers
+    std::vector<uint8_t> image(sizeof(Elf64_Ehdr), 0);
+    Elf64_Shdr sections[object_section_count]{};
+    for (uint16_t i = 1; i < object_section_count; ++i) {
+        sections[i].sh_name = object_name_offsets[i];
+    }
+
+    pad_to(image, 16);
+    sections[text_index].sh_type = SHT_PROGBITS;
+    sections[text_index].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+    sections[text_index].sh_offset = image.size();
+    sections[text_index].sh_size = code.text.size();
+    sections[text_index].sh_addralign = 16;
+    image.insert(image.end(), code.text.begin(), code.text.end());
+
+    pad_to(image, 8);
+    sections[data_index].sh_type = SHT_PROGBITS;
+    sections[data_index].sh_flags = SHF_ALLOC | SHF_WRITE;
+    sections[data_index].sh_offset = image.size();
+    sections[data_index].sh_size = code.data_size;
+    sections[data_index].sh_addralign = 8;
+    image.resize(image.size() + code.data_size, 0);
+
+    pad_to(image, 8);
+    sections[symtab_index].sh_type = SHT_SYMTAB;
+    sections[symtab_index].sh_offset = image.size();
+    sections[symtab_index].sh_size = symbols.size() * sizeof(Elf64_Sym);
+    sections[symtab_index].sh_link = strtab_index;
+    sections[symtab_index].sh_info = first_global;
+    sections[symtab_index].sh_addralign = 8;
+    sections[symtab_index].sh_entsize = sizeof(Elf64_Sym);
+    for (const Elf64_Sym& symbol : symbols) {
+        append(image, symbol);
+    }
+
+    sections[strtab_index].sh_type = SHT_STRTAB;
+    sections[strtab_index].sh_offset = image.size();
+    sections[strtab_index].sh_size = names.size();
+    sections[strtab_index].sh_addralign = 1;
+    image.insert(image.end(), names.begin(), names.end());
+
+    pad_to(image, 8);
+    sections[rela_index].sh_type = SHT_RELA;
+    sections[rela_index].sh_flags = SHF_INFO_LINK;
+    sections[rela_index].sh_offset = image.size();
+    sections[rela_index].sh_size = relocations.size() * sizeof(Elf64_Rela);
+    sections[rela_index].sh_link = symtab_index;
+    sections[rela_index].sh_info = text_index;
+    sections[rela_index].sh_addralign = 8;
+    sections[rela_index].sh_entsize = sizeof(Elf64_Rela);
+    for (const Elf64_Rela& relocation : relocations) {
+        append(image, relocation);
+    }
+
+    sections[shstrtab_index].sh_type = SHT_STRTAB;
+    sections[shstrtab_index].sh_offset = image.size();
+    sections[shstrtab_index].sh_size = sizeof(object_section_names);
+    sections[shstrtab_index].sh_addralign = 1;
+    image.insert(image.end(), object_section_names, object_section_names + sizeof(object_section_names));
+
+    pad_to(image, 8);
+    Elf64_Ehdr header{};
+    init_header(header, ET_REL);
+    header.e_shoff = image.size();
+    header.e_shnum = object_section_count;
+    header.e_shstrndx = shstrtab_index;
+    put(image, 0, header);
+    for (const Elf64_Shdr& section : sections) {
+        append(image, section);
+    }
+
+    return write_output_file(path, image.data(), image.size(), false);
+}
@@ -0,0 +1,11 @@
+#include "core/emitter.hpp"
+#include "utils/output_file.hpp"
+
+void asm_emitter_t::clear() {
+    buffer.clear();
+    lines = 0;
+}
+
+bool asm_emitter_t::write_to_file(const std::string& path) const {
+    return write_output_file(path, buffer.data(), buffer.size());
+}
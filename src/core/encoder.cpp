@@ -0,0 +1,501 @@
+#include <cstring>
+
+#include "core/encoder.hpp"
+#include "utils/error.hpp"
+
+namespace {
+
+constexpr uint32_t unplaced = UINT32_MAX;
+
+uint8_t low_bits(x86_reg_e reg) {
+    return static_cast<uint8_t>(reg) & 7;
+}
+
+bool is_extended(x86_reg_e reg) {
+    return reg != x86_reg_e::none && static_cast<uint8_t>(reg) >= 8;
+}
+
+bool fits_int8(int64_t value) {
+    return value >= INT8_MIN && value <= INT8_MAX;
+}
+
+bool fits_int32(int64_t value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+bool is_jump(x86_op_e op) {
+    return op >= x86_op_e::jmp && op <= x86_op_e::jg;
+}
+
+// Low nibble of the jcc opcodes, 0x70+cc short and 0x0f 0x80+cc near, and
+// of setcc, 0x0f 0x90+cc
+uint8_t condition_code(x86_op_e op) {
+    switch (op) {
+        case x86_op_e::je: case x86_op_e::sete: return 0x4;
+        case x86_op_e::jne: case x86_op_e::setne: return 0x5;
+        case x86_op_e::jl: case x86_op_e::setl: return 0xc;
+        case x86_op_e::jge: case x86_op_e::setge: return 0xd;
+        case x86_op_e::jle: case x86_op_e::setle: return 0xe;
+        case x86_op_e::jg: case x86_op_e::setg: return 0xf;
+        default: return 0;
+    }
+}
+
+struct insn_encoder_t
+{
+    std::vector<uint8_t>& out;
+    const std::vector<uint32_t>& label_offsets;
+    uint32_t insn_offset;
+
+    // Set when the instruction addresses a data label
+    size_t rip_field = SIZE_MAX;
+    x86_label_id_t rip_label = no_label;
+
+    void byte(uint8_t value) { out.push_back(value); }
+
+    void bytes32(int32_t value) {
+        uint8_t raw[4];
+        std::memcpy(raw, &value, 4);
+        out.insert(out.end(), raw, raw + 4);
+    }
+
+    void bytes64(int64_t value) {
+        uint8_t raw[8];
+        std::memcpy(raw, &value, 8);
+        out.insert(out.end(), raw, raw + 8);
+    }
+
+    // REX.W is always set, every operation here is 64 bit
+    void rex(x86_reg_e reg, const x86_operand_t& rm) {
+        uint8_t prefix = 0x48;
+        if (is_extended(reg)) {
+            prefix |= 0x04;
+        }
+        if ((rm.kind == x86_operand_kind_e::reg || rm.kind == x86_operand_kind_e::mem) && is_extended(rm.reg)) {
+            prefix |= 0x01;
+        }
+        if (rm.kind == x86_operand_kind_e::mem && is_extended(rm.index)) {
+            prefix |= 0x02;
+        }
+        byte(prefix);
+    }
+
+    // ModRM (plus SIB and displacement) for a register or memory operand
+    void modrm(uint8_t reg_field, const x86_operand_t& rm) {
+        reg_field = (reg_field & 7) << 3;
+
+        if (rm.kind == x86_operand_kind_e::reg) {
+            byte(0xc0 | reg_field | low_bits(rm.reg));
+            return;
+        }
+
+        if (rm.reg == x86_reg_e::none) {
+            // [rip + disp32], patched once the data section is placed
+            byte(0x05 | reg_field);
+            rip_field = out.size();
+            rip_label = rm.label;
+            bytes32(0);
+            return;
+        }
+
+        const uint8_t base = low_bits(rm.reg);
+        uint8_t mode = 0x80;
+        // rbp and r13 can't be encoded without a displacement
+        if (rm.value == 0 && base != 5) {
+            mode = 0x00;
+        } else if (fits_int8(rm.value)) {
+            mode = 0x40;
+        }
+
+        if (rm.index != x86_reg_e::none) {
+            // SIB: scale, index, base
+            const uint8_t scale_bits = rm.scale == 8 ? 3 : rm.scale == 4 ? 2 : rm.scale == 2 ? 1 : 0;
+            byte(mode | reg_field | 4);
+            byte(static_cast<uint8_t>(scale_bits << 6 | low_bits(rm.index) << 3 | base));
+        } else {
+            byte(mode | reg_field | base);
+            // rsp and r12 as a base need a SIB byte
+            if (base == 4) {
+                byte(0x24);
+            }
+        }
+        if (mode == 0x40) {
+            byte(static_cast<uint8_t>(rm.value));
+        } else if (mode == 0x80) {
+            bytes32(static_cast<int32_t>(rm.value));
+        }
+    }
+
+    // op r/m64, r64
+    void rm_reg(uint8_t opcode, const x86_operand_t& rm, x86_reg_e reg) {
+        rex(reg, rm);
+        byte(opcode);
+        modrm(static_cast<uint8_t>(reg), rm);
+    }
+
+    // op r64, r/m64
+    void reg_rm(uint8_t opcode, x86_reg_e reg, const x86_operand_t& rm) {
+        rm_reg(opcode, rm, reg);
+    }
+
+    // Group 1 arithmetic with an immediate, /extension in the reg field
+    void alu_imm(uint8_t extension, const x86_operand_t& rm, int64_t value) {
+        rex(x86_reg_e::none, rm);
+        if (fits_int8(value)) {
+            byte(0x83);
+            modrm(extension, rm);
+            byte(static_cast<uint8_t>(value));
+        } else {
+            byte(0x81);
+            modrm(extension, rm);
+            bytes32(static_cast<int32_t>(value));
+        }
+    }
+
+    int64_t relative_target(x86_label_id_t label, size_t insn_size) const {
+        uint32_t target = label_offsets[label];
+        if (target == unplaced) {
+            return 0;
+        }
+        return static_cast<int64_t>(target) - (static_cast<int64_t>(insn_offset) + static_cast<int64_t>(insn_size));
+    }
+
+    bool encode(const x86_insn_t& insn, bool short_branch);
+};
+
+bool is_reg(const x86_operand_t& operand) {
+    return operand.kind == x86_operand_kind_e::reg;
+}
+
+bool is_rm(const x86_operand_t& operand) {
+    return operand.kind == x86_operand_kind_e::reg || operand.kind == x86_operand_kind_e::mem;
+}
+
+bool is_imm(const x86_operand_t& operand) {
+    return operand.kind == x86_operand_kind_e::imm;
+}
+
+bool insn_encoder_t::encode(const x86_insn_t& insn, bool short_branch) {
+    const x86_operand_t& dst = insn.dst;
+    const x86_operand_t& src = insn.src;
+
+    switch (insn.op) {
+        case x86_op_e::label:
+        case x86_op_e::comment:
+            return true;
+
+        case x86_op_e::parallel_copy:
+            // Lowered to moves by the register allocator
+            break;
+
+        case x86_op_e::mov:
+            if (is_rm(dst) && is_reg(src)) {
+                rm_reg(0x89, dst, src.reg);
+                return true;
+            }
+            if (is_reg(dst) && is_rm(src)) {
+                reg_rm(0x8b, dst.reg, src);
+                return true;
+            }
+            if (is_rm(dst) && is_imm(src) && fits_int32(src.value)) {
+                rex(x86_reg_e::none, dst);
+                byte(0xc7);
+                modrm(0, dst);
+                bytes32(static_cast<int32_t>(src.value));
+                return true;
+            }
+            if (is_reg(dst) && is_imm(src)) {
+                // movabs, the only form taking a full 64 bit immediate
+                rex(x86_reg_e::none, dst);
+                byte(0xb8 + low_bits(dst.reg));
+                bytes64(src.value);
+                return true;
+            }
+            break;
+
+        case x86_op_e::add:
+        case x86_op_e::sub:
+        case x86_op_e::xor_:
+        case x86_op_e::cmp: {
+            // r/m, reg form of each, the reg, r/m form is the next opcode up
+            uint8_t opcode = 0x01;
+            uint8_t extension = 0;
+            switch (insn.op) {
+                case x86_op_e::sub: opcode = 0x29; extension = 5; break;
+                case x86_op_e::xor_: opcode = 0x31; extension = 6; break;
+                case x86_op_e::cmp: opcode = 0x39; extension = 7; break;
+                default: break;
+            }
+            if (is_rm(dst) && is_reg(src)) {
+                rm_reg(opcode, dst, src.reg);
+                return true;
+            }
+            if (is_reg(dst) && is_rm(src)) {
+                reg_rm(opcode + 2, dst.reg, src);
+                return true;
+            }
+            if (is_rm(dst) && is_imm(src) && fits_int32(src.value)) {
+                alu_imm(extension, dst, src.value);
+                return true;
+            }
+            break;
+        }
+
+        case x86_op_e::imul:
+            if (is_reg(dst) && is_rm(src)) {
+                rex(dst.reg, src);
+                byte(0x0f);
+                byte(0xaf);
+                modrm(static_cast<uint8_t>(dst.reg), src);
+                return true;
+            }
+            if (is_reg(dst) && is_imm(src) && fits_int32(src.value)) {
+                // Three operand form with the destination as the source too
+                rex(dst.reg, dst);
+                byte(fits_int8(src.value) ? 0x6b : 0x69);
+                modrm(static_cast<uint8_t>(dst.reg), dst);
+                if (fits_int8(src.value)) {
+                    byte(static_cast<uint8_t>(src.value));
+                } else {
+                    bytes32(static_cast<int32_t>(src.value));
+                }
+                return true;
+            }
+            break;
+
+        case x86_op_e::sete:
+        case x86_op_e::setne:
+        case x86_op_e::setl:
+        case x86_op_e::setge:
+        case x86_op_e::setle:
+        case x86_op_e::setg:
+            if (is_rm(dst)) {
+                // Byte operand, no REX.W. spl, bpl, sil and dil only exist
+                // with some REX prefix, otherwise they would be ah to bh
+                uint8_t prefix = 0x40;
+                if (is_extended(dst.reg)) {
+                    prefix |= 0x01;
+                }
+                if (prefix != 0x40 || (is_reg(dst) && low_bits(dst.reg) >= 4)) {
+                    byte(prefix);
+                }
+                byte(0x0f);
+                byte(0x90 | condition_code(insn.op));
+                modrm(0, dst);
+                return true;
+            }
+            break;
+
+        case x86_op_e::movzx:
+            if (is_reg(dst) && is_rm(src)) {
+                // REX.W already makes the byte registers 4 to 7 spl to dil
+                rex(dst.reg, src);
+                byte(0x0f);
+                byte(0xb6);
+                modrm(static_cast<uint8_t>(dst.reg), src);
+                return true;
+            }
+            break;
+
+        case x86_op_e::imul_wide:
+        case x86_op_e::idiv:
+        case x86_op_e::neg:
+            // Group 3, F7 /extension
+            if (is_rm(dst)) {
+                rex(x86_reg_e::none, dst);
+                byte(0xf7);
+                modrm(insn.op == x86_op_e::imul_wide ? 5 : insn.op == x86_op_e::idiv ? 7 : 3, dst);
+                return true;
+            }
+            break;
+
+        case x86_op_e::cqo:
+            byte(0x48);
+            byte(0x99);
+            return true;
+
+        case x86_op_e::shl:
+        case x86_op_e::sar:
+        case x86_op_e::shr:
+            // Group 2 by an immediate count, C1 /extension ib, or D1 without
+            // the immediate for a count of 1
+            if (is_rm(dst) && is_imm(src)) {
+                const bool by_one = (src.value & 63) == 1;
+                rex(x86_reg_e::none, dst);
+                byte(by_one ? 0xd1 : 0xc1);
+                modrm(insn.op == x86_op_e::shl ? 4 : insn.op == x86_op_e::sar ? 7 : 5, dst);
+                if (!by_one) {
+                    byte(static_cast<uint8_t>(src.value & 63));
+                }
+                return true;
+            }
+            break;
+
+        case x86_op_e::lea:
+            if (is_reg(dst) && src.kind == x86_operand_kind_e::mem) {
+                reg_rm(0x8d, dst.reg, src);
+                return true;
+            }
+            break;
+
+        case x86_op_e::push:
+        case x86_op_e::pop:
+            if (is_reg(dst)) {
+                if (is_extended(dst.reg)) {
+                    byte(0x41);
+                }
+                byte((insn.op == x86_op_e::push ? 0x50 : 0x58) + low_bits(dst.reg));
+                return true;
+            }
+            break;
+
+        case x86_op_e::jmp:
+        case x86_op_e::je:
+        case x86_op_e::jne:
+        case x86_op_e::jl:
+        case x86_op_e::jge:
+        case x86_op_e::jle:
+        case x86_op_e::jg: {
+            if (dst.kind != x86_operand_kind_e::label) {
+                break;
+            }
+            const bool unconditional = insn.op == x86_op_e::jmp;
+            if (short_branch) {
+                byte(unconditional ? 0xeb : 0x70 | condition_code(insn.op));
+                byte(static_cast<uint8_t>(relative_target(dst.label, 2)));
+            } else if (unconditional) {
+                byte(0xe9);
+                bytes32(static_cast<int32_t>(relative_target(dst.label, 5)));
+            } else {
+                byte(0x0f);
+                byte(0x80 | condition_code(insn.op));
+                bytes32(static_cast<int32_t>(relative_target(dst.label, 6)));
+            }
+            return true;
+        }
+
+        case x86_op_e::call:
+            if (dst.kind == x86_operand_kind_e::label) {
+                byte(0xe8);
+                bytes32(static_cast<int32_t>(relative_target(dst.label, 5)));
+                return true;
+            }
+            break;
+
+        case x86_op_e::ret:
+            byte(0xc3);
+            return true;
+
+        case x86_op_e::syscall:
+            byte(0x0f);
+            byte(0x05);
+            return true;
+    }
+
+    error_msg("Can't encode '{}' with these operands", x86_op_name(insn.op));
+    return false;
+}
+
+} // namespace
+
+bool encode_program(const x86_program_t& program, machine_code_t& code) {
+    const std::vector<x86_insn_t>& text = program.text;
+
+    std::vector<uint32_t> label_offsets(program.labels.size(), unplaced);
+    for (size_t i = 0; i < program.data.size(); ++i) {
+        label_offsets[program.data[i]] = static_cast<uint32_t>(i * 8);
+    }
+    code.data_size = static_cast<uint32_t>(program.data.size() * 8);
+
+    // Functions may live in another object file, anything else must be here
+    for (const x86_label_t& label : program.labels) {
+        if (!label.is_placed && !label.is_function) {
+            error_msg("Undefined label '{}'", label.name);
+            return false;
+        }
+    }
+    auto is_external = [&](const x86_operand_t& operand) {
+        return operand.kind == x86_operand_kind_e::label && !program.labels[operand.label].is_placed;
+    };
+
+    // Everything but the jumps has a fixed size, work those out once
+    std::vector<uint32_t> sizes(text.size());
+    std::vector<bool> short_branch(text.size(), false);
+    std::vector<uint8_t> scratch;
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (is_jump(text[i].op) && !is_external(text[i].dst)) {
+            short_branch[i] = true;
+            sizes[i] = 2;
+            continue;
+        }
+        scratch.clear();
+        insn_encoder_t encoder{scratch, label_offsets, 0};
+        if (!encoder.encode(text[i], false)) {
+            return false;
+        }
+        sizes[i] = static_cast<uint32_t>(scratch.size());
+    }
+
+    // Branch relaxation, jumps only ever grow so this terminates
+    std::vector<uint32_t> offsets(text.size());
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        uint32_t offset = 0;
+        for (size_t i = 0; i < text.size(); ++i) {
+            offsets[i] = offset;
+            if (text[i].op == x86_op_e::label) {
+                label_offsets[text[i].dst.label] = offset;
+            }
+            offset += sizes[i];
+        }
+
+        for (size_t i = 0; i < text.size(); ++i) {
+            if (!short_branch[i]) {
+                continue;
+            }
+            int64_t distance = static_cast<int64_t>(label_offsets[text[i].dst.label]) - (offsets[i] + 2);
+            if (!fits_int8(distance)) {
+                short_branch[i] = false;
+                sizes[i] = text[i].op == x86_op_e::jmp ? 5 : 6;
+                changed = true;
+            }
+        }
+    }
+
+    // Every function label, in label order so the symbol table is stable
+    code.symbols.clear();
+    std::vector<uint32_t> symbol_index(program.labels.size(), UINT32_MAX);
+    for (x86_label_id_t id = 0; id < program.labels.size(); ++id) {
+        const x86_label_t& label = program.labels[id];
+        if (label.is_function) {
+            symbol_index[id] = static_cast<uint32_t>(code.symbols.size());
+            code.symbols.push_back({label.name, label.is_placed ? label_offsets[id] : 0, label.is_placed, label.is_public});
+        }
+    }
+
+    code.text.clear();
+    code.data_fixups.clear();
+    code.symbol_fixups.clear();
+    for (size_t i = 0; i < text.size(); ++i) {
+        insn_encoder_t encoder{code.text, label_offsets, offsets[i]};
+        if (!encoder.encode(text[i], short_branch[i])) {
+            return false;
+        }
+        if (encoder.rip_label != no_label) {
+            code.data_fixups.push_back({static_cast<uint32_t>(encoder.rip_field),
+                                        static_cast<uint32_t>(code.text.size()),
+                                        label_offsets[encoder.rip_label]});
+        }
+        // Only calls and jumps take a function label, the rel32 ends them
+        if (is_external(text[i].dst)) {
+            const uint32_t end = static_cast<uint32_t>(code.text.size());
+            code.symbol_fixups.push_back({end - 4, end, symbol_index[text[i].dst.label]});
+        }
+    }
+
+    // An object file of a program may leave the entry to another one
+    code.entry = program.entry == no_label ? no_entry : label_offsets[program.entry];
+    return true;
+}
@@ -0,0 +1,223 @@
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "core/passes.hpp"
+#include "utils/error.hpp"
+
+namespace {
+
+bool is_leaf(const ir_function_t& function) {
+    for (const ir_block_t& block : function.blocks) {
+        for (const ir_insn_t& insn : block.insns) {
+            if (is_call(insn.op)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Functions ordered so every callee comes before its callers, apart from
+// recursion, which has no such order
+std::vector<uint32_t> callees_first(const ir_module_t& module) {
+    std::vector<std::vector<uint32_t>> callees(module.functions.size());
+    for (uint32_t index = 0; index < module.functions.size(); ++index) {
+        for (const ir_block_t& block : module.functions[index].blocks) {
+            for (const ir_insn_t& insn : block.insns) {
+                if (is_call(insn.op)) {
+                    callees[index].push_back(insn.index);
+                }
+            }
+        }
+    }
+
+    // Depth first with an explicit stack of (function, next callee), call
+    // chains can be longer than the native stack is deep
+    std::vector<uint32_t> order;
+    std::vector<bool> visited(module.functions.size(), false);
+    std::vector<std::pair<uint32_t, size_t>> stack;
+    for (uint32_t root = 0; root < module.functions.size(); ++root) {
+        if (visited[root]) {
+            continue;
+        }
+        visited[root] = true;
+        stack.push_back({root, 0});
+        while (!stack.empty()) {
+            const uint32_t index = stack.back().first;
+            if (stack.back().second == callees[index].size()) {
+                order.push_back(index);
+                stack.pop_back();
+                continue;
+            }
+            const uint32_t callee = callees[index][stack.back().second++];
+            if (!visited[callee]) {
+                visited[callee] = true;
+                stack.push_back({callee, 0});
+            }
+        }
+    }
+    return order;
+}
+
+// Replaces the call at insns[position] of block with a copy of callee's
+// body. The instructions after the call move to a new block the inlined
+// returns jump to.
+void inline_call(ir_function_t& caller, ir_block_id_t block, size_t position, const ir_function_t& callee) {
+    const ir_insn_t call = caller.blocks[block].insns[position];
+    const std::vector<ir_operand_t> arguments(caller.call_arguments(call).begin(), caller.call_arguments(call).end());
+
+    const ir_block_id_t continuation = static_cast<ir_block_id_t>(caller.blocks.size());
+    caller.blocks.emplace_back().name = "call_return";
+    std::vector<ir_insn_t>& insns = caller.blocks[block].insns;
+    caller.blocks[continuation].insns.assign(insns.begin() + position + 1, insns.end());
+    insns.erase(insns.begin() + position, insns.end());
+
+    const ir_value_t value_base = caller.value_count;
+    const ir_block_id_t block_base = static_cast<ir_block_id_t>(caller.blocks.size());
+    caller.value_count += callee.value_count;
+
+    // Parameters are ordinary values of the caller now
+    for (uint32_t i = 0; i < callee.param_count; ++i) {
+        ir_insn_t copy(ir_op_e::copy);
+        copy.dst = value_base + i;
+        copy.a = arguments[i];
+        insns.push_back(copy);
+    }
+    ir_insn_t enter(ir_op_e::jump);
+    enter.target[0] = block_base;
+    insns.push_back(enter);
+
+    auto remap = [&](ir_operand_t operand) {
+        if (operand.is_value()) {
+            operand.value += value_base;
+        }
+        return operand;
+    };
+
+    for (const ir_block_t& callee_block : callee.blocks) {
+        ir_block_t copied;
+        copied.name = callee_block.name;
+        copied.insns.reserve(callee_block.insns.size() + 1);
+        for (ir_insn_t insn : callee_block.insns) {
+            if (insn.op == ir_op_e::ret) {
+                // A return without a value leaves the result undefined, zero
+                // is as good as anything
+                ir_insn_t result(ir_op_e::copy);
+                result.dst = call.dst;
+                result.a = insn.a.kind == ir_operand_kind_e::none ? ir_imm(0) : remap(insn.a);
+                copied.insns.push_back(result);
+
+                ir_insn_t back(ir_op_e::jump);
+                back.target[0] = continuation;
+                copied.insns.push_back(back);
+                continue;
+            }
+
+            if (has_dst(insn.op)) {
+                insn.dst += value_base;
+            }
+            insn.a = remap(insn.a);
+            insn.b = remap(insn.b);
+            if (insn.op == ir_op_e::jump || insn.op == ir_op_e::branch) {
+                insn.target[0] += block_base;
+            }
+            if (insn.op == ir_op_e::branch) {
+                insn.target[1] += block_base;
+            }
+            copied.insns.push_back(insn);
+        }
+        caller.blocks.push_back(std::move(copied));
+    }
+}
+
+// Drops every function neither the entry nor another file can reach
+// through calls, and renumbers the calls to the rest
+uint32_t remove_uncalled_functions(ir_module_t& module) {
+    std::vector<bool> reachable(module.functions.size(), false);
+    std::vector<uint32_t> worklist;
+    for (uint32_t index = 0; index < module.functions.size(); ++index) {
+        if (index == module.entry || module.functions[index].linkage == ir_linkage_e::exported) {
+            reachable[index] = true;
+            worklist.push_back(index);
+        }
+    }
+    while (!worklist.empty()) {
+        const ir_function_t& function = module.functions[worklist.back()];
+        worklist.pop_back();
+        for (const ir_block_t& block : function.blocks) {
+            for (const ir_insn_t& insn : block.insns) {
+                if (is_call(insn.op) && !reachable[insn.index]) {
+                    reachable[insn.index] = true;
+                    worklist.push_back(insn.index);
+                }
+            }
+        }
+    }
+
+    std::vector<uint32_t> renumbered(module.functions.size(), 0);
+    uint32_t next = 0;
+    for (uint32_t index = 0; index < module.functions.size(); ++index) {
+        if (reachable[index]) {
+            renumbered[index] = next;
+            if (next != index) {
+                module.functions[next] = std::move(module.functions[index]);
+            }
+            ++next;
+        }
+    }
+    const uint32_t removed = static_cast<uint32_t>(module.functions.size()) - next;
+    module.functions.resize(next);
+    if (module.entry != no_function) {
+        module.entry = renumbered[module.entry];
+    }
+
+    for (ir_function_t& function : module.functions) {
+        for (ir_block_t& block : function.blocks) {
+            for (ir_insn_t& insn : block.insns) {
+                if (is_call(insn.op)) {
+                    insn.index = renumbered[insn.index];
+                }
+            }
+        }
+    }
+    return removed;
+}
+
+} // namespace
+
+inline_stats_t inline_functions(ir_module_t& module, uint32_t threshold) {
+    inline_stats_t stats;
+
+    // Callees first, so a caller whose calls all got inlined can in turn be
+    // inlined into its own callers
+    for (uint32_t index : callees_first(module)) {
+        ir_function_t& caller = module.functions[index];
+
+        for (ir_block_id_t id = 0; id < caller.blocks.size(); ++id) {
+            for (size_t position = 0; position < caller.blocks[id].insns.size(); ++position) {
+                const ir_insn_t& insn = caller.blocks[id].insns[position];
+                if (insn.op != ir_op_e::call || insn.index == index) {
+                    continue;
+                }
+
+                const ir_function_t& callee = module.functions[insn.index];
+                const size_t size = count_instructions(callee);
+                if (callee.is_external() || size > threshold || insn.count != callee.param_count
+                    || !is_leaf(callee)) {
+                    continue;
+                }
+
+                info_msg("Inlined call to '{}' ({} instructions) into '{}'", callee.name, size, caller.name);
+                inline_call(caller, id, position, callee);
+                ++stats.inlined;
+                // The rest of this block moved to a new block, which gets
+                // visited later
+                break;
+            }
+        }
+    }
+
+    stats.removed_functions = remove_uncalled_functions(module);
+    return stats;
+}
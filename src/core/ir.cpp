@@ -0,0 +1,440 @@
+#include <string>
+
+#include "core/ir.hpp"
+#include "utils/error.hpp"
+
+ir_cond_e invert_cond(ir_cond_e cond) {
+    switch (cond) {
+        case ir_cond_e::eq: return ir_cond_e::ne;
+        case ir_cond_e::ne: return ir_cond_e::eq;
+        case ir_cond_e::lt: return ir_cond_e::ge;
+        case ir_cond_e::ge: return ir_cond_e::lt;
+        case ir_cond_e::le: return ir_cond_e::gt;
+        case ir_cond_e::gt: return ir_cond_e::le;
+    }
+    return cond;
+}
+
+bool is_terminator(ir_op_e op) {
+    return op >= ir_op_e::jump;
+}
+
+bool is_call(ir_op_e op) {
+    return op == ir_op_e::call || op == ir_op_e::tail_call;
+}
+
+bool has_dst(ir_op_e op) {
+    switch (op) {
+        case ir_op_e::copy:
+        case ir_op_e::add:
+        case ir_op_e::sub:
+        case ir_op_e::mul:
+        case ir_op_e::div:
+        case ir_op_e::cmp:
+        case ir_op_e::load:
+        case ir_op_e::call:
+            return true;
+        default:
+            return false;
+    }
+}
+
+std::span<const ir_block_id_t> successors(const ir_insn_t& terminator) {
+    switch (terminator.op) {
+        case ir_op_e::jump:
+            return {terminator.target, 1};
+        case ir_op_e::branch:
+            return {terminator.target, 2};
+        default:
+            return {};
+    }
+}
+
+std::vector<std::vector<ir_block_id_t>> predecessors(const ir_function_t& function) {
+    std::vector<std::vector<ir_block_id_t>> result(function.blocks.size());
+    for (ir_block_id_t id = 0; id < function.blocks.size(); ++id) {
+        for (ir_block_id_t successor : successors(function.blocks[id].terminator())) {
+            result[successor].push_back(id);
+        }
+    }
+    return result;
+}
+
+void remove_unreachable_blocks(ir_function_t& function) {
+    std::vector<ir_block_id_t> renumbered(function.blocks.size(), no_block);
+    std::vector<ir_block_id_t> worklist = {0};
+    renumbered[0] = 0;
+    while (!worklist.empty()) {
+        ir_block_id_t id = worklist.back();
+        worklist.pop_back();
+        for (ir_block_id_t successor : successors(function.blocks[id].terminator())) {
+            if (renumbered[successor] == no_block) {
+                renumbered[successor] = 0;
+                worklist.push_back(successor);
+            }
+        }
+    }
+
+    // Keep the surviving blocks in their original order
+    ir_block_id_t next = 0;
+    for (ir_block_id_t id = 0; id < function.blocks.size(); ++id) {
+        if (renumbered[id] != no_block) {
+            renumbered[id] = next;
+            if (next != id) {
+                function.blocks[next] = std::move(function.blocks[id]);
+            }
+            ++next;
+        }
+    }
+    function.blocks.resize(next);
+
+    for (ir_block_t& block : function.blocks) {
+        ir_insn_t& terminator = block.insns.back();
+        if (terminator.op == ir_op_e::jump || terminator.op == ir_op_e::branch) {
+            terminator.target[0] = renumbered[terminator.target[0]];
+        }
+        if (terminator.op == ir_op_e::branch) {
+            terminator.target[1] = renumbered[terminator.target[1]];
+        }
+    }
+}
+
+void merge_blocks(ir_function_t& function) {
+    std::vector<uint32_t> predecessor_count(function.blocks.size(), 0);
+    for (const ir_block_t& block : function.blocks) {
+        for (ir_block_id_t successor : successors(block.terminator())) {
+            ++predecessor_count[successor];
+        }
+    }
+
+    bool merged = false;
+    for (ir_block_id_t id = 0; id < function.blocks.size(); ++id) {
+        std::vector<ir_insn_t>& insns = function.blocks[id].insns;
+        while (!insns.empty() && insns.back().op == ir_op_e::jump) {
+            const ir_block_id_t target = insns.back().target[0];
+            if (target == id || target == 0 || predecessor_count[target] != 1) {
+                break;
+            }
+            // The target keeps no instructions and nothing jumps to it any more
+            insns.pop_back();
+            std::vector<ir_insn_t>& absorbed = function.blocks[target].insns;
+            insns.insert(insns.end(), absorbed.begin(), absorbed.end());
+            absorbed.clear();
+            predecessor_count[target] = 0;
+            merged = true;
+        }
+    }
+    if (merged) {
+        remove_unreachable_blocks(function);
+    }
+}
+
+size_t count_instructions(const ir_function_t& function) {
+    size_t count = 0;
+    for (const ir_block_t& block : function.blocks) {
+        count += block.insns.size();
+    }
+    return count;
+}
+
+size_t count_instructions(const ir_module_t& module) {
+    size_t count = 0;
+    for (const ir_function_t& function : module.functions) {
+        count += count_instructions(function);
+    }
+    return count;
+}
+
+std::string_view ir_op_name(ir_op_e op) {
+    switch (op) {
+        case ir_op_e::copy: return "copy";
+        case ir_op_e::add: return "add";
+        case ir_op_e::sub: return "sub";
+        case ir_op_e::mul: return "mul";
+        case ir_op_e::div: return "div";
+        case ir_op_e::cmp: return "cmp";
+        case ir_op_e::load: return "load";
+        case ir_op_e::store: return "store";
+        case ir_op_e::call: return "call";
+        case ir_op_e::jump: return "jump";
+        case ir_op_e::branch: return "branch";
+        case ir_op_e::ret: return "ret";
+        case ir_op_e::exit: return "exit";
+        case ir_op_e::tail_call: return "tail_call";
+    }
+    return "<unknown>";
+}
+
+std::string_view ir_cond_name(ir_cond_e cond) {
+    switch (cond) {
+        case ir_cond_e::eq: return "eq";
+        case ir_cond_e::ne: return "ne";
+        case ir_cond_e::lt: return "lt";
+        case ir_cond_e::ge: return "ge";
+        case ir_cond_e::le: return "le";
+        case ir_cond_e::gt: return "gt";
+    }
+    return "<unknown>";
+}
+
+// Named values print as %name, temporaries as %number
+static void append_value(std::string& text, const ir_function_t& function, ir_value_t value) {
+    if (value < function.variables.size()) {
+        std::format_to(std::back_inserter(text), "%{}", function.variables[value]);
+    } else {
+        std::format_to(std::back_inserter(text), "%{}", value);
+    }
+}
+
+static void append_operand(std::string& text, const ir_function_t& function, const ir_operand_t& operand) {
+    switch (operand.kind) {
+        case ir_operand_kind_e::none:
+            text += "<none>";
+            break;
+        case ir_operand_kind_e::value:
+            append_value(text, function, static_cast<ir_value_t>(operand.value));
+            break;
+        case ir_operand_kind_e::imm:
+            std::format_to(std::back_inserter(text), "{}", operand.value);
+            break;
+    }
+}
+
+static void print_insn(const ir_module_t& module, const ir_function_t& function, const ir_insn_t& insn, std::string& text) {
+    text = "    ";
+    if (has_dst(insn.op)) {
+        append_value(text, function, insn.dst);
+        text += " = ";
+    }
+    text += ir_op_name(insn.op);
+
+    switch (insn.op) {
+        case ir_op_e::copy:
+        case ir_op_e::exit:
+            text += ' ';
+            append_operand(text, function, insn.a);
+            break;
+        case ir_op_e::ret:
+            if (insn.a.kind != ir_operand_kind_e::none) {
+                text += ' ';
+                append_operand(text, function, insn.a);
+            }
+            break;
+        case ir_op_e::add:
+        case ir_op_e::sub:
+        case ir_op_e::mul:
+        case ir_op_e::div:
+            text += ' ';
+            append_operand(text, function, insn.a);
+            text += ", ";
+            append_operand(text, function, insn.b);
+            break;
+        case ir_op_e::cmp:
+        case ir_op_e::branch:
+            std::format_to(std::back_inserter(text), " {} ", ir_cond_name(insn.cond));
+            append_operand(text, function, insn.a);
+            text += ", ";
+            append_operand(text, function, insn.b);
+            if (insn.op == ir_op_e::branch) {
+                std::format_to(std::back_inserter(text), " -> bb{}, bb{}", insn.target[0], insn.target[1]);
+            }
+            break;
+        case ir_op_e::load:
+            std::format_to(std::back_inserter(text), " @{}", module.globals[insn.index]);
+            break;
+        case ir_op_e::store:
+            std::format_to(std::back_inserter(text), " @{}, ", module.globals[insn.index]);
+            append_operand(text, function, insn.a);
+            break;
+        case ir_op_e::call:
+        case ir_op_e::tail_call: {
+            std::format_to(std::back_inserter(text), " {}(", module.functions[insn.index].name);
+            bool first = true;
+            for (const ir_operand_t& argument : function.call_arguments(insn)) {
+                if (!first) {
+                    text += ", ";
+                }
+                append_operand(text, function, argument);
+                first = false;
+            }
+            text += ')';
+            break;
+        }
+        case ir_op_e::jump:
+            std::format_to(std::back_inserter(text), " bb{}", insn.target[0]);
+            break;
+    }
+}
+
+void print_ir(const ir_module_t& module, asm_emitter_t& out) {
+    for (const std::string& global : module.globals) {
+        out.format_line("global @{}", global);
+    }
+
+    std::string text;
+    for (uint32_t index = 0; index < module.functions.size(); ++index) {
+        const ir_function_t& function = module.functions[index];
+        out.blank_line();
+
+        text = index == module.entry ? "entry" : (function.is_external() ? "extern " : "function ") + function.name;
+        text += '(';
+        for (uint32_t i = 0; i < function.param_count; ++i) {
+            if (i != 0) {
+                text += ", ";
+            }
+            append_value(text, function, i);
+        }
+        text += "):";
+        out.line(text);
+
+        for (ir_block_id_t id = 0; id < function.blocks.size(); ++id) {
+            const ir_block_t& block = function.blocks[id];
+            out.format_line("bb{}: ; {}", id, block.name);
+            for (const ir_insn_t& insn : block.insns) {
+                print_insn(module, function, insn, text);
+                out.line(text);
+            }
+        }
+    }
+}
+
+namespace {
+
+struct verifier_t
+{
+    const ir_module_t& module;
+    const ir_function_t* function = nullptr;
+    ir_block_id_t block = 0;
+    bool ok = true;
+
+    template <typename... Args>
+    void fail(std::format_string<Args...> fmt, Args&&... args) {
+        error_msg("IR verifier: function '{}', bb{}: {}", function->name, block,
+                  std::format(fmt, std::forward<Args>(args)...));
+        ok = false;
+    }
+
+    void check_operand(const ir_insn_t& insn, const ir_operand_t& operand, bool required) {
+        if (operand.kind == ir_operand_kind_e::none) {
+            if (required) {
+                fail("{} is missing an operand", ir_op_name(insn.op));
+            }
+        } else if (operand.is_value() && (operand.value < 0 || operand.value >= function->value_count)) {
+            fail("{} uses undefined value %{}", ir_op_name(insn.op), operand.value);
+        }
+    }
+
+    void check_target(ir_block_id_t target) {
+        if (target >= function->blocks.size()) {
+            fail("jump to missing block {}", target);
+        }
+    }
+
+    void check_insn(const ir_insn_t& insn, uint32_t function_index) {
+        if (has_dst(insn.op) && insn.dst >= function->value_count) {
+            fail("{} writes undefined value %{}", ir_op_name(insn.op), insn.dst);
+        }
+
+        switch (insn.op) {
+            case ir_op_e::copy:
+            case ir_op_e::exit:
+                check_operand(insn, insn.a, true);
+                break;
+            case ir_op_e::add:
+            case ir_op_e::sub:
+            case ir_op_e::mul:
+            case ir_op_e::div:
+            case ir_op_e::cmp:
+                check_operand(insn, insn.a, true);
+                check_operand(insn, insn.b, true);
+                break;
+            case ir_op_e::load:
+            case ir_op_e::store:
+                if (insn.index >= module.globals.size()) {
+                    fail("{} of missing global {}", ir_op_name(insn.op), insn.index);
+                }
+                if (insn.op == ir_op_e::store) {
+                    check_operand(insn, insn.a, true);
+                }
+                break;
+            case ir_op_e::call:
+            case ir_op_e::tail_call:
+                if (insn.op == ir_op_e::tail_call && function_index == module.entry) {
+                    fail("tail_call in the entry function");
+                }
+                if (insn.index >= module.functions.size() || insn.index == module.entry) {
+                    fail("call to missing function {}", insn.index);
+                }
+                if (size_t{insn.first} + insn.count > function->arguments.size()) {
+                    fail("call arguments out of range");
+                    break;
+                }
+                for (const ir_operand_t& argument : function->call_arguments(insn)) {
+                    check_operand(insn, argument, true);
+                }
+                break;
+            case ir_op_e::jump:
+                check_target(insn.target[0]);
+                break;
+            case ir_op_e::branch:
+                check_operand(insn, insn.a, true);
+                check_operand(insn, insn.b, true);
+                check_target(insn.target[0]);
+                check_target(insn.target[1]);
+                break;
+            case ir_op_e::ret:
+                if (function_index == module.entry) {
+                    fail("ret in the entry function");
+                }
+                check_operand(insn, insn.a, false);
+                break;
+        }
+    }
+};
+
+} // namespace
+
+bool verify_ir(const ir_module_t& module) {
+    verifier_t verifier{module};
+    if (module.entry != no_function && module.entry >= module.functions.size()) {
+        error_msg("IR verifier: module has no entry function");
+        return false;
+    }
+
+    for (uint32_t index = 0; index < module.functions.size(); ++index) {
+        const ir_function_t& function = module.functions[index];
+        verifier.function = &function;
+        verifier.block = 0;
+
+        if (function.is_external()) {
+            if (!function.blocks.empty() || index == module.entry) {
+                verifier.fail("external function with a body");
+            }
+            continue;
+        }
+        if (function.blocks.empty()) {
+            verifier.fail("function has no blocks");
+            continue;
+        }
+        if (function.param_count > function.variables.size() || function.variables.size() > function.value_count) {
+            verifier.fail("more parameters or variables than values");
+        }
+
+        for (ir_block_id_t id = 0; id < function.blocks.size(); ++id) {
+            const ir_block_t& block = function.blocks[id];
+            verifier.block = id;
+            if (block.insns.empty()) {
+                verifier.fail("empty block");
+                continue;
+            }
+            for (size_t i = 0; i < block.insns.size(); ++i) {
+                const ir_insn_t& insn = block.insns[i];
+                if (is_terminator(insn.op) != (i + 1 == block.insns.size())) {
+                    verifier.fail("{} at position {}, blocks end in exactly one terminator", ir_op_name(insn.op), i);
+                }
+                verifier.check_insn(insn, index);
+            }
+        }
+    }
+    return verifier.ok;
+}
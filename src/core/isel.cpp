@@ -0,0 +1,532 @@
+#include <bit>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "core/isel.hpp"
+#include "core/regalloc.hpp"
+#include "utils/error.hpp"
+#include "utils/profiler.hpp"
+
+namespace {
+
+const x86_operand_t rax = x86_reg(x86_reg_e::rax);
+const x86_operand_t rdx = x86_reg(x86_reg_e::rdx);
+const x86_operand_t rdi = x86_reg(x86_reg_e::rdi);
+
+// Parameters are passed in registers: rdi, rsi, rdx, rcx, r8, r9
+const x86_operand_t argument_registers[] = {
+    x86_reg(x86_reg_e::rdi), x86_reg(x86_reg_e::rsi), x86_reg(x86_reg_e::rdx),
+    x86_reg(x86_reg_e::rcx), x86_reg(x86_reg_e::r8), x86_reg(x86_reg_e::r9),
+};
+
+static_assert(std::size(argument_registers) == max_call_arguments);
+
+x86_op_e jump_for(ir_cond_e cond) {
+    switch (cond) {
+        case ir_cond_e::eq: return x86_op_e::je;
+        case ir_cond_e::ne: return x86_op_e::jne;
+        case ir_cond_e::lt: return x86_op_e::jl;
+        case ir_cond_e::ge: return x86_op_e::jge;
+        case ir_cond_e::le: return x86_op_e::jle;
+        case ir_cond_e::gt: return x86_op_e::jg;
+    }
+    return x86_op_e::je;
+}
+
+x86_op_e set_for(ir_cond_e cond) {
+    switch (cond) {
+        case ir_cond_e::eq: return x86_op_e::sete;
+        case ir_cond_e::ne: return x86_op_e::setne;
+        case ir_cond_e::lt: return x86_op_e::setl;
+        case ir_cond_e::ge: return x86_op_e::setge;
+        case ir_cond_e::le: return x86_op_e::setle;
+        case ir_cond_e::gt: return x86_op_e::setg;
+    }
+    return x86_op_e::sete;
+}
+
+// Multiplier and shift with n / d == (high 64 bits of n * multiplier) >> shift,
+// corrected towards zero for negative n. Hacker's Delight 10-1, for d >= 2.
+struct magic_t
+{
+    int64_t multiplier;
+    int shift;
+};
+
+magic_t magic_for(uint64_t d) {
+    const uint64_t two63 = uint64_t{1} << 63;
+    const uint64_t anc = two63 - 1 - two63 % d; // Largest n with n % d == d - 1
+    int p = 63;
+    uint64_t q1 = two63 / anc;
+    uint64_t r1 = two63 - q1 * anc;
+    uint64_t q2 = two63 / d;
+    uint64_t r2 = two63 - q2 * d;
+    uint64_t delta = 0;
+    do {
+        ++p;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            ++q1;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= d) {
+            ++q2;
+            r2 -= d;
+        }
+        delta = d - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    return {static_cast<int64_t>(q2 + 1), p - 64};
+}
+
+// Whether a call's arguments or a function's parameters all have a register.
+// Codegen has already reported the ones that don't, this only keeps selection
+// from running off the register list.
+bool fits_in_registers(uint32_t count) {
+    return count <= std::size(argument_registers);
+}
+
+// Order the blocks are placed in: reverse postorder, so every block comes
+// after the blocks that enter it except along loop back edges. The depth
+// first search visits a branch's false target first, which puts the true
+// target, the if or while body, right after the branch where it falls
+// through. Blocks no path reaches are left out.
+std::vector<ir_block_id_t> block_layout(const ir_function_t& function) {
+    struct frame_t
+    {
+        ir_block_id_t block;
+        size_t next; // Successors visited so far
+    };
+
+    std::vector<ir_block_id_t> postorder;
+    std::vector<bool> visited(function.blocks.size(), false);
+    std::vector<frame_t> stack;
+    visited[0] = true;
+    stack.push_back({0, 0});
+    while (!stack.empty()) {
+        frame_t& frame = stack.back();
+        std::span<const ir_block_id_t> targets = successors(function.blocks[frame.block].terminator());
+        if (frame.next == targets.size()) {
+            postorder.push_back(frame.block);
+            stack.pop_back();
+            continue;
+        }
+        // Last to be visited, first to follow
+        const ir_block_id_t target = targets[targets.size() - 1 - frame.next++];
+        if (!visited[target]) {
+            visited[target] = true;
+            stack.push_back({target, 0});
+        }
+    }
+    return {postorder.rbegin(), postorder.rend()};
+}
+
+// Whether any block ends in ret. A function that only leaves through tail
+// calls gets no return label and no epilogue in front of a ret.
+bool returns(const ir_function_t& function) {
+    for (const ir_block_t& block : function.blocks) {
+        if (block.terminator().op == ir_op_e::ret) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// What selecting one function produces. The labels are handed out up front,
+// the code is appended to the program in function order afterwards.
+struct selected_function_t
+{
+    std::vector<x86_label_id_t> block_labels;
+    x86_label_id_t return_label = no_label;
+    x86_code_t code;
+    regalloc_stats_t stats;
+};
+
+// Selects one function into its own code. Everything shared with the other
+// functions is only read, so they can be selected on separate threads.
+struct isel_t
+{
+    const ir_module_t& module;
+    const std::vector<x86_label_t>& labels;
+    const std::vector<x86_label_id_t>& global_labels;
+    const std::vector<x86_label_id_t>& function_labels;
+    selected_function_t& selected;
+    x86_code_t& code;
+    const std::vector<x86_label_id_t>& block_labels;
+    const x86_label_id_t return_label;
+
+    const ir_function_t* function = nullptr;
+    x86_label_id_t next_label = no_label; // Placed right after the block being selected
+    uint32_t vreg_count = 0;
+
+    isel_t(const ir_module_t& module, const x86_program_t& program, const std::vector<x86_label_id_t>& global_labels,
+           const std::vector<x86_label_id_t>& function_labels, selected_function_t& selected)
+        : module(module), labels(program.labels), global_labels(global_labels), function_labels(function_labels),
+          selected(selected), code(selected.code), block_labels(selected.block_labels),
+          return_label(selected.return_label) {}
+
+    x86_operand_t new_vreg() { return x86_vreg(vreg_count++); }
+
+    // Counts as placed once the code is appended to the program
+    void place(x86_label_id_t label) { code.emit(x86_op_e::label, x86_label(label)); }
+
+    // Falling through is free, a jump to the next block is left out
+    void jump_to(x86_label_id_t label) {
+        if (label != next_label) {
+            code.emit(x86_op_e::jmp, x86_label(label));
+        }
+    }
+
+    x86_operand_t operand(const ir_operand_t& operand) const {
+        if (operand.is_imm()) {
+            return x86_imm(operand.value);
+        }
+        return x86_vreg(static_cast<uint32_t>(operand.value));
+    }
+
+    // x86 can't take an immediate everywhere IR can
+    x86_operand_t in_register(const ir_operand_t& value) {
+        if (value.is_value()) {
+            return operand(value);
+        }
+        x86_operand_t temporary = new_vreg();
+        code.emit(x86_op_e::mov, temporary, x86_imm(value.value));
+        return temporary;
+    }
+
+    void select_function(uint32_t index);
+    void select_insn(const ir_insn_t& insn);
+    void select_arithmetic(const ir_insn_t& insn);
+    bool select_multiply_by_constant(const x86_operand_t& dst, const x86_operand_t& lhs, int64_t factor);
+    bool select_divide_by_constant(const x86_operand_t& dst, const x86_operand_t& lhs, int64_t divisor);
+    void move_arguments(const ir_insn_t& insn);
+    void select_call(const ir_insn_t& insn);
+};
+
+void isel_t::select_function(uint32_t index) {
+    function = &module.functions[index];
+    const bool is_entry = index == module.entry;
+    vreg_count = function->value_count;
+
+    place(function_labels[index]);
+    const size_t body_begin = code.text.size();
+
+    // Move the parameters out of the argument registers into their own
+    std::vector<x86_copy_t> parameters;
+    for (uint32_t i = 0; i < function->param_count && fits_in_registers(i + 1); i++) {
+        parameters.push_back({x86_vreg(i), argument_registers[i]});
+    }
+    if (!parameters.empty()) {
+        code.emit_parallel_copy(parameters);
+    }
+
+    const std::vector<ir_block_id_t> layout = block_layout(*function);
+    for (size_t i = 0; i < layout.size(); ++i) {
+        next_label = i + 1 < layout.size() ? block_labels[layout[i + 1]] : return_label;
+        place(block_labels[layout[i]]);
+        for (const ir_insn_t& insn : function->blocks[layout[i]].insns) {
+            select_insn(insn);
+        }
+    }
+
+    // Every return jumps here, the allocator puts the epilogue in front of ret
+    if (return_label != no_label) {
+        place(return_label);
+        code.emit(x86_op_e::ret);
+    }
+
+    selected.stats = allocate_registers(code, labels, body_begin, vreg_count, !is_entry);
+}
+
+void isel_t::select_arithmetic(const ir_insn_t& insn) {
+    const x86_operand_t dst = x86_vreg(insn.dst);
+    x86_operand_t lhs = operand(insn.a);
+    x86_operand_t rhs = operand(insn.b);
+
+    if (insn.op == ir_op_e::div) {
+        if (insn.b.is_imm() && select_divide_by_constant(dst, in_register(insn.a), insn.b.value)) {
+            return;
+        }
+        // idiv takes its divisor from a register or memory, never an immediate.
+        // cqo sign extends the dividend into rdx.
+        x86_operand_t divisor = in_register(insn.b);
+        code.emit(x86_op_e::mov, rax, lhs);
+        code.emit(x86_op_e::cqo);
+        code.emit(x86_op_e::idiv, divisor);
+        code.emit(x86_op_e::mov, dst, rax);
+        return;
+    }
+    if (insn.op == ir_op_e::mul) {
+        if (insn.b.is_imm() && select_multiply_by_constant(dst, lhs, insn.b.value)) {
+            return;
+        }
+        if (insn.a.is_imm() && select_multiply_by_constant(dst, rhs, insn.a.value)) {
+            return;
+        }
+    }
+
+    x86_op_e op = insn.op == ir_op_e::add ? x86_op_e::add : insn.op == ir_op_e::sub ? x86_op_e::sub : x86_op_e::imul;
+    // Commutative, so avoid overwriting the right hand side when it is dst
+    if (op != x86_op_e::sub && rhs == dst) {
+        std::swap(lhs, rhs);
+    }
+    if (rhs == dst && lhs != dst) {
+        // x = y - x, work in a temporary
+        x86_operand_t temporary = new_vreg();
+        code.emit(x86_op_e::mov, temporary, lhs);
+        code.emit(op, temporary, rhs);
+        code.emit(x86_op_e::mov, dst, temporary);
+        return;
+    }
+    code.emit(x86_op_e::mov, dst, lhs);
+    code.emit(op, dst, rhs);
+}
+
+// imul costs 3 cycles, a shift 1. Factors m * 2^k with m = 3, 5 or 9 keep the
+// imul by m, which the peephole pass turns into lea once registers are known.
+bool isel_t::select_multiply_by_constant(const x86_operand_t& dst, const x86_operand_t& lhs, int64_t factor) {
+    if (factor == 0) {
+        code.emit(x86_op_e::mov, dst, x86_imm(0));
+        return true;
+    }
+    const uint64_t magnitude = factor < 0 ? 0 - static_cast<uint64_t>(factor) : static_cast<uint64_t>(factor);
+    const int shift = std::countr_zero(magnitude);
+    const uint64_t odd = magnitude >> shift;
+    if (odd != 1 && odd != 3 && odd != 5 && odd != 9) {
+        return false;
+    }
+
+    code.emit(x86_op_e::mov, dst, lhs);
+    if (odd != 1) {
+        code.emit(x86_op_e::imul, dst, x86_imm(static_cast<int64_t>(odd)));
+    }
+    if (shift != 0) {
+        code.emit(x86_op_e::shl, dst, x86_imm(shift));
+    }
+    if (factor < 0) {
+        code.emit(x86_op_e::neg, dst);
+    }
+    return true;
+}
+
+// idiv takes 40 to 90 cycles. Powers of two become shifts, other divisors a
+// multiply by the reciprocal. Division rounds towards zero, so a negative
+// dividend needs a correction either way. Returns false for the divisors
+// left to idiv, 0 which has to trap and INT64_MIN.
+bool isel_t::select_divide_by_constant(const x86_operand_t& dst, const x86_operand_t& lhs, int64_t divisor) {
+    if (divisor == 0 || divisor == INT64_MIN) {
+        return false;
+    }
+    if (divisor == 1 || divisor == -1) {
+        code.emit(x86_op_e::mov, dst, lhs);
+        if (divisor == -1) {
+            code.emit(x86_op_e::neg, dst);
+        }
+        return true;
+    }
+
+    const uint64_t magnitude = divisor < 0 ? 0 - static_cast<uint64_t>(divisor) : static_cast<uint64_t>(divisor);
+    if (std::has_single_bit(magnitude)) {
+        // Add 2^k - 1 to a negative dividend before shifting
+        const int shift = std::countr_zero(magnitude);
+        const x86_operand_t result = dst == lhs ? new_vreg() : dst;
+        code.emit(x86_op_e::mov, result, lhs);
+        code.emit(x86_op_e::sar, result, x86_imm(63));
+        code.emit(x86_op_e::shr, result, x86_imm(64 - shift));
+        code.emit(x86_op_e::add, result, lhs);
+        code.emit(x86_op_e::sar, result, x86_imm(shift));
+        if (result != dst) {
+            code.emit(x86_op_e::mov, dst, result);
+        }
+    } else {
+        // The high half of the product, plus one for a negative dividend
+        const magic_t magic = magic_for(magnitude);
+        code.emit(x86_op_e::mov, rax, x86_imm(magic.multiplier));
+        code.emit(x86_op_e::imul_wide, lhs);
+        if (magic.multiplier < 0) {
+            code.emit(x86_op_e::add, rdx, lhs);
+        }
+        if (magic.shift != 0) {
+            code.emit(x86_op_e::sar, rdx, x86_imm(magic.shift));
+        }
+        code.emit(x86_op_e::mov, dst, lhs);
+        code.emit(x86_op_e::shr, dst, x86_imm(63));
+        code.emit(x86_op_e::add, dst, rdx);
+    }
+    if (divisor < 0) {
+        code.emit(x86_op_e::neg, dst);
+    }
+    return true;
+}
+
+void isel_t::move_arguments(const ir_insn_t& insn) {
+    std::span<const ir_operand_t> arguments = function->call_arguments(insn);
+
+    // All arguments go into their registers at once, they may be sitting in
+    // each other's
+    std::vector<x86_copy_t> moves;
+    for (size_t i = 0; i < arguments.size(); i++) {
+        moves.push_back({argument_registers[i], operand(arguments[i])});
+    }
+    if (!moves.empty()) {
+        code.emit_parallel_copy(moves);
+    }
+}
+
+void isel_t::select_call(const ir_insn_t& insn) {
+    if (!fits_in_registers(insn.count)) {
+        return;
+    }
+
+    // The register allocator saves whatever is still needed afterwards
+    move_arguments(insn);
+
+    code.emit(x86_op_e::call, x86_label(function_labels[insn.index]));
+
+    // Function result is in rax
+    code.emit(x86_op_e::mov, x86_vreg(insn.dst), rax);
+}
+
+void isel_t::select_insn(const ir_insn_t& insn) {
+    switch (insn.op) {
+        case ir_op_e::copy:
+            code.emit(x86_op_e::mov, x86_vreg(insn.dst), operand(insn.a));
+            if (insn.dst < function->variables.size()) {
+                code.annotate("{}", function->variables[insn.dst]);
+            }
+            break;
+        case ir_op_e::add:
+        case ir_op_e::sub:
+        case ir_op_e::mul:
+        case ir_op_e::div:
+            select_arithmetic(insn);
+            break;
+        case ir_op_e::cmp: {
+            // setcc only writes the low byte, movzx clears the rest
+            const x86_operand_t dst = x86_vreg(insn.dst);
+            code.emit(x86_op_e::cmp, in_register(insn.a), operand(insn.b));
+            code.emit(set_for(insn.cond), dst);
+            code.emit(x86_op_e::movzx, dst, dst);
+            break;
+        }
+        case ir_op_e::load:
+            code.emit(x86_op_e::mov, x86_vreg(insn.dst), x86_mem(global_labels[insn.index]));
+            break;
+        case ir_op_e::store:
+            code.emit(x86_op_e::mov, x86_mem(global_labels[insn.index]), operand(insn.a));
+            code.annotate("{}", module.globals[insn.index]);
+            break;
+        case ir_op_e::call:
+            select_call(insn);
+            break;
+        case ir_op_e::jump:
+            jump_to(block_labels[insn.target[0]]);
+            break;
+        case ir_op_e::branch: {
+            // cmp can't take an immediate on the left
+            code.emit(x86_op_e::cmp, in_register(insn.a), operand(insn.b));
+            const x86_label_id_t label_true = block_labels[insn.target[0]];
+            const x86_label_id_t label_false = block_labels[insn.target[1]];
+            if (label_true == next_label) {
+                // The usual if and while body, jump away when the condition fails
+                code.emit(jump_for(invert_cond(insn.cond)), x86_label(label_false));
+            } else {
+                code.emit(jump_for(insn.cond), x86_label(label_true));
+                jump_to(label_false);
+            }
+            break;
+        }
+        case ir_op_e::ret:
+            if (insn.a.kind != ir_operand_kind_e::none) {
+                // Return value goes in rax
+                code.emit(x86_op_e::mov, rax, operand(insn.a));
+            }
+            jump_to(return_label);
+            break;
+        case ir_op_e::exit:
+            code.emit(x86_op_e::mov, rdi, operand(insn.a));
+            code.emit(x86_op_e::mov, rax, x86_imm(60));
+            code.annotate("exit syscall");
+            code.emit(x86_op_e::syscall);
+            break;
+        case ir_op_e::tail_call:
+            // Nothing of this frame is needed afterwards, the register
+            // allocator tears it down in front of the jump and the callee
+            // returns straight to our caller
+            if (fits_in_registers(insn.count)) {
+                move_arguments(insn);
+                code.emit(x86_op_e::jmp, x86_label(function_labels[insn.index]));
+                code.annotate("tail call");
+            }
+            break;
+    }
+}
+
+} // namespace
+
+void select_instructions(const ir_module_t& module, x86_program_t& program, thread_pool_t* pool) {
+    std::vector<x86_label_id_t> global_labels;
+    for (const std::string& global : module.globals) {
+        global_labels.push_back(program.add_data("var_" + global));
+    }
+    std::vector<x86_label_id_t> function_labels;
+    for (uint32_t index = 0; index < module.functions.size(); ++index) {
+        const ir_function_t& function = module.functions[index];
+        function_labels.push_back(program.label(index == module.entry ? function.name : "func_" + function.name));
+        // Known up front, a tail call jumps to functions not selected yet
+        x86_label_t& label = program.labels[function_labels.back()];
+        label.is_function = true;
+        label.is_public = index == module.entry || function.linkage == ir_linkage_e::exported;
+    }
+    if (module.entry != no_function) {
+        program.entry = function_labels[module.entry];
+    }
+
+    // Block labels are numbered across the program. Numbering them all here
+    // keeps the names the same however many threads there are, and selecting
+    // never has to touch the label table.
+    std::vector<selected_function_t> selected(module.functions.size());
+    uint32_t label_count = 0;
+    auto generate_label = [&](const std::string& base_name) {
+        return program.label(base_name + "_" + std::to_string(label_count++));
+    };
+    for (uint32_t index = 0; index < module.functions.size(); ++index) {
+        for (const ir_block_t& block : module.functions[index].blocks) {
+            selected[index].block_labels.push_back(generate_label(block.name));
+        }
+        if (index != module.entry && returns(module.functions[index])) {
+            selected[index].return_label = generate_label("return");
+        }
+    }
+
+    auto select = [&](size_t index) {
+        // Defined in another file, its label is left for the linker
+        if (module.functions[index].is_external()) {
+            return;
+        }
+        profile_scope_t scope("select function", module.functions[index].name);
+        isel_t isel(module, program, global_labels, function_labels, selected[index]);
+        isel.select_function(static_cast<uint32_t>(index));
+    };
+    if (pool) {
+        pool->for_each(module.functions.size(), select);
+    } else {
+        for (size_t index = 0; index < module.functions.size(); ++index) {
+            select(index);
+        }
+    }
+
+    for (uint32_t index = 0; index < module.functions.size(); ++index) {
+        if (module.functions[index].is_external()) {
+            continue;
+        }
+        const regalloc_stats_t& stats = selected[index].stats;
+        debug_msg("Allocated {} values in function '{}', {} spilled, {} registers saved around calls",
+                 stats.intervals, module.functions[index].name, stats.spilled, stats.call_saves);
+        program.append(std::move(selected[index].code));
+    }
+}
@@ -0,0 +1,560 @@
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "core/passes.hpp"
+#include "utils/error.hpp"
+
+namespace {
+
+// Headers with more instructions than this aren't copied to the latches
+constexpr size_t rotate_limit = 8;
+
+// Dominator tree (Cooper, Harvey and Kennedy) over the blocks reachable from
+// the entry
+struct dominators_t
+{
+    std::vector<ir_block_id_t> idom;    // no_block for the entry and unreachable blocks
+    std::vector<uint32_t> order;        // Reverse postorder number, unreachable blocks last
+    std::vector<uint32_t> enter;        // Preorder number in the dominator tree
+    std::vector<uint32_t> leave;        // Largest preorder number below the block
+
+    dominators_t(const ir_function_t& function, const std::vector<std::vector<ir_block_id_t>>& preds);
+
+    // b's number falls in the range of the blocks below a, in constant time
+    bool dominates(ir_block_id_t a, ir_block_id_t b) const {
+        return enter[a] <= enter[b] && enter[b] <= leave[a];
+    }
+};
+
+dominators_t::dominators_t(const ir_function_t& function, const std::vector<std::vector<ir_block_id_t>>& preds) {
+    const size_t block_count = function.blocks.size();
+    idom.assign(block_count, no_block);
+    order.assign(block_count, UINT32_MAX);
+
+    // Postorder with an explicit stack of (block, next successor)
+    std::vector<ir_block_id_t> postorder;
+    std::vector<bool> visited(block_count, false);
+    std::vector<std::pair<ir_block_id_t, size_t>> stack = {{0, 0}};
+    visited[0] = true;
+    while (!stack.empty()) {
+        auto& [block, next] = stack.back();
+        std::span<const ir_block_id_t> targets = successors(function.blocks[block].terminator());
+        if (next == targets.size()) {
+            postorder.push_back(block);
+            stack.pop_back();
+            continue;
+        }
+        const ir_block_id_t successor = targets[next++];
+        if (!visited[successor]) {
+            visited[successor] = true;
+            stack.push_back({successor, 0});
+        }
+    }
+
+    std::vector<ir_block_id_t> reverse_postorder(postorder.rbegin(), postorder.rend());
+    for (uint32_t i = 0; i < reverse_postorder.size(); ++i) {
+        order[reverse_postorder[i]] = i;
+    }
+
+    auto intersect = [&](ir_block_id_t a, ir_block_id_t b) {
+        while (a != b) {
+            while (order[a] > order[b]) {
+                a = idom[a];
+            }
+            while (order[b] > order[a]) {
+                b = idom[b];
+            }
+        }
+        return a;
+    };
+
+    // The entry is its own dominator while this runs
+    idom[0] = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 1; i < reverse_postorder.size(); ++i) {
+            const ir_block_id_t block = reverse_postorder[i];
+            ir_block_id_t candidate = no_block;
+            for (ir_block_id_t pred : preds[block]) {
+                if (idom[pred] == no_block) {
+                    continue;
+                }
+                candidate = candidate == no_block ? pred : intersect(pred, candidate);
+            }
+            if (candidate != idom[block]) {
+                idom[block] = candidate;
+                changed = true;
+            }
+        }
+    }
+    idom[0] = no_block;
+
+    std::vector<std::vector<ir_block_id_t>> children(block_count);
+    for (ir_block_id_t block : reverse_postorder) {
+        if (idom[block] != no_block) {
+            children[idom[block]].push_back(block);
+        }
+    }
+    // Unreachable blocks get no range and dominate nothing
+    enter.assign(block_count, UINT32_MAX);
+    leave.assign(block_count, 0);
+    uint32_t counter = 0;
+    enter[0] = counter++;
+    stack = {{0, 0}};
+    while (!stack.empty()) {
+        auto& [block, next] = stack.back();
+        if (next == children[block].size()) {
+            leave[block] = counter - 1;
+            stack.pop_back();
+            continue;
+        }
+        const ir_block_id_t child = children[block][next++];
+        enter[child] = counter++;
+        stack.push_back({child, 0});
+    }
+}
+
+constexpr uint32_t no_loop = UINT32_MAX;
+
+// A natural loop: the header and every block that reaches one of the
+// latches (blocks jumping back to the header) without passing it
+struct loop_t
+{
+    ir_block_id_t header = no_block;
+    std::vector<ir_block_id_t> latches;
+    std::vector<ir_block_id_t> blocks;  // Sorted, the header among them
+    uint32_t parent = no_loop;          // Innermost loop around this one
+
+    bool contains(ir_block_id_t block) const { return std::binary_search(blocks.begin(), blocks.end(), block); }
+};
+
+// The loops of a function, inner loops first, and the predecessors of its
+// blocks. Adding a preheader keeps both up to date, so the loops are only
+// found once.
+struct loop_nest_t
+{
+    std::vector<loop_t> loops;
+    std::vector<std::vector<ir_block_id_t>> preds;
+};
+
+loop_nest_t find_loops(const ir_function_t& function) {
+    const size_t block_count = function.blocks.size();
+    loop_nest_t nest;
+    nest.preds = predecessors(function);
+    const dominators_t dominators(function, nest.preds);
+    std::vector<loop_t>& loops = nest.loops;
+
+    // Back edges, gathered per header
+    std::vector<uint32_t> loop_at(block_count, no_loop);
+    for (ir_block_id_t block = 0; block < block_count; ++block) {
+        if (dominators.order[block] == UINT32_MAX) {
+            continue;
+        }
+        for (ir_block_id_t successor : successors(function.blocks[block].terminator())) {
+            if (!dominators.dominates(successor, block)) {
+                continue;
+            }
+            if (loop_at[successor] == no_loop) {
+                loop_at[successor] = static_cast<uint32_t>(loops.size());
+                loops.emplace_back().header = successor;
+            }
+            loops[loop_at[successor]].latches.push_back(block);
+        }
+    }
+
+    // A block is marked with the loop being collected, so the marks never
+    // need clearing between loops
+    std::vector<uint32_t> mark(block_count, no_loop);
+    for (uint32_t index = 0; index < loops.size(); ++index) {
+        loop_t& loop = loops[index];
+        mark[loop.header] = index;
+        loop.blocks.push_back(loop.header);
+        std::vector<ir_block_id_t> worklist = loop.latches;
+        while (!worklist.empty()) {
+            const ir_block_id_t member = worklist.back();
+            worklist.pop_back();
+            if (mark[member] == index) {
+                continue;
+            }
+            mark[member] = index;
+            loop.blocks.push_back(member);
+            for (ir_block_id_t pred : nest.preds[member]) {
+                worklist.push_back(pred);
+            }
+        }
+        std::sort(loop.blocks.begin(), loop.blocks.end());
+    }
+
+    // Inner loops first, whatever they hoist can move out of the outer loop
+    // in turn
+    std::sort(loops.begin(), loops.end(), [](const loop_t& lhs, const loop_t& rhs) {
+        return lhs.blocks.size() < rhs.blocks.size();
+    });
+
+    // Marking outer loops first leaves each header marked with the innermost
+    // loop around it until its own loop is marked
+    std::fill(mark.begin(), mark.end(), no_loop);
+    for (uint32_t index = static_cast<uint32_t>(loops.size()); index-- > 0;) {
+        loops[index].parent = mark[loops[index].header];
+        for (ir_block_id_t block : loops[index].blocks) {
+            mark[block] = index;
+        }
+    }
+    return nest;
+}
+
+// Copies the header's condition to the end of every latch, so the loop
+// branches once per iteration at the bottom and the header only runs once
+// as the guard in front of it
+bool rotate(ir_function_t& function, const loop_t& loop) {
+    const ir_block_t& header = function.blocks[loop.header];
+    const ir_insn_t& branch = header.terminator();
+    if (branch.op != ir_op_e::branch || header.insns.size() > rotate_limit
+        || loop.contains(branch.target[0]) == loop.contains(branch.target[1])) {
+        return false;
+    }
+    for (ir_block_id_t latch : loop.latches) {
+        if (function.blocks[latch].terminator().op != ir_op_e::jump || latch == loop.header) {
+            return false;
+        }
+    }
+
+    const std::vector<ir_insn_t> condition = header.insns;
+    for (ir_block_id_t latch : loop.latches) {
+        std::vector<ir_insn_t>& insns = function.blocks[latch].insns;
+        insns.pop_back();
+        insns.insert(insns.end(), condition.begin(), condition.end());
+    }
+    return true;
+}
+
+// The block everything entering the loop from outside goes through, made
+// when there is no such block yet
+ir_block_id_t make_preheader(ir_function_t& function, loop_nest_t& nest, uint32_t index) {
+    const loop_t& loop = nest.loops[index];
+    std::vector<ir_block_id_t> inside;
+    std::vector<ir_block_id_t> outside;
+    for (ir_block_id_t pred : nest.preds[loop.header]) {
+        (loop.contains(pred) ? inside : outside).push_back(pred);
+    }
+    if (outside.size() == 1 && function.blocks[outside[0]].terminator().op == ir_op_e::jump) {
+        return outside[0];
+    }
+
+    const ir_block_id_t preheader = static_cast<ir_block_id_t>(function.blocks.size());
+    function.blocks.emplace_back().name = "preheader";
+    ir_insn_t enter(ir_op_e::jump);
+    enter.target[0] = loop.header;
+    function.blocks[preheader].insns.push_back(enter);
+
+    for (ir_block_id_t pred : outside) {
+        ir_insn_t& terminator = function.blocks[pred].insns.back();
+        for (ir_block_id_t& target : terminator.target) {
+            if (target == loop.header) {
+                target = preheader;
+            }
+        }
+    }
+
+    // The header's outside predecessors belong to every loop around this
+    // one, so the preheader does too. It has the highest number, their block
+    // lists stay sorted.
+    for (uint32_t outer = loop.parent; outer != no_loop; outer = nest.loops[outer].parent) {
+        nest.loops[outer].blocks.push_back(preheader);
+    }
+    inside.push_back(preheader);
+    nest.preds[loop.header] = std::move(inside);
+    nest.preds.push_back(std::move(outside));
+    return preheader;
+}
+
+void insert_before_terminator(ir_block_t& block, const ir_insn_t& insn) {
+    block.insns.insert(block.insns.end() - 1, insn);
+}
+
+// A basic induction variable i, which goes up by a constant step once per
+// definition
+struct induction_t
+{
+    ir_block_id_t block = no_block;
+    size_t position = 0;    // Of the definition of i
+    int64_t step = 0;
+};
+
+// Works through the loops of one function, inner loops first. The counts
+// over the whole function are taken once, the ones over a loop only walk its
+// blocks and are cleared again before the next loop.
+struct loop_optimiser_t
+{
+    ir_function_t& function;
+    loop_nest_t& nest;
+    std::vector<uint32_t> defs;         // Per value, in the whole function
+    std::vector<uint32_t> loop_defs;    // Per value, inside the loop
+    std::vector<induction_t> induction; // Per value, inside the loop
+    std::vector<bool> stored;           // Per global, written inside the loop
+    bool has_call = false;
+    uint32_t current = no_loop;
+    ir_block_id_t preheader = no_block;
+
+    loop_optimiser_t(ir_function_t& function, loop_nest_t& nest, size_t global_count);
+
+    const loop_t& loop() const { return nest.loops[current]; }
+
+    void begin_loop(uint32_t index);
+    void end_loop();
+
+    ir_value_t new_value() {
+        defs.push_back(0);
+        loop_defs.push_back(0);
+        induction.emplace_back();
+        return function.new_value();
+    }
+
+    ir_block_t& preheader_block() {
+        if (preheader == no_block) {
+            preheader = make_preheader(function, nest, current);
+        }
+        return function.blocks[preheader];
+    }
+
+    bool is_invariant(const ir_operand_t& operand) const {
+        return !operand.is_value() || loop_defs[operand.value] == 0;
+    }
+    bool can_hoist(const ir_insn_t& insn) const;
+
+    uint32_t hoist_invariants();
+    uint32_t reduce_multiplications();
+};
+
+loop_optimiser_t::loop_optimiser_t(ir_function_t& function, loop_nest_t& nest, size_t global_count)
+    : function(function), nest(nest), defs(function.value_count, 0), loop_defs(function.value_count, 0),
+      induction(function.value_count), stored(global_count, false) {
+    for (const ir_block_t& block : function.blocks) {
+        for (const ir_insn_t& insn : block.insns) {
+            if (has_dst(insn.op)) {
+                ++defs[insn.dst];
+            }
+        }
+    }
+}
+
+void loop_optimiser_t::begin_loop(uint32_t index) {
+    current = index;
+    preheader = no_block;
+    has_call = false;
+    for (ir_block_id_t id : loop().blocks) {
+        for (const ir_insn_t& insn : function.blocks[id].insns) {
+            if (has_dst(insn.op)) {
+                ++loop_defs[insn.dst];
+            }
+            has_call |= is_call(insn.op);
+            if (insn.op == ir_op_e::store) {
+                stored[insn.index] = true;
+            }
+        }
+    }
+}
+
+// Whatever was counted moved out of the loop or is still in its blocks
+void loop_optimiser_t::end_loop() {
+    for (ir_block_id_t id : loop().blocks) {
+        for (const ir_insn_t& insn : function.blocks[id].insns) {
+            if (has_dst(insn.op)) {
+                loop_defs[insn.dst] = 0;
+                induction[insn.dst] = {};
+            }
+            if (insn.op == ir_op_e::store) {
+                stored[insn.index] = false;
+            }
+        }
+    }
+}
+
+bool loop_optimiser_t::can_hoist(const ir_insn_t& insn) const {
+    switch (insn.op) {
+        case ir_op_e::copy:
+        case ir_op_e::add:
+        case ir_op_e::sub:
+        case ir_op_e::mul:
+        case ir_op_e::cmp:
+            break;
+        case ir_op_e::div:
+            // Running it when the loop wouldn't have must not trap
+            if (!insn.b.is_imm() || insn.b.value == 0) {
+                return false;
+            }
+            break;
+        case ir_op_e::load:
+            if (has_call || stored[insn.index]) {
+                return false;
+            }
+            break;
+        default:
+            return false;
+    }
+    // With one definition in the whole function every use after the
+    // preheader sees the value it saw before, or garbage before
+    return insn.dst >= function.param_count && defs[insn.dst] == 1 && is_invariant(insn.a) && is_invariant(insn.b);
+}
+
+uint32_t loop_optimiser_t::hoist_invariants() {
+    uint32_t hoisted = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (ir_block_id_t id : loop().blocks) {
+            for (size_t position = 0; position < function.blocks[id].insns.size();) {
+                const ir_insn_t insn = function.blocks[id].insns[position];
+                if (!can_hoist(insn)) {
+                    ++position;
+                    continue;
+                }
+                insert_before_terminator(preheader_block(), insn);
+                std::vector<ir_insn_t>& insns = function.blocks[id].insns;
+                insns.erase(insns.begin() + static_cast<std::ptrdiff_t>(position));
+                loop_defs[insn.dst] = 0;
+                ++hoisted;
+                changed = true;
+            }
+        }
+    }
+    return hoisted;
+}
+
+// i * k for a basic induction variable i becomes a value r kept equal to
+// i * k: r = i * k in the preheader and r += step * k right after every
+// change of i
+uint32_t loop_optimiser_t::reduce_multiplications() {
+    // Only named values and temporaries with a single definition in the loop
+    // of the form i = i + c, or t = i + c; i = copy t
+    for (ir_block_id_t id : loop().blocks) {
+        const std::vector<ir_insn_t>& insns = function.blocks[id].insns;
+        for (size_t position = 0; position < insns.size(); ++position) {
+            const ir_insn_t& insn = insns[position];
+            if (!has_dst(insn.op) || loop_defs[insn.dst] != 1) {
+                continue;
+            }
+            const ir_insn_t* step = &insn;
+            if (insn.op == ir_op_e::copy && position > 0 && insns[position - 1].dst == insn.a.value && insn.a.is_value()
+                && defs[insns[position - 1].dst] == 1) {
+                step = &insns[position - 1];
+            }
+            if ((step->op == ir_op_e::add || step->op == ir_op_e::sub) && step->a == ir_value(insn.dst) && step->b.is_imm()) {
+                const int64_t amount = step->op == ir_op_e::add ? step->b.value : -step->b.value;
+                induction[insn.dst] = {id, position, amount};
+            }
+        }
+    }
+
+    // One product per (i, k), however many multiplications use it
+    struct reduced_t
+    {
+        ir_value_t variable;
+        int64_t factor;
+        ir_value_t product = no_value;
+    };
+    std::vector<reduced_t> reduced;
+    std::vector<std::pair<ir_block_id_t, size_t>> uses; // Multiplications, with the entry of reduced at .second
+    std::vector<size_t> use_reduced;
+
+    for (ir_block_id_t id : loop().blocks) {
+        const std::vector<ir_insn_t>& insns = function.blocks[id].insns;
+        for (size_t position = 0; position < insns.size(); ++position) {
+            const ir_insn_t& insn = insns[position];
+            if (insn.op != ir_op_e::mul) {
+                continue;
+            }
+            ir_operand_t variable = insn.a;
+            ir_operand_t factor = insn.b;
+            if (variable.is_imm()) {
+                std::swap(variable, factor);
+            }
+            if (!variable.is_value() || !factor.is_imm() || induction[variable.value].block == no_block) {
+                continue;
+            }
+
+            auto existing = std::find_if(reduced.begin(), reduced.end(), [&](const reduced_t& r) {
+                return r.variable == variable.value && r.factor == factor.value;
+            });
+            use_reduced.push_back(static_cast<size_t>(existing - reduced.begin()));
+            if (existing == reduced.end()) {
+                reduced.push_back({static_cast<ir_value_t>(variable.value), factor.value});
+            }
+            uses.push_back({id, position});
+        }
+    }
+    if (reduced.empty()) {
+        return 0;
+    }
+
+    ir_block_t& entry = preheader_block();
+    for (reduced_t& r : reduced) {
+        // Defined here and by the update in the loop
+        r.product = new_value();
+        defs[r.product] = 2;
+        ir_insn_t start(ir_op_e::mul);
+        start.dst = r.product;
+        start.a = ir_value(r.variable);
+        start.b = ir_imm(r.factor);
+        insert_before_terminator(entry, start);
+    }
+
+    for (size_t i = 0; i < uses.size(); ++i) {
+        ir_insn_t& insn = function.blocks[uses[i].first].insns[uses[i].second];
+        ir_insn_t copy(ir_op_e::copy);
+        copy.dst = insn.dst;
+        copy.a = ir_value(reduced[use_reduced[i]].product);
+        insn = copy;
+    }
+
+    // Last position first, so the ones before stay where they were
+    std::sort(reduced.begin(), reduced.end(), [&](const reduced_t& lhs, const reduced_t& rhs) {
+        const induction_t& l = induction[lhs.variable];
+        const induction_t& r = induction[rhs.variable];
+        return l.block != r.block ? l.block < r.block : l.position > r.position;
+    });
+    for (const reduced_t& r : reduced) {
+        const induction_t& step = induction[r.variable];
+        ir_insn_t update(ir_op_e::add);
+        update.dst = r.product;
+        update.a = ir_value(r.product);
+        // Wraps the same way the multiplication would
+        update.b = ir_imm(static_cast<int64_t>(static_cast<uint64_t>(step.step) * static_cast<uint64_t>(r.factor)));
+        std::vector<ir_insn_t>& insns = function.blocks[step.block].insns;
+        insns.insert(insns.begin() + static_cast<std::ptrdiff_t>(step.position + 1), update);
+    }
+    return static_cast<uint32_t>(uses.size());
+}
+
+} // namespace
+
+loop_stats_t optimise_loops(ir_module_t& module) {
+    loop_stats_t stats;
+    for (ir_function_t& function : module.functions) {
+        if (function.is_external()) {
+            continue;
+        }
+        // Rotation first, it changes which block heads each loop
+        loop_nest_t nest = find_loops(function);
+        uint32_t rotated = 0;
+        for (const loop_t& loop : nest.loops) {
+            rotated += rotate(function, loop);
+        }
+        if (rotated != 0) {
+            nest = find_loops(function);
+        }
+        stats.rotated += rotated;
+
+        loop_optimiser_t optimiser(function, nest, module.globals.size());
+        for (uint32_t index = 0; index < nest.loops.size(); ++index) {
+            optimiser.begin_loop(index);
+            stats.hoisted += optimiser.hoist_invariants();
+            stats.reduced += optimiser.reduce_multiplications();
+            optimiser.end_loop();
+        }
+    }
+    return stats;
+}
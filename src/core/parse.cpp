@@ -1,3 +1,4 @@
+#include <charconv>
 #include <iostream>
 #include <string>
 
@@ -5,29 +6,69 @@
 #include "core/tokenise.hpp"
 #include "utils/error.hpp"
 
-const token_t* peek_token(const std::vector<token_t>& tokens, const size_t &index) {
-    if (index < tokens.size()) {
-        return &tokens[index];
-    }
-    return nullptr;
+const token_t* peek_token(lexer_t& lexer) {
+    return lexer.peek();
 }
 
-const token_t* peek_token_ahead(const std::vector<token_t>& tokens, const size_t &index, size_t ahead) {
-    if (index < tokens.size()) {
-        size_t new_index = index + ahead;
-        return &tokens[new_index];
-    }
-    return nullptr;
+const token_t* peek_token_ahead(lexer_t& lexer, size_t ahead) {
+    return lexer.peek(ahead);
 }
 
 // Consume the current token and move to the next one
-const token_t* consume_token(const std::vector<token_t>& tokens, size_t &index) {
-    if (index < tokens.size()) {
-        return &tokens[index++];
-    }
-    return nullptr;
+const token_t* consume_token(lexer_t& lexer) {
+    return lexer.consume();
+}
+
+node_id_t ast_t::add_node(const ast_node_t& node, uint32_t offset) {
+    nodes.push_back(node);
+    offsets.push_back(offset);
+    return static_cast<node_id_t>(nodes.size() - 1);
+}
+
+// Move everything pushed to scratch since scratch_mark into a list
+node_list_t ast_t::add_list(size_t scratch_mark) {
+    node_list_t range;
+    range.begin = static_cast<uint32_t>(lists.size());
+    range.count = static_cast<uint32_t>(scratch.size() - scratch_mark);
+    lists.insert(lists.end(), scratch.begin() + scratch_mark, scratch.end());
+    scratch.resize(scratch_mark);
+    return range;
+}
+
+namespace {
+
+ast_node_t make_node(token_type_e type) {
+    ast_node_t node;
+    node.type = type;
+    return node;
 }
 
+// Binary nodes are located at their operator
+node_id_t add_binary(ast_t& ast, token_type_e type, node_id_t lhs, node_id_t rhs, uint32_t offset) {
+    ast_node_t node = make_node(type);
+    node.binary.lhs = lhs;
+    node.binary.rhs = rhs;
+    return ast.add_node(node, offset);
+}
+
+node_id_t add_unary(ast_t& ast, token_type_e type, node_id_t value, uint32_t offset) {
+    ast_node_t node = make_node(type);
+    node.unary.value = value;
+    return ast.add_node(node, offset);
+}
+
+// Errors about a token point at it, or at the end of the file once the
+// stream has run out
+source_location_t location_of(const lexer_t& lexer, const token_t* token) {
+    return token ? token->location() : lexer.end_location();
+}
+
+uint32_t next_offset(lexer_t& lexer) {
+    return location_of(lexer, peek_token(lexer)).offset;
+}
+
+} // namespace
+
 bool is_math_operator(const token_t& token) {
     if (token.type == token_type_e::type_add ||
                           token.type == token_type_e::type_sub ||
@@ -76,518 +117,506 @@ std::string token_type_to_string(token_type_e type) {
     }
 }
 
-void parse_block(std::vector<token_t>& tokens, size_t& token_index, ast_node_t& root_node) {
-    std::vector<ast_node_t> block_statements;
+node_id_t parse_block(lexer_t& lexer, ast_t& ast) {
+    const size_t scratch_mark = ast.scratch.size();
+    const uint32_t offset = next_offset(lexer);
    
     while (true) {
-        const token_t* token = peek_token(tokens, token_index);
+        const token_t* token = peek_token(lexer);
         if (!token) {
-            error_msg("Unexpected end of file in block");
+            error_at(lexer.end_location(), "Unexpected end of file in block");
             break;
         }
        
         if (token->type == token_type_e::type_close_squigly) {
-            consume_token(tokens, token_index); // Consume '}'
+            consume_token(lexer); // Consume '}'
             break;
         }
        
         // Parse a statement and add it to the block
-        ast_node_t statement;
+        node_id_t statement = null_node;
         if (token->type == token_type_e::type_let) {
-            parse_let_statement(tokens, token_index, statement);
+            statement = parse_let_statement(lexer, ast);
         }
         else if (token->type == token_type_e::type_if) {
-            parse_if_statement(tokens, token_index, statement);
+            statement = parse_if_statement(lexer, ast);
         }
         else if (token->type == token_type_e::type_while) {
-            parse_while_statement(tokens, token_index, statement);
+            statement = parse_while_statement(lexer, ast);
         }
         else if (token->type == token_type_e::type_exit) {
-            parse_exit_statement(tokens, token_index, statement);
+            statement = parse_exit_statement(lexer, ast);
         }
         else if (token->type == token_type_e::type_return) {
-            parse_return_statement(tokens, token_index, statement);
+            statement = parse_return_statement(lexer, ast);
         }
         else if (token->type == token_type_e::type_identifier) {
             // Check if this is an assignment (identifier followed by =)
-            const token_t* next_token = peek_token_ahead(tokens, token_index, 1);
+            const token_t* next_token = peek_token_ahead(lexer, 1);
             
             if (next_token && next_token->type == token_type_e::type_assignment) {
                 // This is an assignment statement
-                parse_assignment_statement(tokens, token_index, statement);
+                statement = parse_assignment_statement(lexer, ast);
             }
             else {
                 // This is an expression starting with an identifier
-                parse_expression(tokens, token_index, statement);
+                statement = parse_expression(lexer, ast);
             }
             
             // Look for semicolon
-            token = peek_token(tokens, token_index);
+            token = peek_token(lexer);
             if (token && token->type == token_type_e::type_semi) {
-                consume_token(tokens, token_index);
+                consume_token(lexer);
             } else {
-                error_msg("Expected ';' after statement, but found: {}", 
+                error_at(location_of(lexer, token), "Expected ';' after statement, but found: {}", 
                         token ? token_type_to_string(token->type) : "EOF");
                 // Try to recover by skipping to next semicolon or closing brace
                 while (token && token->type != token_type_e::type_semi &&
                       token->type != token_type_e::type_close_squigly) {
-                    consume_token(tokens, token_index);
-                    token = peek_token(tokens, token_index);
+                    consume_token(lexer);
+                    token = peek_token(lexer);
                 }
                 if (token && token->type == token_type_e::type_semi) {
-                    consume_token(tokens, token_index);
+                    consume_token(lexer);
                 }
                 continue;
             }
         }
         else if (token->type == token_type_e::type_int_lit ||
                 token->type == token_type_e::type_open_paren) {
-            parse_expression(tokens, token_index, statement);
+            statement = parse_expression(lexer, ast);
            
             // Look for semicolon
-            token = peek_token(tokens, token_index);
+            token = peek_token(lexer);
             if (token && token->type == token_type_e::type_semi) {
-                consume_token(tokens, token_index);
+                consume_token(lexer);
             } else {
-                error_msg("Expected ';' after expression in block, but found: {}", 
+                error_at(location_of(lexer, token), "Expected ';' after expression in block, but found: {}", 
                         token ? token_type_to_string(token->type) : "EOF");
                 // Try to recover by skipping to next semicolon or closing brace
                 while (token && token->type != token_type_e::type_semi &&
                       token->type != token_type_e::type_close_squigly) {
-                    consume_token(tokens, token_index);
-                    token = peek_token(tokens, token_index);
+                    consume_token(lexer);
+                    token = peek_token(lexer);
                 }
                 if (token && token->type == token_type_e::type_semi) {
-                    consume_token(tokens, token_index);
+                    consume_token(lexer);
                 }
                 continue;
             }
         }
         else {
-            error_msg("Unexpected token in block: {}", token_type_to_string(token->type));
+            error_at(location_of(lexer, token), "Unexpected token in block: {}", token_type_to_string(token->type));
             // Skip to next statement
             while (token && token->type != token_type_e::type_semi &&
                   token->type != token_type_e::type_close_squigly) {
-                consume_token(tokens, token_index);
-                token = peek_token(tokens, token_index);
+                consume_token(lexer);
+                token = peek_token(lexer);
             }
             if (token && token->type == token_type_e::type_semi) {
-                consume_token(tokens, token_index);
+                consume_token(lexer);
             }
             continue;
         }
        
-        block_statements.push_back(std::move(statement));
+        if (statement != null_node) {
+            ast.scratch.push_back(statement);
+        }
     }
    
-    // Store the statements in the root node
-    root_node.type = token_type_e::type_block;
-    root_node.statements = std::move(block_statements);
+    ast_node_t block_node = make_node(token_type_e::type_block);
+    block_node.block.statements = ast.add_list(scratch_mark);
+    return ast.add_node(block_node, offset);
 }
 
 
 // Parse factor (integers or parenthesized expressions)
-void parse_factor(std::vector<token_t>& tokens, size_t& token_index,
-                  ast_node_t& root_node) {
-    const token_t* token = peek_token(tokens, token_index);
+node_id_t parse_factor(lexer_t& lexer, ast_t& ast) {
+    const token_t* token = peek_token(lexer);
 
     if (!token || token->type == token_type_e::type_EOF) {
-        error_msg("Unexpected end of tokens while parsing factor.");
-        return;
+        error_at(lexer.end_location(), "Unexpected end of tokens while parsing factor.");
+        return null_node;
     }
 
     if (token->type == token_type_e::type_int_lit) {
-        root_node.type = token->type;
-        root_node.int_value = stoi(token->value);
-        info_msg("Parsed integer literal: {}", root_node.int_value);
-        consume_token(tokens, token_index);
+        ast_node_t literal = make_node(token_type_e::type_int_lit);
+        literal.int_lit.value = 0;
+        const auto [end, ec] = std::from_chars(token->value.data(), token->value.data() + token->value.size(),
+                                               literal.int_lit.value);
+        if (ec != std::errc()) {
+            error_at(token->location(), "Integer literal out of range: {}", token->value);
+        }
+        debug_msg("Parsed integer literal: {}", literal.int_lit.value);
+        consume_token(lexer);
+        return ast.add_node(literal, token->offset);
     } else if (token->type == token_type_e::type_identifier) {
         // Save the identifier value
-        std::string identifier_name = token->value;
-        consume_token(tokens, token_index);
+        symbol_t identifier_name = token->symbol;
+        const uint32_t identifier_offset = token->offset;
+        consume_token(lexer);
         
         // Check if this is a function call
-        token = peek_token(tokens, token_index);
+        token = peek_token(lexer);
         if (token && token->type == token_type_e::type_open_paren) {
             // This is a function call
-            root_node.type = token_type_e::type_call;
-            root_node.string_value = identifier_name; // Function name
-            consume_token(tokens, token_index); // Consume '('
+            consume_token(lexer); // Consume '('
             
             // Parse arguments
-            std::vector<ast_node_t> args;
+            const size_t scratch_mark = ast.scratch.size();
             bool first_arg = true;
             
             while (true) {
-                token = peek_token(tokens, token_index);
+                token = peek_token(lexer);
                 if (!token) {
-                    error_msg("Unexpected end of file in function arguments");
-                    return;
+                    error_at(lexer.end_location(), "Unexpected end of file in function arguments");
+                    ast.scratch.resize(scratch_mark);
+                    return null_node;
                 }
                 
                 if (token->type == token_type_e::type_close_paren) {
-                    consume_token(tokens, token_index);
+                    consume_token(lexer);
                     break;
                 }
                 
                 // Handle comma between arguments
                 if (!first_arg) {
                     if (token->type != token_type_e::type_comma) {
-                        error_msg("Expected ',' between arguments, but found: {}", 
+                        error_at(location_of(lexer, token), "Expected ',' between arguments, but found: {}", 
                                  token_type_to_string(token->type));
-                        return;
+                        ast.scratch.resize(scratch_mark);
+                        return null_node;
                     }
-                    consume_token(tokens, token_index);
+                    consume_token(lexer);
                 }
                 
                 // Parse argument expression
-                ast_node_t arg;
-                parse_expression(tokens, token_index, arg);
-                args.push_back(std::move(arg));
+                ast.scratch.push_back(parse_expression(lexer, ast));
                 first_arg = false;
             }
             
             // Store arguments in the function call node
-            root_node.arguments = std::move(args);
+            ast_node_t call = make_node(token_type_e::type_call);
+            call.call.name = identifier_name; // Function name
+            call.call.arguments = ast.add_list(scratch_mark);
+            return ast.add_node(call, identifier_offset);
         } else {
             // This is a variable reference
-            root_node.type = token_type_e::type_identifier;
-            root_node.string_value = identifier_name;
-            info_msg("Parsed identifier: {}", root_node.string_value);
+            ast_node_t identifier = make_node(token_type_e::type_identifier);
+            identifier.identifier.name = identifier_name;
+            identifier.identifier.slot = unresolved_slot;
+            debug_msg("Parsed identifier: {}", ast.name(identifier_name));
+            return ast.add_node(identifier, identifier_offset);
         }
     } else if (token->type == token_type_e::type_open_paren) {
-        consume_token(tokens, token_index);
-        parse_expression(tokens, token_index, root_node);
+        // A comparison in parentheses is a value, 1 when it holds and 0 otherwise
+        consume_token(lexer);
+        node_id_t expression = parse_comparison(lexer, ast);
 
-        token = peek_token(tokens, token_index);
+        token = peek_token(lexer);
         if (!token || token->type != token_type_e::type_close_paren) {
-            error_msg("Expected ')', but found: {}", 
+            error_at(location_of(lexer, token), "Expected ')', but found: {}", 
                      token ? token_type_to_string(token->type) : "EOF");
-            return;
+            return null_node;
         }
-        consume_token(tokens, token_index);
+        consume_token(lexer);
+        return expression;
     } else {
-        error_msg(
+        error_at(location_of(lexer, token),
             "Invalid factor, expected integer literal or '(' but found: {}",
             token_type_to_string(token->type));
+        return null_node;
     }
 }
 
-void parse_return_statement(std::vector<token_t>& tokens, size_t& token_index, ast_node_t& root_node) {
+node_id_t parse_return_statement(lexer_t& lexer, ast_t& ast) {
     // Consume 'return' token
-    consume_token(tokens, token_index);
-    
-    root_node.type = token_type_e::type_return;
+    const uint32_t offset = consume_token(lexer)->offset;
     
     // Parse the return expression
-    ast_node_t expr_node;
-    parse_expression(tokens, token_index, expr_node);
-    root_node.child_node_1 = std::make_unique<ast_node_t>(std::move(expr_node));
+    node_id_t return_node = add_unary(ast, token_type_e::type_return, parse_expression(lexer, ast), offset);
     
-    const token_t* token = peek_token(tokens, token_index);
+    const token_t* token = peek_token(lexer);
     if (!token || token->type != token_type_e::type_semi) {
-        error_msg("Expected ';' after return expression, but found: {}", 
-                 token_type_to_string(token->type));
-        return;
+        error_at(location_of(lexer, token), "Expected ';' after return expression, but found: {}", 
+                 token ? token_type_to_string(token->type) : "EOF");
+        return return_node;
     }
-    consume_token(tokens, token_index);
+    consume_token(lexer);
+    return return_node;
 }
 
 // Parse multiplication and division operations
-void parse_term(std::vector<token_t>& tokens, size_t& token_index, ast_node_t& root_node) {
-    parse_factor(tokens, token_index, root_node);
+node_id_t parse_term(lexer_t& lexer, ast_t& ast) {
+    node_id_t root_node = parse_factor(lexer, ast);
 
     while (true) {
-        const token_t* token = peek_token(tokens, token_index);
+        const token_t* token = peek_token(lexer);
         if (!token) break;
 
         if (token->type == token_type_e::type_mul || token->type == token_type_e::type_div) {
-            ast_node_t operator_node;
-            operator_node.type = token->type;
-            consume_token(tokens, token_index);
+            token_type_e operator_type = token->type;
+            const uint32_t operator_offset = token->offset;
+            consume_token(lexer);
 
-            operator_node.child_node_1 = std::make_unique<ast_node_t>(std::move(root_node));
-            operator_node.child_node_2 = std::make_unique<ast_node_t>();
-
-            parse_factor(tokens, token_index, *operator_node.child_node_2);
-            root_node = std::move(operator_node);
+            node_id_t rhs = parse_factor(lexer, ast);
+            root_node = add_binary(ast, operator_type, root_node, rhs, operator_offset);
         } else {
             break;
         }
     }
+    return root_node;
 }
 
 // Parse addition and subtraction operations
-void parse_expression(std::vector<token_t>& tokens, size_t& token_index, ast_node_t& root_node) {
-    parse_term(tokens, token_index, root_node);
+node_id_t parse_expression(lexer_t& lexer, ast_t& ast) {
+    node_id_t root_node = parse_term(lexer, ast);
 
     while (true) {
-        const token_t* token = peek_token(tokens, token_index);
+        const token_t* token = peek_token(lexer);
         if (!token) break;
 
         if (token->type == token_type_e::type_add || token->type == token_type_e::type_sub) {
-            ast_node_t operator_node;
-            operator_node.type = token->type;
-            consume_token(tokens, token_index);
-
-            operator_node.child_node_1 = std::make_unique<ast_node_t>(std::move(root_node));
-            operator_node.child_node_2 = std::make_unique<ast_node_t>();
+            token_type_e operator_type = token->type;
+            const uint32_t operator_offset = token->offset;
+            consume_token(lexer);
 
-            parse_term(tokens, token_index, *operator_node.child_node_2);
-            root_node = std::move(operator_node);
+            node_id_t rhs = parse_term(lexer, ast);
+            root_node = add_binary(ast, operator_type, root_node, rhs, operator_offset);
         } else {
             break;
         }
     }
+    return root_node;
 }
 
-void parse_while_statement(std::vector<token_t>& tokens, size_t& token_index, ast_node_t& root_node) {
-    consume_token(tokens, token_index); // Consume 'while' token
+node_id_t parse_while_statement(lexer_t& lexer, ast_t& ast) {
+    const uint32_t offset = consume_token(lexer)->offset; // Consume 'while' token
     
     // Check for opening parenthesis
-    const token_t* open_paren = peek_token(tokens, token_index);
+    const token_t* open_paren = peek_token(lexer);
     if (!open_paren || open_paren->type != token_type_e::type_open_paren) {
-        error_msg("Expected '(' after while statement, but found: {}",
+        error_at(location_of(lexer, open_paren), "Expected '(' after while statement, but found: {}",
                 open_paren ? token_type_to_string(open_paren->type) : "EOF");
-        return;
+        return null_node;
     }
-    consume_token(tokens, token_index);
+    consume_token(lexer);
     
     // Parse condition
-    ast_node_t condition_node;
-    parse_comparison(tokens, token_index, condition_node);
+    node_id_t condition_node = parse_comparison(lexer, ast);
     
     // Check for closing parenthesis
-    const token_t* close_paren = peek_token(tokens, token_index);
+    const token_t* close_paren = peek_token(lexer);
     if (!close_paren || close_paren->type != token_type_e::type_close_paren) {
-        error_msg("Expected ')' after while condition, but found: {}",
+        error_at(location_of(lexer, close_paren), "Expected ')' after while condition, but found: {}",
                 close_paren ? token_type_to_string(close_paren->type) : "EOF");
-        return;
+        return null_node;
     }
-    consume_token(tokens, token_index);
+    consume_token(lexer);
     
     // Check for opening brace
-    const token_t* open_squigly = peek_token(tokens, token_index);
+    const token_t* open_squigly = peek_token(lexer);
     if (!open_squigly || open_squigly->type != token_type_e::type_open_squigly) {
-        error_msg("Expected '{{' after while condition, but found: {}",
+        error_at(location_of(lexer, open_squigly), "Expected '{{' after while condition, but found: {}",
                 open_squigly ? token_type_to_string(open_squigly->type) : "EOF");
-        return;
+        return null_node;
     }
-    consume_token(tokens, token_index);
+    consume_token(lexer);
     
-    // Parse body
-    ast_node_t body_node;
-    body_node.type = token_type_e::type_block;  
-    parse_block(tokens, token_index, body_node);
-    
-    // REMOVE THIS SECTION - DON'T CHECK FOR CLOSING BRACE
-    // parse_block() already consumed it
-    /*
-    const token_t* close_squigly = peek_token(tokens, token_index);
-    if (!close_squigly || close_squigly->type != token_type_e::type_close_squigly) {
-        error_msg("Expected '}}' at the end of while block, but found: {}",
-                close_squigly ? token_type_to_string(close_squigly->type) : "EOF");
-        return;
-    }
-    consume_token(tokens, token_index);
-    */
+    // Parse body, parse_block() consumes the closing brace
+    node_id_t body_node = parse_block(lexer, ast);
     
     // Create the while statement node
-    root_node.type = token_type_e::type_while;
-    root_node.child_node_1 = std::make_unique<ast_node_t>(std::move(condition_node));
-    root_node.child_node_2 = std::make_unique<ast_node_t>(std::move(body_node));
+    ast_node_t while_node = make_node(token_type_e::type_while);
+    while_node.while_stmt.condition = condition_node;
+    while_node.while_stmt.body = body_node;
+    return ast.add_node(while_node, offset);
 }
 
-void parse_assignment_statement(std::vector<token_t>& tokens, size_t& token_index, ast_node_t& root_node) {
+node_id_t parse_assignment_statement(lexer_t& lexer, ast_t& ast) {
     // Parse left-hand side (identifier)
-    const token_t* identifier_token = peek_token(tokens, token_index);
+    const token_t* identifier_token = peek_token(lexer);
     if (!identifier_token || identifier_token->type != token_type_e::type_identifier) {
-        error_msg("Expected identifier in assignment, but found: {}", 
+        error_at(location_of(lexer, identifier_token), "Expected identifier in assignment, but found: {}", 
                  identifier_token ? token_type_to_string(identifier_token->type) : "EOF");
-        return;
+        return null_node;
     }
     
-    std::string identifier_value = identifier_token->value;
-    consume_token(tokens, token_index);
+    symbol_t identifier_value = identifier_token->symbol;
+    const uint32_t offset = identifier_token->offset;
+    consume_token(lexer);
     
     // Parse '='
-    const token_t* equal_token = peek_token(tokens, token_index);
+    const token_t* equal_token = peek_token(lexer);
     if (!equal_token || equal_token->type != token_type_e::type_assignment) {
-        error_msg("Expected '=' in assignment, but found: {}", 
+        error_at(location_of(lexer, equal_token), "Expected '=' in assignment, but found: {}", 
                  equal_token ? token_type_to_string(equal_token->type) : "EOF");
-        return;
+        return null_node;
     }
-    consume_token(tokens, token_index);
-    
-    // Create the assignment node
-    root_node.type = token_type_e::type_assignment;
-    root_node.string_value = identifier_value;
+    consume_token(lexer);
     
-    // Parse right-hand side (expression)
-    root_node.child_node_1 = std::make_unique<ast_node_t>();
-    parse_expression(tokens, token_index, *root_node.child_node_1);
+    // Create the assignment node, right-hand side is an expression
+    ast_node_t assignment = make_node(token_type_e::type_assignment);
+    assignment.assign.name = identifier_value;
+    assignment.assign.value = parse_expression(lexer, ast);
+    assignment.assign.slot = unresolved_slot;
+    return ast.add_node(assignment, offset);
 }
 
-void parse_function_statement(std::vector<token_t>& tokens, size_t& token_index, ast_node_t& root_node) {
-    consume_token(tokens, token_index); // Consume 'fn' token
+node_id_t parse_function_statement(lexer_t& lexer, ast_t& ast) {
+    const uint32_t offset = consume_token(lexer)->offset; // Consume 'fn' token
     
-    const token_t* func_name_token = peek_token(tokens, token_index);
+    const token_t* func_name_token = peek_token(lexer);
     if (!func_name_token || func_name_token->type != token_type_e::type_identifier) {
-        error_msg("Expected function name but found: {}", 
+        error_at(location_of(lexer, func_name_token), "Expected function name but found: {}", 
                  func_name_token ? token_type_to_string(func_name_token->type) : "EOF");
-        return;
+        return null_node;
     }
     
-    root_node.type = token_type_e::type_fn;
-    root_node.string_value = func_name_token->value;
-    consume_token(tokens, token_index);
+    ast_node_t function = make_node(token_type_e::type_fn);
+    function.fn.name = func_name_token->symbol;
+    consume_token(lexer);
 
-    const token_t* open_paren_token = peek_token(tokens, token_index);
+    const token_t* open_paren_token = peek_token(lexer);
     if (!open_paren_token || open_paren_token->type != token_type_e::type_open_paren) {
-        error_msg("Expected '(' but found: {}", 
+        error_at(location_of(lexer, open_paren_token), "Expected '(' but found: {}", 
                  open_paren_token ? token_type_to_string(open_paren_token->type) : "EOF");
-        return;
+        return null_node;
     }
-    consume_token(tokens, token_index);
+    consume_token(lexer);
 
-    std::vector<std::string> parameters;
+    const size_t scratch_mark = ast.scratch.size();
     bool first_parameter = true;
 
     while (true) {
-        const token_t* token = peek_token(tokens, token_index);
+        const token_t* token = peek_token(lexer);
         if (!token) {
-            error_msg("Unexpected end of file in function parameters");
-            return;
+            error_at(lexer.end_location(), "Unexpected end of file in function parameters");
+            ast.scratch.resize(scratch_mark);
+            return null_node;
         }
 
         if (token->type == token_type_e::type_close_paren) {
-            consume_token(tokens, token_index);
+            consume_token(lexer);
             break;
         }
 
         if (!first_parameter) {
             if (token->type != token_type_e::type_comma) {
-                error_msg("Expected ',' between function args but found: {}", 
+                error_at(location_of(lexer, token), "Expected ',' between function args but found: {}", 
                          token_type_to_string(token->type));
-                return;
+                ast.scratch.resize(scratch_mark);
+                return null_node;
             }
-            consume_token(tokens, token_index);
-            token = peek_token(tokens, token_index);
+            consume_token(lexer);
+            token = peek_token(lexer);
             if (!token) {
-                error_msg("Unexpected end of file after comma in function parameters");
-                return;
+                error_at(lexer.end_location(), "Unexpected end of file after comma in function parameters");
+                ast.scratch.resize(scratch_mark);
+                return null_node;
             }
         }
         
         if (token->type != token_type_e::type_identifier) {
-            error_msg("Expected parameter name but found: {}", 
+            error_at(location_of(lexer, token), "Expected parameter name but found: {}", 
                      token_type_to_string(token->type));
-            return;
+            ast.scratch.resize(scratch_mark);
+            return null_node;
         }
-        parameters.push_back(token->value);
-        consume_token(tokens, token_index);
+        ast.scratch.push_back(token->symbol);
+        consume_token(lexer);
         first_parameter = false;
     }
 
-    root_node.parameters = std::move(parameters);
+    function.fn.params = ast.add_list(scratch_mark);
 
-    const token_t* squigly_token = peek_token(tokens, token_index);
+    const token_t* squigly_token = peek_token(lexer);
     if (!squigly_token || squigly_token->type != token_type_e::type_open_squigly) {
-        error_msg("Expected '{' but found: {}", 
+        error_at(location_of(lexer, squigly_token), "Expected '{{' but found: {}", 
                  squigly_token ? token_type_to_string(squigly_token->type) : "EOF");
-        return;
+        return null_node;
     }
-    consume_token(tokens, token_index);
+    consume_token(lexer);
 
-    ast_node_t body_node;
-    body_node.type = token_type_e::type_block;
-    
-    parse_block(tokens, token_index, body_node);
-    
-    root_node.body = std::move(body_node.statements);
+    function.fn.body = parse_block(lexer, ast);
+    return ast.add_node(function, offset);
 }
 
-void parse_exit_statement(std::vector<token_t>& tokens, size_t& token_index, ast_node_t& root_node) {
+node_id_t parse_exit_statement(lexer_t& lexer, ast_t& ast) {
     // Consume exit token
-    consume_token(tokens, token_index);
+    const uint32_t offset = consume_token(lexer)->offset;
 
-    const token_t* token = peek_token(tokens, token_index);
+    const token_t* token = peek_token(lexer);
     if (!token || token->type != token_type_e::type_open_paren) {
-        error_msg("Expected '(' but found: {}", token_type_to_string(token->type));
-        return;
+        error_at(location_of(lexer, token), "Expected '(' but found: {}", token ? token_type_to_string(token->type) : "EOF");
+        return null_node;
     }
-    consume_token(tokens, token_index);
+    consume_token(lexer);
 
     // Parse the expression inside exit()
-    ast_node_t expr_node;
-    parse_expression(tokens, token_index, expr_node);
+    node_id_t expr_node = parse_expression(lexer, ast);
 
 
-    token = peek_token(tokens, token_index);
+    token = peek_token(lexer);
     if (!token || token->type != token_type_e::type_close_paren) {
-        error_msg("Expected ')' in exit statement, but found: {}", token_type_to_string(token->type));
-        return;
+        error_at(location_of(lexer, token), "Expected ')' in exit statement, but found: {}", token ? token_type_to_string(token->type) : "EOF");
+        return null_node;
     }
-    consume_token(tokens, token_index);
+    consume_token(lexer);
 
     // Check for semicolon
-    token = peek_token(tokens, token_index);
+    token = peek_token(lexer);
     if (!token || token->type != token_type_e::type_semi) {
-        error_msg("Expected ';' after exit statement, but found: {}", token_type_to_string(token->type));
-        return;
+        error_at(location_of(lexer, token), "Expected ';' after exit statement, but found: {}", token ? token_type_to_string(token->type) : "EOF");
+        return null_node;
     }
-    consume_token(tokens, token_index);
+    consume_token(lexer);
 
-    // Create let node with expression as child
-    root_node.type = token_type_e::type_exit;
-    root_node.child_node_1 = std::make_unique<ast_node_t>(std::move(expr_node));
+    // Create exit node with expression as child
+    return add_unary(ast, token_type_e::type_exit, expr_node, offset);
 }
 
-void parse_let_statement(std::vector<token_t>& tokens, size_t &token_index, ast_node_t& root_node) {
-    consume_token(tokens, token_index); // Let token
+node_id_t parse_let_statement(lexer_t& lexer, ast_t& ast) {
+    const uint32_t offset = consume_token(lexer)->offset; // Let token
 
-    const token_t* id_token = peek_token(tokens, token_index);
+    const token_t* id_token = peek_token(lexer);
     if (!id_token || id_token->type != token_type_e::type_identifier) {
-        error_msg("Expected variable name but found: {}", token_type_to_string(id_token->type));
-        return;
+        error_at(location_of(lexer, id_token), "Expected variable name but found: {}", id_token ? token_type_to_string(id_token->type) : "EOF");
+        return null_node;
     }
 
-    // Create an identifier node
-    ast_node_t identifier_node;
-    identifier_node.type = token_type_e::type_identifier;
-    identifier_node.string_value = id_token->value; // Store the identifier name
-    consume_token(tokens, token_index); // Consume the identifier token
+    symbol_t identifier = id_token->symbol; // Store the identifier name
+    consume_token(lexer); // Consume the identifier token
 
-    const token_t* equal_token = peek_token(tokens, token_index);
+    const token_t* equal_token = peek_token(lexer);
     if (!equal_token || equal_token->type != token_type_e::type_assignment) {
-        error_msg("Expected '=' in let statement, but found: {}", token_type_to_string(equal_token->type));
-        return;
+        error_at(location_of(lexer, equal_token), "Expected '=' in let statement, but found: {}", equal_token ? token_type_to_string(equal_token->type) : "EOF");
+        return null_node;
     }
-    consume_token(tokens, token_index); // Consume the '=' token
+    consume_token(lexer); // Consume the '=' token
 
-    // Parse the expression
-    ast_node_t expr_node;
-    parse_expression(tokens, token_index, expr_node);
-
-    // Create an assignment node
-    root_node.type = token_type_e::type_let; 
-    root_node.child_node_1 = std::make_unique<ast_node_t>(std::move(identifier_node)); // Left child is the identifier
-    root_node.child_node_2 = std::make_unique<ast_node_t>(std::move(expr_node));       // Right child is the expression
+    // Create the let node, binding the identifier to the expression
+    ast_node_t let_node = make_node(token_type_e::type_let);
+    let_node.assign.name = identifier;
+    let_node.assign.value = parse_expression(lexer, ast);
+    let_node.assign.slot = unresolved_slot;
+    node_id_t let_id = ast.add_node(let_node, offset);
 
     // Check for semicolon
-    const token_t* semi_token = peek_token(tokens, token_index);
+    const token_t* semi_token = peek_token(lexer);
     if (!semi_token || semi_token->type != token_type_e::type_semi) {
-        error_msg("Expected ';' after let statement, but found: {}", token_type_to_string(semi_token->type));
-        return;
+        error_at(location_of(lexer, semi_token), "Expected ';' after let statement, but found: {}", semi_token ? token_type_to_string(semi_token->type) : "EOF");
+        return let_id;
     }
-    consume_token(tokens, token_index); // Consume the ';' token
+    consume_token(lexer); // Consume the ';' token
+    return let_id;
 }
 
-void parse_comparison(std::vector<token_t>& tokens, size_t& token_index, ast_node_t& root_node) {
-    parse_expression(tokens, token_index, root_node);
+node_id_t parse_comparison(lexer_t& lexer, ast_t& ast) {
+    node_id_t root_node = parse_expression(lexer, ast);
 
-    const token_t* token = peek_token(tokens, token_index);
-    if (!token) return;
+    const token_t* token = peek_token(lexer);
+    if (!token) return root_node;
 
     if (token->type == token_type_e::type_eq || 
         token->type == token_type_e::type_nq || 
@@ -596,158 +625,142 @@ void parse_comparison(std::vector<token_t>& tokens, size_t& token_index, ast_nod
         token->type == token_type_e::type_lt || 
         token->type == token_type_e::type_gt) {
         
-        ast_node_t operator_node;
-        operator_node.type = token->type;
-        consume_token(tokens, token_index);
-
-        operator_node.child_node_1 = std::make_unique<ast_node_t>(std::move(root_node));
-        operator_node.child_node_2 = std::make_unique<ast_node_t>();
+        token_type_e operator_type = token->type;
+        const uint32_t operator_offset = token->offset;
+        consume_token(lexer);
 
-        parse_expression(tokens, token_index, *operator_node.child_node_2);
-        root_node = std::move(operator_node);
+        node_id_t rhs = parse_expression(lexer, ast);
+        root_node = add_binary(ast, operator_type, root_node, rhs, operator_offset);
     }
+    return root_node;
 }
 
-void parse_if_statement(std::vector<token_t>& tokens, size_t &token_index, ast_node_t& root_node) {
-    consume_token(tokens, token_index); // if token
+node_id_t parse_if_statement(lexer_t& lexer, ast_t& ast) {
+    const uint32_t offset = consume_token(lexer)->offset; // if token
    
-    const token_t* open_paren = peek_token(tokens, token_index);
+    const token_t* open_paren = peek_token(lexer);
     if (!open_paren || open_paren->type != token_type_e::type_open_paren) {
-        error_msg("Expected '(' after if statement, but found: {}",
+        error_at(location_of(lexer, open_paren), "Expected '(' after if statement, but found: {}",
                  open_paren ? token_type_to_string(open_paren->type) : "EOF");
-        return;
+        return null_node;
     }
-    consume_token(tokens, token_index); // Consume '('
+    consume_token(lexer); // Consume '('
    
     // Parse condition expression
-    ast_node_t condition_node;
-    parse_comparison(tokens, token_index, condition_node);
+    node_id_t condition_node = parse_comparison(lexer, ast);
    
     // Check for closing parenthesis
-    const token_t* close_paren = peek_token(tokens, token_index);
+    const token_t* close_paren = peek_token(lexer);
     if (!close_paren || close_paren->type != token_type_e::type_close_paren) {
-        error_msg("Expected ')' after if condition, but found: {}",
+        error_at(location_of(lexer, close_paren), "Expected ')' after if condition, but found: {}",
                  close_paren ? token_type_to_string(close_paren->type) : "EOF");
-        return;
+        return null_node;
     }
-    consume_token(tokens, token_index); // Consume ')'
+    consume_token(lexer); // Consume ')'
    
     // Check for opening brace
-    const token_t* open_squigly = peek_token(tokens, token_index);
+    const token_t* open_squigly = peek_token(lexer);
     if (!open_squigly || open_squigly->type != token_type_e::type_open_squigly) {
-        error_msg("Expected '{' after if condition, but found: {}",
+        error_at(location_of(lexer, open_squigly), "Expected '{{' after if condition, but found: {}",
                  open_squigly ? token_type_to_string(open_squigly->type) : "EOF");
-        return;
+        return null_node;
     }
-    consume_token(tokens, token_index); // Consume '{'
+    consume_token(lexer); // Consume '{'
    
     // Parse the then branch (statements inside the if block)
-    ast_node_t then_branch;
-    then_branch.type = token_type_e::type_block;
-    parse_block(tokens, token_index, then_branch);
+    node_id_t then_branch = parse_block(lexer, ast);
    
     // Check for else branch
-    const token_t* else_token = peek_token(tokens, token_index);
-    ast_node_t else_branch;
-    bool has_else = false;
+    const token_t* else_token = peek_token(lexer);
+    node_id_t else_branch = null_node;
    
     if (else_token && else_token->type == token_type_e::type_else) {
-        consume_token(tokens, token_index); // Consume 'else'
-        has_else = true;
+        consume_token(lexer); // Consume 'else'
        
         // Check if it's an else-if
-        const token_t* next_token = peek_token(tokens, token_index);
+        const token_t* next_token = peek_token(lexer);
         if (next_token && next_token->type == token_type_e::type_if) {
             // Parse the else-if as a nested if statement
-            parse_if_statement(tokens, token_index, else_branch);
+            else_branch = parse_if_statement(lexer, ast);
         } else {
             // Parse the else block
-            const token_t* else_open_squigly = peek_token(tokens, token_index);
+            const token_t* else_open_squigly = peek_token(lexer);
             if (!else_open_squigly || else_open_squigly->type != token_type_e::type_open_squigly) {
-                error_msg("Expected '{' after else, but found: {}",
+                error_at(location_of(lexer, else_open_squigly), "Expected '{{' after else, but found: {}",
                          else_open_squigly ? token_type_to_string(else_open_squigly->type) : "EOF");
-                return;
+                return null_node;
             }
-            consume_token(tokens, token_index); // Consume '{'
-           
-            else_branch.type = token_type_e::type_block;
+            consume_token(lexer); // Consume '{'
             
             // Parse statements until we hit the closing brace
-            parse_block(tokens, token_index, else_branch);
+            else_branch = parse_block(lexer, ast);
         }
     }
    
     // Create the if node with condition, then branch, and optional else branch
-    root_node.type = token_type_e::type_if;
-    root_node.child_node_1 = std::make_unique<ast_node_t>(std::move(condition_node)); // Condition
-    root_node.child_node_2 = std::make_unique<ast_node_t>(std::move(then_branch));    // Then branch
-   
-    if (has_else) {
-        root_node.child_node_3 = std::make_unique<ast_node_t>(std::move(else_branch)); // Else branch
-    }
+    ast_node_t if_node = make_node(token_type_e::type_if);
+    if_node.if_stmt.condition = condition_node;
+    if_node.if_stmt.then_block = then_branch;
+    if_node.if_stmt.else_branch = else_branch;
+    return ast.add_node(if_node, offset);
 }
 
 // Parse program statements
-std::vector<ast_node_t> parse_statement(std::vector<token_t>& token_stream) {
-    std::vector<ast_node_t> program_ast;
-    size_t token_index = 0;
+ast_t parse_statement(lexer_t& lexer) {
+    ast_t ast;
+    ast.symbols = &lexer.symbols;
+    ast.file = lexer.file_id();
+    const size_t scratch_mark = ast.scratch.size();
 
-    while (token_index < token_stream.size()) {
-        const token_t* token = peek_token(token_stream, token_index);
+    while (true) {
+        const token_t* token = peek_token(lexer);
         if (!token) break;
 
         // Skip whitespace
         while (token && token->type == token_type_e::type_space) {
-            consume_token(token_stream, token_index);
-            token = peek_token(token_stream, token_index);
+            consume_token(lexer);
+            token = peek_token(lexer);
         }
 
         if (!token) break;
 
+        node_id_t root_node = null_node;
         if (token->type == token_type_e::type_exit) {
-            ast_node_t root_node;
-            parse_exit_statement(token_stream, token_index, root_node);
-            program_ast.push_back(std::move(root_node));
+            root_node = parse_exit_statement(lexer, ast);
         }
         else if (token->type == token_type_e::type_int_lit ||
                  token->type == token_type_e::type_open_paren) {
-            ast_node_t root_node;
-            parse_expression(token_stream, token_index, root_node);
+            root_node = parse_expression(lexer, ast);
 
             // Look for semicolon
-            token = peek_token(token_stream, token_index);
+            token = peek_token(lexer);
             if (token && token->type == token_type_e::type_semi) {
-                consume_token(token_stream, token_index);
+                consume_token(lexer);
             } else {
-                error_msg("Expected ';' after expression, but found: {}", token_type_to_string(token->type));
+                error_at(location_of(lexer, token), "Expected ';' after expression, but found: {}", token ? token_type_to_string(token->type) : "EOF");
             }
-
-            program_ast.push_back(std::move(root_node));
         } else if(token->type == token_type_e::type_let) {
-            ast_node_t root_node;
-            parse_let_statement(token_stream, token_index, root_node);
-            program_ast.push_back(std::move(root_node));
+            root_node = parse_let_statement(lexer, ast);
         } else if (token->type == token_type_e::type_if) {
-            ast_node_t root_node;
-            parse_if_statement(token_stream, token_index, root_node);
-            program_ast.push_back(std::move(root_node));
+            root_node = parse_if_statement(lexer, ast);
         } else if (token->type == token_type_e::type_while) {
-            ast_node_t root_node;
-            parse_while_statement(token_stream, token_index, root_node);
-            program_ast.push_back(std::move(root_node));
+            root_node = parse_while_statement(lexer, ast);
         } else if (token->type == token_type_e::type_fn) {
-            ast_node_t root_node;
-            parse_function_statement(token_stream, token_index, root_node);
-            program_ast.push_back(std::move(root_node));
+            root_node = parse_function_statement(lexer, ast);
         }
         else if (token->type == token_type_e::type_EOF) {
             break;
         }
         else {
-            error_msg("Unexpected token type: {}", token_type_to_string(token->type));
-            consume_token(token_stream, token_index);
+            error_at(location_of(lexer, token), "Unexpected token type: {}", token_type_to_string(token->type));
+            consume_token(lexer);
+        }
+
+        if (root_node != null_node) {
+            ast.scratch.push_back(root_node);
         }
     }
 
-    return program_ast;
+    ast.program = ast.add_list(scratch_mark);
+    return ast;
 }
@@ -0,0 +1,66 @@
+#include "core/passes.hpp"
+#include "utils/error.hpp"
+#include "utils/profiler.hpp"
+
+void optimise_ir(ir_module_t& module, const optimise_options_t& options) {
+    if (!options.enabled) {
+        return;
+    }
+    size_t before = count_instructions(module);
+
+    // Reports what a pass did to the instruction count and checks its output
+    auto finish_pass = [&](const char* name) {
+        size_t after = count_instructions(module);
+        info_msg("IR after {}: {} instructions ({:+})", name, after,
+                 static_cast<int64_t>(after) - static_cast<int64_t>(before));
+        before = after;
+        return verify_ir(module);
+    };
+
+    if (options.tail_calls) {
+        profile_scope_t scope("tail recursion elimination");
+        info_msg("Tail recursion: {} self calls turned into loops", eliminate_tail_recursion(module));
+        if (!finish_pass("tail recursion elimination")) {
+            return;
+        }
+    }
+
+    if (options.inline_threshold > 0) {
+        profile_scope_t scope("inlining");
+        inline_stats_t stats = inline_functions(module, options.inline_threshold);
+        info_msg("Inlining: {} calls inlined, {} functions no longer called", stats.inlined, stats.removed_functions);
+        if (!finish_pass("inlining")) {
+            return;
+        }
+    }
+
+    if (options.loops) {
+        profile_scope_t scope("loop optimisation");
+        loop_stats_t stats = optimise_loops(module);
+        info_msg("Loops: {} rotated, {} instructions hoisted, {} multiplications strength reduced",
+                 stats.rotated, stats.hoisted, stats.reduced);
+        if (!finish_pass("loop optimisation")) {
+            return;
+        }
+    }
+
+    if (options.constant_propagation) {
+        profile_scope_t scope("constant propagation");
+        constant_stats_t stats = propagate_constants(module);
+        info_msg("Constant propagation: {} folded, {} branches decided, {} dead instructions removed",
+                 stats.folded, stats.branches, stats.removed);
+        if (!finish_pass("constant propagation")) {
+            return;
+        }
+    }
+
+    // Last, inlining and constant propagation may leave more calls right
+    // before a ret
+    if (options.tail_calls) {
+        profile_scope_t scope("tail calls");
+        info_msg("Tail calls: {} calls turned into jumps", mark_tail_calls(module));
+        if (!finish_pass("tail calls")) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,249 @@
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+#include "core/peephole.hpp"
+
+namespace {
+
+constexpr size_t not_placed = SIZE_MAX;
+
+// Jumps pointing at each other would keep being threaded
+constexpr int max_sweeps = 16;
+
+bool is_conditional_jump(x86_op_e op) {
+    return op >= x86_op_e::je && op <= x86_op_e::jg;
+}
+
+bool is_jump(const x86_insn_t& insn) {
+    return (insn.op == x86_op_e::jmp || is_conditional_jump(insn.op)) && insn.dst.kind == x86_operand_kind_e::label;
+}
+
+bool is_mem(const x86_operand_t& operand) {
+    return operand.kind == x86_operand_kind_e::mem;
+}
+
+bool is_pseudo(x86_op_e op) {
+    return op == x86_op_e::label || op == x86_op_e::comment;
+}
+
+// One pass over the text. Rules read from text and append whatever replaces
+// the instructions they matched to out.
+struct sweep_t
+{
+    const std::vector<x86_insn_t>& text;
+    std::vector<x86_insn_t>& out;
+    std::vector<size_t> label_position; // Index into text, per label
+
+    // First real instruction at or after position
+    size_t skip_pseudo(size_t position) const {
+        while (position < text.size() && is_pseudo(text[position].op)) {
+            ++position;
+        }
+        return position;
+    }
+};
+
+// A rule returns how many instructions from position on it replaced, 0 when
+// it doesn't match there
+struct rule_t
+{
+    const char* name;
+    size_t (*apply)(sweep_t& sweep, size_t position);
+};
+
+// mov a, a
+size_t self_move(sweep_t& sweep, size_t position) {
+    const x86_insn_t& insn = sweep.text[position];
+    return insn.op == x86_op_e::mov && insn.dst == insn.src ? 1 : 0;
+}
+
+// push a; pop b -> mov b, a
+size_t push_pop(sweep_t& sweep, size_t position) {
+    if (position + 1 >= sweep.text.size()) {
+        return 0;
+    }
+    const x86_insn_t& push = sweep.text[position];
+    const x86_insn_t& pop = sweep.text[position + 1];
+    if (push.op != x86_op_e::push || pop.op != x86_op_e::pop || (is_mem(push.dst) && is_mem(pop.dst))) {
+        return 0;
+    }
+    if (!(push.dst == pop.dst)) {
+        sweep.out.push_back({x86_op_e::mov, pop.dst, push.dst, push.comment});
+    }
+    return 2;
+}
+
+// mov a, b; mov b, a -> mov a, b
+size_t move_back(sweep_t& sweep, size_t position) {
+    if (position + 1 >= sweep.text.size()) {
+        return 0;
+    }
+    const x86_insn_t& first = sweep.text[position];
+    const x86_insn_t& second = sweep.text[position + 1];
+    if (first.op != x86_op_e::mov || second.op != x86_op_e::mov || !(first.dst == second.src)
+        || !(first.src == second.dst)) {
+        return 0;
+    }
+    // mov rbx, [rbx + 8] moved the memory operand along with its base
+    if (first.dst.kind == x86_operand_kind_e::reg && is_mem(first.src) && first.src.reg == first.dst.reg) {
+        return 0;
+    }
+    sweep.out.push_back(first);
+    return 2;
+}
+
+// jmp L (or jcc L) with only labels between it and L
+size_t jump_to_next(sweep_t& sweep, size_t position) {
+    const x86_insn_t& insn = sweep.text[position];
+    if (!is_jump(insn)) {
+        return 0;
+    }
+    for (size_t next = position + 1; next < sweep.text.size() && is_pseudo(sweep.text[next].op); ++next) {
+        if (sweep.text[next].op == x86_op_e::label && sweep.text[next].dst.label == insn.dst.label) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// jmp L or jcc L where L: jmp M -> jmp M or jcc M
+size_t thread_jump(sweep_t& sweep, size_t position) {
+    const x86_insn_t& insn = sweep.text[position];
+    if (!is_jump(insn) || sweep.label_position[insn.dst.label] == not_placed) {
+        return 0;
+    }
+    const size_t target = sweep.skip_pseudo(sweep.label_position[insn.dst.label]);
+    if (target >= sweep.text.size() || !is_jump(sweep.text[target]) || sweep.text[target].op != x86_op_e::jmp
+        || sweep.text[target].dst.label == insn.dst.label) {
+        return 0;
+    }
+    x86_insn_t threaded = insn;
+    threaded.dst = sweep.text[target].dst;
+    sweep.out.push_back(threaded);
+    return 1;
+}
+
+// Anything between a jmp or ret and the next label
+size_t unreachable(sweep_t& sweep, size_t position) {
+    if (is_pseudo(sweep.text[position].op)) {
+        return 0;
+    }
+    for (auto it = sweep.out.rbegin(); it != sweep.out.rend(); ++it) {
+        if (it->op == x86_op_e::comment) {
+            continue;
+        }
+        return it->op == x86_op_e::jmp || it->op == x86_op_e::ret ? 1 : 0;
+    }
+    return 0;
+}
+
+// mov reg, 0 -> xor reg, reg, 3 bytes instead of 7. Only while nothing reads
+// the flags before they are set again. Selection never keeps flags alive
+// past a label, jump or call.
+size_t zero_idiom(sweep_t& sweep, size_t position) {
+    const x86_insn_t& insn = sweep.text[position];
+    if (insn.op != x86_op_e::mov || insn.dst.kind != x86_operand_kind_e::reg
+        || insn.src.kind != x86_operand_kind_e::imm || insn.src.value != 0) {
+        return 0;
+    }
+    for (size_t next = position + 1; next < sweep.text.size(); ++next) {
+        switch (sweep.text[next].op) {
+            case x86_op_e::comment:
+            case x86_op_e::mov:
+            case x86_op_e::push:
+            case x86_op_e::pop:
+                continue;
+            case x86_op_e::je:
+            case x86_op_e::jne:
+            case x86_op_e::jl:
+            case x86_op_e::jge:
+            case x86_op_e::jle:
+            case x86_op_e::jg:
+            case x86_op_e::sete:
+            case x86_op_e::setne:
+            case x86_op_e::setl:
+            case x86_op_e::setge:
+            case x86_op_e::setle:
+            case x86_op_e::setg:
+                return 0;
+            default:
+                break;
+        }
+        break;
+    }
+    sweep.out.push_back({x86_op_e::xor_, insn.dst, insn.dst, insn.comment});
+    return 1;
+}
+
+// imul reg, 3, 5 or 9 -> lea reg, [reg+reg*2, 4 or 8], one cycle instead of
+// three. Selection leaves these behind for multiplications by constants.
+size_t multiply_to_lea(sweep_t& sweep, size_t position) {
+    const x86_insn_t& insn = sweep.text[position];
+    if (insn.op != x86_op_e::imul || insn.dst.kind != x86_operand_kind_e::reg
+        || insn.src.kind != x86_operand_kind_e::imm) {
+        return 0;
+    }
+    if (insn.src.value != 3 && insn.src.value != 5 && insn.src.value != 9) {
+        return 0;
+    }
+    const uint8_t scale = static_cast<uint8_t>(insn.src.value - 1);
+    sweep.out.push_back({x86_op_e::lea, insn.dst, x86_mem(insn.dst.reg, insn.dst.reg, scale), insn.comment});
+    return 1;
+}
+
+// Tried in order at every position, the first match wins
+constexpr rule_t rules[] = {
+    {"self move", self_move},
+    {"push pop", push_pop},
+    {"move back", move_back},
+    {"jump to next", jump_to_next},
+    {"thread jump", thread_jump},
+    {"unreachable", unreachable},
+    {"zero idiom", zero_idiom},
+    {"multiply to lea", multiply_to_lea},
+};
+
+} // namespace
+
+peephole_stats_t optimise_peephole(x86_program_t& program) {
+    peephole_stats_t stats;
+    for (const rule_t& rule : rules) {
+        stats.rules.push_back({rule.name, 0});
+    }
+    stats.before = program.text.size();
+
+    std::vector<x86_insn_t> out;
+    bool changed = true;
+    for (int pass = 0; changed && pass < max_sweeps; ++pass) {
+        changed = false;
+        out.clear();
+        out.reserve(program.text.size());
+        sweep_t sweep{program.text, out, std::vector<size_t>(program.labels.size(), not_placed)};
+        for (size_t i = 0; i < program.text.size(); ++i) {
+            if (program.text[i].op == x86_op_e::label) {
+                sweep.label_position[program.text[i].dst.label] = i;
+            }
+        }
+
+        for (size_t position = 0; position < program.text.size();) {
+            size_t replaced = 0;
+            for (size_t r = 0; r < std::size(rules) && replaced == 0; ++r) {
+                replaced = rules[r].apply(sweep, position);
+                if (replaced != 0) {
+                    ++stats.rules[r].hits;
+                    changed = true;
+                }
+            }
+            if (replaced == 0) {
+                out.push_back(program.text[position]);
+                replaced = 1;
+            }
+            position += replaced;
+        }
+        program.text.swap(out);
+    }
+
+    stats.after = program.text.size();
+    return stats;
+}
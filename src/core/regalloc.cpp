@@ -0,0 +1,712 @@
+#include <algorithm>
+#include <bit>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+#include "core/regalloc.hpp"
+#include "utils/error.hpp"
+
+namespace {
+
+// Preferred order, the callee saved registers last since using one costs a
+// save and a restore
+constexpr x86_reg_e allocatable[] = {
+    x86_reg_e::rdi, x86_reg_e::rsi, x86_reg_e::rcx, x86_reg_e::r8, x86_reg_e::r9, x86_reg_e::r10,
+    x86_reg_e::rbx, x86_reg_e::r12, x86_reg_e::r13, x86_reg_e::r14, x86_reg_e::r15,
+};
+
+constexpr x86_reg_e callee_saved[] = {
+    x86_reg_e::rbx, x86_reg_e::r12, x86_reg_e::r13, x86_reg_e::r14, x86_reg_e::r15,
+};
+
+// For values live across a call, a callee saved register costs nothing at
+// the call while any other one gets pushed and popped around it
+constexpr x86_reg_e across_calls[] = {
+    x86_reg_e::rbx, x86_reg_e::r12, x86_reg_e::r13, x86_reg_e::r14, x86_reg_e::r15,
+    x86_reg_e::rdi, x86_reg_e::rsi, x86_reg_e::rcx, x86_reg_e::r8, x86_reg_e::r9, x86_reg_e::r10,
+};
+
+constexpr x86_reg_e scratch = x86_reg_e::r11;
+// Breaks cycles in parallel copies, free whenever one runs
+constexpr x86_reg_e cycle_scratch = x86_reg_e::rax;
+
+constexpr size_t register_count = static_cast<size_t>(x86_reg_e::none);
+
+bool is_allocatable(x86_reg_e reg) {
+    return std::find(std::begin(allocatable), std::end(allocatable), reg) != std::end(allocatable);
+}
+
+bool is_callee_saved(x86_reg_e reg) {
+    return std::find(std::begin(callee_saved), std::end(callee_saved), reg) != std::end(callee_saved);
+}
+
+bool is_vreg(const x86_operand_t& operand) {
+    return operand.kind == x86_operand_kind_e::vreg;
+}
+
+bool is_mem(const x86_operand_t& operand) {
+    return operand.kind == x86_operand_kind_e::mem;
+}
+
+bool fits_int32(int64_t value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+bool is_branch(x86_op_e op) {
+    return op >= x86_op_e::jmp && op <= x86_op_e::jg;
+}
+
+// Calls visit(vreg, is_def) for each virtual register insn reads or writes,
+// reads first
+template <typename Visit>
+void for_each_vreg(const x86_code_t& code, const x86_insn_t& insn, Visit&& visit) {
+    auto use = [&](const x86_operand_t& operand) {
+        if (is_vreg(operand)) {
+            visit(static_cast<uint32_t>(operand.value), false);
+        }
+    };
+    auto def = [&](const x86_operand_t& operand) {
+        if (is_vreg(operand)) {
+            visit(static_cast<uint32_t>(operand.value), true);
+        }
+    };
+
+    switch (insn.op) {
+        case x86_op_e::mov:
+        case x86_op_e::pop:
+        case x86_op_e::movzx:
+            use(insn.src);
+            def(insn.dst);
+            break;
+        case x86_op_e::sete:
+        case x86_op_e::setne:
+        case x86_op_e::setl:
+        case x86_op_e::setge:
+        case x86_op_e::setle:
+        case x86_op_e::setg:
+            // Only the low byte, but a movzx of it always follows
+            def(insn.dst);
+            break;
+        case x86_op_e::add:
+        case x86_op_e::sub:
+        case x86_op_e::imul:
+        case x86_op_e::xor_:
+        case x86_op_e::neg:
+        case x86_op_e::shl:
+        case x86_op_e::sar:
+        case x86_op_e::shr:
+            use(insn.src);
+            use(insn.dst);
+            def(insn.dst);
+            break;
+        case x86_op_e::cmp:
+        case x86_op_e::imul_wide:
+        case x86_op_e::idiv:
+        case x86_op_e::push:
+            use(insn.dst);
+            use(insn.src);
+            break;
+        case x86_op_e::parallel_copy:
+            for (int64_t i = 0; i < insn.src.value; ++i) {
+                use(code.copies[insn.dst.value + i].src);
+            }
+            for (int64_t i = 0; i < insn.src.value; ++i) {
+                def(code.copies[insn.dst.value + i].dst);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Fixed size bit set per basic block, over the function's virtual registers
+struct vreg_sets_t
+{
+    size_t words;
+    std::vector<uint64_t> bits;
+
+    vreg_sets_t(size_t set_count, uint32_t vreg_count) : words((vreg_count + 63) / 64), bits(set_count * words, 0) {}
+
+    uint64_t* set(size_t index) { return bits.data() + index * words; }
+    static bool test(const uint64_t* set, uint32_t vreg) { return (set[vreg / 64] >> (vreg % 64)) & 1; }
+    static void add(uint64_t* set, uint32_t vreg) { set[vreg / 64] |= uint64_t(1) << (vreg % 64); }
+
+    // Calls visit(vreg) for each vreg in the set, only looking at set bits
+    template <typename Visit>
+    void for_each(const uint64_t* set, Visit&& visit) const {
+        for (size_t w = 0; w < words; ++w) {
+            for (uint64_t word = set[w]; word != 0; word &= word - 1) {
+                visit(static_cast<uint32_t>(w * 64 + std::countr_zero(word)));
+            }
+        }
+    }
+};
+
+struct block_t
+{
+    uint32_t first; // Index into the body
+    uint32_t last;
+    uint32_t successors[2];
+    uint32_t successor_count = 0;
+};
+
+constexpr uint32_t no_interval = UINT32_MAX;
+
+// Positions are doubled: instruction i reads its operands at 2i and writes
+// its results at 2i + 1, so a value can take over the register of one that
+// dies in the same instruction
+struct interval_t
+{
+    uint32_t vreg;
+    uint32_t start = no_interval;
+    uint32_t end = 0;
+    bool crosses_call = false;
+};
+
+struct allocator_t
+{
+    x86_code_t& code;
+    const std::vector<x86_label_t>& labels;
+    std::vector<x86_insn_t> body;
+    uint32_t vreg_count;
+
+    std::vector<block_t> blocks;
+    std::vector<interval_t> intervals;     // Indexed by vreg
+    std::vector<x86_reg_e> register_hint;  // From copies to or from a fixed register
+    std::vector<uint32_t> copy_hint;       // From copies between two vregs
+    std::unordered_map<uint32_t, std::vector<uint32_t>> live_after_call; // Body index of a call to vregs
+
+    std::vector<x86_operand_t> location;   // Register or spill slot per vreg
+    std::vector<uint32_t> spill_slot;
+    uint32_t spill_count = 0;
+    bool used[register_count] = {};
+    uint32_t call_saves = 0;
+
+    void build_blocks();
+    void compute_intervals();
+    void collect_hints();
+    void linear_scan();
+    void rewrite(bool save_callee_saved, std::vector<x86_insn_t>& out);
+    std::vector<x86_reg_e> clobbered_at_call(uint32_t call) const;
+
+    x86_operand_t substitute(const x86_operand_t& operand) const {
+        return is_vreg(operand) ? location[operand.value] : operand;
+    }
+};
+
+void allocator_t::build_blocks() {
+    std::unordered_map<x86_label_id_t, uint32_t> label_block;
+
+    // Leaders: the first instruction, every label and whatever follows a jump
+    std::vector<bool> leader(body.size() + 1, false);
+    leader[0] = true;
+    for (size_t i = 0; i < body.size(); ++i) {
+        if (body[i].op == x86_op_e::label) {
+            leader[i] = true;
+        } else if (is_branch(body[i].op) || body[i].op == x86_op_e::ret) {
+            leader[i + 1] = true;
+        }
+    }
+
+    for (size_t i = 0; i < body.size(); ++i) {
+        if (leader[i]) {
+            if (!blocks.empty()) {
+                blocks.back().last = static_cast<uint32_t>(i - 1);
+            }
+            blocks.push_back({static_cast<uint32_t>(i), static_cast<uint32_t>(i), {0, 0}});
+        }
+        if (body[i].op == x86_op_e::label) {
+            label_block[body[i].dst.label] = static_cast<uint32_t>(blocks.size() - 1);
+        }
+    }
+    if (!blocks.empty()) {
+        blocks.back().last = static_cast<uint32_t>(body.size() - 1);
+    }
+
+    for (size_t b = 0; b < blocks.size(); ++b) {
+        block_t& block = blocks[b];
+        const x86_insn_t& last = body[block.last];
+        const bool falls_through = last.op != x86_op_e::jmp && last.op != x86_op_e::ret;
+        if (is_branch(last.op)) {
+            auto target = label_block.find(last.dst.label);
+            if (target != label_block.end()) {
+                block.successors[block.successor_count++] = target->second;
+            }
+        }
+        if (falls_through && b + 1 < blocks.size()) {
+            block.successors[block.successor_count++] = static_cast<uint32_t>(b + 1);
+        }
+    }
+}
+
+void allocator_t::compute_intervals() {
+    const size_t block_count = blocks.size();
+    vreg_sets_t live_in(block_count, vreg_count);
+    vreg_sets_t live_out(block_count, vreg_count);
+
+    // What each block reads before writing it and what it writes, as lists:
+    // a block only touches a few of the function's vregs
+    std::vector<uint32_t> gen;
+    std::vector<uint32_t> kill;
+    std::vector<uint32_t> gen_begin(block_count + 1, 0);
+    std::vector<uint32_t> kill_begin(block_count + 1, 0);
+    {
+        vreg_sets_t seen(1, vreg_count);   // Read or written so far in the block
+        vreg_sets_t killed(1, vreg_count);
+        for (size_t b = 0; b < block_count; ++b) {
+            const size_t block_kill = kill.size();
+            for (uint32_t i = blocks[b].first; i <= blocks[b].last; ++i) {
+                for_each_vreg(code, body[i], [&](uint32_t vreg, bool is_def) {
+                    if (is_def) {
+                        if (!vreg_sets_t::test(killed.set(0), vreg)) {
+                            vreg_sets_t::add(killed.set(0), vreg);
+                            kill.push_back(vreg);
+                        }
+                    } else if (!vreg_sets_t::test(killed.set(0), vreg) && !vreg_sets_t::test(seen.set(0), vreg)) {
+                        vreg_sets_t::add(seen.set(0), vreg);
+                        gen.push_back(vreg);
+                    }
+                });
+            }
+            // Clear what this block set, not the whole sets
+            for (uint32_t g = gen_begin[b]; g < gen.size(); ++g) {
+                seen.set(0)[gen[g] / 64] = 0;
+            }
+            for (size_t k = block_kill; k < kill.size(); ++k) {
+                killed.set(0)[kill[k] / 64] = 0;
+            }
+            gen_begin[b + 1] = static_cast<uint32_t>(gen.size());
+            kill_begin[b + 1] = static_cast<uint32_t>(kill.size());
+        }
+    }
+
+    // Backwards dataflow, iterating blocks in reverse converges quickly
+    std::vector<uint64_t> updated(live_in.words);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t b = block_count; b-- > 0;) {
+            uint64_t* out = live_out.set(b);
+            for (uint32_t s = 0; s < blocks[b].successor_count; ++s) {
+                const uint64_t* successor_in = live_in.set(blocks[b].successors[s]);
+                for (size_t w = 0; w < live_out.words; ++w) {
+                    out[w] |= successor_in[w];
+                }
+            }
+            // in = gen + (out - kill)
+            std::copy(out, out + live_out.words, updated.begin());
+            for (uint32_t k = kill_begin[b]; k < kill_begin[b + 1]; ++k) {
+                updated[kill[k] / 64] &= ~(uint64_t(1) << (kill[k] % 64));
+            }
+            for (uint32_t g = gen_begin[b]; g < gen_begin[b + 1]; ++g) {
+                vreg_sets_t::add(updated.data(), gen[g]);
+            }
+            uint64_t* in = live_in.set(b);
+            if (!std::equal(updated.begin(), updated.end(), in)) {
+                std::copy(updated.begin(), updated.end(), in);
+                changed = true;
+            }
+        }
+    }
+
+    // What each call has to keep: walk every block backwards from its live
+    // out set and take the set after each call
+    std::vector<uint64_t> live(live_out.words);
+    for (size_t b = 0; b < block_count; ++b) {
+        const uint64_t* out = live_out.set(b);
+        std::copy(out, out + live_out.words, live.begin());
+        for (uint32_t i = blocks[b].last + 1; i-- > blocks[b].first;) {
+            if (body[i].op == x86_op_e::call) {
+                std::vector<uint32_t>& after = live_after_call[i];
+                live_out.for_each(live.data(), [&](uint32_t vreg) { after.push_back(vreg); });
+            }
+            // live = (live - defs) + uses, for_each_vreg hands out the uses
+            // first so they wait until the defs are gone
+            std::vector<uint32_t> uses;
+            for_each_vreg(code, body[i], [&](uint32_t vreg, bool is_def) {
+                if (is_def) {
+                    live[vreg / 64] &= ~(uint64_t(1) << (vreg % 64));
+                } else {
+                    uses.push_back(vreg);
+                }
+            });
+            for (uint32_t vreg : uses) {
+                vreg_sets_t::add(live.data(), vreg);
+            }
+        }
+    }
+
+    intervals.resize(vreg_count);
+    for (uint32_t v = 0; v < vreg_count; ++v) {
+        intervals[v].vreg = v;
+    }
+    auto extend = [&](uint32_t vreg, uint32_t position) {
+        intervals[vreg].start = std::min(intervals[vreg].start, position);
+        intervals[vreg].end = std::max(intervals[vreg].end, position);
+    };
+
+    for (size_t b = 0; b < block_count; ++b) {
+        const uint32_t block_start = 2 * blocks[b].first;
+        const uint32_t block_end = 2 * blocks[b].last + 1;
+        live_in.for_each(live_in.set(b), [&](uint32_t vreg) { extend(vreg, block_start); });
+        live_out.for_each(live_out.set(b), [&](uint32_t vreg) { extend(vreg, block_end); });
+        for (uint32_t i = blocks[b].first; i <= blocks[b].last; ++i) {
+            for_each_vreg(code, body[i], [&](uint32_t vreg, bool is_def) {
+                extend(vreg, is_def ? 2 * i + 1 : 2 * i);
+            });
+        }
+    }
+
+    std::vector<uint32_t> calls;
+    for (uint32_t i = 0; i < body.size(); ++i) {
+        if (body[i].op == x86_op_e::call) {
+            calls.push_back(2 * i);
+        }
+    }
+    for (interval_t& interval : intervals) {
+        if (interval.start == no_interval) {
+            continue;
+        }
+        auto call = std::upper_bound(calls.begin(), calls.end(), interval.start);
+        interval.crosses_call = call != calls.end() && *call < interval.end;
+    }
+}
+
+void allocator_t::collect_hints() {
+    register_hint.assign(vreg_count, x86_reg_e::none);
+    copy_hint.assign(vreg_count, no_interval);
+
+    auto hint = [&](const x86_operand_t& dst, const x86_operand_t& src) {
+        if (is_vreg(dst) && src.kind == x86_operand_kind_e::reg) {
+            if (is_allocatable(src.reg)) {
+                register_hint[dst.value] = src.reg;
+            }
+        } else if (is_vreg(src) && dst.kind == x86_operand_kind_e::reg) {
+            if (is_allocatable(dst.reg)) {
+                register_hint[src.value] = dst.reg;
+            }
+        } else if (is_vreg(dst) && is_vreg(src)) {
+            copy_hint[dst.value] = static_cast<uint32_t>(src.value);
+        }
+    };
+
+    for (const x86_insn_t& insn : body) {
+        if (insn.op == x86_op_e::mov) {
+            hint(insn.dst, insn.src);
+        } else if (insn.op == x86_op_e::parallel_copy) {
+            for (int64_t i = 0; i < insn.src.value; ++i) {
+                const x86_copy_t& copy = code.copies[insn.dst.value + i];
+                hint(copy.dst, copy.src);
+            }
+        }
+    }
+}
+
+void allocator_t::linear_scan() {
+    std::vector<uint32_t> order;
+    for (const interval_t& interval : intervals) {
+        if (interval.start != no_interval) {
+            order.push_back(interval.vreg);
+        }
+    }
+    std::sort(order.begin(), order.end(), [&](uint32_t lhs, uint32_t rhs) {
+        return intervals[lhs].start < intervals[rhs].start;
+    });
+
+    location.assign(vreg_count, x86_operand_t{});
+    spill_slot.assign(vreg_count, no_interval);
+
+    uint32_t owner[register_count];
+    std::fill(std::begin(owner), std::end(owner), no_interval);
+    std::vector<uint32_t> active; // vregs holding a register
+
+    auto spill = [&](uint32_t vreg) {
+        spill_slot[vreg] = spill_count++;
+    };
+
+    for (uint32_t vreg : order) {
+        const interval_t& current = intervals[vreg];
+
+        // Free the registers of everything that died before this starts
+        std::erase_if(active, [&](uint32_t other) {
+            if (intervals[other].end < current.start) {
+                owner[static_cast<size_t>(location[other].reg)] = no_interval;
+                return true;
+            }
+            return false;
+        });
+
+        auto is_free = [&](x86_reg_e reg) {
+            return owner[static_cast<size_t>(reg)] == no_interval;
+        };
+
+        x86_reg_e choice = x86_reg_e::none;
+        if (register_hint[vreg] != x86_reg_e::none && is_free(register_hint[vreg])) {
+            choice = register_hint[vreg];
+        } else if (copy_hint[vreg] != no_interval && location[copy_hint[vreg]].kind == x86_operand_kind_e::reg
+                   && is_free(location[copy_hint[vreg]].reg)) {
+            choice = location[copy_hint[vreg]].reg;
+        } else {
+            for (x86_reg_e reg : current.crosses_call ? std::span(across_calls) : std::span(allocatable)) {
+                if (is_free(reg)) {
+                    choice = reg;
+                    break;
+                }
+            }
+        }
+
+        if (choice == x86_reg_e::none) {
+            // Out of registers, spill whichever interval reaches furthest
+            uint32_t victim = no_interval;
+            for (uint32_t other : active) {
+                if (victim == no_interval || intervals[other].end > intervals[victim].end) {
+                    victim = other;
+                }
+            }
+            if (victim == no_interval || intervals[victim].end <= current.end) {
+                spill(vreg);
+                continue;
+            }
+            choice = location[victim].reg;
+            spill(victim);
+            std::erase(active, victim);
+        }
+
+        location[vreg] = x86_reg(choice);
+        owner[static_cast<size_t>(choice)] = vreg;
+        used[static_cast<size_t>(choice)] = true;
+        active.push_back(vreg);
+    }
+}
+
+// Appends a move, going through the scratch register where x86 can't do it
+// in one instruction
+void emit_move(std::vector<x86_insn_t>& out, const x86_operand_t& dst, const x86_operand_t& src) {
+    if (dst == src) {
+        return;
+    }
+    const bool big_immediate = src.kind == x86_operand_kind_e::imm && !fits_int32(src.value);
+    if (is_mem(dst) && (is_mem(src) || big_immediate)) {
+        out.push_back({x86_op_e::mov, x86_reg(scratch), src});
+        out.push_back({x86_op_e::mov, dst, x86_reg(scratch)});
+        return;
+    }
+    out.push_back({x86_op_e::mov, dst, src});
+}
+
+void emit_parallel_copy(std::vector<x86_insn_t>& out, std::vector<x86_copy_t> pending) {
+    std::erase_if(pending, [](const x86_copy_t& copy) { return copy.dst == copy.src; });
+
+    while (!pending.empty()) {
+        // A move is safe once nothing still waiting reads its destination
+        auto ready = std::find_if(pending.begin(), pending.end(), [&](const x86_copy_t& copy) {
+            return std::none_of(pending.begin(), pending.end(), [&](const x86_copy_t& other) {
+                return &other != &copy && other.src == copy.dst;
+            });
+        });
+
+        if (ready != pending.end()) {
+            emit_move(out, ready->dst, ready->src);
+            pending.erase(ready);
+            continue;
+        }
+
+        // Only cycles left, park one destination's value and read it from there
+        const x86_operand_t parked = pending.front().dst;
+        emit_move(out, x86_reg(cycle_scratch), parked);
+        for (x86_copy_t& copy : pending) {
+            if (copy.src == parked) {
+                copy.src = x86_reg(cycle_scratch);
+            }
+        }
+    }
+}
+
+// Registers holding a value the call at body index call has to keep, and
+// which the callee may overwrite
+std::vector<x86_reg_e> allocator_t::clobbered_at_call(uint32_t call) const {
+    std::vector<x86_reg_e> clobbered;
+    auto after = live_after_call.find(call);
+    if (after == live_after_call.end()) {
+        return clobbered;
+    }
+    for (uint32_t vreg : after->second) {
+        const x86_operand_t& where = location[vreg];
+        if (where.kind == x86_operand_kind_e::reg && !is_callee_saved(where.reg)
+            && std::find(clobbered.begin(), clobbered.end(), where.reg) == clobbered.end()) {
+            clobbered.push_back(where.reg);
+        }
+    }
+    return clobbered;
+}
+
+void allocator_t::rewrite(bool save_callee_saved, std::vector<x86_insn_t>& out) {
+    std::vector<x86_reg_e> saved;
+    if (save_callee_saved) {
+        for (x86_reg_e reg : callee_saved) {
+            if (used[static_cast<size_t>(reg)]) {
+                saved.push_back(reg);
+            }
+        }
+    }
+
+    // Frame: saved registers right below rbp, spill slots after them
+    const int32_t frame_size = static_cast<int32_t>((saved.size() + spill_count) * 8);
+    auto save_slot = [](size_t index) {
+        return x86_mem(x86_reg_e::rbp, -static_cast<int32_t>((index + 1) * 8));
+    };
+    for (uint32_t v = 0; v < vreg_count; ++v) {
+        if (spill_slot[v] != no_interval) {
+            location[v] = save_slot(saved.size() + spill_slot[v]);
+        }
+    }
+
+    out.push_back({x86_op_e::push, x86_reg(x86_reg_e::rbp), {}});
+    out.push_back({x86_op_e::mov, x86_reg(x86_reg_e::rbp), x86_reg(x86_reg_e::rsp)});
+    if (frame_size > 0) {
+        out.push_back({x86_op_e::sub, x86_reg(x86_reg_e::rsp), x86_imm(frame_size)});
+    }
+    for (size_t i = 0; i < saved.size(); ++i) {
+        out.push_back({x86_op_e::mov, save_slot(i), x86_reg(saved[i])});
+    }
+
+    // Saved around the call being selected, pushed before its argument moves
+    std::vector<x86_reg_e> call_saved;
+
+    for (uint32_t index = 0; index < body.size(); ++index) {
+        const x86_insn_t& insn = body[index];
+        const bool before_call = index + 1 < body.size() && body[index + 1].op == x86_op_e::call;
+        if (insn.op == x86_op_e::call || (insn.op == x86_op_e::parallel_copy && before_call)) {
+            if (insn.op != x86_op_e::call || index == 0 || body[index - 1].op != x86_op_e::parallel_copy) {
+                call_saved = clobbered_at_call(insn.op == x86_op_e::call ? index : index + 1);
+                for (x86_reg_e reg : call_saved) {
+                    out.push_back({x86_op_e::push, x86_reg(reg), {}});
+                }
+                call_saves += static_cast<uint32_t>(call_saved.size());
+            }
+        }
+
+        x86_insn_t rewritten = insn;
+        rewritten.dst = substitute(insn.dst);
+        rewritten.src = substitute(insn.src);
+        const x86_operand_t& dst = rewritten.dst;
+        const x86_operand_t& src = rewritten.src;
+        const bool big_immediate = src.kind == x86_operand_kind_e::imm && !fits_int32(src.value);
+
+        switch (insn.op) {
+            case x86_op_e::parallel_copy: {
+                std::vector<x86_copy_t> copies;
+                for (int64_t i = 0; i < insn.src.value; ++i) {
+                    const x86_copy_t& copy = code.copies[insn.dst.value + i];
+                    copies.push_back({substitute(copy.dst), substitute(copy.src)});
+                }
+                emit_parallel_copy(out, std::move(copies));
+                continue;
+            }
+
+            case x86_op_e::jmp:
+                if (!labels[insn.dst.label].is_function) {
+                    break;
+                }
+                // A tail call, the callee returns for this function so the
+                // frame has to go first
+                [[fallthrough]];
+            case x86_op_e::ret:
+                for (size_t i = 0; i < saved.size(); ++i) {
+                    out.push_back({x86_op_e::mov, x86_reg(saved[i]), save_slot(i)});
+                }
+                out.push_back({x86_op_e::mov, x86_reg(x86_reg_e::rsp), x86_reg(x86_reg_e::rbp)});
+                out.push_back({x86_op_e::pop, x86_reg(x86_reg_e::rbp), {}});
+                out.push_back(rewritten);
+                continue;
+
+            case x86_op_e::call:
+                out.push_back(rewritten);
+                for (size_t i = call_saved.size(); i-- > 0;) {
+                    out.push_back({x86_op_e::pop, x86_reg(call_saved[i]), {}});
+                }
+                call_saved.clear();
+                continue;
+
+            case x86_op_e::mov: {
+                const size_t mark = out.size();
+                emit_move(out, dst, src);
+                if (out.size() > mark) {
+                    out.back().comment = insn.comment;
+                }
+                continue;
+            }
+
+            case x86_op_e::add:
+            case x86_op_e::sub:
+            case x86_op_e::xor_:
+            case x86_op_e::cmp:
+                if ((is_mem(dst) && is_mem(src)) || big_immediate) {
+                    out.push_back({x86_op_e::mov, x86_reg(scratch), src});
+                    rewritten.src = x86_reg(scratch);
+                }
+                break;
+
+            case x86_op_e::movzx:
+                if (is_mem(dst)) {
+                    out.push_back({x86_op_e::movzx, x86_reg(scratch), src});
+                    out.push_back({x86_op_e::mov, dst, x86_reg(scratch)});
+                    continue;
+                }
+                break;
+
+            case x86_op_e::imul:
+                if (is_mem(dst)) {
+                    // imul can only write a register
+                    x86_operand_t factor = src;
+                    if (big_immediate) {
+                        out.push_back({x86_op_e::mov, x86_reg(cycle_scratch), src});
+                        factor = x86_reg(cycle_scratch);
+                    }
+                    out.push_back({x86_op_e::mov, x86_reg(scratch), dst});
+                    out.push_back({x86_op_e::imul, x86_reg(scratch), factor});
+                    out.push_back({x86_op_e::mov, dst, x86_reg(scratch)});
+                    continue;
+                }
+                if (big_immediate) {
+                    out.push_back({x86_op_e::mov, x86_reg(scratch), src});
+                    rewritten.src = x86_reg(scratch);
+                }
+                break;
+
+            default:
+                break;
+        }
+
+        out.push_back(rewritten);
+    }
+}
+
+} // namespace
+
+regalloc_stats_t allocate_registers(x86_code_t& code, const std::vector<x86_label_t>& labels, size_t begin,
+                                    uint32_t vreg_count, bool save_callee_saved) {
+    allocator_t allocator{code, labels, {}, vreg_count, {}, {}, {}, {}, {}, {}, {}};
+    allocator.body.assign(code.text.begin() + begin, code.text.end());
+    code.text.resize(begin);
+
+    regalloc_stats_t stats;
+    if (!allocator.body.empty()) {
+        allocator.build_blocks();
+        allocator.compute_intervals();
+        allocator.collect_hints();
+        allocator.linear_scan();
+        for (const interval_t& interval : allocator.intervals) {
+            stats.intervals += interval.start != no_interval;
+        }
+        stats.spilled = allocator.spill_count;
+    } else {
+        allocator.location.assign(vreg_count, x86_operand_t{});
+        allocator.spill_slot.assign(vreg_count, no_interval);
+    }
+
+    allocator.rewrite(save_callee_saved, code.text);
+    stats.call_saves = allocator.call_saves;
+    return stats;
+}
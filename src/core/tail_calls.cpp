@@ -0,0 +1,123 @@
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "core/passes.hpp"
+#include "utils/error.hpp"
+
+namespace {
+
+// Whether the block ends in a call whose result is returned as is, the
+// call is the second to last instruction then
+bool ends_in_tail_call(const ir_block_t& block) {
+    if (block.insns.size() < 2 || block.terminator().op != ir_op_e::ret) {
+        return false;
+    }
+    const ir_insn_t& call = block.insns[block.insns.size() - 2];
+    const ir_operand_t& result = block.terminator().a;
+    return call.op == ir_op_e::call && (result.kind == ir_operand_kind_e::none || result == ir_value(call.dst));
+}
+
+// Turns the calls of function to itself in tail position into jumps back to
+// the start of its body. Returns how many there were.
+uint32_t loop_self_calls(ir_function_t& function, uint32_t index) {
+    uint32_t replaced = 0;
+    ir_block_id_t header = no_block;
+
+    // Blocks appended below end in a jump, the loop doesn't need to see them
+    const ir_block_id_t block_count = static_cast<ir_block_id_t>(function.blocks.size());
+    for (ir_block_id_t id = 0; id < block_count; ++id) {
+        if (!ends_in_tail_call(function.blocks[id])) {
+            continue;
+        }
+        const ir_insn_t call = function.blocks[id].insns[function.blocks[id].insns.size() - 2];
+        if (call.index != index || call.count != function.param_count) {
+            continue;
+        }
+
+        // Nothing may jump to the entry block, so the body moves to a new
+        // block the entry falls into
+        if (header == no_block) {
+            header = static_cast<ir_block_id_t>(function.blocks.size());
+            function.blocks.emplace_back().name = "tail_recursion";
+            function.blocks[header].insns = std::move(function.blocks[0].insns);
+            function.blocks[0].insns.clear();
+            ir_insn_t enter(ir_op_e::jump);
+            enter.target[0] = header;
+            function.blocks[0].insns.push_back(enter);
+            if (id == 0) {
+                id = header;
+            }
+        }
+
+        std::vector<ir_insn_t>& insns = function.blocks[id].insns;
+        insns.erase(insns.end() - 2, insns.end());
+
+        // The arguments may read parameters assigned before them, so they
+        // all go through temporaries first
+        std::vector<ir_value_t> temporaries;
+        for (uint32_t i = 0; i < call.count; ++i) {
+            const ir_operand_t argument = function.arguments[call.first + i];
+            if (argument == ir_value(i)) {
+                temporaries.push_back(no_value);
+                continue;
+            }
+            ir_insn_t copy(ir_op_e::copy);
+            copy.dst = function.new_value();
+            copy.a = argument;
+            insns.push_back(copy);
+            temporaries.push_back(copy.dst);
+        }
+        for (uint32_t i = 0; i < call.count; ++i) {
+            if (temporaries[i] == no_value) {
+                continue;
+            }
+            ir_insn_t copy(ir_op_e::copy);
+            copy.dst = i;
+            copy.a = ir_value(temporaries[i]);
+            insns.push_back(copy);
+        }
+        ir_insn_t back(ir_op_e::jump);
+        back.target[0] = header;
+        insns.push_back(back);
+        ++replaced;
+    }
+    return replaced;
+}
+
+} // namespace
+
+uint32_t eliminate_tail_recursion(ir_module_t& module) {
+    uint32_t replaced = 0;
+    for (uint32_t index = 0; index < module.functions.size(); ++index) {
+        if (index == module.entry) {
+            continue;
+        }
+        const uint32_t count = loop_self_calls(module.functions[index], index);
+        if (count > 0) {
+            info_msg("Turned {} self calls in '{}' into a loop", count, module.functions[index].name);
+        }
+        replaced += count;
+    }
+    return replaced;
+}
+
+uint32_t mark_tail_calls(ir_module_t& module) {
+    uint32_t marked = 0;
+    for (uint32_t index = 0; index < module.functions.size(); ++index) {
+        if (index == module.entry) {
+            continue;
+        }
+        for (ir_block_t& block : module.functions[index].blocks) {
+            if (!ends_in_tail_call(block)) {
+                continue;
+            }
+            block.insns.pop_back();
+            ir_insn_t& call = block.insns.back();
+            call.op = ir_op_e::tail_call;
+            call.dst = no_value;
+            ++marked;
+        }
+    }
+    return marked;
+}
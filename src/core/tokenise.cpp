@@ -1,177 +1,352 @@
-#include <string>
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "core/tokenise.hpp"
 #include "utils/error.hpp"
 
 
-char consume(const std::string &contents, size_t &token_index) {
+char consume(std::string_view contents, size_t &token_index) {
     return contents[token_index++];
 }
 
-char peek(const std::string &contents, size_t token_index) {
-    if (token_index >= contents.length()) {
+char peek(std::string_view contents, size_t token_index) {
+    if (token_index >= contents.size()) {
         return '\0';
     }
     return contents[token_index];
 }
 
-char peek_ahead(const std::string &contents, size_t token_index, size_t amount_ahead) {
-    if (token_index + amount_ahead >= contents.length()) {
-        return '\0';
+namespace {
+
+// What the lexer should do when it sees a given byte
+enum class char_class_e : uint8_t
+{
+    invalid,
+    end,          // '\0' terminates the input like it always has
+    space,
+    digit,
+    alpha,
+    single,       // One character token, type is in char_table_t::single
+    compound,     // Token on its own, or a two character operator when followed by '='
+    needs_equals, // Only valid when followed by '=' ('!')
+};
+
+struct char_table_t
+{
+    std::array<char_class_e, 256> classes{};
+    std::array<token_type_e, 256> single{};
+    std::array<token_type_e, 256> with_equals{};
+};
+
+constexpr char_table_t build_char_table() {
+    char_table_t table;
+    table.classes.fill(char_class_e::invalid);
+
+    table.classes['\0'] = char_class_e::end;
+    for (char c : {' ', '\t', '\n', '\v', '\f', '\r'}) {
+        table.classes[static_cast<uint8_t>(c)] = char_class_e::space;
     }
-    return contents[token_index + amount_ahead];
+    for (int c = '0'; c <= '9'; ++c) {
+        table.classes[c] = char_class_e::digit;
+    }
+    for (int c = 'a'; c <= 'z'; ++c) {
+        table.classes[c] = char_class_e::alpha;
+        table.classes[c - 'a' + 'A'] = char_class_e::alpha;
+    }
+
+    auto set_single = [&](char c, token_type_e type) {
+        table.classes[static_cast<uint8_t>(c)] = char_class_e::single;
+        table.single[static_cast<uint8_t>(c)] = type;
+    };
+    set_single('*', token_type_e::type_mul);
+    set_single('/', token_type_e::type_div);
+    set_single('+', token_type_e::type_add);
+    set_single('-', token_type_e::type_sub);
+    set_single(';', token_type_e::type_semi);
+    set_single('(', token_type_e::type_open_paren);
+    set_single(')', token_type_e::type_close_paren);
+    set_single('{', token_type_e::type_open_squigly);
+    set_single('}', token_type_e::type_close_squigly);
+    set_single(',', token_type_e::type_comma);
+
+    auto set_compound = [&](char c, token_type_e alone, token_type_e with_equals) {
+        table.classes[static_cast<uint8_t>(c)] = char_class_e::compound;
+        table.single[static_cast<uint8_t>(c)] = alone;
+        table.with_equals[static_cast<uint8_t>(c)] = with_equals;
+    };
+    set_compound('=', token_type_e::type_assignment, token_type_e::type_eq);
+    set_compound('>', token_type_e::type_gt, token_type_e::type_ge);
+    set_compound('<', token_type_e::type_lt, token_type_e::type_le);
+
+    table.classes['!'] = char_class_e::needs_equals;
+    table.with_equals['!'] = token_type_e::type_nq;
+
+    return table;
 }
 
-std::vector<token_t> tokenise(const std::string &contents) {
-    std::vector<token_t> tokens;
-    size_t token_index = 0;
+constexpr char_table_t char_table = build_char_table();
 
-    while (peek(contents, token_index) != '\0') {
-        // Skip any whitespace characters
-        if (isspace(peek(contents, token_index))) {
-            while (isspace(peek(contents, token_index))) {
-                consume(contents, token_index);
-            }
-            continue;  // Do not create a token for whitespace.
-        }
+char_class_e class_of(char c) {
+    return char_table.classes[static_cast<uint8_t>(c)];
+}
 
-        token_t curr_token;
+// Keywords are looked up through a perfect hash. The seed is searched for at
+// compile time, so adding a keyword either still fits the table or fails the
+// static_assert below instead of silently colliding.
+struct keyword_t
+{
+    std::string_view text;
+    token_type_e type;
+};
 
-        if (isdigit(peek(contents, token_index))) {
-            curr_token.type = token_type_e::type_int_lit;
-            std::string num;
-            while (isdigit(peek(contents, token_index))) {
-                num += peek(contents, token_index);
-                consume(contents, token_index);
-            }
-            curr_token.value = num;
-        }
-        else if (isalpha(peek(contents, token_index))) {
-            std::string word;
-            while (isalpha(peek(contents, token_index))) {
-                word += peek(contents, token_index);
-                consume(contents, token_index);
-            }
-            if (word == "exit")
-                curr_token.type = token_type_e::type_exit;
-            else if (word == "let")
-                curr_token.type = token_type_e::type_let;
-            else if (word ==  "if") {
-                curr_token.type = token_type_e::type_if;
-            } else if (word == "while") {
-                curr_token.type = token_type_e::type_while;
-            }
-            else if (word == "else") {
-                curr_token.type = token_type_e::type_else;
-            } else if (word == "return") {
-                curr_token.type = token_type_e::type_return;
-            } else if (word == "fn") {
-                curr_token.type = token_type_e::type_fn;
-            } 
-            else
-                curr_token.type = token_type_e::type_identifier;
-            curr_token.value = word;
-        }
-        else if (peek(contents, token_index) == '*') {
-            curr_token.type = token_type_e::type_mul;
-            curr_token.value = std::string(1, consume(contents, token_index));
-        }
-        else if (peek(contents, token_index) == '/') {
-            curr_token.type = token_type_e::type_div;
-            curr_token.value = std::string(1, consume(contents, token_index));
-        }
-        else if (peek(contents, token_index) == '+') {
-            curr_token.type = token_type_e::type_add;
-            curr_token.value = std::string(1, consume(contents, token_index));
-        }
-        else if (peek(contents, token_index) == '-') {
-            curr_token.type = token_type_e::type_sub;
-            curr_token.value = std::string(1, consume(contents, token_index));
-        }
-        else if (peek(contents, token_index) == ';') {
-            curr_token.type = token_type_e::type_semi;
-            curr_token.value = std::string(1, consume(contents, token_index));
-        }
-        else if (peek(contents, token_index) == '(') {
-            curr_token.type = token_type_e::type_open_paren;
-            curr_token.value = std::string(1, consume(contents, token_index));
+constexpr keyword_t keywords[] = {
+    {"exit", token_type_e::type_exit},
+    {"let", token_type_e::type_let},
+    {"if", token_type_e::type_if},
+    {"while", token_type_e::type_while},
+    {"else", token_type_e::type_else},
+    {"return", token_type_e::type_return},
+    {"fn", token_type_e::type_fn},
+};
+
+constexpr size_t keyword_table_size = 16;
+static_assert((keyword_table_size & (keyword_table_size - 1)) == 0, "keyword table size must be a power of two");
+
+constexpr uint32_t keyword_hash(std::string_view word, uint32_t seed) {
+    uint32_t h = static_cast<uint8_t>(word.front()) * seed + static_cast<uint8_t>(word.back()) +
+                 static_cast<uint32_t>(word.size()) * 7;
+    return (h ^ (h >> 5)) & (keyword_table_size - 1);
+}
+
+consteval uint32_t find_keyword_seed() {
+    for (uint32_t seed = 1; seed < 4096; ++seed) {
+        bool used[keyword_table_size] = {};
+        bool collision = false;
+        for (const keyword_t& keyword : keywords) {
+            uint32_t slot = keyword_hash(keyword.text, seed);
+            collision |= used[slot];
+            used[slot] = true;
         }
-        else if (peek(contents, token_index) == ')') {
-            curr_token.type = token_type_e::type_close_paren;
-            curr_token.value = std::string(1, consume(contents, token_index));
+        if (!collision) {
+            return seed;
         }
-        else if (peek(contents, token_index) == '=') {
-            // Check for ==
-            if (peek_ahead(contents, token_index, 1) == '=') {
-                curr_token.type = token_type_e::type_eq;
-                curr_token.value = "==";
-                consume(contents, token_index); // Consume first '='
-                consume(contents, token_index); // Consume second '='
-            } else {
-                curr_token.type = token_type_e::type_assignment;
-                curr_token.value = std::string(1, consume(contents, token_index));
-            }
+    }
+    return 0;
+}
+
+constexpr uint32_t keyword_seed = find_keyword_seed();
+static_assert(keyword_seed != 0, "no collision free seed for the keyword table");
+
+consteval std::array<keyword_t, keyword_table_size> build_keyword_table() {
+    std::array<keyword_t, keyword_table_size> table{};
+    table.fill({"", token_type_e::type_identifier});
+    for (const keyword_t& keyword : keywords) {
+        table[keyword_hash(keyword.text, keyword_seed)] = keyword;
+    }
+    return table;
+}
+
+constexpr std::array<keyword_t, keyword_table_size> keyword_table = build_keyword_table();
+
+consteval size_t longest_keyword() {
+    size_t longest = 0;
+    for (const keyword_t& keyword : keywords) {
+        longest = keyword.text.size() > longest ? keyword.text.size() : longest;
+    }
+    return longest;
+}
+
+token_type_e lookup_keyword(std::string_view word) {
+    if (word.size() > longest_keyword()) {
+        return token_type_e::type_identifier;
+    }
+    const keyword_t& keyword = keyword_table[keyword_hash(word, keyword_seed)];
+    return keyword.text == word ? keyword.type : token_type_e::type_identifier;
+}
+
+// Run scanners: return the first position at or after pos that isn't part of
+// the run. With SSE2 they test 16 bytes per iteration and only fall back to
+// the table for the tail of the buffer, we never read past contents.size().
+#if defined(__SSE2__)
+// Lanes where lo <= byte <= lo + span, as unsigned bytes
+inline __m128i in_range(__m128i chunk, char lo, char span) {
+    __m128i offset = _mm_sub_epi8(chunk, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(span)), offset);
+}
+
+template <typename Predicate>
+size_t scan_run_simd(const char *data, size_t pos, size_t size, Predicate predicate) {
+    while (pos + 16 <= size) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(predicate(chunk)));
+        if (mask != 0xFFFF) {
+            return pos + __builtin_ctz(~mask);
         }
-        else if (peek(contents, token_index) == '!') {
-            // Check for !=
-            if (peek_ahead(contents, token_index, 1) == '=') {
-                curr_token.type = token_type_e::type_nq;
-                curr_token.value = "!=";
-                consume(contents, token_index); // Consume '!'
-                consume(contents, token_index); // Consume '='
-            } else {
-                error_msg("Invalid token: expected '=' after '!'");
-                consume(contents, token_index); // Consume '!'
-                continue;
+        pos += 16;
+    }
+    return pos;
+}
+#endif
+
+size_t scan_run_scalar(const char *data, size_t pos, size_t size, char_class_e run_class) {
+    while (pos < size && class_of(data[pos]) == run_class) {
+        ++pos;
+    }
+    return pos;
+}
+
+size_t scan_space(const char *data, size_t pos, size_t size) {
+#if defined(__SSE2__)
+    pos = scan_run_simd(data, pos, size, [](__m128i chunk) {
+        // '\t'..'\r' or ' '
+        return _mm_or_si128(in_range(chunk, '\t', '\r' - '\t'), _mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')));
+    });
+#endif
+    return scan_run_scalar(data, pos, size, char_class_e::space);
+}
+
+size_t scan_digits(const char *data, size_t pos, size_t size) {
+#if defined(__SSE2__)
+    pos = scan_run_simd(data, pos, size, [](__m128i chunk) {
+        return in_range(chunk, '0', 9);
+    });
+#endif
+    return scan_run_scalar(data, pos, size, char_class_e::digit);
+}
+
+size_t scan_alpha(const char *data, size_t pos, size_t size) {
+#if defined(__SSE2__)
+    pos = scan_run_simd(data, pos, size, [](__m128i chunk) {
+        // Folding to lower case maps both letter ranges onto 'a'..'z'
+        return in_range(_mm_or_si128(chunk, _mm_set1_epi8(0x20)), 'a', 25);
+    });
+#endif
+    return scan_run_scalar(data, pos, size, char_class_e::alpha);
+}
+
+} // namespace
+
+lexer_t::lexer_t(std::string_view contents, string_interner_t& symbols, uint32_t file)
+    : symbols(symbols), contents(contents), file(file) {}
+
+token_t lexer_t::lex_next() {
+    const char *data = contents.data();
+    const size_t size = contents.size();
+
+    while (pos < size) {
+        const uint8_t c = static_cast<uint8_t>(data[pos]);
+        const size_t token_start = pos;
+        token_t curr_token;
+
+        switch (char_table.classes[c]) {
+        case char_class_e::end:
+            pos = size;
+            continue;
+        case char_class_e::space:
+            pos = scan_space(data, pos + 1, size);
+            continue;  // Do not create a token for whitespace.
+        case char_class_e::digit:
+            curr_token.type = token_type_e::type_int_lit;
+            pos = scan_digits(data, pos + 1, size);
+            break;
+        case char_class_e::alpha:
+            pos = scan_alpha(data, pos + 1, size);
+            curr_token.type = lookup_keyword(contents.substr(token_start, pos - token_start));
+            if (curr_token.type == token_type_e::type_identifier) {
+                curr_token.symbol = symbols.intern(contents.substr(token_start, pos - token_start));
             }
-        }
-         else if (peek(contents, token_index) == '>') {
-            // Check for >=
-            if (peek_ahead(contents, token_index, 1) == '=') {
-                curr_token.type = token_type_e::type_ge;
-                curr_token.value = ">=";
-                consume(contents, token_index); // Consume '>'
-                consume(contents, token_index); // Consume '='
+            break;
+        case char_class_e::single:
+            curr_token.type = char_table.single[c];
+            ++pos;
+            break;
+        case char_class_e::compound:
+            if (pos + 1 < size && data[pos + 1] == '=') {
+                curr_token.type = char_table.with_equals[c];
+                pos += 2;
             } else {
-                curr_token.type = token_type_e::type_gt; // greater than
-                curr_token.value = std::string(1, consume(contents, token_index));
+                curr_token.type = char_table.single[c];
+                ++pos;
             }
-        }
-         else if (peek(contents, token_index) == '<') {
-            // Check for <=
-            if (peek_ahead(contents, token_index, 1) == '=') {
-                curr_token.type = token_type_e::type_le;
-                curr_token.value = "<=";
-                consume(contents, token_index); // Consume '<'
-                consume(contents, token_index); // Consume '='
-            } else {
-                curr_token.type = token_type_e::type_lt; // less than
-                curr_token.value = std::string(1, consume(contents, token_index));
+            break;
+        case char_class_e::needs_equals:
+            if (pos + 1 < size && data[pos + 1] == '=') {
+                curr_token.type = char_table.with_equals[c];
+                pos += 2;
+                break;
             }
-        
-        }else if (peek(contents, token_index) == '{') {
-            curr_token.type = token_type_e::type_open_squigly;
-            curr_token.value = std::string(1, consume(contents, token_index));
-        }else if (peek(contents, token_index) == '}') {
-            curr_token.type = token_type_e::type_close_squigly;
-            curr_token.value = std::string(1, consume(contents, token_index));
-        } else if (peek(contents, token_index) == ',') {
-            curr_token.type = token_type_e::type_comma;
-            curr_token.value = std::string(1, consume(contents, token_index));
-        }
-        else {
-            error_msg("Invalid token");
-            consume(contents, token_index); // Consume unknown character
+            error_at({file, static_cast<uint32_t>(token_start)}, "Invalid token: expected '=' after '!'");
+            ++pos;
+            continue;
+        case char_class_e::invalid:
+        default:
+            error_at({file, static_cast<uint32_t>(token_start)}, "Invalid token");
+            ++pos; // Consume unknown character
             continue;
         }
 
-        tokens.push_back(curr_token);
+        curr_token.value = contents.substr(token_start, pos - token_start);
+        curr_token.offset = static_cast<uint32_t>(token_start);
+        curr_token.file = file;
+        return curr_token;
     }
 
-    // Append the EOF token.
     token_t eof_token;
     eof_token.type = token_type_e::type_EOF;
-    tokens.push_back(eof_token);
+    eof_token.offset = static_cast<uint32_t>(size);
+    eof_token.file = file;
+    return eof_token;
+}
 
+// Make sure `wanted` tokens are buffered, false if the stream ends first
+bool lexer_t::fill(size_t wanted) {
+    while (buffered < wanted) {
+        if (eof_lexed) {
+            return false;
+        }
+        token_t token = lex_next();
+        eof_lexed = token.type == token_type_e::type_EOF;
+        ring[(head + buffered) % ring.size()] = token;
+        ++buffered;
+        ++lexed_count;
+    }
+    return true;
+}
+
+const token_t* lexer_t::peek(size_t ahead) {
+    if (ahead >= max_lookahead) {
+        error_msg("Lexer lookahead of {} exceeds the maximum of {}", ahead, max_lookahead - 1);
+        return nullptr;
+    }
+    if (!fill(ahead + 1)) {
+        return nullptr;
+    }
+    return &ring[(head + ahead) % ring.size()];
+}
+
+const token_t* lexer_t::consume() {
+    if (!fill(1)) {
+        return nullptr;
+    }
+    const token_t* token = &ring[head];
+    head = (head + 1) % ring.size();
+    --buffered;
+    return token;
+}
+
+std::vector<token_t> tokenise(std::string_view contents, string_interner_t& symbols) {
+    std::vector<token_t> tokens;
+    // Rough guess at token density so the vector doesn't keep regrowing on big inputs
+    tokens.reserve(contents.size() / 4 + 1);
+
+    lexer_t lexer(contents, symbols);
+    while (const token_t* token = lexer.consume()) {
+        tokens.push_back(*token);
+    }
     return tokens;
 }
@@ -0,0 +1,229 @@
+#include <algorithm>
+#include <iterator>
+
+#include "core/x86.hpp"
+
+x86_label_id_t x86_program_t::label(std::string_view name) {
+    auto [it, inserted] = label_lookup.try_emplace(std::string(name), static_cast<x86_label_id_t>(labels.size()));
+    if (inserted) {
+        labels.push_back({std::string(name)});
+    }
+    return it->second;
+}
+
+x86_label_id_t x86_program_t::add_data(std::string_view name) {
+    x86_label_id_t id = label(name);
+    labels[id].section = x86_section_e::data;
+    labels[id].is_placed = true;
+    data.push_back(id);
+    return id;
+}
+
+void x86_program_t::place(x86_label_id_t label) {
+    labels[label].is_placed = true;
+    emit(x86_op_e::label, x86_label(label));
+}
+
+void x86_program_t::append(x86_code_t&& code) {
+    const uint32_t comment_base = static_cast<uint32_t>(comments.size());
+    const int64_t copy_base = static_cast<int64_t>(copies.size());
+    for (x86_insn_t& insn : code.text) {
+        if (insn.comment != no_comment) {
+            insn.comment += comment_base;
+        }
+        if (insn.op == x86_op_e::parallel_copy) {
+            insn.dst.value += copy_base;
+        } else if (insn.op == x86_op_e::label) {
+            labels[insn.dst.label].is_placed = true;
+        }
+        text.push_back(insn);
+    }
+    std::move(code.comments.begin(), code.comments.end(), std::back_inserter(comments));
+    copies.insert(copies.end(), code.copies.begin(), code.copies.end());
+    code = {};
+}
+
+void x86_code_t::emit_parallel_copy(const std::vector<x86_copy_t>& moves) {
+    emit(x86_op_e::parallel_copy, x86_imm(copies.size()), x86_imm(moves.size()));
+    copies.insert(copies.end(), moves.begin(), moves.end());
+}
+
+std::string_view x86_reg_name(x86_reg_e reg) {
+    static constexpr std::string_view names[] = {
+        "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+    };
+    if (reg == x86_reg_e::none) {
+        return "<none>";
+    }
+    return names[static_cast<size_t>(reg)];
+}
+
+std::string_view x86_byte_reg_name(x86_reg_e reg) {
+    static constexpr std::string_view names[] = {
+        "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+        "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
+    };
+    if (reg == x86_reg_e::none) {
+        return "<none>";
+    }
+    return names[static_cast<size_t>(reg)];
+}
+
+std::string_view x86_op_name(x86_op_e op) {
+    switch (op) {
+        case x86_op_e::label: return "<label>";
+        case x86_op_e::comment: return "<comment>";
+        case x86_op_e::parallel_copy: return "<parallel copy>";
+        case x86_op_e::mov: return "mov";
+        case x86_op_e::push: return "push";
+        case x86_op_e::pop: return "pop";
+        case x86_op_e::add: return "add";
+        case x86_op_e::sub: return "sub";
+        case x86_op_e::imul: return "imul";
+        case x86_op_e::imul_wide: return "imul";
+        case x86_op_e::cqo: return "cqo";
+        case x86_op_e::idiv: return "idiv";
+        case x86_op_e::neg: return "neg";
+        case x86_op_e::shl: return "shl";
+        case x86_op_e::sar: return "sar";
+        case x86_op_e::shr: return "shr";
+        case x86_op_e::lea: return "lea";
+        case x86_op_e::xor_: return "xor";
+        case x86_op_e::cmp: return "cmp";
+        case x86_op_e::sete: return "sete";
+        case x86_op_e::setne: return "setne";
+        case x86_op_e::setl: return "setl";
+        case x86_op_e::setge: return "setge";
+        case x86_op_e::setle: return "setle";
+        case x86_op_e::setg: return "setg";
+        case x86_op_e::movzx: return "movzx";
+        case x86_op_e::jmp: return "jmp";
+        case x86_op_e::je: return "je";
+        case x86_op_e::jne: return "jne";
+        case x86_op_e::jl: return "jl";
+        case x86_op_e::jge: return "jge";
+        case x86_op_e::jle: return "jle";
+        case x86_op_e::jg: return "jg";
+        case x86_op_e::call: return "call";
+        case x86_op_e::ret: return "ret";
+        case x86_op_e::syscall: return "syscall";
+    }
+    return "<unknown>";
+}
+
+static void append_operand(std::string& text, const x86_program_t& program, const x86_operand_t& operand, bool needs_size,
+                           bool is_byte = false) {
+    switch (operand.kind) {
+        case x86_operand_kind_e::none:
+            break;
+        case x86_operand_kind_e::reg:
+            text += is_byte ? x86_byte_reg_name(operand.reg) : x86_reg_name(operand.reg);
+            break;
+        case x86_operand_kind_e::vreg:
+            std::format_to(std::back_inserter(text), "v{}", operand.value);
+            break;
+        case x86_operand_kind_e::imm:
+            std::format_to(std::back_inserter(text), "{}", operand.value);
+            break;
+        case x86_operand_kind_e::mem:
+            if (is_byte) {
+                text += "byte ";
+            } else if (needs_size) {
+                text += "qword ";
+            }
+            if (operand.reg == x86_reg_e::none) {
+                std::format_to(std::back_inserter(text), "[{}]", program.labels[operand.label].name);
+            } else if (operand.index != x86_reg_e::none) {
+                std::format_to(std::back_inserter(text), "[{}+{}*{}", x86_reg_name(operand.reg),
+                               x86_reg_name(operand.index), operand.scale);
+                if (operand.value != 0) {
+                    std::format_to(std::back_inserter(text), "{:+}", operand.value);
+                }
+                text += ']';
+            } else if (operand.value == 0) {
+                std::format_to(std::back_inserter(text), "[{}]", x86_reg_name(operand.reg));
+            } else {
+                std::format_to(std::back_inserter(text), "[{}{:+}]", x86_reg_name(operand.reg), operand.value);
+            }
+            break;
+        case x86_operand_kind_e::label:
+            text += program.labels[operand.label].name;
+            break;
+    }
+}
+
+void print_fasm(const x86_program_t& program, asm_emitter_t& out) {
+    out.line("format ELF64");
+
+    out.line("section '.data' writeable");
+    for (x86_label_id_t label : program.data) {
+        const std::string& name = program.labels[label].name;
+        out.format_line("    {} dq 0", name);
+        out.format_line("    {}_len = $ - {}", name, name);
+    }
+
+    out.line("section '.text' executable");
+
+    // Functions of other files never get placed here
+    for (const x86_label_t& label : program.labels) {
+        if (label.is_function && !label.is_placed) {
+            out.format_line("extrn {}", label.name);
+        }
+    }
+
+    std::string text;
+    for (const x86_insn_t& insn : program.text) {
+        if (insn.op == x86_op_e::label) {
+            const x86_label_t& label = program.labels[insn.dst.label];
+            if (label.is_function) {
+                out.blank_line();
+            }
+            if (label.is_public) {
+                out.format_line("public {}", label.name);
+            }
+            out.format_line("{}:", label.name);
+            continue;
+        }
+
+        if (insn.op == x86_op_e::comment) {
+            out.format_line("    ; {}", program.comments[insn.comment]);
+            continue;
+        }
+
+        // Only left before register allocation, not something fasm knows
+        if (insn.op == x86_op_e::parallel_copy) {
+            text.assign("    ; parallel copy");
+            for (int64_t i = 0; i < insn.src.value; ++i) {
+                const x86_copy_t& copy = program.copies[insn.dst.value + i];
+                text += i == 0 ? " " : ", ";
+                append_operand(text, program, copy.dst, false);
+                text += " <- ";
+                append_operand(text, program, copy.src, false);
+            }
+            out.line(text);
+            continue;
+        }
+
+        text.assign("    ");
+        text += x86_op_name(insn.op);
+        // setcc writes a byte, movzx reads one
+        const bool byte_dst = insn.op >= x86_op_e::sete && insn.op <= x86_op_e::setg;
+        const bool byte_src = insn.op == x86_op_e::movzx;
+        if (insn.dst.kind != x86_operand_kind_e::none) {
+            // Memory with an immediate has no register to take the size from
+            bool needs_size = insn.src.kind == x86_operand_kind_e::imm || insn.src.kind == x86_operand_kind_e::none;
+            text += ' ';
+            append_operand(text, program, insn.dst, needs_size, byte_dst);
+        }
+        if (insn.src.kind != x86_operand_kind_e::none) {
+            text += ", ";
+            append_operand(text, program, insn.src, false, byte_src);
+        }
+        if (insn.comment != no_comment) {
+            text += "; ";
+            text += program.comments[insn.comment];
+        }
+        out.line(text);
+    }
+}
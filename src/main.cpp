@@ -1,12 +1,32 @@
+#include <cstdlib>
+#include <filesystem>
 #include <iostream>
 #include <fstream>
 #include <iterator>
+#include <atomic>
+#include <memory>
+#include <sstream>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "core/parse.hpp"
 #include "core/tokenise.hpp"
 #include "core/codegen.hpp"
+#include "core/elf_writer.hpp"
+#include "core/emitter.hpp"
+#include "core/encoder.hpp"
+#include "core/ir.hpp"
+#include "core/isel.hpp"
+#include "core/passes.hpp"
+#include "core/peephole.hpp"
+#include "core/x86.hpp"
+#include "utils/build_cache.hpp"
 #include "utils/error.hpp"
+#include "utils/profiler.hpp"
+#include "utils/source_file.hpp"
+#include "utils/string_interner.hpp"
+#include "utils/thread_pool.hpp"
 
 /*
 fn add(a, b) {
@@ -34,56 +54,590 @@ while (counter < 5) {
 let final_result = max(bigger, sum);
 exit(final_result);*/
 
-std::string program_contents;
+namespace {
 
+struct compile_options_t
+{
+  optimise_options_t optimise;
+  bool emit_ir = false;    // Also write the IR listing next to the output
+  bool emit_asm = false;   // Also write the fasm listing next to the output
+  bool use_fasm = false;   // Build through fasm and ld instead of the built in encoder
+  build_cache_t* cache = nullptr; // Outputs of earlier runs, none with --no-cache
+};
+
+// One input file, tokens and the AST point into its source and interner so it
+// stays put until its output is written
+struct unit_t
+{
+  std::string input_path;
+  std::string output_path; // Without extension
+  uint32_t file = no_source_file; // Id its diagnostics are reported against
+  source_file_t source;
+  // Identifiers are interned once by the lexer, everything after that
+  // refers to them by symbol id
+  string_interner_t symbols;
+  ast_t ast;
+  bool is_parsed = false;
+  unit_options_t options;
+
+  // What the other files need to know about this one. Kept in the cache, so
+  // an unchanged file isn't even parsed.
+  std::vector<function_signature_t> defines;
+  std::vector<std::string> identifiers; // All the others, calls to other files are among them
+
+  uint64_t source_key = 0; // Hash of the compiler, the options and the source
+  uint64_t output_key = 0; // And of the functions of other files it calls
+};
+
+void parse_unit(unit_t& unit)
+{
+  std::string_view program_contents = unit.source.contents();
+
+  debug_msg("File contents: {}", program_contents);
+
+  profile_scope_t scope("lex and parse");
+  // Lexing runs in lockstep with the parser, no token vector is built
+  lexer_t lexer(program_contents, unit.symbols, unit.file);
+  unit.ast = parse_statement(lexer);
+  unit.is_parsed = true;
+  scope.count("tokens", lexer.tokens_lexed());
+  scope.count("AST nodes", unit.ast.nodes.size());
+}
+
+void describe_unit(unit_t& unit)
+{
+  std::vector<bool> is_defined(unit.symbols.size(), false);
+  for (node_id_t statement : unit.ast.list(unit.ast.program)) {
+    const ast_node_t& node = unit.ast.node(statement);
+    if (node.type == token_type_e::type_fn && !is_defined[node.fn.name]) {
+      is_defined[node.fn.name] = true;
+      unit.defines.push_back({std::string(unit.ast.name(node.fn.name)), node.fn.params.count});
+    }
+  }
+  for (symbol_t symbol = 0; symbol < unit.symbols.size(); ++symbol) {
+    if (!is_defined[symbol]) {
+      unit.identifiers.emplace_back(unit.symbols.name(symbol));
+    }
+  }
+}
+
+// One "fn <name> <parameters>" or "id <name>" per line
+std::string write_manifest(const unit_t& unit)
+{
+  std::string text;
+  for (const function_signature_t& function : unit.defines) {
+    text += std::format("fn {} {}\n", function.name, function.param_count);
+  }
+  for (const std::string& identifier : unit.identifiers) {
+    text += std::format("id {}\n", identifier);
+  }
+  return text;
+}
+
+bool read_manifest(const std::string& text, unit_t& unit)
+{
+  std::istringstream lines(text);
+  std::string kind;
+  while (lines >> kind) {
+    if (kind == "fn") {
+      function_signature_t& function = unit.defines.emplace_back();
+      lines >> function.name >> function.param_count;
+    } else if (kind == "id") {
+      lines >> unit.identifiers.emplace_back();
+    } else {
+      break;
+    }
+  }
+  if (!lines.eof()) {
+    unit.defines.clear();
+    unit.identifiers.clear();
+    return false;
+  }
+  return true;
+}
 
+// Opens the file, then takes what the others need to know from the cache or
+// parses it to find out. False when it can't be read or doesn't parse.
+bool load_unit(unit_t& unit, const compile_options_t& options, const content_hash_t& base_hash)
+{
+  error_scope_t errors;
+  {
+    profile_scope_t scope("load");
+    if (!unit.source.open(unit.input_path)) {
+      error_msg("Could not open file: {}", unit.input_path);
+      return false;
+    }
+    set_source_contents(unit.file, unit.source.contents());
+    scope.count("source bytes", unit.source.contents().size());
+    if (options.cache) {
+      unit.source_key = content_hash_t(base_hash).add(unit.source.contents()).value();
+      std::string manifest;
+      if (options.cache->load_text(unit.source_key, "manifest", manifest) && read_manifest(manifest, unit)) {
+        return true;
+      }
+    }
+  }
+  parse_unit(unit);
+  describe_unit(unit);
+  return errors.error_count() == 0;
+}
+
+// Writes an executable when the program is this one unit, otherwise an
+// object file for ld
+bool compile_unit(unit_t& unit, const compile_options_t& options, thread_pool_t& pool, bool is_program)
+{
+  // Only this unit's errors, other files may be compiling at the same time
+  error_scope_t errors;
+  ir_module_t module;
+  {
+    profile_scope_t scope("codegen");
+    gen_ir_for_ast(unit.ast, module, unit.options);
+    const size_t instructions = count_instructions(module);
+    info_msg("IR after lowering: {} instructions", instructions);
+    scope.count("IR instructions", instructions);
+  }
+
+  if (!verify_ir(module)) {
+    return false;
+  }
+  optimise_ir(module, options.optimise);
+
+  if (options.emit_ir) {
+    profile_scope_t scope("print IR");
+    asm_emitter_t output_ir;
+    print_ir(module, output_ir);
+    const std::string ir_path = unit.output_path + ".ir";
+    if (!output_ir.write_to_file(ir_path)) {
+      error_msg("Could not open output file '{}'", ir_path);
+      return false;
+    }
+    info_msg("IR listing is found in {}", ir_path);
+  }
+
+  if (errors.error_count() != 0) {
+    return false;
+  }
+
+  x86_program_t program;
+  {
+    profile_scope_t scope("instruction selection");
+    select_instructions(module, program, &pool);
+    scope.count("x86 instructions", program.text.size());
+  }
+  // Calls selection couldn't lower are left out, the code is no good
+  if (errors.error_count() != 0) {
+    return false;
+  }
+  if (options.optimise.enabled && options.optimise.peephole) {
+    profile_scope_t scope("peephole");
+    peephole_stats_t peephole = optimise_peephole(program);
+    for (const peephole_rule_stats_t& rule : peephole.rules) {
+      if (rule.hits != 0) {
+        info_msg("Peephole rule '{}': {} hits", rule.name, rule.hits);
+      }
+    }
+    info_msg("Peephole: {} instructions ({:+})", peephole.after,
+             static_cast<int64_t>(peephole.after) - static_cast<int64_t>(peephole.before));
+  }
+
+  const std::string asm_path = unit.output_path + ".asm";
+  const std::string object_path = unit.output_path + ".o";
+  if (options.emit_asm) {
+    // The whole listing is built in memory and written out in one go
+    profile_scope_t scope("print assembly");
+    asm_emitter_t output_asm;
+    print_fasm(program, output_asm);
+    if (!output_asm.write_to_file(asm_path)) {
+      error_msg("Could not open output file '{}'", asm_path);
+      return false;
+    }
+    info_msg("Assembly listing is found in {}", asm_path);
+  }
+
+  if (options.use_fasm) {
+    {
+      profile_scope_t scope("fasm");
+      flush_log();
+      // An object left over from an earlier build must never be linked in
+      // place of the one fasm failed to write
+      std::error_code error;
+      std::filesystem::remove(object_path, error);
+      const std::string fasm_command = "fasm " + asm_path + " " + object_path;
+      if (system(fasm_command.c_str()) != 0) {
+        error_msg("fasm failed: {}", fasm_command);
+        return false;
+      }
+    }
+    if (is_program) {
+      profile_scope_t scope("ld");
+      flush_log();
+      const std::string link_command = "ld -o " + unit.output_path + " " + object_path;
+      if (system(link_command.c_str()) != 0) {
+        error_msg("ld failed: {}", link_command);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Encode and write the output in process, no assembler needed
+  machine_code_t code;
+  const std::string& path = is_program ? unit.output_path : object_path;
+  {
+    profile_scope_t scope("encode");
+    if (!encode_program(program, code)) {
+      error_msg("Could not write '{}'", path);
+      return false;
+    }
+    scope.count("bytes", code.text.size());
+  }
+  profile_scope_t scope("write ELF");
+  if (!(is_program ? write_elf_executable(path, code) : write_elf_object(path, code))) {
+    error_msg("Could not write '{}'", path);
+    return false;
+  }
+  return true;
+}
+
+// Every function defined by a unit, so each one can call the others. False
+// when two files define the same one.
+bool collect_signatures(const std::vector<std::unique_ptr<unit_t>>& units, std::vector<function_signature_t>& signatures)
+{
+  bool ok = true;
+  std::unordered_map<std::string_view, size_t> defined_in;
+  for (size_t i = 0; i < units.size(); ++i) {
+    for (const function_signature_t& function : units[i]->defines) {
+      auto [it, inserted] = defined_in.try_emplace(function.name, i);
+      if (!inserted) {
+        error_msg("Function '{}' is defined in both '{}' and '{}'", function.name, units[it->second]->input_path, units[i]->input_path);
+        ok = false;
+        continue;
+      }
+      signatures.push_back(function);
+    }
+  }
+  return ok;
+}
+
+// Hash of everything the unit's output depends on, given the functions of
+// the whole program
+uint64_t output_key(const unit_t& unit, const std::unordered_map<std::string_view, uint32_t>& param_counts)
+{
+  content_hash_t hash;
+  hash.add(unit.source_key).add(unit.options.has_entry).add(unit.options.exports);
+  for (const std::string& identifier : unit.identifiers) {
+    auto it = param_counts.find(identifier);
+    if (it != param_counts.end()) {
+      hash.add(identifier).add(it->second);
+    }
+  }
+  return hash.value();
+}
+
+struct artifact_t
+{
+  std::string_view extension; // Of the cache entry
+  std::string path;
+  bool executable = false;
+};
+
+std::vector<artifact_t> unit_artifacts(const unit_t& unit, const compile_options_t& options, bool is_program)
+{
+  std::vector<artifact_t> artifacts;
+  if (is_program) {
+    artifacts.push_back({"exe", unit.output_path, true});
+  } else {
+    artifacts.push_back({"o", unit.output_path + ".o"});
+  }
+  if (options.emit_ir) {
+    artifacts.push_back({"ir", unit.output_path + ".ir"});
+  }
+  if (options.emit_asm) {
+    artifacts.push_back({"asm", unit.output_path + ".asm"});
+  }
+  return artifacts;
+}
+
+// Compiles the unit unless the cache has all of its outputs already
+bool build_unit(unit_t& unit, const compile_options_t& options, thread_pool_t& pool, bool is_program, std::atomic<uint32_t>& reused)
+{
+  const std::vector<artifact_t> artifacts = unit_artifacts(unit, options, is_program);
+  if (options.cache) {
+    profile_scope_t scope("cache lookup");
+    bool restored = true;
+    for (const artifact_t& artifact : artifacts) {
+      restored = restored && options.cache->restore(unit.output_key, artifact.extension, artifact.path, artifact.executable);
+    }
+    if (restored) {
+      info_msg("Reused the output of '{}' from the cache", unit.input_path);
+      ++reused;
+      return true;
+    }
+  }
+
+  error_scope_t errors;
+  if (!unit.is_parsed) {
+    parse_unit(unit);
+    if (errors.error_count() != 0) {
+      return false;
+    }
+  }
+  // An output written despite errors must never be reused, so anything
+  // reported while building the unit keeps it out of the cache
+  if (!compile_unit(unit, options, pool, is_program) || errors.error_count() != 0) {
+    return false;
+  }
+
+  if (options.cache) {
+    profile_scope_t scope("cache store");
+    for (const artifact_t& artifact : artifacts) {
+      options.cache->store(unit.output_key, artifact.extension, artifact.path);
+    }
+    options.cache->store_text(unit.source_key, "manifest", write_manifest(unit));
+  }
+  return true;
+}
+
+// Prints what's left of the diagnostics on the way out of main, before the
+// sources they point into are closed
+struct diagnostics_report_t
+{
+  ~diagnostics_report_t()
+  {
+    flush_diagnostics();
+  }
+};
+
+// Reports on the way out of main, whether compiling worked or not
+struct profile_report_t
+{
+  bool time_report = false; // --time-report, time and memory of each phase
+  bool stats = false;       // --stats, what each phase got through
+  std::string trace_path;   // --trace=FILE, Chrome trace events
+
+  ~profile_report_t()
+  {
+    if (!g_profiler.is_enabled()) {
+      return;
+    }
+    g_profiler.finish();
+    flush_log();
+    if (time_report) {
+      g_profiler.print_time_report();
+    }
+    if (stats) {
+      g_profiler.print_stats();
+    }
+    if (!trace_path.empty() && !g_profiler.write_chrome_trace(trace_path)) {
+      error_msg("Could not write the trace to '{}'", trace_path);
+    }
+  }
+};
+
+} // namespace
 
 int main(int argc, char **argv)
 {
-  info_msg("Outputted binary is found in output/output");
-  if (argc != 2)
+  std::vector<const char*> input_paths;
+  compile_options_t options;
+  uint32_t jobs = thread_pool_t::hardware_threads(); // Threads for compiling files and functions
+  bool use_cache = true;
+  profile_report_t profile_report;
+  std::string cache_directory = "../output/cache";
+  bool usage_error = false;
+  std::vector<std::unique_ptr<unit_t>> units;
+  diagnostics_report_t diagnostics_report;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string_view argument = argv[i];
+    if (argument == "-O0") {
+      options.optimise.enabled = false;
+    } else if (argument.starts_with("--inline-threshold=")) {
+      options.optimise.inline_threshold = static_cast<uint32_t>(std::strtoul(argv[i] + argument.find('=') + 1, nullptr, 10));
+    } else if (argument == "--no-tail-calls") {
+      options.optimise.tail_calls = false;
+    } else if (argument == "--no-loops") {
+      options.optimise.loops = false;
+    } else if (argument == "--no-constant-propagation") {
+      options.optimise.constant_propagation = false;
+    } else if (argument == "--no-peephole") {
+      options.optimise.peephole = false;
+    } else if (argument == "-j" && i + 1 < argc) {
+      jobs = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (argument.starts_with("-j")) {
+      jobs = static_cast<uint32_t>(std::strtoul(argv[i] + 2, nullptr, 10));
+    } else if (argument == "--emit-ir") {
+      options.emit_ir = true;
+    } else if (argument == "--emit-asm") {
+      options.emit_asm = true;
+    } else if (argument == "--use-fasm") {
+      options.emit_asm = true;
+      options.use_fasm = true;
+    } else if (argument == "-v") {
+      set_log_level(log_level_e::DEBUG);
+    } else if (argument.starts_with("--log-level=")) {
+      std::string_view level = argument.substr(argument.find('=') + 1);
+      if (level == "debug") {
+        set_log_level(log_level_e::DEBUG);
+      } else if (level == "info") {
+        set_log_level(log_level_e::INFO);
+      } else if (level == "warning") {
+        set_log_level(log_level_e::WARNING);
+      } else if (level == "error") {
+        set_log_level(log_level_e::ERROR);
+      } else {
+        usage_error = true;
+        break;
+      }
+    } else if (argument == "--time-report") {
+      profile_report.time_report = true;
+    } else if (argument == "--stats") {
+      profile_report.stats = true;
+    } else if (argument.starts_with("--trace=")) {
+      profile_report.trace_path = argument.substr(argument.find('=') + 1);
+    } else if (argument == "--no-cache") {
+      use_cache = false;
+    } else if (argument.starts_with("--cache-dir=")) {
+      cache_directory = argument.substr(argument.find('=') + 1);
+    } else if (!argument.starts_with("-")) {
+      input_paths.push_back(argv[i]);
+    } else {
+      usage_error = true;
+      break;
+    }
+  }
+
+  if (input_paths.empty() || usage_error)
   {
     error_msg("Incorrect usage, please specify the file");
-    info_msg("Correct usage is: ./epsilang <Filename.eps>");
+    // Not info_msg, release builds compile those out
+    warning_msg("Correct usage is: ./epsilang <Filename.eps>... [-O0] [--inline-threshold=N] [--no-tail-calls] [--no-loops] [--no-constant-propagation] [--no-peephole] [-j N] [--emit-ir] [--emit-asm] [--use-fasm] [--no-cache] [--cache-dir=DIR] [--time-report] [--stats] [--trace=FILE] [--log-level=debug|info|warning|error] [-v]");
 
     return 1;
   }
 
-  std::ofstream output_asm("../output/output.asm");
-  if (!output_asm) {
-    error_msg("Could not open output file '../output/output.asm'");
-    return 1;
+  if (profile_report.time_report || profile_report.stats || !profile_report.trace_path.empty()) {
+    g_profiler.enable();
   }
 
-  std::ifstream input_file(argv[1]);
-  if (!input_file) {
-    error_msg("Could not open file: {}", argv[1]);
-    return 1;
-  }
+  // The calling thread works along, so it counts as one of the jobs
+  thread_pool_t pool(jobs > 1 ? jobs - 1 : 0);
 
-  std::string line_buf;
-  while (std::getline(input_file, line_buf)) {
-    program_contents += line_buf + '\n';
+  // Everything an output depends on besides its sources: the compiler
+  // itself and the options that change the code. -j and the listings don't.
+  build_cache_t cache;
+  content_hash_t base_hash;
+  if (use_cache) {
+    if (!build_cache_t::hash_compiler(base_hash)) {
+      warning_msg("Could not read the compiler binary, building without the cache");
+    } else if (cache.open(cache_directory)) {
+      options.cache = &cache;
+    }
   }
+  const optimise_options_t& optimise = options.optimise;
+  base_hash.add(optimise.enabled).add(optimise.inline_threshold).add(optimise.constant_propagation)
+           .add(optimise.loops).add(optimise.tail_calls).add(optimise.peephole).add(options.use_fasm);
 
-  info_msg("File contents: {}", program_contents);
+  // Registered up front, so diagnostics come out in input order
+  for (const char* input_path : input_paths) {
+    unit_t& unit = *units.emplace_back(std::make_unique<unit_t>());
+    unit.input_path = input_path;
+    unit.file = add_source_file(unit.input_path);
+  }
+  std::atomic<uint32_t> reused = 0;
 
+  // A single file is the whole program and becomes the executable directly
+  if (units.size() == 1) {
+    unit_t& unit = *units.front();
+    unit.output_path = "../output/output";
+    if (!load_unit(unit, options, base_hash)) {
+      return 1;
+    }
+    unit.output_key = output_key(unit, {});
+    if (!build_unit(unit, options, pool, true, reused)) {
+      return 1;
+    }
+    flush_diagnostics();
+    info_msg("Outputted binary is found in output/output");
+    info_msg("Error count: {}", std::to_string(get_error_count()));
+    reset_error_count();
+    return 0;
+  }
 
+  // Otherwise each file becomes an object file named after it, the first
+  // one holds the top level statements and ld links them in input order
+  bool ok = true;
+  std::unordered_map<std::string, const char*> stems;
+  for (std::unique_ptr<unit_t>& unit : units) {
+    std::string stem = std::filesystem::path(unit->input_path).stem().string();
+    auto [it, inserted] = stems.try_emplace(stem, unit->input_path.c_str());
+    if (!inserted) {
+      error_msg("Files '{}' and '{}' would both be compiled to '{}.o'", it->second, unit->input_path, stem);
+      ok = false;
+    }
+    unit->output_path = "../output/" + stem;
+  }
 
+  std::vector<char> loaded(units.size(), false);
+  pool.for_each(units.size(), [&](size_t i) { loaded[i] = load_unit(*units[i], options, base_hash); });
+  for (char unit_loaded : loaded) {
+    ok = ok && unit_loaded;
+  }
+  flush_diagnostics();
 
-  std::vector<token_t> tokens = tokenise(program_contents);
-  std::vector<ast_node_t> ast = parse_statement(tokens);
+  std::vector<function_signature_t> signatures;
+  if (!ok || !collect_signatures(units, signatures)) {
+    return 1;
+  }
+  std::unordered_map<std::string_view, uint32_t> param_counts;
+  for (const function_signature_t& function : signatures) {
+    param_counts.emplace(function.name, function.param_count);
+  }
+  for (size_t i = 0; i < units.size(); ++i) {
+    units[i]->options.has_entry = i == 0;
+    units[i]->options.exports = true;
+    units[i]->options.externals = signatures;
+    units[i]->output_key = output_key(*units[i], param_counts);
+  }
 
-  std::map<std::string, std::string> symbol_table;
-  gen_code_for_ast(ast, output_asm, symbol_table);
+  // Files are compiled side by side, each one selects its functions on the
+  // same pool. Unchanged files are copied out of the cache instead.
+  std::vector<char> built(units.size(), false);
+  pool.for_each(units.size(), [&](size_t i) { built[i] = build_unit(*units[i], options, pool, false, reused); });
+  for (char unit_built : built) {
+    ok = ok && unit_built;
+  }
+  flush_diagnostics();
+  if (!ok) {
+    return 1;
+  }
+  if (options.cache) {
+    info_msg("Reused {} of {} files from the cache", reused.load(), units.size());
+  }
 
-  system("fasm ../output/output.asm ../output/output.o");
-  system("ld -o ../output/output ../output/output.o");
+  // The same objects link to the same executable, ld only runs when one changed
+  content_hash_t link_hash;
+  std::string link_command = "ld -o ../output/output";
+  for (const std::unique_ptr<unit_t>& unit : units) {
+    link_hash.add(unit->output_key);
+    link_command += ' ';
+    link_command += unit->output_path + ".o";
+  }
+  if (!options.cache || !cache.restore(link_hash.value(), "exe", "../output/output", true)) {
+    profile_scope_t scope("ld");
+    flush_log();
+    if (system(link_command.c_str()) != 0) {
+      error_msg("Linking failed: {}", link_command);
+      return 1;
+    }
+    if (options.cache) {
+      cache.store(link_hash.value(), "exe", "../output/output");
+    }
+  }
 
-  info_msg("Outputted binary is found in output/output.asm");
+  info_msg("Outputted binary is found in output/output");
   info_msg("Error count: {}", std::to_string(get_error_count()));
   reset_error_count();
 
-
   return 0;
 }
@@ -0,0 +1,93 @@
+#include <cstdio>
+#include <filesystem>
+#include <format>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils/build_cache.hpp"
+#include "utils/error.hpp"
+#include "utils/output_file.hpp"
+#include "utils/source_file.hpp"
+
+content_hash_t& content_hash_t::add_bytes(const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        state = (state ^ bytes[i]) * 0x100000001b3;
+    }
+    return *this;
+}
+
+content_hash_t& content_hash_t::add(std::string_view text) {
+    add(static_cast<uint64_t>(text.size()));
+    return add_bytes(text.data(), text.size());
+}
+
+content_hash_t& content_hash_t::add(uint64_t value) {
+    return add_bytes(&value, sizeof(value));
+}
+
+bool build_cache_t::open(const std::string& path) {
+    std::error_code error;
+    std::filesystem::create_directories(path, error);
+    if (error) {
+        warning_msg("Could not create cache directory '{}': {}", path, error.message());
+        return false;
+    }
+    directory = path;
+    return true;
+}
+
+std::string build_cache_t::entry_path(uint64_t key, std::string_view extension) const {
+    return std::format("{}/{:016x}.{}", directory, key, extension);
+}
+
+bool build_cache_t::restore(uint64_t key, std::string_view extension, const std::string& path, bool executable) const {
+    source_file_t entry;
+    if (!entry.open(entry_path(key, extension))) {
+        return false;
+    }
+    std::string_view contents = entry.contents();
+    return write_output_file(path, contents.data(), contents.size(), executable);
+}
+
+bool build_cache_t::store(uint64_t key, std::string_view extension, const std::string& path) {
+    source_file_t output;
+    if (!output.open(path)) {
+        return false;
+    }
+    return store_text(key, extension, output.contents());
+}
+
+bool build_cache_t::load_text(uint64_t key, std::string_view extension, std::string& text) const {
+    source_file_t entry;
+    if (!entry.open(entry_path(key, extension))) {
+        return false;
+    }
+    text.assign(entry.contents());
+    return true;
+}
+
+bool build_cache_t::store_text(uint64_t key, std::string_view extension, std::string_view text) {
+    const std::string entry = entry_path(key, extension);
+    const std::string temporary = std::format("{}.{}.{}", entry, getpid(), temporaries.fetch_add(1));
+    if (!write_output_file(temporary, text.data(), text.size())) {
+        return false;
+    }
+    if (std::rename(temporary.c_str(), entry.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool build_cache_t::hash_compiler(content_hash_t& hash) {
+    // Hashing a debug build's contents alone would take longer than a cached
+    // compile, any rebuild changes the file's identity or time anyway
+    struct stat st;
+    if (stat("/proc/self/exe", &st) != 0) {
+        return false;
+    }
+    hash.add(st.st_dev).add(st.st_ino).add(st.st_size).add(st.st_mtim.tv_sec).add(st.st_mtim.tv_nsec);
+    return true;
+}
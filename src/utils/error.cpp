@@ -0,0 +1,193 @@
+#include <algorithm>
+#include <atomic>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "utils/error.hpp"
+
+namespace {
+
+log_level_e g_log_level = log_level_e::INFO;
+
+// Log lines collect here and go to stderr in big writes, stderr itself
+// isn't buffered
+class log_sink_t
+{
+public:
+    ~log_sink_t() { flush(); }
+
+    void write(log_level_e level, std::string_view message) {
+        std::lock_guard lock(mutex);
+        const time_t now = std::time(nullptr);
+        if (now != cached_second) {
+            update_timestamp(now);
+        }
+        std::format_to(std::back_inserter(buffer), "[{}][{}]: {}\n", std::string_view(timestamp, timestamp_size),
+                       log_level_to_string(level), message);
+        // An error may be the last thing before a crash
+        if (buffer.size() >= flush_size || level == log_level_e::ERROR) {
+            flush_locked();
+        }
+    }
+
+    void flush() {
+        std::lock_guard lock(mutex);
+        flush_locked();
+    }
+
+private:
+    static constexpr size_t flush_size = 64 * 1024;
+
+    // Formatting the local time is the slow part of a log line, and it only
+    // changes once a second
+    void update_timestamp(time_t now) {
+        std::tm local{};
+        localtime_r(&now, &local);
+        timestamp_size = std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &local);
+        cached_second = now;
+    }
+
+    void flush_locked() {
+        if (!buffer.empty()) {
+            std::cerr.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            std::cerr.flush();
+            buffer.clear();
+        }
+    }
+
+    std::mutex mutex;
+    std::string buffer;
+    time_t cached_second = -1;
+    char timestamp[32] = {};
+    size_t timestamp_size = 0;
+};
+
+log_sink_t g_log_sink;
+
+std::atomic<size_t> error_count{0};
+std::atomic<size_t> warning_count{0};
+
+thread_local error_scope_t* current_error_scope = nullptr;
+
+struct diagnostic_t
+{
+    source_location_t location;
+    log_level_e level;
+    std::string message;
+};
+
+// Only its own thread appends, flush_diagnostics drains it once the threads
+// are done. Buffers are never freed, so a thread that has exited still leaves
+// its diagnostics behind.
+struct diagnostic_buffer_t
+{
+    std::vector<diagnostic_t> diagnostics;
+};
+
+std::mutex buffers_mutex;
+std::vector<std::unique_ptr<diagnostic_buffer_t>> buffers;
+
+diagnostic_buffer_t& thread_buffer() {
+    thread_local diagnostic_buffer_t* buffer = nullptr;
+    if (!buffer) {
+        // Once per thread
+        std::lock_guard lock(buffers_mutex);
+        buffer = buffers.emplace_back(std::make_unique<diagnostic_buffer_t>()).get();
+    }
+    return *buffer;
+}
+
+} // namespace
+
+void set_log_level(log_level_e level) {
+    g_log_level = level;
+}
+
+log_level_e get_log_level() {
+    return g_log_level;
+}
+
+void write_log_line(log_level_e level, std::string_view message) {
+    g_log_sink.write(level, message);
+}
+
+void flush_log() {
+    g_log_sink.flush();
+}
+
+error_scope_t::error_scope_t() : parent(current_error_scope) {
+    current_error_scope = this;
+}
+
+error_scope_t::~error_scope_t() {
+    current_error_scope = parent;
+}
+
+error_scope_t* error_scope_t::current() {
+    return current_error_scope;
+}
+
+error_scope_t* error_scope_t::make_current(error_scope_t* scope) {
+    return std::exchange(current_error_scope, scope);
+}
+
+void report_diagnostic(log_level_e level, source_location_t location, std::string message) {
+    (level == log_level_e::ERROR ? error_count : warning_count).fetch_add(1, std::memory_order_relaxed);
+    if (level == log_level_e::ERROR) {
+        for (error_scope_t* scope = current_error_scope; scope; scope = scope->parent) {
+            scope->errors.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    thread_buffer().diagnostics.push_back({location, level, std::move(message)});
+}
+
+void flush_diagnostics() {
+    std::vector<diagnostic_t> diagnostics;
+    {
+        std::lock_guard lock(buffers_mutex);
+        for (const std::unique_ptr<diagnostic_buffer_t>& buffer : buffers) {
+            std::move(buffer->diagnostics.begin(), buffer->diagnostics.end(), std::back_inserter(diagnostics));
+            buffer->diagnostics.clear();
+        }
+    }
+    if (diagnostics.empty()) {
+        return;
+    }
+
+    // Ones without a file (no_source_file) sort last and stay in the order
+    // they were reported in
+    std::stable_sort(diagnostics.begin(), diagnostics.end(), [](const diagnostic_t& lhs, const diagnostic_t& rhs) {
+        if (lhs.location.file != rhs.location.file) {
+            return lhs.location.file < rhs.location.file;
+        }
+        if (lhs.location.file == no_source_file || lhs.location.offset != rhs.location.offset) {
+            return lhs.location.offset < rhs.location.offset;
+        }
+        return lhs.message < rhs.message;
+    });
+    for (const diagnostic_t& diagnostic : diagnostics) {
+        if (diagnostic.location.file == no_source_file) {
+            write_log_line(diagnostic.level, diagnostic.message);
+        } else {
+            write_log_line(diagnostic.level, std::format("{}: {}", format_location(diagnostic.location), diagnostic.message));
+        }
+    }
+    flush_log();
+}
+
+size_t get_error_count() {
+    return error_count.load(std::memory_order_relaxed);
+}
+
+size_t get_warning_count() {
+    return warning_count.load(std::memory_order_relaxed);
+}
+
+void reset_error_count() {
+    error_count.store(0, std::memory_order_relaxed);
+    warning_count.store(0, std::memory_order_relaxed);
+}
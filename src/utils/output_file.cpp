@@ -0,0 +1,38 @@
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils/error.hpp"
+#include "utils/output_file.hpp"
+
+bool write_output_file(const std::string& path, const void* data, size_t size, bool executable) {
+    const mode_t mode = executable ? 0755 : 0644;
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd < 0) {
+        return false;
+    }
+    // An existing file keeps its old mode through O_TRUNC
+    if (executable) {
+        fchmod(fd, mode);
+    }
+
+    // write() may stop short on big buffers, keep going until it's all out
+    const char* remaining_data = static_cast<const char*>(data);
+    size_t remaining = size;
+    while (remaining > 0) {
+        ssize_t written = ::write(fd, remaining_data, remaining);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_msg("Writing '{}' failed", path);
+            ::close(fd);
+            return false;
+        }
+        remaining_data += written;
+        remaining -= written;
+    }
+    return ::close(fd) == 0;
+}
@@ -0,0 +1,298 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <ctime>
+#include <format>
+#include <iostream>
+#include <new>
+
+#include <sys/resource.h>
+
+#include "utils/output_file.hpp"
+#include "utils/profiler.hpp"
+
+namespace {
+
+// Set once by profiler_t::enable, before any worker threads exist
+std::atomic<bool> counting_allocations{false};
+std::atomic<uint64_t> allocation_count{0};
+std::atomic<uint64_t> allocated_bytes{0};
+thread_local uint64_t thread_allocation_count = 0;
+thread_local uint64_t thread_allocated_bytes = 0;
+std::atomic<uint32_t> thread_count{0};
+thread_local uint32_t scope_depth = 0;
+
+void* counted_allocation(size_t size) {
+    if (counting_allocations.load(std::memory_order_relaxed)) {
+        allocation_count.fetch_add(1, std::memory_order_relaxed);
+        allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+        ++thread_allocation_count;
+        thread_allocated_bytes += size;
+    }
+    if (void* memory = std::malloc(size != 0 ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+int64_t cpu_us(clockid_t clock) {
+    timespec now;
+    clock_gettime(clock, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+uint64_t peak_rss_kb() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<uint64_t>(usage.ru_maxrss);
+}
+
+uint32_t current_thread() {
+    thread_local const uint32_t id = thread_count.fetch_add(1, std::memory_order_relaxed);
+    return id;
+}
+
+std::string format_bytes(uint64_t bytes) {
+    if (bytes >= 1024 * 1024) {
+        return std::format("{:.1f} MB", bytes / (1024.0 * 1024.0));
+    }
+    if (bytes >= 1024) {
+        return std::format("{:.1f} KB", bytes / 1024.0);
+    }
+    return std::format("{} B", bytes);
+}
+
+std::string format_rate(double per_second) {
+    if (per_second >= 1e6) {
+        return std::format("{:.2f}M/s", per_second / 1e6);
+    }
+    if (per_second >= 1e3) {
+        return std::format("{:.2f}K/s", per_second / 1e3);
+    }
+    return std::format("{:.0f}/s", per_second);
+}
+
+void append_json_string(std::string& out, std::string_view text) {
+    out += '"';
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            std::format_to(std::back_inserter(out), "\\u{:04x}", c);
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+// Phases with the same name added up, the detailed ones only go to the trace
+struct phase_total_t
+{
+    const char* name = nullptr;
+    uint32_t depth = 0;
+    int64_t first_start_us = 0;
+    uint32_t runs = 0;
+    int64_t wall_us = 0;
+    int64_t cpu_us = 0;
+    uint64_t allocations = 0;
+    uint64_t allocated_bytes = 0;
+    uint64_t peak_rss_kb = 0;
+    std::vector<profile_counter_t> counters;
+};
+
+std::vector<phase_total_t> sum_phases(const std::vector<profile_event_t>& events) {
+    std::vector<phase_total_t> phases;
+    for (const profile_event_t& event : events) {
+        if (!event.detail.empty()) {
+            continue;
+        }
+        auto it = std::find_if(phases.begin(), phases.end(), [&](const phase_total_t& phase) {
+            return std::string_view(phase.name) == event.name;
+        });
+        if (it == phases.end()) {
+            it = phases.insert(phases.end(), phase_total_t{});
+            it->name = event.name;
+            it->depth = event.depth;
+            it->first_start_us = event.start_us;
+        }
+        phase_total_t& phase = *it;
+        phase.first_start_us = std::min(phase.first_start_us, event.start_us);
+        ++phase.runs;
+        phase.wall_us += event.wall_us;
+        phase.cpu_us += event.cpu_us;
+        phase.allocations += event.allocations;
+        phase.allocated_bytes += event.allocated_bytes;
+        phase.peak_rss_kb = std::max(phase.peak_rss_kb, event.peak_rss_kb);
+        for (const profile_counter_t& counter : event.counters) {
+            auto total = std::find_if(phase.counters.begin(), phase.counters.end(), [&](const profile_counter_t& other) {
+                return std::string_view(other.name) == counter.name;
+            });
+            if (total != phase.counters.end()) {
+                total->value += counter.value;
+            } else {
+                phase.counters.push_back(counter);
+            }
+        }
+    }
+    // Events are recorded as they end, a phase comes before the ones nested in it
+    std::stable_sort(phases.begin(), phases.end(), [](const phase_total_t& lhs, const phase_total_t& rhs) {
+        return lhs.first_start_us < rhs.first_start_us;
+    });
+    return phases;
+}
+
+} // namespace
+
+void* operator new(size_t size) {
+    return counted_allocation(size);
+}
+
+void* operator new[](size_t size) {
+    return counted_allocation(size);
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete[](void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+profiler_t g_profiler;
+
+allocation_counts_t allocation_counts() {
+    return {allocation_count.load(std::memory_order_relaxed), allocated_bytes.load(std::memory_order_relaxed)};
+}
+
+allocation_counts_t thread_allocation_counts() {
+    return {thread_allocation_count, thread_allocated_bytes};
+}
+
+void profiler_t::enable() {
+    enabled = true;
+    counting_allocations.store(true, std::memory_order_relaxed);
+    origin = std::chrono::steady_clock::now();
+    origin_cpu_us = cpu_us(CLOCK_PROCESS_CPUTIME_ID);
+    origin_allocations = allocation_counts();
+}
+
+int64_t profiler_t::now_us() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - origin).count();
+}
+
+void profiler_t::record(profile_event_t&& event) {
+    event.thread = current_thread();
+    std::lock_guard lock(mutex);
+    events.push_back(std::move(event));
+}
+
+void profiler_t::finish() {
+    const allocation_counts_t allocations = allocation_counts();
+    profile_event_t total;
+    total.name = "total";
+    total.wall_us = now_us();
+    total.cpu_us = cpu_us(CLOCK_PROCESS_CPUTIME_ID) - origin_cpu_us;
+    total.allocations = allocations.count - origin_allocations.count;
+    total.allocated_bytes = allocations.bytes - origin_allocations.bytes;
+    total.peak_rss_kb = peak_rss_kb();
+    record(std::move(total));
+}
+
+void profiler_t::print_time_report() const {
+    std::lock_guard lock(mutex);
+    std::string report = std::format("{:<28} {:>5} {:>10} {:>10} {:>12} {:>12} {:>12}\n",
+                                     "Phase", "Runs", "Wall ms", "CPU ms", "Peak RSS", "Allocations", "Allocated");
+    for (const phase_total_t& phase : sum_phases(events)) {
+        std::format_to(std::back_inserter(report), "{:<28} {:>5} {:>10.3f} {:>10.3f} {:>12} {:>12} {:>12}\n",
+                       std::string(phase.depth * 2, ' ') + phase.name, phase.runs, phase.wall_us / 1000.0, phase.cpu_us / 1000.0,
+                       format_bytes(phase.peak_rss_kb * 1024), phase.allocations, format_bytes(phase.allocated_bytes));
+    }
+    std::cerr << report;
+}
+
+void profiler_t::print_stats() const {
+    std::lock_guard lock(mutex);
+    std::string report;
+    for (const phase_total_t& phase : sum_phases(events)) {
+        if (phase.counters.empty()) {
+            continue;
+        }
+        std::format_to(std::back_inserter(report), "{}:", phase.name);
+        const double seconds = std::max<int64_t>(phase.wall_us, 1) / 1e6;
+        for (size_t i = 0; i < phase.counters.size(); ++i) {
+            const profile_counter_t& counter = phase.counters[i];
+            std::format_to(std::back_inserter(report), "{} {} {} ({})", i == 0 ? "" : ",", counter.value, counter.name,
+                           format_rate(counter.value / seconds));
+        }
+        report += '\n';
+    }
+    std::cerr << report;
+}
+
+bool profiler_t::write_chrome_trace(const std::string& path) const {
+    std::lock_guard lock(mutex);
+    std::string trace = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    for (size_t i = 0; i < events.size(); ++i) {
+        const profile_event_t& event = events[i];
+        trace += "{\"name\":";
+        append_json_string(trace, event.detail.empty() ? std::string_view(event.name) : std::string_view(event.detail));
+        trace += ",\"cat\":";
+        append_json_string(trace, event.name);
+        std::format_to(std::back_inserter(trace), ",\"ph\":\"X\",\"pid\":1,\"tid\":{},\"ts\":{},\"dur\":{},\"args\":{{"
+                       "\"cpu_us\":{},\"allocations\":{},\"allocated_bytes\":{},\"peak_rss_kb\":{}",
+                       event.thread, event.start_us, event.wall_us, event.cpu_us, event.allocations,
+                       event.allocated_bytes, event.peak_rss_kb);
+        for (const profile_counter_t& counter : event.counters) {
+            trace += ',';
+            append_json_string(trace, counter.name);
+            std::format_to(std::back_inserter(trace), ":{}", counter.value);
+        }
+        trace += i + 1 < events.size() ? "}},\n" : "}}\n";
+    }
+    trace += "]}\n";
+    return write_output_file(path, trace.data(), trace.size());
+}
+
+profile_scope_t::profile_scope_t(const char* name, std::string_view detail)
+    : active(g_profiler.is_enabled()) {
+    if (!active) {
+        return;
+    }
+    event.name = name;
+    event.detail = detail;
+    event.depth = scope_depth++;
+    event.start_us = g_profiler.now_us();
+    event.cpu_us = cpu_us(CLOCK_THREAD_CPUTIME_ID);
+    start_allocations = thread_allocation_counts();
+}
+
+profile_scope_t::~profile_scope_t() {
+    if (!active) {
+        return;
+    }
+    --scope_depth;
+    const allocation_counts_t allocations = thread_allocation_counts();
+    event.wall_us = g_profiler.now_us() - event.start_us;
+    event.cpu_us = cpu_us(CLOCK_THREAD_CPUTIME_ID) - event.cpu_us;
+    event.allocations = allocations.count - start_allocations.count;
+    event.allocated_bytes = allocations.bytes - start_allocations.bytes;
+    event.peak_rss_kb = peak_rss_kb();
+    g_profiler.record(std::move(event));
+}
+
+void profile_scope_t::count(const char* counter, uint64_t value) {
+    if (active) {
+        event.counters.push_back({counter, value});
+    }
+}
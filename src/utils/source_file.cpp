@@ -0,0 +1,59 @@
+#include <fstream>
+#include <iterator>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils/error.hpp"
+#include "utils/source_file.hpp"
+
+source_file_t::~source_file_t() {
+    close();
+}
+
+bool source_file_t::open(const std::string& path) {
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            // The lexer walks the buffer front to back exactly once
+            madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+            ::close(fd);
+            data = static_cast<const char*>(mapping);
+            size = st.st_size;
+            mapped = true;
+            return true;
+        }
+        warning_msg("mmap failed for '{}', falling back to buffered read", path);
+    }
+    ::close(fd);
+
+    // Not mappable (pipe, empty file, ...), read it the slow way
+    std::ifstream input_file(path, std::ios::binary);
+    if (!input_file) {
+        return false;
+    }
+    fallback_buffer.assign(std::istreambuf_iterator<char>(input_file), std::istreambuf_iterator<char>());
+    data = fallback_buffer.data();
+    size = fallback_buffer.size();
+    return true;
+}
+
+void source_file_t::close() {
+    if (mapped) {
+        munmap(const_cast<char*>(data), size);
+    }
+    fallback_buffer.clear();
+    data = nullptr;
+    size = 0;
+    mapped = false;
+}
@@ -0,0 +1,73 @@
+#include <algorithm>
+#include <deque>
+#include <format>
+#include <mutex>
+#include <vector>
+
+#include "utils/source_location.hpp"
+
+namespace {
+
+struct source_entry_t
+{
+    std::string path;
+    std::string_view contents;
+    bool has_contents = false;
+    std::vector<uint32_t> line_starts; // Filled on the first lookup
+};
+
+// A deque so entries don't move while other threads set their contents
+std::mutex sources_mutex;
+std::deque<source_entry_t> sources;
+
+source_entry_t* find_source(uint32_t file) {
+    std::lock_guard lock(sources_mutex);
+    return file < sources.size() ? &sources[file] : nullptr;
+}
+
+} // namespace
+
+uint32_t add_source_file(std::string_view path) {
+    std::lock_guard lock(sources_mutex);
+    sources.emplace_back().path = path;
+    return static_cast<uint32_t>(sources.size() - 1);
+}
+
+void set_source_contents(uint32_t file, std::string_view contents) {
+    if (source_entry_t* source = find_source(file)) {
+        source->contents = contents;
+        source->has_contents = true;
+        source->line_starts.clear();
+    }
+}
+
+std::string_view source_file_path(uint32_t file) {
+    const source_entry_t* source = find_source(file);
+    return source ? std::string_view(source->path) : std::string_view();
+}
+
+line_column_t resolve_location(source_location_t location) {
+    source_entry_t* source = find_source(location.file);
+    if (!source || !source->has_contents) {
+        return {};
+    }
+    if (source->line_starts.empty()) {
+        source->line_starts.push_back(0);
+        const std::string_view contents = source->contents;
+        for (size_t pos = contents.find('\n'); pos != std::string_view::npos; pos = contents.find('\n', pos + 1)) {
+            source->line_starts.push_back(static_cast<uint32_t>(pos + 1));
+        }
+    }
+    const uint32_t offset = std::min<uint32_t>(location.offset, static_cast<uint32_t>(source->contents.size()));
+    const auto line = std::upper_bound(source->line_starts.begin(), source->line_starts.end(), offset) - 1;
+    return {static_cast<uint32_t>(line - source->line_starts.begin() + 1), offset - *line + 1};
+}
+
+std::string format_location(source_location_t location) {
+    const std::string_view path = source_file_path(location.file);
+    const line_column_t position = resolve_location(location);
+    if (position.line == 0) {
+        return std::string(path);
+    }
+    return std::format("{}:{}:{}", path, position.line, position.column);
+}
@@ -0,0 +1,87 @@
+#include <cstring>
+
+#include "utils/string_interner.hpp"
+
+string_interner_t::string_interner_t() {
+    slots.assign(256, slot_t{0, null_symbol});
+}
+
+// FNV-1a, identifiers are short so anything fancier doesn't pay off
+uint32_t string_interner_t::hash_of(std::string_view text) {
+    uint32_t hash = 2166136261u;
+    for (char c : text) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Slot holding text, or the empty slot where it would go
+size_t string_interner_t::probe(std::string_view text, uint32_t hash) const {
+    const size_t mask = slots.size() - 1;
+    size_t index = hash & mask;
+    while (slots[index].symbol != null_symbol) {
+        if (slots[index].hash == hash && strings[slots[index].symbol] == text) {
+            break;
+        }
+        index = (index + 1) & mask;
+    }
+    return index;
+}
+
+symbol_t string_interner_t::find(std::string_view text) const {
+    return slots[probe(text, hash_of(text))].symbol;
+}
+
+symbol_t string_interner_t::intern(std::string_view text) {
+    const uint32_t hash = hash_of(text);
+    size_t index = probe(text, hash);
+    if (slots[index].symbol != null_symbol) {
+        return slots[index].symbol;
+    }
+
+    symbol_t symbol = static_cast<symbol_t>(strings.size());
+    strings.push_back(store(text));
+    slots[index] = slot_t{hash, symbol};
+
+    // Keep the load factor under 1/2
+    if (strings.size() * 2 > slots.size()) {
+        grow();
+    }
+    return symbol;
+}
+
+void string_interner_t::grow() {
+    std::vector<slot_t> old_slots = std::move(slots);
+    slots.assign(old_slots.size() * 2, slot_t{0, null_symbol});
+
+    const size_t mask = slots.size() - 1;
+    for (const slot_t& slot : old_slots) {
+        if (slot.symbol == null_symbol) {
+            continue;
+        }
+        size_t index = slot.hash & mask;
+        while (slots[index].symbol != null_symbol) {
+            index = (index + 1) & mask;
+        }
+        slots[index] = slot;
+    }
+}
+
+std::string_view string_interner_t::store(std::string_view text) {
+    if (text.size() > chunk_size) {
+        // Oversized names get a chunk of their own, which is full straight away
+        chunks.push_back(std::make_unique<char[]>(text.size()));
+        std::memcpy(chunks.back().get(), text.data(), text.size());
+        chunk_used = chunk_size;
+        return {chunks.back().get(), text.size()};
+    }
+    if (chunks.empty() || chunk_used + text.size() > chunk_size) {
+        chunks.push_back(std::make_unique<char[]>(chunk_size));
+        chunk_used = 0;
+    }
+    char* destination = chunks.back().get() + chunk_used;
+    std::memcpy(destination, text.data(), text.size());
+    chunk_used += text.size();
+    return {destination, text.size()};
+}
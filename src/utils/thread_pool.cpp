@@ -0,0 +1,80 @@
+#include <algorithm>
+
+#include "utils/thread_pool.hpp"
+
+thread_pool_t::thread_pool_t(uint32_t worker_count) {
+    workers.reserve(worker_count);
+    for (uint32_t i = 0; i < worker_count; ++i) {
+        workers.emplace_back([this] { work(); });
+    }
+}
+
+thread_pool_t::~thread_pool_t() {
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+uint32_t thread_pool_t::hardware_threads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+bool thread_pool_t::run_one(batch_t& batch) {
+    const size_t index = batch.next.fetch_add(1, std::memory_order_relaxed);
+    if (index >= batch.count) {
+        return false;
+    }
+    error_scope_t* previous = error_scope_t::make_current(batch.error_scope);
+    (*batch.job)(index);
+    error_scope_t::make_current(previous);
+    return true;
+}
+
+void thread_pool_t::for_each(size_t count, const std::function<void(size_t)>& job) {
+    if (count == 0) {
+        return;
+    }
+    batch_t batch{&job, count, error_scope_t::current()};
+    if (!workers.empty() && count > 1) {
+        {
+            std::lock_guard lock(mutex);
+            batches.push_back(&batch);
+        }
+        wake.notify_all();
+    }
+
+    while (run_one(batch)) {
+    }
+
+    // Every index is handed out, once no worker is left in the batch all of
+    // its jobs have returned and it can go out of scope
+    std::unique_lock lock(mutex);
+    std::erase(batches, &batch);
+    finished.wait(lock, [&] { return batch.workers == 0; });
+}
+
+void thread_pool_t::work() {
+    std::unique_lock lock(mutex);
+    while (true) {
+        wake.wait(lock, [&] { return stopping || !batches.empty(); });
+        if (stopping) {
+            return;
+        }
+        batch_t& batch = *batches.front();
+        ++batch.workers;
+        lock.unlock();
+        while (run_one(batch)) {
+        }
+        lock.lock();
+        // Nothing left to hand out, the batch's caller may be waiting on us
+        std::erase(batches, &batch);
+        if (--batch.workers == 0) {
+            finished.notify_all();
+        }
+    }
+}